@@ -5,6 +5,15 @@
 #cmakedefine HAVE_BUFFEREVENT_SETCB
 #cmakedefine HAVE_BUFFEREVENT_SETWATERMARK
 #cmakedefine HAVE_BUFFEREVENT_SETWATERMARK_PROTO
+#cmakedefine HAVE_EVDNS_GETADDRINFO
+#cmakedefine HAVE_RECVMMSG
+#cmakedefine HAVE_SENDMMSG
+#cmakedefine HAVE_DLOPEN
+#cmakedefine HAVE_PAM
+#cmakedefine HAVE_ZLIB
+#cmakedefine HAVE_OPENSSL
+#cmakedefine HAVE_LINUX_BPF_H
+#cmakedefine HAVE_LINUX_TCP_H
 
 /*
  * number of second the client have to finish the authentication
@@ -23,11 +32,50 @@
  */
 #define SOCKS_STREAM_BUFSIZ	(1024 * 64 * 2)
 
+/*
+ * Stream buffers following the bandwidth-delay product: bounds of the
+ * bytes queued for each side, and milliseconds between two samples
+ */
+#define AUTOBUF_MIN		(1024 * 16)
+#define AUTOBUF_MAX		(1024 * 1024 * 16)
+#define AUTOBUF_INTERVAL	500
+
 /*
  * Timeout before re-trying to launch helper
  */
 #define HELPERS_REFILL_POOL_TIMEOUT	{ 5, 0 }
 
+/*
+ * Maximum factor applied to the timeout above when helpers
+ * keep failing to start
+ */
+#define HELPERS_REFILL_POOL_BACKOFF_MAX	16
+
+/*
+ * Time given to an helper to exit after SIGTERM, before SIGKILL
+ */
+#define HELPER_KILL_TIMEOUT	{ 2, 0 }
+
+/*
+ * Accept is paused once clients, with the links and helpers serving them,
+ * hold ADMIT_FDS_HIGH percent of the fds the process may open, and resumed
+ * under ADMIT_FDS_LOW percent. The same for a full auth queue, or
+ * ADMIT_HELPER_DEPTH requests waiting for each helper, until under
+ * ADMIT_AUTH_LOW percent
+ */
+#define ADMIT_FDS_HIGH		90
+#define ADMIT_FDS_LOW		80
+#define ADMIT_HELPER_DEPTH	32
+#define ADMIT_AUTH_LOW		50
+
+/*
+ * Past ADMIT_HANDSHAKE_SHARE percent of the clients allowed by the fds,
+ * those still in their handshake have less than their auth timeout to
+ * finish it, down to ADMIT_HANDSHAKE_MIN seconds when they are all
+ */
+#define ADMIT_HANDSHAKE_SHARE	10
+#define ADMIT_HANDSHAKE_MIN	10
+
 /*
  * Maximum startup time for an helper
  */
@@ -38,6 +86,69 @@
  */
 #define HELPER_AUTH_TIMEOUT	10
 
+/*
+ * Maximum number of clients waiting for an helper to be
+ * available, and how long (in seconds) they can wait
+ */
+#define HELPER_QUEUE_MAX	1024
+#define HELPER_QUEUE_TIMEOUT	15
+
+/*
+ * Default number of PAM worker threads
+ */
+#define PAM_WORKERS	4
+
+/*
+ * Number of datagrams read or sent by a single system call, and
+ * buffer sizes of the UDP sockets shared by all associations
+ */
+#define UDP_BATCH		32
+#define UDP_SOCKET_BUFSIZ	(1024 * 1024 * 4)
+
+/*
+ * Bytes each tunnel channel may have in flight in each direction, the
+ * number of channels a tunnel may carry, and how long a next-hop which
+ * doesn't accept tunnels gets plain connections before trying again
+ */
+#define MUX_WINDOW		(1024 * 256)
+#define MUX_CHANNELS_MAX	1024
+#define MUX_RETRY_TIMEOUT	60
+
+/*
+ * Size of the chunks a striped connection is cut into, bytes queued
+ * on each of its links before the sender waits for them to drain, and
+ * how long a next-hop which doesn't accept striped connections gets
+ * plain connections before trying again
+ */
+#define STRIPE_CHUNK_SIZE	16384
+#define STRIPE_LINK_BUFSIZ	(1024 * 256)
+#define STRIPE_RETRY_TIMEOUT	60
+
+/*
+ * Compressed links between sockslinkd hops: most bytes compressed at
+ * once, bytes queued before the sender waits for the link to drain,
+ * bytes sent as is after a chunk which didn't compress well, and
+ * microseconds each link may spend compressing every second
+ */
+#define ZLINK_CHUNK		16384
+#define ZLINK_BUFSIZ		(1024 * 256)
+#define ZLINK_BYPASS		(1024 * 1024)
+#define ZLINK_BUDGET		50000
+
+/*
+ * Bytes queued each way by TLS connections relayed in userspace, when
+ * the kernel can't take the records over
+ */
+#define TLS_LINK_BUFSIZ		(1024 * 256)
+
+/*
+ * Streams relayed in the kernel: sockets the map holds (two per
+ * client), and milliseconds between checks that the client got all the
+ * data of a server which went away
+ */
+#define SOCKMAP_MAX_SOCKETS	65536
+#define SOCKMAP_FLUSH_INTERVAL	10
+
 /*
  * Path of default config file
  */
@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+#
+# Example authentication service for sockslinkd --helper-socket
+#
+# Same protocol as the helpers, each line is prefixed by a request
+# id, and answers can be sent in any order.
+
+import os
+import sys
+import socketserver
+from urllib.parse import unquote
+
+users = {
+    'test' : 'test123',
+    'test2' : 'test2',
+}
+
+def authenticate(args):
+    if len(args) == 2 and args[1] == 'none':
+        return 'OK ! none'
+    if len(args) == 4 and args[1] == 'username':
+        uname, passwd = unquote(args[2]), unquote(args[3])
+        if users.get(uname) == passwd:
+            return 'OK ! username %s' % args[2]
+        return 'ERR Authentication failure'
+    return 'ERR Invalid number of argument'
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        for line in self.rfile:
+            reqid, _, line = line.decode().rstrip('\n').partition(' ')
+            answer = '%s %s\n' % (reqid, authenticate(line.split(' ')))
+            self.wfile.write(answer.encode())
+            self.wfile.flush()
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else '/var/run/sockslink-auth.sock'
+    if os.path.exists(path):
+        os.unlink(path)
+    server = socketserver.ThreadingUnixStreamServer(path, Handler)
+    server.serve_forever()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,43 @@
+/*
+ * Example sockslinkd plugin, build with:
+ *   cc -shared -fPIC -I../src -o dummy-plugin.so dummy-plugin.c
+ *
+ * Allows test:test123, rejects other usernames and lets the helper
+ * decide for clients not using a username.
+ */
+
+#include <string.h>
+
+#include "sockslink-plugin.h"
+
+static void dummy_authenticate(void *priv, sockslink_auth_request *req,
+			       const struct sockaddr *source, socklen_t sourcelen,
+			       uint8_t method,
+			       const uint8_t *user, size_t ulen,
+			       const uint8_t *pass, size_t plen,
+			       sockslink_auth_completion completion)
+{
+  if (method != SOCKSLINK_METHOD_USERNAME)
+    completion(req, SOCKSLINK_AUTH_DECLINE, NULL);
+  else if (ulen == 4 && !memcmp(user, "test", 4) &&
+	   plen == 7 && !memcmp(pass, "test123", 7))
+    completion(req, SOCKSLINK_AUTH_ALLOW, NULL);
+  else
+    completion(req, SOCKSLINK_AUTH_DENY, "Authentication failure");
+}
+
+static int dummy_route(void *priv, const struct sockaddr *source,
+		       socklen_t sourcelen, const uint8_t *user, size_t ulen,
+		       struct sockslink_route *route)
+{
+  route->nexthop = NULL; /* default next-hop */
+  route->method = SOCKSLINK_METHOD_NONE;
+  return 0;
+}
+
+const struct sockslink_plugin sockslink_plugin = {
+  .abi = SOCKSLINK_PLUGIN_ABI,
+  .name = "dummy",
+  .authenticate = dummy_authenticate,
+  .route = dummy_route,
+};
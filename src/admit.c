@@ -0,0 +1,350 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "profile.h"
+#include "admit.h"
+#include "wheel.h"
+#include "log.h"
+
+/*
+ * Admission control
+ *
+ * Each client takes two fds, and what serves it reports those it adds:
+ * the socketpairs of compressed, TLS, tunneled and striped links, the
+ * sockets of UDP flows and of tunnels, the pipes or connections of the
+ * helpers. Once those of all the listeners reach ADMIT_FDS_HIGH percent
+ * of RLIMIT_NOFILE, or once the clients of a listener fill its auth
+ * queue or wait for ADMIT_HELPER_DEPTH answers per helper, its accept
+ * events are removed, and added back under ADMIT_FDS_LOW percent and
+ * ADMIT_AUTH_LOW percent of those.
+ * Waiting clients stay in the listen backlog meanwhile. When accept()
+ * fails for lack of fds anyway, they are paused until a client leaves.
+ *
+ * With --overload-reject, listeners keep accepting and close new
+ * clients right away, replying that no method is acceptable, so they
+ * fail instead of waiting. A spare fd is kept to do so when the process
+ * has none left.
+ *
+ * Clients we wait for, until their greeting, credentials or request are
+ * all there, are kept oldest first. The helpers, the resolver or the
+ * next-hop taking time doesn't count. As their share of the clients
+ * fds allow goes past ADMIT_HANDSHAKE_SHARE percent, the time they
+ * have to send it all shrinks from auth_timeout down to
+ * ADMIT_HANDSHAKE_MIN seconds, and those past it are dropped, oldest
+ * first: a handshake trickled one byte at a time can't keep its fd
+ * while others wait, a prompt one is done long before. Pending TLS
+ * handshakes count too, and get the budget of their accept.
+ */
+
+struct admit {
+  SocksLink *sl;
+  int fds; /* of the clients of all the listeners, and what serves them */
+  int fds_base; /* open before the helpers and the first client */
+  int fds_high; /* fds to pause at */
+  int fds_low; /* fds to resume at */
+  bool fds_over;
+  bool fds_full; /* accept() ran out of fds */
+  int reserve; /* spare fd for --overload-reject */
+  struct wheel_timer sweep; /* of the handshakes, every second */
+};
+
+/* Virtual listeners share the fds, and the state of the main SocksLink */
+static SocksLink *admit_master(SocksLink *sl)
+{
+  return sl->master ? sl->master : sl;
+}
+
+static void admit_apply(SocksLink *sl)
+{
+  bool over = admit_overloaded(sl);
+
+  if (admit_master(sl)->overload_reject || over == sl->accept_paused)
+    return ;
+
+  sl->accept_paused = over;
+  for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX && sl->fd[i] != -1; ++i) {
+    if (over)
+      event_del(&sl->ev_accept[i]);
+    else
+      event_add(&sl->ev_accept[i], NULL);
+  }
+
+  if (over)
+    pr_warn(sl, "overloaded (%d fds, %d clients waiting for an helper), "
+	    "pausing accept", admit_master(sl)->admit->fds,
+	    sl->auth_queue_len + sl->auth_pending);
+  else
+    pr_warn(sl, "resuming accept");
+}
+
+static void admit_apply_all(SocksLink *sl)
+{
+  SocksLink *vl;
+
+  admit_apply(sl);
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    admit_apply(vl);
+}
+
+static void on_admit_sweep(struct wheel_timer *timer);
+
+int admit_start(SocksLink *sl)
+{
+  struct admit *ad;
+  struct rlimit rl;
+  int limit;
+
+  ad = calloc(sizeof (*ad), 1);
+  if (!ad)
+    return -1;
+  sl->admit = ad;
+  ad->sl = sl;
+  wheel_timer_init(&ad->sweep, on_admit_sweep);
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY ||
+      rl.rlim_cur > 0x7fffffff)
+    limit = 0x7fffffff;
+  else
+    limit = rl.rlim_cur;
+
+  /* the lowest free fd, about the number of those already open */
+  ad->reserve = open("/dev/null", O_RDONLY);
+  if (ad->reserve == -1) {
+    pr_err(sl, "can't open /dev/null: %s", strerror(errno));
+    return -1;
+  }
+  ad->fds_base = ad->reserve;
+  if (!sl->overload_reject) {
+    close(ad->reserve);
+    ad->reserve = -1;
+  }
+
+  ad->fds_high = (long)limit * ADMIT_FDS_HIGH / 100 - ad->fds_base;
+  ad->fds_low = (long)limit * ADMIT_FDS_LOW / 100 - ad->fds_base;
+  pr_debug(sl, "overloaded from %d fds, until back to %d",
+	   ad->fds_high, ad->fds_low);
+  return 0;
+}
+
+void admit_stop(SocksLink *sl)
+{
+  struct admit *ad = sl->admit;
+
+  if (!ad)
+    return ;
+
+  if (ad->reserve != -1)
+    close(ad->reserve);
+  wheel_del(&ad->sweep);
+  free(ad);
+  sl->admit = NULL;
+}
+
+bool admit_overloaded(SocksLink *sl)
+{
+  struct admit *ad = admit_master(sl)->admit;
+
+  return ad && (ad->fds_over || ad->fds_full || sl->auth_over);
+}
+
+/* Accept a client only to close it, failing its method negotiation */
+void admit_reject(SocksLink *sl, int afd, bool tls)
+{
+  static const uint8_t reply[] = {SOCKS5_VER, AUTH_METHOD_INVALID};
+  int fd = accept(afd, NULL, NULL);
+
+  if (fd == -1)
+    return ;
+
+  /* a TLS client would only see garbage */
+  if (!tls && send(fd, reply, sizeof (reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    pr_debug(sl, "can't reject client: %s", strerror(errno));
+  close(fd);
+}
+
+void admit_accept_failed(SocksLink *sl, int afd, bool tls, int err)
+{
+  SocksLink *master = admit_master(sl);
+  struct admit *ad = master->admit;
+
+  if (!ad || (err != EMFILE && err != ENFILE)) {
+    pr_warn(sl, "accept failed: %s", strerror(err));
+    return ;
+  }
+
+  if (ad->reserve != -1) {
+    close(ad->reserve);
+    admit_reject(sl, afd, tls);
+    ad->reserve = open("/dev/null", O_RDONLY);
+    return ;
+  }
+
+  if (ad->fds_full)
+    return ;
+
+  pr_warn(sl, "accept failed: %s", strerror(err));
+  ad->fds_full = true;
+  admit_apply_all(master);
+}
+
+/* Fds were opened for clients, or closed */
+void admit_fds(SocksLink *sl, int delta)
+{
+  SocksLink *master = admit_master(sl);
+  struct admit *ad = master->admit;
+  bool over;
+
+  if (!ad)
+    return ;
+
+  ad->fds += delta;
+
+  /* one left, fds may be back */
+  if (delta < 0 && ad->fds_full) {
+    ad->fds_full = false;
+    admit_apply_all(master);
+  }
+
+  over = ad->fds_over ? ad->fds > ad->fds_low : ad->fds >= ad->fds_high;
+  if (over == ad->fds_over)
+    return ;
+
+  ad->fds_over = over;
+  admit_apply_all(master);
+}
+
+/* Past high, until back under ADMIT_AUTH_LOW percent of it */
+static bool admit_auth_over(bool over, int depth, int high)
+{
+  if (!high)
+    return false;
+  return over ? depth > high * ADMIT_AUTH_LOW / 100 : depth >= high;
+}
+
+/* Clients were queued for, sent to, or answered by the helpers */
+void admit_auth(SocksLink *sl)
+{
+  bool over;
+
+  over = admit_auth_over(sl->auth_over, sl->auth_queue_len,
+			 sl->auth_queue_max) ||
+    admit_auth_over(sl->auth_over, sl->auth_pending,
+		    sl->helpers_max * ADMIT_HELPER_DEPTH);
+  if (over == sl->auth_over)
+    return ;
+
+  sl->auth_over = over;
+  admit_apply(sl);
+}
+
+/* Seconds a client has to start streaming, given how many are trying */
+static unsigned long admit_handshake_budget(SocksLink *master,
+					    const struct profile *profile)
+{
+  struct admit *ad = master->admit;
+  unsigned long budget = profile->auth_timeout;
+  unsigned long min = ADMIT_HANDSHAKE_MIN < budget ? ADMIT_HANDSHAKE_MIN :
+    budget;
+  long share;
+
+  /* two fds each, like a client */
+  share = (long)master->handshakes_len * 2 * 100 /
+    (ad->fds_high > 0 ? ad->fds_high : 1);
+  if (share <= ADMIT_HANDSHAKE_SHARE)
+    return budget;
+  if (share > 100)
+    share = 100;
+
+  return min + (budget - min) * (100 - share) / (100 - ADMIT_HANDSHAKE_SHARE);
+}
+
+static void on_admit_sweep(struct wheel_timer *timer)
+{
+  struct admit *ad = container_of(timer, struct admit, sweep);
+  SocksLink *master = ad->sl;
+  Client *cl, *tmp;
+  unsigned long now = wheel_now(master);
+  int dropped = 0;
+
+  /* budgets differ between profiles, an older client may still be in its own */
+  list_for_each_entry_safe(cl, tmp, &master->handshakes, next_handshake,
+			   Client) {
+    if (now - cl->accepted < admit_handshake_budget(master, cl->profile))
+      continue ;
+    prcl_debug(cl, "handshake too slow for the load, disconnecting");
+    admit_handshake_done(cl);
+    cl->aborted = true;
+    client_disconnect(cl);
+    dropped++;
+  }
+
+  if (dropped)
+    pr_warn(master, "dropped %d slow handshakes, %d left", dropped,
+	    master->handshakes_len);
+
+  if (master->handshakes_len)
+    wheel_add(master, timer, 1);
+}
+
+/* A client was accepted, or has to send its request: we wait for it */
+void admit_handshake_start(Client *cl)
+{
+  SocksLink *master = admit_master(cl->parent);
+  struct admit *ad = master->admit;
+
+  if (!ad || !list_empty(&cl->next_handshake))
+    return ;
+
+  cl->accepted = wheel_now(master);
+  list_add_tail(&cl->next_handshake, &master->handshakes);
+  master->handshakes_len++;
+
+  if (!wheel_pending(&ad->sweep))
+    wheel_add(master, &ad->sweep, 1);
+}
+
+/* All read, or leaving, either way we don't wait for the client anymore */
+void admit_handshake_done(Client *cl)
+{
+  if (list_empty(&cl->next_handshake))
+    return ;
+
+  list_del_init(&cl->next_handshake);
+  admit_master(cl->parent)->handshakes_len--;
+}
+
+/*
+ * A client of a TLS listener was accepted, it isn't a Client until its
+ * handshake is done: returns the seconds it has. Its fd is reported by
+ * the TLS connection.
+ */
+unsigned long admit_tls_start(SocksLink *sl, const struct profile *profile)
+{
+  SocksLink *master = admit_master(sl);
+
+  if (!master->admit)
+    return profile->auth_timeout;
+
+  master->handshakes_len++;
+  return admit_handshake_budget(master, profile);
+}
+
+/* Its TLS handshake is over, it becomes a Client or leaves */
+void admit_tls_done(SocksLink *sl)
+{
+  SocksLink *master = admit_master(sl);
+
+  if (!master->admit)
+    return ;
+
+  master->handshakes_len--;
+}
@@ -0,0 +1,25 @@
+#ifndef ADMIT_H
+# define ADMIT_H
+
+#include <stdbool.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int admit_start(SocksLink *sl);
+void admit_stop(SocksLink *sl);
+
+bool admit_overloaded(SocksLink *sl);
+void admit_reject(SocksLink *sl, int afd, bool tls);
+void admit_accept_failed(SocksLink *sl, int afd, bool tls, int err);
+
+void admit_fds(SocksLink *sl, int delta);
+void admit_auth(SocksLink *sl);
+
+void admit_handshake_start(Client *cl);
+void admit_handshake_done(Client *cl);
+
+unsigned long admit_tls_start(SocksLink *sl, const struct profile *profile);
+void admit_tls_done(SocksLink *sl);
+
+#endif /* !ADMIT_H */
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "aliases.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Next-hop aliases, for "user@alias" usernames
+ *
+ * # alias        next-hop
+ * localhost      127.0.0.1:1080
+ * localhostv6    [::1]:1080
+ *
+ * A client logging in as "user@localhost" is sent to 127.0.0.1:1080
+ * as "user", with its password. Next-hops are addresses, parsed when the
+ * file is loaded: reloads can't wait for a resolver. Aliases are kept in
+ * an open addressing hash table.
+ */
+
+struct alias {
+  uint32_t hash;
+  uint8_t len;			/* 0 for empty buckets */
+  char *name;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+struct aliases {
+  struct alias *buckets;
+  uint32_t mask;
+  unsigned int count;
+};
+
+static struct alias *aliases_bucket(const struct aliases *aliases,
+				    const uint8_t *name, size_t len)
+{
+  uint32_t hash = hash_fnv1a(HASH_FNV1A_INIT, name, len);
+
+  for (uint32_t i = hash & aliases->mask; ; i = (i + 1) & aliases->mask) {
+    struct alias *alias = &aliases->buckets[i];
+
+    if (!alias->len)
+      return alias;
+    if (alias->hash == hash && alias->len == len &&
+	!memcmp(alias->name, name, len))
+      return alias;
+  }
+}
+
+static int aliases_grow(struct aliases *aliases)
+{
+  struct alias *old = aliases->buckets;
+  uint32_t size = aliases->mask + 1;
+
+  aliases->buckets = calloc(sizeof (*old), size * 2);
+  if (!aliases->buckets) {
+    aliases->buckets = old;
+    return -1;
+  }
+  aliases->mask = size * 2 - 1;
+
+  for (uint32_t i = 0; i < size; ++i) {
+    if (old[i].len)
+      *aliases_bucket(aliases, (uint8_t *)old[i].name, old[i].len) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+struct aliases *aliases_open(SocksLink *sl, const char *path)
+{
+  struct aliases *aliases;
+  FILE *fp;
+  char line[1024];
+  int lineno = 0;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    pr_err(sl, "can't open aliases file '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+
+  aliases = calloc(sizeof (*aliases), 1);
+  if (!aliases)
+    goto error;
+  aliases->mask = 15;
+  aliases->buckets = calloc(sizeof (*aliases->buckets), aliases->mask + 1);
+  if (!aliases->buckets)
+    goto error;
+
+  while (fgets(line, sizeof (line), fp)) {
+    char *name, *nexthop, *end;
+    struct alias *alias;
+    size_t len;
+    int ret;
+
+    lineno++;
+
+    if ((end = strchr(line, '#')))
+      *end = '\0';
+
+    name = strtok(line, " \t\r\n");
+    if (!name)
+      continue ;
+    nexthop = strtok(NULL, " \t\r\n");
+    len = strlen(name);
+    if (!nexthop || strtok(NULL, " \t\r\n") || len > 255) {
+      pr_err(sl, "%s:%d: invalid alias", path, lineno);
+      goto error;
+    }
+
+    /* keep the load factor under 1/2 */
+    if ((aliases->count + 1) * 2 > aliases->mask + 1 && aliases_grow(aliases))
+      goto error;
+
+    alias = aliases_bucket(aliases, (uint8_t *)name, len);
+    if (alias->len) {
+      pr_err(sl, "%s:%d: duplicate alias '%s'", path, lineno, name);
+      goto error;
+    }
+
+    ret = parse_nexthop_numeric(nexthop, &alias->addr, &alias->addrlen);
+    if (ret) {
+      pr_err(sl, "%s:%d: invalid next-hop address '%s': %s",
+	     path, lineno, nexthop, gai_strerror(ret));
+      goto error;
+    }
+
+    alias->name = strdup(name);
+    if (!alias->name)
+      goto error;
+    alias->hash = hash_fnv1a(HASH_FNV1A_INIT, name, len);
+    alias->len = len;
+    aliases->count++;
+  }
+
+  fclose(fp);
+  return aliases;
+
+ error:
+  if (errno == ENOMEM)
+    pr_err(sl, "can't load aliases file '%s': %s", path, strerror(errno));
+  aliases_close(aliases);
+  fclose(fp);
+  return NULL;
+}
+
+void aliases_close(struct aliases *aliases)
+{
+  if (!aliases)
+    return ;
+
+  if (aliases->buckets) {
+    for (uint32_t i = 0; i <= aliases->mask; ++i)
+      free(aliases->buckets[i].name);
+    free(aliases->buckets);
+  }
+  free(aliases);
+}
+
+unsigned int aliases_count(const struct aliases *aliases)
+{
+  return aliases->count;
+}
+
+const struct sockaddr_storage *aliases_lookup(const struct aliases *aliases,
+					      const uint8_t *name, size_t len,
+					      socklen_t *addrlen)
+{
+  const struct alias *alias;
+
+  if (!len || len > 255)
+    return NULL;
+
+  alias = aliases_bucket(aliases, name, len);
+  if (!alias->len)
+    return NULL;
+
+  *addrlen = alias->addrlen;
+  return &alias->addr;
+}
+
+int aliases_load(SocksLink *sl)
+{
+  if (!sl->aliases_file)
+    return 0;
+
+  sl->aliases = aliases_open(sl, sl->aliases_file);
+  if (!sl->aliases)
+    return -1;
+
+  pr_infos(sl, "%u aliases loaded from %s", aliases_count(sl->aliases),
+	   sl->aliases_file);
+  return 0;
+}
+
+/* Swap tables only once the new one is loaded */
+void aliases_reload(SocksLink *sl)
+{
+  struct aliases *aliases;
+
+  if (!sl->aliases_file)
+    return ;
+
+  aliases = aliases_open(sl, sl->aliases_file);
+  if (!aliases) {
+    pr_err(sl, "keeping the old aliases");
+    return ;
+  }
+
+  aliases_close(sl->aliases);
+  sl->aliases = aliases;
+
+  pr_infos(sl, "%u aliases reloaded from %s", aliases_count(aliases),
+	   sl->aliases_file);
+}
+
+void aliases_unload(SocksLink *sl)
+{
+  aliases_close(sl->aliases);
+  sl->aliases = NULL;
+}
+
+/* Returns -1 if the username doesn't end with a known "@alias" */
+int aliases_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  const struct sockaddr_storage *nexthop_addr;
+  socklen_t nexthop_addrlen;
+  uint8_t *uname = cl->auth.username.uname;
+  int at;
+
+  if (!sl->aliases || cl->client_method != AUTH_METHOD_USERNAME)
+    return -1;
+
+  for (at = cl->auth.username.ulen - 1; at >= 0; --at)
+    if (uname[at] == '@')
+      break ;
+  if (at < 0)
+    return -1;
+
+  nexthop_addr = aliases_lookup(sl->aliases, uname + at + 1,
+				cl->auth.username.ulen - at - 1,
+				&nexthop_addrlen);
+  if (!nexthop_addr)
+    return -1;
+
+  prcl_debug(cl, "routed by alias '%.*s'", cl->auth.username.ulen - at - 1,
+	     uname + at + 1);
+
+  /* Forward client credentials, without the alias */
+  cl->auth.username.ulen = at;
+  cl->server_method = cl->client_method;
+  client_auth_accept(cl, nexthop_addr, nexthop_addrlen);
+  return 0;
+}
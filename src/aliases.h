@@ -0,0 +1,22 @@
+#ifndef ALIASES_H
+# define ALIASES_H
+
+#include "sockslink.h"
+#include "client.h"
+
+struct aliases;
+
+struct aliases *aliases_open(SocksLink *sl, const char *path);
+void aliases_close(struct aliases *aliases);
+const struct sockaddr_storage *aliases_lookup(const struct aliases *aliases,
+					      const uint8_t *name, size_t len,
+					      socklen_t *addrlen);
+unsigned int aliases_count(const struct aliases *aliases);
+
+int aliases_load(SocksLink *sl);
+void aliases_reload(SocksLink *sl);
+void aliases_unload(SocksLink *sl);
+
+int aliases_call(Client *client);
+
+#endif /* !ALIASES_H */
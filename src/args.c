@@ -1,5 +1,6 @@
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +16,43 @@
 #include "args.h"
 #include "log.h"
 #include "utils.h"
+#include "stripe.h"
+#include "profile.h"
+
+/* Options without short equivalent */
+enum {
+  OPT_AUTH_QUEUE = 256,
+  OPT_PLUGIN,
+  OPT_PLUGIN_ARG,
+  OPT_HELPER_SOCKET,
+  OPT_USERS_FILE,
+  OPT_ROUTES,
+  OPT_ALIASES,
+  OPT_RULES,
+  OPT_PAM,
+  OPT_PAM_WORKERS,
+  OPT_DESTINATIONS,
+  OPT_UDP,
+  OPT_MUX,
+  OPT_MUX_ACCEPT,
+  OPT_STRIPE,
+  OPT_STRIPE_ACCEPT,
+  OPT_HOP,
+  OPT_HOP_ACCEPT,
+  OPT_COMPRESS,
+  OPT_TLS_PORT,
+  OPT_TLS_CERT,
+  OPT_TLS_KEY,
+  OPT_TLS_NEXT_HOP,
+  OPT_TLS_CA,
+  OPT_TLS_NAME,
+  OPT_KERNEL_RELAY,
+  OPT_SOURCE,
+  OPT_SOURCE_HASH,
+  OPT_RESET_ABORTED,
+  OPT_PROFILE,
+  OPT_OVERLOAD_REJECT,
+};
 
 static void version(void)
 {
@@ -32,7 +70,8 @@ static void usage(void)
 	  "  -i, --interface=<iface>   listen on this interface, similar to -l, but will\n"
 	  "                            try to listen on all addresses used by this interface.\n"
 	  "                            (default is none)\n"
-	  "  -l, --listen=<addr>       listen on this address  (default: 0.0.0.0 and ::)\n"
+	  "  -l, --listen=<addr>       listen on this address  (default: 0.0.0.0 and ::),\n"
+	  "                            <addr>@<profile> to tune its connections\n"
 	  "  -p, --port=<port>         TCP port (default: 1080)\n"
 	  "  -d, --max-fds=<num>       maximum number of file descriptor open\n"
 	  "                            = (clients * 2) + (helpers * 3) + 1\n"
@@ -41,24 +80,92 @@ static void usage(void)
 	  "  -n, --next-hop=<next>     default route when not specified by helper\n"
 	  "                            to specify a non-standard port, use ':'\n"
 	  "                            between address and port (example: '[::1]:1081' or \n"
-	  "                            '192.168.0.1:1081')\n"
+	  "                            '192.168.0.1:1081'), or 'direct' to connect\n"
+	  "                            to the requested destination ourself\n"
 	  "  -H, --helper=<helper>     path to authentication and routing helper\n"
+	  "      --helper-socket=<path>\n"
+	  "                            unix socket of a running authentication and\n"
+	  "                            routing service, used instead of --helper\n"
 	  "  -j, --helpers-max=<num>   number of helper instances sockslink should start (default is 1)\n"
+	  "                            or of connections to the authentication service\n"
+	  "      --auth-queue=<num>    number of clients that can wait for an helper to be\n"
+	  "                            available (default is %d, 0 to disable)\n"
+	  "      --users-file=<file>   authenticate usernames with this database, built\n"
+	  "                            by sockslink-userdb (reloaded on SIGHUP)\n"
+	  "      --routes=<file>       choose the next-hop from the client address, once PAM\n"
+	  "                            or the plugin accepted it, matching clients skip the\n"
+	  "                            helper (reloaded on SIGHUP)\n"
+	  "      --aliases=<file>      route \"user@alias\" usernames to the alias next-hop,\n"
+	  "                            once PAM or the plugin accepted them, without asking\n"
+	  "                            the helper (reloaded on SIGHUP)\n"
+	  "      --rules=<file>        allow, deny or route clients before any other\n"
+	  "                            authentication (reloaded on SIGHUP)\n"
+	  "      --destinations=<file> read client requests and choose the next-hop from\n"
+	  "                            their destination (reloaded on SIGHUP)\n",
+	  HELPER_QUEUE_MAX);
+  fprintf(stderr,
+	  "      --udp                 relay UDP ASSOCIATE requests, to the next-hop UDP\n"
+	  "                            relay or to destinations with a direct next-hop\n"
+	  "      --mux=<num>           carry connections to each next-hop over this number\n"
+	  "                            of persistent tunnels, next-hops which don't accept\n"
+	  "                            tunnels get plain connections\n"
+	  "      --mux-accept          accept tunnels from other sockslinkd instances\n"
+	  "      --stripe=<num>        carry each connection to a next-hop over this number\n"
+	  "                            of parallel links (at most %d), for bulk transfers\n"
+	  "                            over long fat links\n"
+	  "      --stripe-accept       accept striped connections from other sockslinkd\n"
+	  "                            instances\n"
+	  "      --hop                 offer next-hops the one-shot handshake of sockslinkd,\n"
+	  "                            saving a round trip once they select it\n"
+	  "      --hop-accept=<nets>   select the one-shot handshake for sockslinkd instances\n"
+	  "                            in these comma separated networks, policies then\n"
+	  "                            apply to the client address they give\n"
+	  "      --compress            compress the links of the one-shot handshake, for\n"
+	  "                            sockslinkd instances which use it too\n"
+	  "      --tls-port=<port>     also listen on this port for TLS clients, with\n"
+	  "                            kernel TLS offload when available\n"
+	  "      --tls-cert=<file>     certificate chain of the TLS listeners (PEM)\n"
+	  "      --tls-key=<file>      private key of the TLS listeners (PEM)\n"
+	  "      --tls-next-hop        connect to next-hops with TLS\n"
+	  "      --tls-ca=<file>       CA certificates for next-hops (default: system ones)\n"
+	  "      --tls-name=<name>     name in next-hop certificates (default: their address)\n"
+	  "      --kernel-relay        relay established TCP streams in the kernel, with a\n"
+	  "                            BPF sockmap\n"
+	  "      --source=<addrs>      bind outbound connections to these comma separated\n"
+	  "                            local addresses, in turn\n"
+	  "      --source-hash         pick the source address by hashing the client address\n"
+	  "      --reset-aborted       reset outbound connections we abort on an error, a\n"
+	  "                            timeout or an overload, instead of keeping them in\n"
+	  "                            TIME_WAIT\n"
+	  "      --profile=<name>:<key>=<value>,...\n"
+	  "                            tuning of the connections of the addresses listened\n"
+	  "                            with @<name>, or of the others for \"default\": buffer\n"
+	  "                            (bytes or auto, following the bandwidth-delay product),\n"
+	  "                            auth-timeout, io-timeout, sndbuf, rcvbuf, nodelay,\n"
+	  "                            notsent-lowat, keepalive=<idle>:<intvl>:<count>, cc\n"
+	  "      --overload-reject     when out of fds or helpers, reject new clients instead\n"
+	  "                            of leaving them in the listen backlog\n"
+	  "      --pam=<service>       authenticate usernames with this PAM service\n"
+	  "      --pam-workers=<num>   number of concurrent PAM conversations (default is %d)\n"
+	  "      --plugin=<file>       in-process authentication and routing plugin,\n"
+	  "                            clients it declines are given to the helper\n"
+	  "      --plugin-arg=<arg>    argument given to the plugin\n"
 	  "  -m, --method=<method>     enable this method, arguments order defines method priority,\n"
-	  "                            \"none\" and \"username\" methods are available\n"
-	  "\n"
+	  "                            \"none\" and \"username\" methods are available\n",
+	  STRIPE_LINKS_MAX, PAM_WORKERS);
+  fprintf(stderr, "\n"
 	  "  -D, --foreground          don't go to background (default: go to background)\n"
-	  "      --pidfile=<file>      write the pid in this file (default: /var/run/sockslinkd.pid)"
+	  "      --pidfile=<file>      write the pid in this file (default: /var/run/sockslinkd.pid)\n"
 	  "  -u, --user=<username>     change to this user after startup\n"
 	  "  -g, --group=<group>       change to this group after startup\n"
 	  "  -v, --verbose             be more verbose\n"
 	  "  -q, --quiet               be more quiet\n"
 	  "\n"
-	  "  -c, --conf                config file path\n"
+	  "  -c, --conf                config file path, its [<name>] sections are virtual\n"
+	  "                            listeners served by the same process\n"
 	  "\n"
 	  "  -h, --help                display this help and exit\n"
-	  "  -V, --version             output version information and exit\n"
-	  );
+	  "  -V, --version             output version information and exit\n");
 }
 
 static int parse_helper(SocksLink *sl, const char *optarg)
@@ -82,6 +189,30 @@ static int parse_helper(SocksLink *sl, const char *optarg)
   return 0;
 }
 
+static int parse_helper_socket(SocksLink *sl, const char *optarg)
+{
+  if (sl->helper_socket) {
+    pr_err(sl, "helper socket already set");
+    return -1;
+  }
+  if (strlen(optarg) >= sizeof (((struct sockaddr_un *)0)->sun_path)) {
+    pr_err(sl, "helper socket path is too long");
+    return -1;
+  }
+  sl->helper_socket = strdup(optarg);
+  return 0;
+}
+
+static int parse_plugin(SocksLink *sl, const char *optarg)
+{
+  if (sl->plugin_path) {
+    pr_err(sl, "plugin already set");
+    return -1;
+  }
+  sl->plugin_path = strdup(optarg);
+  return 0;
+}
+
 static int parse_helpers_max(SocksLink *sl, const char *optarg)
 {
   if (sl->helpers_max) {
@@ -97,6 +228,71 @@ static int parse_helpers_max(SocksLink *sl, const char *optarg)
   return 0;
 }
 
+static int parse_auth_queue(SocksLink *sl, const char *optarg)
+{
+  char *end;
+
+  if (sl->auth_queue_max != -1) {
+    pr_err(sl, "auth queue size already set\n");
+    return -1;
+  }
+  sl->auth_queue_max = strtol(optarg, &end, 0);
+  if (*end || sl->auth_queue_max < 0) {
+    pr_err(sl, "invalid argument for --auth-queue: '%s'\n",
+	   optarg);
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_pam_workers(SocksLink *sl, const char *optarg)
+{
+  char *end;
+
+  if (sl->pam_workers) {
+    pr_err(sl, "PAM workers already set\n");
+    return -1;
+  }
+  sl->pam_workers = strtol(optarg, &end, 0);
+  if (*end || sl->pam_workers <= 0) {
+    pr_err(sl, "invalid argument for --pam-workers: '%s'\n", optarg);
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_mux(SocksLink *sl, const char *optarg)
+{
+  char *end;
+
+  if (sl->mux_tunnels) {
+    pr_err(sl, "tunnels already set\n");
+    return -1;
+  }
+  sl->mux_tunnels = strtol(optarg, &end, 0);
+  if (*end || sl->mux_tunnels <= 0) {
+    pr_err(sl, "invalid argument for --mux: '%s'\n", optarg);
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_stripe(SocksLink *sl, const char *optarg)
+{
+  char *end;
+
+  if (sl->stripe_links) {
+    pr_err(sl, "stripe links already set\n");
+    return -1;
+  }
+  sl->stripe_links = strtol(optarg, &end, 0);
+  if (*end || sl->stripe_links <= 0 || sl->stripe_links > STRIPE_LINKS_MAX) {
+    pr_err(sl, "invalid argument for --stripe: '%s'\n", optarg);
+    return -1;
+  }
+  return 0;
+}
+
 static int parse_fd_max(SocksLink *sl, const char *optarg)
 {
   if (getuid() != 0) {
@@ -118,9 +314,15 @@ static int parse_fd_max(SocksLink *sl, const char *optarg)
 
 static int parse_addresses(SocksLink *sl, const char *optarg)
 {
+  const char *profile = strchr(optarg, '@');
+
   for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX; ++i)
     if (!sl->addresses[i]) {
-      sl->addresses[i] = strdup(optarg);
+      if (profile) {
+	sl->addresses[i] = strndup(optarg, profile - optarg);
+	sl->address_profiles[i] = strdup(profile + 1);
+      } else
+	sl->addresses[i] = strdup(optarg);
       return 0;
     }
 
@@ -210,11 +412,11 @@ static int parse_port(SocksLink *sl, const char *optarg)
   return 0;
 }
 
-static int parse_nexthop(SocksLink *sl, const char *optarg)
+static int parse_default_nexthop(SocksLink *sl, const char *optarg)
 {
   int ret;
 
-  ret = parse_ip_port(optarg, "socks", &sl->nexthop_addr, &sl->nexthop_addrlen);
+  ret = parse_nexthop(optarg, &sl->nexthop_addr, &sl->nexthop_addrlen);
 
   if (ret != 0) {
     pr_err(sl, "getaddrinfo(%s): %s", optarg, gai_strerror(ret));
@@ -299,6 +501,193 @@ static int parse_arg(SocksLink *sl, int c, char *optarg)
       goto error;
     break;
 
+  case OPT_HELPER_SOCKET:
+    if (parse_helper_socket(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_USERS_FILE:
+    if (sl->users_file) {
+      pr_err(sl, "users file already set");
+      goto error;
+    }
+    sl->users_file = strdup(optarg);
+    break;
+
+  case OPT_ROUTES:
+    if (sl->routes_file) {
+      pr_err(sl, "routes file already set");
+      goto error;
+    }
+    sl->routes_file = strdup(optarg);
+    break;
+
+  case OPT_ALIASES:
+    if (sl->aliases_file) {
+      pr_err(sl, "aliases file already set");
+      goto error;
+    }
+    sl->aliases_file = strdup(optarg);
+    break;
+
+  case OPT_RULES:
+    if (sl->rules_file) {
+      pr_err(sl, "rules file already set");
+      goto error;
+    }
+    sl->rules_file = strdup(optarg);
+    break;
+
+  case OPT_PAM:
+    if (sl->pam_service) {
+      pr_err(sl, "PAM service already set");
+      goto error;
+    }
+    sl->pam_service = strdup(optarg);
+    break;
+
+  case OPT_DESTINATIONS:
+    if (sl->destinations_file) {
+      pr_err(sl, "destinations file already set");
+      goto error;
+    }
+    sl->destinations_file = strdup(optarg);
+    break;
+
+  case OPT_UDP:
+    sl->udp = true;
+    break;
+
+  case OPT_MUX:
+    if (parse_mux(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_MUX_ACCEPT:
+    sl->mux_accept = true;
+    break;
+
+  case OPT_STRIPE:
+    if (parse_stripe(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_STRIPE_ACCEPT:
+    sl->stripe_accept = true;
+    break;
+
+  case OPT_HOP:
+    sl->hop = true;
+    break;
+
+  case OPT_HOP_ACCEPT:
+    if (sl->hop_accept) {
+      pr_err(sl, "hop networks already set");
+      goto error;
+    }
+    sl->hop_accept = strdup(optarg);
+    break;
+
+  case OPT_COMPRESS:
+    sl->compress = true;
+    break;
+
+  case OPT_TLS_PORT:
+    if (sl->tls_port) {
+      pr_err(sl, "TLS port already set");
+      goto error;
+    }
+    sl->tls_port = strdup(optarg);
+    break;
+
+  case OPT_TLS_CERT:
+    if (sl->tls_cert) {
+      pr_err(sl, "TLS certificate already set");
+      goto error;
+    }
+    sl->tls_cert = strdup(optarg);
+    break;
+
+  case OPT_TLS_KEY:
+    if (sl->tls_key) {
+      pr_err(sl, "TLS private key already set");
+      goto error;
+    }
+    sl->tls_key = strdup(optarg);
+    break;
+
+  case OPT_TLS_NEXT_HOP:
+    sl->tls_nexthop = true;
+    break;
+
+  case OPT_TLS_CA:
+    if (sl->tls_ca) {
+      pr_err(sl, "TLS CA certificates already set");
+      goto error;
+    }
+    sl->tls_ca = strdup(optarg);
+    break;
+
+  case OPT_TLS_NAME:
+    if (sl->tls_name) {
+      pr_err(sl, "TLS name already set");
+      goto error;
+    }
+    sl->tls_name = strdup(optarg);
+    break;
+
+  case OPT_KERNEL_RELAY:
+    sl->kernel_relay = true;
+    break;
+
+  case OPT_SOURCE:
+    if (sl->source) {
+      pr_err(sl, "source addresses already set");
+      goto error;
+    }
+    sl->source = strdup(optarg);
+    break;
+
+  case OPT_SOURCE_HASH:
+    sl->source_hash = true;
+    break;
+
+  case OPT_OVERLOAD_REJECT:
+    sl->overload_reject = true;
+    break;
+
+  case OPT_RESET_ABORTED:
+    sl->reset_aborted = true;
+    break;
+
+  case OPT_PROFILE:
+    if (profile_parse(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_PAM_WORKERS:
+    if (parse_pam_workers(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_PLUGIN:
+    if (parse_plugin(sl, optarg))
+      goto error;
+    break;
+
+  case OPT_PLUGIN_ARG:
+    if (sl->plugin_arg) {
+      pr_err(sl, "plugin argument already set");
+      goto error;
+    }
+    sl->plugin_arg = strdup(optarg);
+    break;
+
+  case OPT_AUTH_QUEUE:
+    if (parse_auth_queue(sl, optarg))
+      goto error;
+    break;
+
   case 'd':
     if (parse_fd_max(sl, optarg))
       goto error;
@@ -310,7 +699,7 @@ static int parse_arg(SocksLink *sl, int c, char *optarg)
     break;
 
   case 'n':
-    if (parse_nexthop(sl, optarg))
+    if (parse_default_nexthop(sl, optarg))
       goto error;
     break;
 
@@ -356,7 +745,38 @@ static struct option long_options[] =
     {"max-fds",       required_argument, 0, 'd'},
     {"pipe",          no_argument,       0, 'P'},
     {"helper",        required_argument, 0, 'H'},
+    {"helper-socket", required_argument, 0, OPT_HELPER_SOCKET},
     {"helpers-max",   required_argument, 0, 'j'},
+    {"auth-queue",    required_argument, 0, OPT_AUTH_QUEUE},
+    {"users-file",    required_argument, 0, OPT_USERS_FILE},
+    {"routes",        required_argument, 0, OPT_ROUTES},
+    {"aliases",       required_argument, 0, OPT_ALIASES},
+    {"rules",         required_argument, 0, OPT_RULES},
+    {"pam",           required_argument, 0, OPT_PAM},
+    {"destinations",  required_argument, 0, OPT_DESTINATIONS},
+    {"udp",           no_argument,       0, OPT_UDP},
+    {"mux",           required_argument, 0, OPT_MUX},
+    {"mux-accept",    no_argument,       0, OPT_MUX_ACCEPT},
+    {"stripe",        required_argument, 0, OPT_STRIPE},
+    {"stripe-accept", no_argument,       0, OPT_STRIPE_ACCEPT},
+    {"hop",           no_argument,       0, OPT_HOP},
+    {"hop-accept",    required_argument, 0, OPT_HOP_ACCEPT},
+    {"compress",      no_argument,       0, OPT_COMPRESS},
+    {"tls-port",      required_argument, 0, OPT_TLS_PORT},
+    {"tls-cert",      required_argument, 0, OPT_TLS_CERT},
+    {"tls-key",       required_argument, 0, OPT_TLS_KEY},
+    {"tls-next-hop",  no_argument,       0, OPT_TLS_NEXT_HOP},
+    {"tls-ca",        required_argument, 0, OPT_TLS_CA},
+    {"tls-name",      required_argument, 0, OPT_TLS_NAME},
+    {"kernel-relay",  no_argument,       0, OPT_KERNEL_RELAY},
+    {"source",        required_argument, 0, OPT_SOURCE},
+    {"source-hash",   no_argument,       0, OPT_SOURCE_HASH},
+    {"reset-aborted", no_argument,       0, OPT_RESET_ABORTED},
+    {"profile",       required_argument, 0, OPT_PROFILE},
+    {"overload-reject", no_argument,     0, OPT_OVERLOAD_REJECT},
+    {"pam-workers",   required_argument, 0, OPT_PAM_WORKERS},
+    {"plugin",        required_argument, 0, OPT_PLUGIN},
+    {"plugin-arg",    required_argument, 0, OPT_PLUGIN_ARG},
     {"method",        required_argument, 0, 'm'},
     {"next-hop",      required_argument, 0, 'n'},
     {"help",          no_argument,       0, 'h'},
@@ -364,17 +784,39 @@ static struct option long_options[] =
     {NULL, 0, 0, '\0'}
   };
 
-/* Basic dummy file parser */
+/* Options of the whole process, which virtual listeners can't set */
+static bool option_is_global(int c)
+{
+  switch (c) {
+  case 'c':
+  case 'D':
+  case 't':
+  case 'u':
+  case 'g':
+  case 'd':
+  case OPT_OVERLOAD_REJECT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Basic dummy file parser. A "[<name>]" line starts a virtual listener,
+ * which the next options configure instead of the main one.
+ */
 static int parse_conf(SocksLink *sl, const char *filename)
 {
   FILE *fp = fopen(filename, "r");
+  SocksLink *cur = sl;
   char buffer[1024];
   char *val;
+  int ret = 0;
 
   if (!fp) {
     pr_warn(sl, "can't open configuration file '%s': %s", filename,
 	    strerror(errno));
-    return -1;
+    return 0;
   }
 
   while (fgets(buffer, sizeof (buffer), fp)) {
@@ -386,6 +828,23 @@ static int parse_conf(SocksLink *sl, const char *filename)
     if (val)
       *val = '\0';
 
+    if (*buffer == '[') {
+      val = strchr(buffer, ']');
+      if (!val || val == buffer + 1 || val[1]) {
+	pr_err(sl, "invalid listener section '%s'", buffer);
+	ret = -1;
+	break ;
+      }
+      *val = '\0';
+      cur = sockslink_new_listener(sl, buffer + 1);
+      if (!cur) {
+	ret = -1;
+	break ;
+      }
+      pr_trace(sl, "configuration: listener %s", cur->name);
+      continue ;
+    }
+
     val = strchr(buffer, '=');
 
     if (val) {
@@ -400,45 +859,73 @@ static int parse_conf(SocksLink *sl, const char *filename)
 	  pr_trace(sl, "configuration: %s", buffer, val);
 
 	if (opt->has_arg == no_argument && val)
-	  pr_err(sl, "%s doesn't take any argument", buffer);
+	  pr_err(cur, "%s doesn't take any argument", buffer);
 	else if (opt->has_arg == required_argument && !val)
-	  pr_err(sl, "%s needs an argument", buffer);
+	  pr_err(cur, "%s needs an argument", buffer);
+	else if (cur != sl && option_is_global(opt->val))
+	  pr_err(cur, "%s can't be set for a listener", buffer);
 	else
-	  parse_arg(sl, opt->val, val);
+	  parse_arg(cur, opt->val, val);
       }
     }
   }
 
   fclose(fp);
-  return 0;
+  return ret;
 }
 
-int parse_args(int argc, char *argv[], SocksLink *sl)
+/* Checks and defaults of the options of sl, the main one or a listener */
+static int check_args(SocksLink *sl)
 {
-  while (1) {
-    int option_index = 0;
-    int c;
+  if (sl->pipe && (sl->helper_command || sl->helper_socket ||
+		   sl->plugin_path || sl->users_file || sl->routes_file ||
+		   sl->aliases_file || sl->rules_file || sl->pam_service ||
+		   sl->destinations_file || sl->udp)) {
+    pr_err(sl, "You can't use --pipe with --helper, --helper-socket, --plugin, --users-file, --routes, --aliases, --rules, --pam, --destinations or --udp");
+    return -1;
+  }
 
-    c = getopt_long(argc, argv, "t:c:Dvqu:g:i:l:p:H:j:Pd:m:n:b:hV",
-		    long_options, &option_index);
+  if (sl->mux_tunnels && sl->stripe_links) {
+    pr_err(sl, "You can't use --mux with --stripe");
+    return -1;
+  }
 
-    if (c == -1)
-      break;
+  if (sl->compress && !sl->hop && !sl->hop_accept) {
+    pr_err(sl, "You can't use --compress without --hop or --hop-accept");
+    return -1;
+  }
 
-    if (parse_arg(sl, c, optarg))
-      goto error;
+  if (sl->tls_port ? !sl->tls_cert || !sl->tls_key :
+      sl->tls_cert || sl->tls_key) {
+    pr_err(sl, "You must use --tls-port with --tls-cert and --tls-key");
+    return -1;
   }
 
-  if (!sl->conf)
-    sl->conf = strdup(SOCKSLINKD_CONF_FILE);
+  if ((sl->tls_ca || sl->tls_name) && !sl->tls_nexthop) {
+    pr_err(sl, "You can't use --tls-ca or --tls-name without --tls-next-hop");
+    return -1;
+  }
 
-  parse_conf(sl, sl->conf);
+  if (sl->tls_nexthop && (sl->mux_tunnels || sl->stripe_links)) {
+    pr_err(sl, "You can't use --tls-next-hop with --mux or --stripe");
+    return -1;
+  }
 
-  if (!sl->pid && !sl->fg)
-    sl->pid = strdup(SOCKSLINKD_PID_FILE);
+  for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX && sl->addresses[i]; ++i)
+    if (sl->address_profiles[i] &&
+	!profile_find(sl, sl->address_profiles[i])) {
+      pr_err(sl, "unknown profile '%s' for address '%s'",
+	     sl->address_profiles[i], sl->addresses[i]);
+      return -1;
+    }
+
+  if (sl->source_hash && !sl->source) {
+    pr_err(sl, "You can't use --source-hash without --source");
+    return -1;
+  }
 
-  if (sl->pipe && sl->helper_command) {
-    pr_err(sl, "You can't use --pipe with --helper");
+  if (sl->helper_command && sl->helper_socket) {
+    pr_err(sl, "You can't use --helper with --helper-socket");
     return -1;
   }
 
@@ -452,14 +939,17 @@ int parse_args(int argc, char *argv[], SocksLink *sl)
     return -1;
   }
 
-  if (!sl->helper_command && !sl->nexthop_addrlen) {
-    pr_err(sl, "You must specify --helper or --next-hop");
+  if (sl->pipe && nexthop_is_direct(&sl->nexthop_addr, sl->nexthop_addrlen)) {
+    pr_err(sl, "You can't use --pipe with a direct next-hop");
     return -1;
   }
 
-  if (!sl->fg) {
-    pr_debug(sl, "switching to syslog");
-    sl->syslog = true;
+  if (!sl->helper_command && !sl->helper_socket && !sl->plugin_path &&
+      !sl->users_file && !sl->routes_file && !sl->aliases_file &&
+      !sl->rules_file && !sl->pam_service && !sl->destinations_file &&
+      !sl->nexthop_addrlen) {
+    pr_err(sl, "You must specify --helper, --helper-socket, --plugin, --users-file, --routes, --aliases, --rules, --pam, --destinations or --next-hop");
+    return -1;
   }
 
   if (!sl->port)
@@ -474,13 +964,64 @@ int parse_args(int argc, char *argv[], SocksLink *sl)
 
   if (sl->methods[0] == AUTH_METHOD_INVALID) {
     sl->methods[0] = AUTH_METHOD_NONE;
-    if (sl->helper_command)
+    if (sl->helper_command || sl->helper_socket || sl->plugin_path ||
+	sl->users_file || sl->aliases_file || sl->rules_file ||
+	sl->pam_service)
       sl->methods[1] = AUTH_METHOD_USERNAME;
   }
 
-  if (sl->helper_command && !sl->helpers_max)
+  if ((sl->helper_command || sl->helper_socket) && !sl->helpers_max)
     sl->helpers_max = 1;
 
+  if (sl->auth_queue_max == -1)
+    sl->auth_queue_max = HELPER_QUEUE_MAX;
+
+  if (!sl->pam_workers)
+    sl->pam_workers = PAM_WORKERS;
+
+  return 0;
+}
+
+int parse_args(int argc, char *argv[], SocksLink *sl)
+{
+  SocksLink *vl;
+
+  while (1) {
+    int option_index = 0;
+    int c;
+
+    c = getopt_long(argc, argv, "t:c:Dvqu:g:i:l:p:H:j:Pd:m:n:b:hV",
+		    long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    if (parse_arg(sl, c, optarg))
+      goto error;
+  }
+
+  if (!sl->conf)
+    sl->conf = strdup(SOCKSLINKD_CONF_FILE);
+
+  if (parse_conf(sl, sl->conf))
+    goto error;
+
+  if (!sl->pid && !sl->fg)
+    sl->pid = strdup(SOCKSLINKD_PID_FILE);
+
+  if (check_args(sl))
+    goto error;
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    if (check_args(vl))
+      goto error;
+
+  if (!sl->fg) {
+    pr_debug(sl, "switching to syslog");
+    sl->syslog = true;
+    list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+      vl->syslog = true;
+  }
+
 #if defined(DEBUG)
   sl->cores = 1;
 #endif
@@ -0,0 +1,189 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_TCP_H
+# include <linux/tcp.h>
+#endif
+
+#include "sockslink.h"
+#include "client.h"
+#include "autobuf.h"
+#include "profile.h"
+#include "log.h"
+
+#ifdef HAVE_LINUX_TCP_H
+
+/*
+ * Buffers following the bandwidth-delay product
+ *
+ * With buffer=auto in its profile, a streaming client has TCP_INFO of
+ * both sockets sampled every AUTOBUF_INTERVAL, by one timer walking all
+ * of those clients. What's read from one side is
+ * allowed to queue for the other up to twice the bytes that other side
+ * carries in a round trip (delivery rate times RTT), within AUTOBUF_MIN
+ * and AUTOBUF_MAX: a fast long-distance flow gets room to fill its
+ * pipe, an interactive one stops piling up data it can't send yet.
+ * The unsent bytes the kernel keeps are bounded to one such product
+ * too, by TCP_NOTSENT_LOWAT, unless the profile sets it.
+ *
+ * SO_SNDBUF and SO_RCVBUF are left to the kernel, setting them would
+ * stop its own autotuning.
+ */
+
+struct autobufs {
+  struct list_head clients;
+  struct event timer;
+};
+
+static size_t autobuf_target(const struct tcp_info *info)
+{
+  uint64_t bdp = info->tcpi_delivery_rate * info->tcpi_rtt / 1000000;
+
+  if (bdp > AUTOBUF_MAX / 2)
+    return AUTOBUF_MAX;
+  if (bdp < AUTOBUF_MIN / 2)
+    return AUTOBUF_MIN;
+  return bdp * 2;
+}
+
+/* Resize what may queue in out, read from in, to what out carries */
+static void autobuf_tune(Client *cl, struct bufferevent *in,
+			 struct bufferevent *out, int out_fd, size_t *bufsiz)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof (info);
+  size_t target;
+  int lowat;
+
+  memset(&info, 0, sizeof (info));
+  if (getsockopt(out_fd, IPPROTO_TCP, TCP_INFO, &info, &len) ||
+      !info.tcpi_rtt || !info.tcpi_delivery_rate)
+    return ;
+
+  target = autobuf_target(&info);
+
+  /* a rate we didn't feed enough says nothing of what it could be */
+  if (target < *bufsiz && info.tcpi_delivery_rate_app_limited)
+    return ;
+
+  /* within 25%, not worth it */
+  if (target * 4 > *bufsiz * 3 && target * 4 < *bufsiz * 5)
+    return ;
+
+  prcl_trace(cl, "buffer resized from %zu to %zu bytes (rtt %uus)",
+	     *bufsiz, target, info.tcpi_rtt);
+
+  *bufsiz = target;
+  bufferevent_setwatermark(in, EV_READ, 0, target);
+  bufferevent_setwatermark(out, EV_WRITE, target / 2, 0);
+
+  if (!cl->profile->notsent_lowat) {
+    lowat = target / 2;
+    setsockopt(out_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof (lowat));
+  }
+}
+
+static void autobuf_timer_add(struct autobufs *abs)
+{
+  struct timeval tv = {AUTOBUF_INTERVAL / 1000, (AUTOBUF_INTERVAL % 1000) * 1000};
+
+  event_add(&abs->timer, &tv);
+}
+
+static void on_autobuf_timer(int fd, short ev, void *arg)
+{
+  struct autobufs *abs = arg;
+  Client *cl, *tmp;
+
+  list_for_each_entry_safe(cl, tmp, &abs->clients, next_autobuf, Client) {
+    /* the kernel relays it now */
+    if (cl->sockmap) {
+      autobuf_release(cl);
+      continue ;
+    }
+
+    autobuf_tune(cl, cl->client.bufev, cl->server.bufev, cl->server.fd,
+		 &cl->server_bufsiz);
+    autobuf_tune(cl, cl->server.bufev, cl->client.bufev, cl->client.fd,
+		 &cl->client_bufsiz);
+  }
+
+  if (!list_empty(&abs->clients))
+    autobuf_timer_add(abs);
+}
+
+/* Virtual listeners share the timer of the main SocksLink */
+static struct autobufs *autobufs_get(SocksLink *sl)
+{
+  SocksLink *master = sl->master ? sl->master : sl;
+  struct autobufs *abs = master->autobufs;
+
+  if (abs)
+    return abs;
+
+  abs = calloc(sizeof (*abs), 1);
+  if (!abs)
+    return NULL;
+
+  INIT_LIST_HEAD(&abs->clients);
+  evtimer_set(&abs->timer, on_autobuf_timer, abs);
+  event_base_set(master->base, &abs->timer);
+  master->autobufs = abs;
+  return abs;
+}
+
+void autobuf_start(Client *cl)
+{
+  struct autobufs *abs;
+
+  if (!cl->profile->adaptive || !list_empty(&cl->next_autobuf) ||
+      !cl->server.bufev || cl->close)
+    return ;
+
+  abs = autobufs_get(cl->parent);
+  if (!abs)
+    return ;
+
+  if (list_empty(&abs->clients))
+    autobuf_timer_add(abs);
+  list_add_tail(&cl->next_autobuf, &abs->clients);
+}
+
+void autobuf_release(Client *cl)
+{
+  /* the timer stops by itself once nobody is left */
+  list_del_init(&cl->next_autobuf);
+}
+
+void autobuf_stop(SocksLink *sl)
+{
+  struct autobufs *abs = sl->autobufs;
+
+  if (!abs)
+    return ;
+
+  event_del(&abs->timer);
+  free(abs);
+  sl->autobufs = NULL;
+}
+
+#else
+
+void autobuf_start(Client *cl)
+{
+}
+
+void autobuf_release(Client *cl)
+{
+}
+
+void autobuf_stop(SocksLink *sl)
+{
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef AUTOBUF_H
+# define AUTOBUF_H
+
+#include "client.h"
+
+void autobuf_start(Client *cl);
+void autobuf_release(Client *cl);
+void autobuf_stop(SocksLink *sl);
+
+#endif /* !AUTOBUF_H */
@@ -6,7 +6,28 @@
 #include "client.h"
 #include "server.h"
 #include "helper.h"
+#include "plugin.h"
+#include "users.h"
+#include "routes.h"
+#include "aliases.h"
+#include "rules.h"
+#include "pamauth.h"
+#include "destinations.h"
+#include "udp.h"
+#include "mux.h"
+#include "stripe.h"
+#include "hop.h"
+#include "zlink.h"
+#include "tls.h"
+#include "sockmap.h"
+#include "source.h"
+#include "profile.h"
+#include "autobuf.h"
+#include "wheel.h"
+#include "admit.h"
+#include "request.h"
 #include "list.h"
+#include "utils.h"
 #include "log.h"
 #include "config.h"
 
@@ -19,24 +40,60 @@ static void on_client_event(struct bufferevent *bev, short why, void *ctx)
     /* Client disconnected, remove the read event and the
      * free the client structure. */
     pr_debug(sl, "client disconnected");
-    client_drop(cl);
-  } else if (why & EVBUFFER_TIMEOUT) {
-    pr_debug(sl, "client timeout");
-    client_disconnect(cl);
+    client_drop(cl, false);
   } else if (cl->client.fd != -1) {
     pr_debug(sl, "client socket error, disconnecting");
-    client_drop(cl);
+    client_drop(cl, true);
   }
 }
 
+/*
+ * Handshake deadline, then idle timeout once streaming: I/O only stamps
+ * cl->active, the timer is set again for what's left when it fires
+ */
+static void on_client_timeout(struct wheel_timer *timer)
+{
+  Client *cl = container_of(timer, Client, timer);
+  unsigned long idle = wheel_now(cl->parent) - cl->active;
+
+  /* the kernel relays the stream, with its own idle timer */
+  if (cl->sockmap)
+    return ;
+
+  if (idle < cl->timeout) {
+    wheel_add(cl->parent, timer, cl->timeout - idle);
+    return ;
+  }
+
+  if (cl->close) {
+    prcl_debug(cl, "timeout while flushing, dropping");
+    client_drop(cl, true);
+    return ;
+  }
+
+  prcl_debug(cl, "timeout, disconnecting");
+  cl->aborted = true;
+  /* the same delay to flush what's left */
+  wheel_add(cl->parent, timer, cl->timeout);
+  client_disconnect(cl);
+}
+
 static void on_client_write(struct bufferevent *bev, void *ctx)
 {
   Client *cl = ctx;
 
   prcl_trace(cl, "client write buffer sent");
-
-  if (cl->close)
-    client_drop(cl);
+  if (cl->authenticated)
+    cl->active = wheel_now(cl->parent);
+
+  if (cl->close && !EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)))
+    client_drop(cl, false);
+  else if (cl->server_paused) {
+    /* the client caught up, read the server again */
+    cl->server_paused = false;
+    bufferevent_enable(cl->server.bufev, EV_READ);
+  } else if (cl->sockmap_wait)
+    sockmap_offload(cl);
 }
 
 static void on_client_read_dummy(struct bufferevent *bev, void *ctx)
@@ -47,7 +104,8 @@ static void on_client_read_dummy(struct bufferevent *bev, void *ctx)
 
 static void client_connect_server(Client *cl)
 {
-  SocksLink *sl = cl->parent;
+  /* the client sent all it had to, what's left is up to us */
+  admit_handshake_done(cl);
 
   /*
    * If the client is dummy, he may send data before receiving authentication
@@ -58,14 +116,180 @@ static void client_connect_server(Client *cl)
 		    on_client_write, on_client_event, cl);
   bufferevent_setwatermark(cl->client.bufev, EV_READ, 0, 1);
 
-  if (!sl->helpers_max) {
+  /* routes only pick a next-hop, PAM and the plugin check credentials first */
+  if (rules_call(cl) && users_call(cl) && pamauth_call(cl) && plugin_call(cl))
+    client_auth_fallback(cl);
+}
+
+/*
+ * PAM or the plugin accepted the client without picking its next-hop:
+ * its "@alias" login or its source address may, else the default one
+ */
+void client_auth_route(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+
+  if (aliases_call(cl) && routes_call(cl))
+    client_auth_accept(cl, &sl->nexthop_addr, sl->nexthop_addrlen);
+}
+
+/*
+ * Route the client by its "@alias" login or its source address, else ask
+ * the external helper, if any, or use the default next-hop
+ */
+void client_auth_fallback(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+
+  if (sl->pipe) {
+    /* Nothing to negotiate, the client talks to the next-hop */
     server_connect(cl, &sl->nexthop_addr, sl->nexthop_addrlen);
+  } else if (!aliases_call(cl) || !routes_call(cl)) {
+    /* routed, without asking the helper */
+  } else if (!sl->helpers_max) {
+    if (!users_reject(cl))
+      return ;
+    /* Forward client credentials */
+    cl->server_method = cl->client_method;
+    client_auth_accept(cl, &sl->nexthop_addr, sl->nexthop_addrlen);
   } else {
     if (helper_call(cl)) {
-      /* No helper available, drop client (he may try to reconnect later) */
+      /* Auth queue is full, drop client (he may try to reconnect later) */
+      client_disconnect(cl);
+    }
+  }
+}
+
+/* Reply to the request with cl->request_rep, or a general failure */
+void client_request_fail(Client *cl)
+{
+  uint8_t message[] = {SOCKS5_VER, cl->request_rep, 0x00, SOCKS5_ATYP_IPV4,
+		       0, 0, 0, 0, 0, 0};
+
+  if (message[1] == SOCKS5_REP_SUCCEEDED)
+    message[1] = SOCKS5_REP_FAILURE;
+
+  bufferevent_write(cl->client.bufev, message, sizeof (message));
+}
+
+/*
+ * The request is left in the input buffer and relayed to the next-hop
+ * once connected, unless we connect to the destination ourself
+ */
+static void on_client_read_request(struct bufferevent *bev, void *ctx)
+{
+  Client *cl = ctx;
+  struct sockaddr_storage nexthop_addr;
+  socklen_t nexthop_addrlen = cl->server.addrlen;
+  int ret;
+
+  prcl_trace(cl, "received %d bytes from client",
+	     EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)));
+
+  if (!cl->request) {
+    cl->request = malloc(sizeof (*cl->request));
+    if (!cl->request) {
+      prcl_err(cl, "can't allocate request");
       client_disconnect(cl);
+      return ;
     }
   }
+
+  ret = socks5_request_parse(EVBUFFER_DATA(EVBUFFER_INPUT(bev)),
+			     EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)),
+			     cl->request);
+  if (!ret)
+    return ;
+  if (ret < 0) {
+    prcl_warn(cl, "invalid request");
+    client_disconnect(cl);
+    return ;
+  }
+  admit_handshake_done(cl);
+
+  memcpy(&nexthop_addr, &cl->server.addr, nexthop_addrlen);
+  /* the destination of UDP requests is the client itself */
+  if (cl->parent->destinations && cl->request->cmd != SOCKS5_CMD_UDP)
+    destinations_route(cl, cl->request, &nexthop_addr, &nexthop_addrlen);
+
+  if (!nexthop_addrlen) {
+    prcl_err(cl, "no valid next-hop for this request");
+    client_disconnect(cl);
+    return ;
+  }
+
+  bufferevent_setcb(bev, on_client_read_dummy, on_client_write,
+		    on_client_event, cl);
+  bufferevent_setwatermark(bev, EV_READ, 0, 1);
+
+  if (nexthop_is_direct(&nexthop_addr, nexthop_addrlen)) {
+    evbuffer_drain(EVBUFFER_INPUT(bev), ret);
+    server_connect_direct(cl);
+    return ;
+  }
+
+  server_connect(cl, &nexthop_addr, nexthop_addrlen);
+}
+
+/* Accept the client now, so it sends its request before we connect */
+static void client_read_request(Client *cl,
+				const struct sockaddr_storage *nexthop,
+				socklen_t nexthop_addrlen)
+{
+  struct bufferevent *bev = cl->client.bufev;
+
+  memcpy(&cl->server.addr, nexthop, nexthop_addrlen);
+  cl->server.addrlen = nexthop_addrlen;
+
+  if (cl->client_method == AUTH_METHOD_USERNAME)
+    client_auth_username_successful(cl);
+  cl->auth_replied = true;
+
+  /* waiting for the client again */
+  admit_handshake_start(cl);
+
+  bufferevent_setcb(bev, on_client_read_request, on_client_write,
+		    on_client_event, cl);
+  bufferevent_setwatermark(bev, EV_READ, 0, SOCKS5_REQUEST_MAX);
+
+  /* there is still data available in the buffer, call next callback */
+  if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
+    on_client_read_request(bev, cl);
+}
+
+/*
+ * Every authentication backend ends up here once it decided where
+ * the client goes, cl->server_method and cl->auth must be set
+ */
+void client_auth_accept(Client *cl, const struct sockaddr_storage *nexthop,
+			socklen_t nexthop_addrlen)
+{
+  if (!nexthop_addrlen && !cl->parent->destinations) {
+    prcl_err(cl, "no valid next-hop for this client");
+    client_disconnect(cl);
+    return ;
+  }
+  if (cl->server_method == AUTH_METHOD_INVALID) {
+    prcl_err(cl, "no valid authentication method for the next-hop");
+    client_disconnect(cl);
+    return ;
+  }
+
+  if (cl->parent->destinations || cl->parent->udp ||
+      nexthop_is_direct(nexthop, nexthop_addrlen)) {
+    client_read_request(cl, nexthop, nexthop_addrlen);
+    return ;
+  }
+
+  server_connect(cl, nexthop, nexthop_addrlen);
+}
+
+void client_auth_reject(Client *cl, const char *error)
+{
+  prcl_warn(cl, "authentication error: %s", error);
+
+  /* client_disconnect will handle authentication specific failure */
+  client_disconnect(cl);
 }
 
 void client_invalid_version(Client *cl)
@@ -131,6 +355,63 @@ static void on_client_read_auth_username(struct bufferevent *bev, void *ctx)
   client_connect_server(cl);
 }
 
+static bool client_method_enabled(SocksLink *sl, uint8_t method)
+{
+  for (int i = 0; i < ARRAY_SIZE(sl->methods); ++i) {
+    if (sl->methods[i] == AUTH_METHOD_INVALID)
+      break ;
+    if (sl->methods[i] == method)
+      return true;
+  }
+  return false;
+}
+
+static void on_client_read_hop(struct bufferevent *bev, void *ctx)
+{
+  Client *cl = ctx;
+  bool compress = cl->client_method == AUTH_METHOD_HOP_ZLIB;
+  int ret;
+
+  prcl_trace(cl, "received %d bytes from client",
+	     EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)));
+
+  ret = hop_parse(cl, EVBUFFER_DATA(EVBUFFER_INPUT(bev)),
+		  EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)));
+  if (!ret)
+    return ;
+  if (ret < 0) {
+    prcl_warn(cl, "invalid hop handshake");
+    client_disconnect(cl);
+    return ;
+  }
+
+  evbuffer_drain(EVBUFFER_INPUT(bev), ret);
+
+  /* everything else is compressed, replies included */
+  if (compress) {
+    if (zlink_wrap(cl, &cl->client, 0)) {
+      client_drop(cl, true);
+      return ;
+    }
+    bufferevent_setcb(cl->client.bufev, on_client_read_dummy,
+		      on_client_write, on_client_event, cl);
+  }
+
+  if (!client_method_enabled(cl->parent, cl->client_method)) {
+    prcl_debug(cl, "hop handshake with a disabled method (%#x)",
+	       cl->client_method);
+    client_auth_username_fail(cl);
+    client_disconnect(cl);
+    return ;
+  }
+
+  /* replies are those of RFC1929, without credentials it's now */
+  if (cl->client_method == AUTH_METHOD_NONE)
+    client_auth_username_successful(cl);
+
+  client_connect_server(cl);
+}
+
 static void on_client_read_stream(struct bufferevent *bev, void *ctx)
 {
   Client *cl = ctx;
@@ -138,9 +419,19 @@ static void on_client_read_stream(struct bufferevent *bev, void *ctx)
   char *buffer = EVBUFFER_DATA(EVBUFFER_INPUT(bev));
 
   prcl_trace(cl, "received %d bytes from client", bytes);
+  cl->active = wheel_now(cl->parent);
 
-  bufferevent_write(cl->server.bufev, buffer, bytes);
+  /* UDP associations we terminate have no server */
+  if (cl->server.bufev)
+    bufferevent_write(cl->server.bufev, buffer, bytes);
   evbuffer_drain(EVBUFFER_INPUT(bev), bytes);
+
+  /* don't queue more than server_bufsiz for a slower server */
+  if (cl->server.bufev &&
+      EVBUFFER_LENGTH(EVBUFFER_OUTPUT(cl->server.bufev)) >= cl->server_bufsiz) {
+    cl->client_paused = true;
+    bufferevent_disable(bev, EV_READ);
+  }
 }
 
 static void on_client_read_init(struct bufferevent *bev, void *ctx)
@@ -159,6 +450,16 @@ static void on_client_read_init(struct bufferevent *bev, void *ctx)
   ver = buffer[0];
   nmeth = buffer[1];
 
+  if (ver == MUX_MAGIC && sl->mux_accept) {
+    mux_accept(cl);
+    return ;
+  }
+
+  if (ver == STRIPE_MAGIC && sl->stripe_accept) {
+    stripe_accept(cl);
+    return ;
+  }
+
   if (ver != SOCKS5_VER) {
     client_invalid_version(cl);
     return ;
@@ -182,6 +483,18 @@ static void on_client_read_init(struct bufferevent *bev, void *ctx)
       break ;
   }
 
+  /* a trusted sockslinkd gets the one-shot handshake instead */
+  if (hop_is_trusted(cl)) {
+    for (int j = 0; j < nmeth; ++j) {
+      if (buffer[2 + j] == AUTH_METHOD_HOP_ZLIB && sl->compress) {
+	method = AUTH_METHOD_HOP_ZLIB;
+	break ;
+      }
+      if (buffer[2 + j] == AUTH_METHOD_HOP)
+	method = AUTH_METHOD_HOP;
+    }
+  }
+
   if (method == AUTH_METHOD_INVALID) {
     prcl_debug(cl, "no matching authentication method found");
   } else {
@@ -192,6 +505,9 @@ static void on_client_read_init(struct bufferevent *bev, void *ctx)
 
   cl->client_method = method;
 
+  /* reply first, the client may be dropped by the next steps */
+  bufferevent_write(cl->client.bufev, (uint8_t []){SOCKS5_VER, method}, 2);
+
   if (method == AUTH_METHOD_NONE)
     client_connect_server(cl);
   else if (method == AUTH_METHOD_USERNAME) {
@@ -201,11 +517,14 @@ static void on_client_read_init(struct bufferevent *bev, void *ctx)
     /* there is still data available in the buffer, call next callback */
     if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
       on_client_read_auth_username(bev, cl);
-  }
-
-  bufferevent_write(cl->client.bufev, (uint8_t []){SOCKS5_VER, method}, 2);
+  } else if (method == AUTH_METHOD_HOP ||
+	     method == AUTH_METHOD_HOP_ZLIB) {
+    bufferevent_setcb(cl->client.bufev, on_client_read_hop,
+		      on_client_write, on_client_event, cl);
 
-  if (method == AUTH_METHOD_INVALID)
+    if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
+      on_client_read_hop(bev, cl);
+  } else
     client_disconnect(cl);
 }
 
@@ -214,29 +533,41 @@ void client_start_stream(Client *cl)
   struct bufferevent *bev = cl->client.bufev;
 
   cl->authenticated = true;
+  admit_handshake_done(cl);
+
+  cl->timeout = cl->profile->io_timeout;
+  cl->active = wheel_now(cl->parent);
+  wheel_add(cl->parent, &cl->timer, cl->timeout);
 
   bufferevent_disable(bev, EV_READ | EV_WRITE);
-  bufferevent_settimeout(bev, SOCKS_IO_TIMEOUT, SOCKS_IO_TIMEOUT);
-  bufferevent_setwatermark(bev, EV_READ, 0, SOCKS_STREAM_BUFSIZ);
+  bufferevent_setwatermark(bev, EV_READ, 0, cl->server_bufsiz);
+  bufferevent_setwatermark(bev, EV_WRITE, cl->client_bufsiz / 2, 0);
   bufferevent_setcb(bev, on_client_read_stream, on_client_write, on_client_event, cl);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
 
   /* there is still data available in the buffer, call next callback */
   if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
     on_client_read_stream(bev, cl);
+
+  autobuf_start(cl);
+  sockmap_offload(cl);
 }
 
 Client *client_new(SocksLink *sl, int fd, struct sockaddr_storage *addr,
-		   socklen_t addrlen)
+		   socklen_t addrlen, const struct profile *profile)
 {
   Client *cl = calloc(sizeof (*cl), 1);
   struct bufferevent *bev;
 
+  if (!cl)
+    return NULL;
+
   INIT_LIST_HEAD(&cl->next);
   INIT_LIST_HEAD(&cl->next_auth);
+  INIT_LIST_HEAD(&cl->next_handshake);
+  INIT_LIST_HEAD(&cl->next_autobuf);
 
-  if (!cl)
-    return NULL;
+  wheel_timer_init(&cl->timer, on_client_timeout);
 
   bev = bufferevent_new(fd, NULL, NULL, NULL, NULL);
   if (!bev) {
@@ -249,6 +580,9 @@ Client *client_new(SocksLink *sl, int fd, struct sockaddr_storage *addr,
   cl->client_method = AUTH_METHOD_INVALID;
   cl->server_method = AUTH_METHOD_INVALID;
   cl->parent = sl;
+  cl->profile = profile;
+  cl->client_bufsiz = profile->bufsize;
+  cl->server_bufsiz = profile->bufsize;
   cl->client.bufev = bev;
   cl->client.fd = fd;
   cl->client.addr = *addr;
@@ -256,12 +590,21 @@ Client *client_new(SocksLink *sl, int fd, struct sockaddr_storage *addr,
   cl->server.fd = -1;
 
   list_add(&cl->next, &sl->clients);
+  /* its socket, and the server one */
+  admit_fds(sl, 2);
+  admit_handshake_start(cl);
+
+  /* authenticate and connect within auth_timeout */
+  cl->timeout = profile->auth_timeout;
+  cl->active = wheel_now(sl);
+  wheel_add(sl, &cl->timer, cl->timeout);
+
+  prcl_infos(cl, "client connected #%d", cl->client.fd);
 
   if (sl->pipe) {
     client_connect_server(cl);
   } else {
     bufferevent_setcb(bev, on_client_read_init, on_client_write, on_client_event, cl);
-    bufferevent_settimeout(bev, SOCKS5_AUTH_TIMEOUT, SOCKS5_AUTH_TIMEOUT);
     bufferevent_enable(bev, EV_READ|EV_WRITE);
   }
 
@@ -275,22 +618,33 @@ void client_disconnect(Client *cl)
 
   prcl_trace(cl, "disconnecting client");
 
+  /* a pending resolution is of no use anymore */
+  server_cancel(cl);
+
   /* first, try to send bytes, then disconnect */
   if (bytes)
     cl->close = true;
   else {
-    if (!cl->authenticated && cl->client_method == AUTH_METHOD_USERNAME) {
+    if (!cl->authenticated && cl->auth_replied) {
+      /* the client is waiting for the result of its request */
+      client_request_fail(cl);
+      cl->close = true;
+    } else if (!cl->authenticated &&
+	       cl->client_method == AUTH_METHOD_USERNAME) {
       /* tsocks <= 1.8 will freeze if the socket is disconnected before
        * authentication results */
       client_auth_username_fail(cl);
       cl->close = true;
     } else
-      client_drop(cl);
+      client_drop(cl, false);
   }
 }
 
-/* Disconnect and remove the client *NOW* */
-void client_drop(Client *cl)
+/*
+ * Disconnect and remove the client *NOW*, aborted when we end it on an
+ * error, a timeout or for admission control rather than on an end of stream
+ */
+void client_drop(Client *cl, bool aborted)
 {
   if (!cl)
     return ;
@@ -309,14 +663,31 @@ void client_drop(Client *cl)
 
   if (cl->client.fd >= 0)
     close(cl->client.fd);
-  if (cl->server.fd >= 0)
+  if (cl->server.fd >= 0) {
+    /* don't leave the 4-tuple in TIME_WAIT when we end the connection */
+    if (cl->parent->reset_aborted && (aborted || cl->aborted) &&
+	!cl->server_eof)
+      sock_set_linger(cl->server.fd, 1, 0);
     close(cl->server.fd);
+  }
 
   cl->client.fd = -1;
   cl->server.fd = -1;
 
-  list_del_init(&cl->next_auth);
+  helper_cancel(cl);
+  plugin_cancel(cl);
+  pamauth_cancel(cl);
+  server_cancel(cl);
+  tls_cancel(cl);
+  sockmap_release(cl);
+  source_release(cl);
+  autobuf_release(cl);
+  udp_release(cl);
+  wheel_del(&cl->timer);
   list_del_init(&cl->next);
+  admit_fds(cl->parent, -2);
+  admit_handshake_done(cl);
 
+  free(cl->request);
   free(cl);
 }
@@ -2,6 +2,7 @@
 # define CLIENT_H
 
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #include "sockslink.h"
 
@@ -16,10 +17,46 @@ typedef struct peer Peer;
 
 struct client {
   struct sockslink *parent;
+  const struct profile *profile; /* of the listener the client came from */
   Peer client;
   Peer server;
   bool close;
+  struct wheel_timer timer; /* handshake, then idle timeout */
+  unsigned long active; /* tick of the last stream I/O */
+  unsigned int timeout; /* seconds of the timer */
+  struct list_head next_handshake; /* in the main SocksLink handshakes */
+  unsigned long accepted; /* tick we started waiting for the client at */
   struct list_head next_auth;
+  bool auth_queued; /* waiting for an helper in parent's auth_queue */
+  bool auth_sent; /* waiting for the answer of an helper */
+  struct timeval auth_deadline;
+  unsigned int auth_id;
+  struct sockslink_auth_request *plugin_req;
+  struct pam_job *pam_job;
+  bool auth_replied; /* request read before connecting to the next-hop */
+  struct socks5_request *request;
+  uint8_t request_rep; /* reply sent if the request fails */
+  bool direct; /* connected to the destination, not to a next-hop */
+  struct server_resolve *resolve;
+  struct udp_flow *udp;
+  struct tls_conn *tls; /* TLS handshake with the next-hop */
+  struct sockmap_conn *sockmap; /* stream relayed in the kernel */
+  bool sockmap_wait; /* waiting for our buffers to flush to offload */
+  struct source_addr *source; /* address the server socket is bound to */
+  unsigned int source_start; /* first pool address tried */
+  bool server_eof; /* the server ended the connection */
+  bool aborted; /* dropped on an error or a timeout, not on an end of stream */
+  size_t client_bufsiz; /* bytes queued for the client before pausing the server */
+  size_t server_bufsiz; /* bytes queued for the server before pausing the client */
+  bool client_paused; /* not reading the client until the server catches up */
+  bool server_paused;
+  struct list_head next_autobuf; /* in the main SocksLink autobufs while
+				   resizing the buffers above */
+  bool server_mux; /* the server is a channel of a tunnel */
+  uint8_t server_hop; /* hop method whose handshake was sent with the
+			method request, 0 if none */
+  struct sockaddr_storage hop_addr; /* the sockslinkd relaying the client */
+  socklen_t hop_addrlen; /* 0 if the client came by itself */
   struct list_head next;
   bool authenticated;
   uint8_t client_method;
@@ -37,12 +74,18 @@ struct client {
 typedef struct client Client;
 
 Client *client_new(SocksLink *sl, int fd, struct sockaddr_storage *addr,
-		   socklen_t addrlen);
+		   socklen_t addrlen, const struct profile *profile);
 void client_disconnect(Client *cl);
 void client_invalid_version(Client *cl);
-void client_drop(Client *cl);
+void client_drop(Client *cl, bool aborted);
 void client_start_stream(Client *cl);
 void client_auth_username_successful(Client *cl);
 void client_auth_username_fail(Client *cl);
+void client_request_fail(Client *cl);
+void client_auth_accept(Client *cl, const struct sockaddr_storage *nexthop,
+			socklen_t nexthop_addrlen);
+void client_auth_reject(Client *cl, const char *error);
+void client_auth_route(Client *cl);
+void client_auth_fallback(Client *cl);
 
 #endif /* !CLIENT_H */
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "destinations.h"
+#include "request.h"
+#include "prefix.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Destination routing table
+ *
+ * # destination        next-hop
+ * corp.example.com     10.0.0.1:1080
+ * www.corp.example.com !
+ * 10.0.0.0/8           10.0.0.1:1080
+ * 2001:db8::/32        [2001:db8::1]:1080
+ *
+ * Once authenticated, the client request is read and its destination
+ * may override the next-hop chosen by the authentication: a domain
+ * matches itself and all its subdomains, addresses use the longest
+ * matching prefix, and '!' keeps the next-hop given by the
+ * authentication. The request is then replayed to the next-hop.
+ *
+ * Domains are kept in a trie of labels, walked from the top level
+ * domain.
+ */
+
+struct destination {
+  struct sockaddr_storage nexthop_addr;
+  socklen_t nexthop_addrlen;	/* 0 to keep the current next-hop */
+};
+
+struct label_node {
+  char *label;
+  uint8_t len;
+  int child;
+  int sibling;
+  int value;			/* -1 if no domain ends here */
+};
+
+struct destinations {
+  struct destination *dests;
+  int ndests;
+  struct prefix_table *addresses;
+  struct label_node *labels;
+  int nlabels;
+};
+
+static int label_child(const struct destinations *dests, int node,
+		       const char *label, size_t len)
+{
+  for (int n = dests->labels[node].child; n != -1;
+       n = dests->labels[n].sibling) {
+    const struct label_node *l = &dests->labels[n];
+
+    if (l->len == len && !strncasecmp(l->label, label, len))
+      return n;
+  }
+  return -1;
+}
+
+/* Returns the previous label of name[0:end], and its length */
+static const char *label_prev(const char *name, size_t *end, size_t *len)
+{
+  size_t start = *end;
+
+  while (start > 0 && name[start - 1] != '.')
+    start--;
+
+  *len = *end - start;
+  *end = start ? start - 1 : 0;
+  return name + start;
+}
+
+static int labels_add(struct destinations *dests, const char *name,
+		      int value)
+{
+  size_t end = strlen(name);
+  int node = 0;
+
+  if (end && name[end - 1] == '.')
+    end--;
+
+  while (end) {
+    size_t len;
+    const char *label = label_prev(name, &end, &len);
+    int child;
+
+    if (!len || len > 63)
+      return -1;
+
+    child = label_child(dests, node, label, len);
+    if (child == -1) {
+      struct label_node *labels;
+
+      labels = realloc(dests->labels, (dests->nlabels + 1) * sizeof (*labels));
+      if (!labels)
+	return -1;
+      dests->labels = labels;
+
+      child = dests->nlabels++;
+      labels[child].label = strndup(label, len);
+      if (!labels[child].label)
+	return -1;
+      labels[child].len = len;
+      labels[child].value = -1;
+      labels[child].child = -1;
+      labels[child].sibling = labels[node].child;
+      labels[node].child = child;
+    }
+    node = child;
+  }
+
+  if (!node)
+    return -1;
+  /* first match in the file wins */
+  if (dests->labels[node].value == -1)
+    dests->labels[node].value = value;
+  return 0;
+}
+
+static int labels_lookup(const struct destinations *dests, const char *name,
+			 size_t end)
+{
+  int best = -1;
+  int node = 0;
+
+  if (end && name[end - 1] == '.')
+    end--;
+
+  while (end) {
+    size_t len;
+    const char *label = label_prev(name, &end, &len);
+
+    node = label_child(dests, node, label, len);
+    if (node == -1)
+      break ;
+    if (dests->labels[node].value != -1)
+      best = dests->labels[node].value;
+  }
+
+  return best;
+}
+
+struct destinations *destinations_open(SocksLink *sl, const char *path)
+{
+  struct destinations *dests;
+  FILE *fp;
+  char line[1024];
+  int lineno = 0;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    pr_err(sl, "can't open destinations file '%s': %s", path,
+	   strerror(errno));
+    return NULL;
+  }
+
+  dests = calloc(sizeof (*dests), 1);
+  if (!dests)
+    goto error;
+  dests->addresses = prefix_table_new();
+  dests->labels = calloc(sizeof (*dests->labels), 1);
+  if (!dests->addresses || !dests->labels)
+    goto error;
+  dests->nlabels = 1;
+  dests->labels[0].child = dests->labels[0].sibling = -1;
+  dests->labels[0].value = -1;
+
+  while (fgets(line, sizeof (line), fp)) {
+    struct destination *dest;
+    struct prefix prefix;
+    char *name, *nexthop, *end;
+    int ret;
+
+    lineno++;
+
+    if ((end = strchr(line, '#')))
+      *end = '\0';
+
+    name = strtok(line, " \t\r\n");
+    if (!name)
+      continue ;
+    nexthop = strtok(NULL, " \t\r\n");
+    if (!nexthop || strtok(NULL, " \t\r\n"))
+      goto error_line;
+
+    dest = realloc(dests->dests, (dests->ndests + 1) * sizeof (*dest));
+    if (!dest)
+      goto error;
+    dests->dests = dest;
+    dest = &dests->dests[dests->ndests];
+    memset(dest, 0, sizeof (*dest));
+
+    if (strcmp(nexthop, "!")) {
+      ret = parse_nexthop_numeric(nexthop, &dest->nexthop_addr,
+				  &dest->nexthop_addrlen);
+      if (ret) {
+	pr_err(sl, "%s:%d: invalid next-hop address '%s': %s",
+	       path, lineno, nexthop, gai_strerror(ret));
+	errno = EINVAL;
+	goto error;
+      }
+    }
+
+    if (!prefix_parse(name, &prefix))
+      ret = prefix_table_add(dests->addresses, &prefix, dests->ndests);
+    else
+      ret = labels_add(dests, name, dests->ndests);
+    if (ret)
+      goto error_line;
+
+    dests->ndests++;
+  }
+
+  if (prefix_table_compile(dests->addresses))
+    goto error;
+
+  fclose(fp);
+  return dests;
+
+ error_line:
+  pr_err(sl, "%s:%d: invalid destination", path, lineno);
+  errno = EINVAL;
+ error:
+  if (errno != EINVAL)
+    pr_err(sl, "can't load destinations file '%s': %s", path,
+	   strerror(errno));
+  destinations_close(dests);
+  fclose(fp);
+  return NULL;
+}
+
+void destinations_close(struct destinations *dests)
+{
+  if (!dests)
+    return ;
+
+  for (int i = 0; i < dests->nlabels; ++i)
+    free(dests->labels[i].label);
+  free(dests->labels);
+  free(dests->dests);
+  prefix_table_free(dests->addresses);
+  free(dests);
+}
+
+int destinations_count(const struct destinations *dests)
+{
+  return dests->ndests;
+}
+
+int destinations_load(SocksLink *sl)
+{
+  if (!sl->destinations_file)
+    return 0;
+
+  sl->destinations = destinations_open(sl, sl->destinations_file);
+  if (!sl->destinations)
+    return -1;
+
+  pr_infos(sl, "%d destinations loaded from %s",
+	   destinations_count(sl->destinations), sl->destinations_file);
+  return 0;
+}
+
+/* Swap tables only once the new one is loaded */
+void destinations_reload(SocksLink *sl)
+{
+  struct destinations *dests;
+
+  if (!sl->destinations_file)
+    return ;
+
+  dests = destinations_open(sl, sl->destinations_file);
+  if (!dests) {
+    pr_err(sl, "keeping the old destinations");
+    return ;
+  }
+
+  destinations_close(sl->destinations);
+  sl->destinations = dests;
+
+  pr_infos(sl, "%d destinations reloaded from %s", destinations_count(dests),
+	   sl->destinations_file);
+}
+
+void destinations_unload(SocksLink *sl)
+{
+  destinations_close(sl->destinations);
+  sl->destinations = NULL;
+}
+
+/* Update the next-hop if the destination of the request is known */
+void destinations_route(Client *cl, const struct socks5_request *req,
+			struct sockaddr_storage *nexthop_addr,
+			socklen_t *nexthop_addrlen)
+{
+  const struct destinations *dests = cl->parent->destinations;
+  int dest;
+
+  if (req->addrlen)
+    dest = prefix_table_lookup(dests->addresses, &req->addr);
+  else
+    dest = labels_lookup(dests, req->name, strlen(req->name));
+
+  if (dest != -1 && dests->dests[dest].nexthop_addrlen) {
+    prcl_debug(cl, "routed by destination");
+    memcpy(nexthop_addr, &dests->dests[dest].nexthop_addr,
+	   dests->dests[dest].nexthop_addrlen);
+    *nexthop_addrlen = dests->dests[dest].nexthop_addrlen;
+  }
+}
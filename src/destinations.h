@@ -0,0 +1,24 @@
+#ifndef DESTINATIONS_H
+# define DESTINATIONS_H
+
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+struct socks5_request;
+struct destinations;
+
+struct destinations *destinations_open(SocksLink *sl, const char *path);
+void destinations_close(struct destinations *dests);
+int destinations_count(const struct destinations *dests);
+
+int destinations_load(SocksLink *sl);
+void destinations_reload(SocksLink *sl);
+void destinations_unload(SocksLink *sl);
+
+void destinations_route(Client *client, const struct socks5_request *req,
+			struct sockaddr_storage *nexthop_addr,
+			socklen_t *nexthop_addrlen);
+
+#endif /* !DESTINATIONS_H */
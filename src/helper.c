@@ -7,52 +7,68 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "log.h"
 #include "config.h"
 #include "utils.h"
 #include "sockslink.h"
 #include "helper.h"
-#include "server.h"
+#include "client.h"
+#include "wheel.h"
+#include "admit.h"
 
-static int helper_kill(Helper *helper)
-{
-  int status;
-  pid_t pid;
-  int retry = 2;
-  int ret;
+static void helper_queue_arm(SocksLink *sl);
+static void helpers_drain_queue(SocksLink *sl);
 
-  ret = kill(helper->pid, SIGTERM);
-
-  if (ret == -1 && errno == ESRCH)
-    return 0;
-
-  while (retry--) {
-    pid = waitpid(helper->pid, &status, WNOHANG);
-
-    if (pid == helper->pid)
-      return 0;
+/* The pid of the helper, or the index of its connection to the service */
+static int helper_id(const Helper *helper)
+{
+  return helper->socket ? helper->conn : helper->pid;
+}
 
-    /* try to let the helper finish its stuff */
-    usleep(200);
-  }
+static void on_helper_kill_timeout(int fd, short event, void *ctx)
+{
+  Helper *helper = ctx;
+  SocksLink *sl = helper->parent;
 
   /*
-   * failed to stop the helper gracefully, kill it
-   * wait with WNOHANG, if it doesn't work, sockslink
-   * SIGCHLD handler will take care of freeing memory
+   * failed to stop the helper gracefully, kill it, the SIGCHLD
+   * event will take care of freeing memory
    */
-  ret = kill(helper->pid, SIGKILL);
+  pr_warn(sl, "helper[%d] still alive, sending SIGKILL", helper->pid);
 
-  if (ret == -1 && errno == ESRCH)
-    return 0;
+  if (kill(helper->pid, SIGKILL) == -1 && errno != ESRCH)
+    pr_err(sl, "helper[%d] can't be killed ?!? %s", helper->pid,
+	   strerror(errno));
+}
 
-  pid = waitpid(helper->pid, &status, 0);
+/*
+ * Ask the helper to exit, and keep it in the zombies list until
+ * the SIGCHLD event reaps it. Never blocks.
+ */
+static void helper_kill(Helper *helper)
+{
+  SocksLink *sl = helper->parent;
+  static const struct timeval tv = HELPER_KILL_TIMEOUT;
+  int ret;
 
-  if (pid == helper->pid)
-    return 0;
+  ret = kill(helper->pid, SIGTERM);
 
-  return -1;
+  /* Already reaped by someone else */
+  if (ret == -1 && errno == ESRCH) {
+    free(helper);
+    return ;
+  }
+
+  list_add(&helper->next, &sl->helpers_zombies);
+
+  timeout_set(&helper->kill_event, on_helper_kill_timeout, helper);
+  event_base_set(sl->base, &helper->kill_event);
+  timeout_add(&helper->kill_event, &tv);
 }
 
 static int helper_stop(Helper *helper)
@@ -60,7 +76,7 @@ static int helper_stop(Helper *helper)
   Client *client, *ctmp;
   SocksLink *sl = helper->parent;
 
-  pr_infos(sl, "helper[%d] stopping", helper->pid);
+  pr_infos(sl, "helper[%d] stopping", helper_id(helper));
 
   if (helper->running) {
     helper->running = false;
@@ -68,17 +84,17 @@ static int helper_stop(Helper *helper)
   }
 
   list_del_init(&helper->next);
+  wheel_del(&helper->timeout);
 
-  /* Drop clients waiting for auth on this helper */
+  /* Give clients waiting for auth on this helper to the next one */
   list_for_each_entry_safe(client, ctmp, &helper->clients, next_auth, Client) {
-    client_disconnect(client);
-    list_del_init(&client->next_auth);
+    helper_cancel(client);
+    if (sl->exiting || helper_queue(client))
+      client_disconnect(client);
   }
 
-  if (!helper->dying && helper->pid > 0) {
-    if (helper_kill(helper))
-      pr_err(sl, "helper[%d] can't be killed ?!?", helper->pid);
-  }
+  if (!sl->exiting)
+    helpers_drain_queue(sl);
 
   if (helper->bufev_in) {
     bufferevent_disable(helper->bufev_in,  EV_WRITE);
@@ -97,9 +113,14 @@ static int helper_stop(Helper *helper)
 
   close(helper->stdin);
   close(helper->stdout);
-  close(helper->stderr);
+  if (helper->stderr != -1)
+    close(helper->stderr);
+  admit_fds(sl, helper->stderr != -1 ? -3 : -2);
 
-  free(helper);
+  if (!helper->dying && helper->pid > 0)
+    helper_kill(helper);
+  else
+    free(helper);
 
   if (!sl->exiting)
     helpers_refill_pool(sl);
@@ -107,6 +128,24 @@ static int helper_stop(Helper *helper)
   return 0;
 }
 
+static void on_helper_timeout(struct wheel_timer *timer)
+{
+  Helper *helper = container_of(timer, Helper, timeout);
+  SocksLink *sl = helper->parent;
+  unsigned long idle = wheel_now(sl) - helper->active;
+
+  if (list_empty(&helper->clients))
+    return ;
+
+  if (idle < HELPER_AUTH_TIMEOUT) {
+    wheel_add(sl, timer, HELPER_AUTH_TIMEOUT - idle);
+    return ;
+  }
+
+  pr_infos(sl, "helper[%d] authentication timeout", helper_id(helper));
+  helper_stop(helper);
+}
+
 /**
  * Helper protocol:
  *
@@ -118,6 +157,13 @@ static int helper_stop(Helper *helper)
  * stdin> source-ip method [username [password]]
  * stdout< OK (next-hop|!) method [username [password]]
  * stdout< ERR [error]
+ *
+ * Auth services (--helper-socket) use the same lines, prefixed by a
+ * request id, and may answer out of order:
+ *
+ * > id source-ip method [username [password]]
+ * < id OK (next-hop|!) method [username [password]]
+ * < id ERR [error]
  */
 
 static void helper_parse_authentication(Helper *hl, Client *cl, int argc,
@@ -166,11 +212,11 @@ static int helper_parse_nexthop(Helper *hl, Client *cl, const char *nexthop,
   if (!strcmp(nexthop, "!"))
     return 0;
 
-  ret = parse_ip_port(nexthop, "socks", nexthop_addr, nexthop_addrlen);
+  ret = parse_nexthop(nexthop, nexthop_addr, nexthop_addrlen);
 
   if (ret != 0) {
     prcl_err(cl, "helper[%d]: can't resolve address: getaddrinfo(%s): %s",
-	     hl->pid, nexthop, gai_strerror(ret));
+	     helper_id(hl), nexthop, gai_strerror(ret));
     return -1;
   }
 
@@ -216,29 +262,47 @@ static void on_helper_read_ok(Helper *hl, Client *cl, char *buffer)
   }
 
  connect:
-  if (!nexthop_addrlen) {
-    prcl_err(cl, "helper[%d] did not send a valid next-hop", hl->pid);
-    client_disconnect(cl);
-    return ;
-  }
-  if (cl->server_method == AUTH_METHOD_INVALID) {
-    prcl_err(cl, "helper[%d] did no provide a valid authentication method",
-	     hl->pid);
+  client_auth_accept(cl, &nexthop_addr, nexthop_addrlen);
+}
+
+static void on_helper_read_err(Helper *hl, Client *cl, const char *error)
+{
+  client_auth_reject(cl, error);
+}
+
+static void helper_dispatch(Helper *hl, Client *cl, char *buffer)
+{
+  if (!strncmp(buffer, "OK", 2))
+    on_helper_read_ok(hl, cl, buffer);
+  else if (!strncmp(buffer, "ERR", 3))
+    on_helper_read_err(hl, cl, buffer + 3);
+  else {
+    pr_err(hl->parent, "helper[%d] send an invalid answer (not starting "
+	   "with OK or ERR)", helper_id(hl));
     client_disconnect(cl);
-    return ;
   }
-
-  server_connect(cl, &nexthop_addr, nexthop_addrlen);
 }
 
-static void on_helper_read_err(Helper *hl, Client *cl, const char *error)
+/* Parse the request id of an auth service answer */
+static Client *helper_find_client(Helper *hl, char **line)
 {
-  SocksLink *sl = cl->parent;
+  Client *client;
+  unsigned long id;
+  char *end;
+
+  id = strtoul(*line, &end, 10);
+  if (end == *line || !isblank(*end))
+    return NULL;
+
+  for (; isblank(*end); end++)
+    ;
+  *line = end;
 
-  pr_warn(sl, "helper[%d]: authentication error: %s", hl->pid, error);
+  list_for_each_entry(client, &hl->clients, next_auth, Client)
+    if (client->auth_id == id)
+      return client;
 
-  /* client_disconnect will handle authentication specific failure */
-  client_disconnect(cl);
+  return NULL;
 }
 
 static void on_helper_read_stdout(struct bufferevent *bev, void *ctx)
@@ -250,53 +314,52 @@ static void on_helper_read_stdout(struct bufferevent *bev, void *ctx)
   Client *client;
   char *endofline;
 
-  pr_trace(sl, "helper[%d] ready to read data (%d bytes)", helper->pid, bytes);
+  pr_trace(sl, "helper[%d] ready to read data (%d bytes)", helper_id(helper),
+	   bytes);
+  helper->active = wheel_now(sl);
 
   while (bytes > 0 && (endofline = strnchr(buffer, bytes, '\n')) != NULL) {
     size_t consumed = 0;
 
     if (list_empty(&helper->clients)) {
       pr_err(sl, "helper[%d] sent data, but no clients in auth queue,"
-	     "ignoring data", helper->pid);
+	     "ignoring data", helper_id(helper));
       evbuffer_drain(EVBUFFER_INPUT(bev), bytes);
       break ;
     }
 
     *endofline = '\0';
+    consumed = endofline - buffer + 1;
 
-    pr_trace(sl, "helper[%d]: >> [%s]", helper->pid, buffer);
-
-    client = list_first_entry(&helper->clients, Client, next_auth);
-    list_del_init(&client->next_auth);
-
-    if (!strncmp(buffer, "OK", 2))
-      on_helper_read_ok(helper, client, buffer);
-    else if (!strncmp(buffer, "ERR", 3))
-      on_helper_read_err(helper, client, buffer + 3);
-    else
-      pr_err(sl, "helper[%d] send an invalid answer (not starting "
-	     "with OK or ERR)", helper->pid);
+    pr_trace(sl, "helper[%d]: >> [%s]", helper_id(helper), buffer);
+
+    if (helper->socket) {
+      char *line = buffer;
+
+      client = helper_find_client(helper, &line);
+      if (!client) {
+	/* client went away while waiting for its answer */
+	pr_debug(sl, "helper[%d] answered an unknown request",
+		 helper_id(helper));
+	goto next;
+      }
+      helper_cancel(client);
+      helper_dispatch(helper, client, line);
+    } else {
+      client = list_first_entry(&helper->clients, Client, next_auth);
+      helper_cancel(client);
+      helper_dispatch(helper, client, buffer);
+    }
 
-    consumed = endofline - buffer + 1;
+  next:
     evbuffer_drain(EVBUFFER_INPUT(bev), consumed);
     bytes -= consumed;
     buffer += consumed;
   }
 
   /* no more client waiting, remove timeout */
-  if (list_empty(&helper->clients)) {
-    struct bufferevent *bev;
-
-    bev = helper->bufev_in;
-    bufferevent_disable(bev, EV_WRITE);
-    bufferevent_settimeout(bev, 0, 0);
-    bufferevent_enable(bev, EV_WRITE);
-
-    bev = helper->bufev_out;
-    bufferevent_disable(bev, EV_READ);
-    bufferevent_settimeout(bev, 0, 0);
-    bufferevent_enable(bev, EV_READ);
-  }
+  if (list_empty(&helper->clients))
+    wheel_del(&helper->timeout);
 }
 
 static void on_helper_read_stderr(struct bufferevent *bev, void *ctx)
@@ -309,7 +372,7 @@ static void on_helper_read_stderr(struct bufferevent *bev, void *ctx)
   while ((bytes = bufferevent_read(bev, buf, sizeof (buf) - 1)) > 0) {
     buf[bytes] = '\0';
 
-    pr_err(sl, "helper[%d]: %s", helper->pid, buf);
+    pr_err(sl, "helper[%d]: %s", helper_id(helper), buf);
   }
 }
 
@@ -322,9 +385,11 @@ static void on_helper_write_stdin(struct bufferevent *bev, void *ctx)
     bufferevent_settimeout(bev, 0, 0);
     helper->running = true;
     helper->parent->helpers_running++;
-    pr_infos(sl, "helper[%d] started", helper->pid);
+    pr_infos(sl, "helper[%d] started", helper_id(helper));
+    sl->helpers_backoff = 0;
+    helpers_drain_queue(sl);
   } else {
-    pr_trace(sl, "helper[%d] finished to write data", helper->pid);
+    pr_trace(sl, "helper[%d] finished to write data", helper_id(helper));
   }
 
 }
@@ -336,20 +401,112 @@ static void on_helper_event(struct bufferevent *bev, short why, void *ctx)
 
   if (why & EVBUFFER_EOF) {
     /* Helper died... */
-    pr_infos(sl, "helper[%d] died", helper->pid);
+    pr_infos(sl, "helper[%d] died", helper_id(helper));
   } else if (why & EVBUFFER_TIMEOUT) {
-    pr_infos(sl, "helper[%d] authentication timeout", helper->pid);
+    pr_infos(sl, "helper[%d] authentication timeout", helper_id(helper));
   } else {
-    pr_infos(sl, "helper[%d] unknown error", helper->pid);
+    pr_infos(sl, "helper[%d] unknown error", helper_id(helper));
   }
   helper_stop(helper);
 }
 
+/*
+ * Connect to a long running auth service, both directions of the
+ * connection are handled like an helper's stdin and stdout
+ */
+static int helper_connect(SocksLink *sl)
+{
+  struct sockaddr_un sun;
+  Helper *helper = NULL;
+  struct bufferevent *bev;
+  int fd;
+
+  memset(&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strlcpy(sun.sun_path, sl->helper_socket, sizeof (sun.sun_path));
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    goto error;
+
+  if (sock_set_nonblock(fd) < 0)
+    goto error;
+
+  /*
+   * Local sockets connect right away, or complete once writable. EAGAIN
+   * is a full listen backlog: the refill retries it with a backoff.
+   */
+  if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) == -1 &&
+      errno != EINPROGRESS) {
+    if (errno != EAGAIN)
+      goto error;
+    pr_warn(sl, "auth service %s is busy, retrying later", sl->helper_socket);
+    close(fd);
+    return -1;
+  }
+
+  helper = calloc(sizeof (*helper), 1);
+  if (!helper)
+    goto error;
+
+  INIT_LIST_HEAD(&helper->clients);
+  INIT_LIST_HEAD(&helper->next);
+  wheel_timer_init(&helper->timeout, on_helper_timeout);
+
+  helper->parent = sl;
+  helper->socket = true;
+  helper->conn = ++sl->helper_conns;
+  helper->stdin = fd;
+  helper->stdout = dup(fd);
+  helper->stderr = -1;
+
+  if (helper->stdout == -1) {
+    free(helper);
+    goto error;
+  }
+  admit_fds(sl, 2);
+
+  helper->bufev_in = bufferevent_new(helper->stdin, NULL, NULL, NULL, NULL);
+  helper->bufev_out = bufferevent_new(helper->stdout, NULL, NULL, NULL, NULL);
+
+  list_add(&helper->next, &sl->helpers);
+
+  if (!helper->bufev_in || !helper->bufev_out) {
+    pr_err(sl, "error while finishing auth service connection");
+    helper_stop(helper);
+    return -1;
+  }
+
+  bev = helper->bufev_in;
+  bufferevent_setcb(bev, NULL, on_helper_write_stdin, on_helper_event, helper);
+  bufferevent_base_set(sl->base, bev);
+  bufferevent_enable(bev, EV_WRITE);
+  bufferevent_settimeout(bev, 0, HELPER_STARTUP_TIMEOUT);
+
+  bev = helper->bufev_out;
+  bufferevent_setcb(bev, on_helper_read_stdout, NULL, on_helper_event, helper);
+  bufferevent_base_set(sl->base, bev);
+  bufferevent_enable(bev, EV_READ);
+
+  pr_infos(sl, "helper[%d] connected to %s (#%d)", helper_id(helper),
+	   sl->helper_socket, fd);
+  return 0;
+ error:
+  pr_err(sl, "can't connect to auth service %s: %s", sl->helper_socket,
+	 strerror(errno));
+  if (fd != -1)
+    close(fd);
+  return -1;
+}
+
 static int helper_start(SocksLink *sl)
 {
   int in[2], out[2], err[2];
   pid_t pid;
 
+  if (sl->helper_socket)
+    return helper_connect(sl);
+
   in[0] = in[1] = -1;
   out[0] = out[1] = -1;
   err[0] = err[1] = -1;
@@ -379,12 +536,15 @@ static int helper_start(SocksLink *sl)
       goto error_parent;
 
     INIT_LIST_HEAD(&helper->clients);
+    INIT_LIST_HEAD(&helper->next);
+    wheel_timer_init(&helper->timeout, on_helper_timeout);
 
     helper->parent = sl;
     helper->pid = pid;
     helper->stdin = in[1];
     helper->stdout = out[0];
     helper->stderr = err[0];
+    admit_fds(sl, 3);
 
     helper->bufev_in = bufferevent_new(helper->stdin, NULL, NULL, NULL, NULL);
     helper->bufev_out = bufferevent_new(helper->stdout, NULL, NULL, NULL, NULL);
@@ -451,7 +611,8 @@ static int helper_start(SocksLink *sl)
     list_for_each_entry(helper, &sl->helpers, next, Helper) {
       close(helper->stdin);
       close(helper->stdout);
-      close(helper->stderr);
+      if (helper->stderr != -1)
+	close(helper->stderr);
     }
 
     for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX; ++i) {
@@ -507,9 +668,14 @@ static void on_helpers_refill(int fd, short event, void *ctx)
   for (int i = sl->helpers_running; i < sl->helpers_max; ++i)
     ret |= helper_start(sl);
 
-  if (ret)
+  if (ret) {
+    /* back off while the helper (or auth service) keeps failing */
+    if (!sl->helpers_backoff)
+      sl->helpers_backoff = 1;
+    else if (sl->helpers_backoff < HELPERS_REFILL_POOL_BACKOFF_MAX)
+      sl->helpers_backoff *= 2;
     helpers_refill_pool(sl);
-  else if (timeout_pending(&sl->helper_refill_event, NULL))
+  } else if (timeout_pending(&sl->helper_refill_event, NULL))
     timeout_del(&sl->helper_refill_event);
 }
 
@@ -527,17 +693,70 @@ void helpers_stop_pool(SocksLink *sl)
 {
   Helper *helper, *tmp;
 
-  if (timeout_pending(&sl->helper_refill_event, NULL))
+  if (timeout_initialized(&sl->helper_refill_event) &&
+      timeout_pending(&sl->helper_refill_event, NULL))
       timeout_del(&sl->helper_refill_event);
 
+  if (timeout_initialized(&sl->auth_queue_event) &&
+      timeout_pending(&sl->auth_queue_event, NULL))
+      timeout_del(&sl->auth_queue_event);
+
   list_for_each_entry_safe(helper, tmp, &sl->helpers, next, Helper)
     helper_stop(helper);
+
+  /* Nobody will reap them anymore, init will */
+  list_for_each_entry_safe(helper, tmp, &sl->helpers_zombies, next, Helper) {
+    timeout_del(&helper->kill_event);
+    list_del(&helper->next);
+    free(helper);
+  }
+}
+
+static void helper_reaped(SocksLink *sl, pid_t pid)
+{
+  Helper *helper, *tmp;
+
+  /* Pipes will report EOF, on_helper_event() will stop it */
+  list_for_each_entry(helper, &sl->helpers, next, Helper)
+    if (helper->pid == pid)
+      helper->dying = true;
+
+  list_for_each_entry_safe(helper, tmp, &sl->helpers_zombies, next, Helper) {
+    if (helper->pid != pid)
+      continue ;
+    timeout_del(&helper->kill_event);
+    list_del(&helper->next);
+    free(helper);
+  }
+}
+
+/* Children of the whole process, virtual listeners included */
+void helpers_reap(SocksLink *sl)
+{
+  SocksLink *vl;
+  pid_t pid;
+  int status;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (WIFSIGNALED(status))
+      pr_debug(sl, "helper[%d] killed by signal %d", pid, WTERMSIG(status));
+    else
+      pr_debug(sl, "helper[%d] exited with status %d", pid,
+	       WEXITSTATUS(status));
+
+    helper_reaped(sl, pid);
+    list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+      helper_reaped(vl, pid);
+  }
 }
 
 void helpers_refill_pool(SocksLink *sl)
 {
   struct event *ev = &sl->helper_refill_event;
-  static const struct timeval tv = HELPERS_REFILL_POOL_TIMEOUT;
+  struct timeval tv = HELPERS_REFILL_POOL_TIMEOUT;
+
+  if (sl->helpers_backoff)
+    tv.tv_sec *= sl->helpers_backoff;
 
   if (!timeout_initialized(ev)) {
     timeout_set(ev, on_helpers_refill, sl);
@@ -569,18 +788,19 @@ static Helper *helper_round_robin(SocksLink *sl)
   return helper;
 }
 
-int helper_call(Client *client)
+static void helper_send(Helper *helper, Client *client)
 {
-  Helper *helper = helper_round_robin(client->parent);
-  struct bufferevent *bev;
+  struct bufferevent *bev = helper->bufev_in;
   char buf[ADDR_NTOP_BUFSIZ];
 
-  if (!helper || helper->dying) {
-    helpers_refill_pool(client->parent);
-    return -1;
+  if (helper->socket) {
+    char id[16];
+
+    client->auth_id = ++helper->parent->auth_id;
+    snprintf(id, sizeof (id), "%u ", client->auth_id);
+    bufferevent_write(bev, id, strlen(id));
   }
 
-  bev = helper->bufev_in;
 
   if (addr_ntop(&client->client.addr, buf, sizeof (buf))) {
     bufferevent_write(bev, buf, strlen(buf));
@@ -608,10 +828,144 @@ int helper_call(Client *client)
   }
   bufferevent_write(bev, "\n", 1);
 
-  /* setup auth timeout */
-  bufferevent_settimeout(helper->bufev_in, 0, HELPER_AUTH_TIMEOUT);
-  bufferevent_settimeout(helper->bufev_out, HELPER_AUTH_TIMEOUT, 0);
-  list_add(&client->next_auth, &helper->clients);
+  /* setup auth timeout, counted from the last reply */
+  if (list_empty(&helper->clients))
+    helper->active = wheel_now(helper->parent);
+  if (!wheel_pending(&helper->timeout))
+    wheel_add(helper->parent, &helper->timeout, HELPER_AUTH_TIMEOUT);
+  list_add_tail(&client->next_auth, &helper->clients);
+  client->auth_sent = true;
+  helper->parent->auth_pending++;
+  admit_auth(helper->parent);
+}
+
+static void on_helper_queue_timeout(int fd, short event, void *ctx)
+{
+  SocksLink *sl = ctx;
+  Client *client, *ctmp;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  list_for_each_entry_safe(client, ctmp, &sl->auth_queue, next_auth, Client) {
+    if (timercmp(&client->auth_deadline, &now, >))
+      continue ;
+    prcl_warn(client, "no helper available after %d seconds, giving up",
+	      HELPER_QUEUE_TIMEOUT);
+    helper_cancel(client);
+    client_disconnect(client);
+  }
+
+  helper_queue_arm(sl);
+}
+
+/* Arm the queue timer on the closest deadline */
+static void helper_queue_arm(SocksLink *sl)
+{
+  struct event *ev = &sl->auth_queue_event;
+  struct timeval now, tv;
+  Client *client;
+  bool first = true;
+
+  if (!timeout_initialized(ev)) {
+    timeout_set(ev, on_helper_queue_timeout, sl);
+    event_base_set(sl->base, ev);
+  }
+  if (timeout_pending(ev, NULL))
+    timeout_del(ev);
+
+  list_for_each_entry(client, &sl->auth_queue, next_auth, Client) {
+    if (first || timercmp(&client->auth_deadline, &tv, <))
+      tv = client->auth_deadline;
+    first = false;
+  }
+
+  if (first)
+    return ;
+
+  gettimeofday(&now, NULL);
+  if (timercmp(&tv, &now, <))
+    timerclear(&tv);
+  else
+    timersub(&tv, &now, &tv);
+
+  timeout_add(ev, &tv);
+}
+
+static void helpers_drain_queue(SocksLink *sl)
+{
+  Client *client;
+  Helper *helper;
+
+  while (!list_empty(&sl->auth_queue)) {
+    helper = helper_round_robin(sl);
+    if (!helper || helper->dying)
+      break ;
+
+    client = list_first_entry(&sl->auth_queue, Client, next_auth);
+    helper_cancel(client);
+    helper_send(helper, client);
+  }
+
+  helper_queue_arm(sl);
+}
+
+/*
+ * Park the client until an helper is running, keeping its
+ * deadline if it was already queued once
+ */
+int helper_queue(Client *client)
+{
+  SocksLink *sl = client->parent;
+
+  if (sl->auth_queue_len >= sl->auth_queue_max) {
+    prcl_warn(client, "authentication queue is full (%d clients)",
+	      sl->auth_queue_len);
+    return -1;
+  }
+
+  if (!timerisset(&client->auth_deadline)) {
+    struct timeval tv = { HELPER_QUEUE_TIMEOUT, 0 };
+
+    gettimeofday(&client->auth_deadline, NULL);
+    timeradd(&client->auth_deadline, &tv, &client->auth_deadline);
+  }
+
+  prcl_debug(client, "no helper available, queuing authentication request");
+
+  list_add_tail(&client->next_auth, &sl->auth_queue);
+  client->auth_queued = true;
+  sl->auth_queue_len++;
+  admit_auth(sl);
+
+  helpers_refill_pool(sl);
+  helper_queue_arm(sl);
+  return 0;
+}
+
+void helper_cancel(Client *client)
+{
+  if (client->auth_queued) {
+    client->auth_queued = false;
+    client->parent->auth_queue_len--;
+    admit_auth(client->parent);
+  }
+  if (client->auth_sent) {
+    client->auth_sent = false;
+    client->parent->auth_pending--;
+    admit_auth(client->parent);
+  }
+  list_del_init(&client->next_auth);
+}
+
+int helper_call(Client *client)
+{
+  Helper *helper = helper_round_robin(client->parent);
+
+  if (!helper || helper->dying)
+    return helper_queue(client);
+
+  helper_send(helper, client);
   return 0;
 }
 
@@ -8,8 +8,11 @@
 void helpers_start_pool(SocksLink *sl);
 void helpers_stop_pool(SocksLink *sl);
 void helpers_refill_pool(SocksLink *sl);
+void helpers_reap(SocksLink *sl);
 
 bool helper_available(SocksLink *sl);
 int helper_call(Client *client);
+int helper_queue(Client *client);
+void helper_cancel(Client *client);
 
 #endif /* !HELPER_H */
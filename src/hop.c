@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "hop.h"
+#include "prefix.h"
+#include "request.h"
+#include "list.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * One-shot handshake between sockslinkd instances
+ *
+ * A sockslinkd started with --hop offers the private AUTH_METHOD_HOP
+ * method to its next-hops, along with the method it would use
+ * otherwise, and AUTH_METHOD_HOP_ZLIB first with --compress. A next-hop
+ * started with --hop-accept selects one of them for the peers it
+ * trusts, and the RFC1929 exchange is replaced by:
+ *
+ *   version (1) | flags (1) | client address (ATYP, address, port) |
+ *   [ ulen (1) | username | plen (1) | password ]
+ *
+ * answered like RFC1929 by version 0x01 and a status, 0x00 meaning
+ * success. The credentials are only there with HOP_FLAG_USERNAME.
+ *
+ * With AUTH_METHOD_HOP_ZLIB, everything after this message (and after
+ * the method reply the other way) goes through a compressed link, see
+ * zlink.c.
+ *
+ * Once a next-hop selected a method, it's remembered and the next
+ * connections send the message right behind the method request, with
+ * the client request if it was already read: a chained handshake then
+ * costs a single round trip. The next-hop applies its own policy to
+ * the original client address, which must thus come from a trusted
+ * peer.
+ *
+ * There is no route in the message: the one this sockslinkd picked
+ * ends at the next-hop it connected to, an alias included, and the
+ * next-hop routes further from the credentials and the client address
+ * with its own aliases, routes and rules. A next-hop taken from the
+ * message would let a peer choose where the next one connects.
+ */
+
+#define HOP_VERSION		0x01
+#define HOP_FLAG_USERNAME	0x01
+
+/* Next-hops known to select a hop method */
+struct hop_peer {
+  struct list_head next;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint8_t method;
+};
+
+struct hops {
+  struct list_head peers;
+  struct prefix_table *trusted; /* NULL without --hop-accept */
+};
+
+/* Build the table of the peers listed by --hop-accept */
+static int hop_trusted_load(SocksLink *sl, struct hops *hops)
+{
+  struct prefix prefix;
+  char *list, *tok, *save;
+  int ret = 0;
+
+  hops->trusted = prefix_table_new();
+  list = strdup(sl->hop_accept);
+  if (!hops->trusted || !list) {
+    free(list);
+    return -1;
+  }
+
+  for (tok = strtok_r(list, ",", &save); tok && !ret;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (prefix_parse(tok, &prefix)) {
+      pr_err(sl, "invalid network in --hop-accept: '%s'", tok);
+      ret = -1;
+    } else
+      ret = prefix_table_add(hops->trusted, &prefix, 0);
+  }
+
+  free(list);
+  if (!ret)
+    ret = prefix_table_compile(hops->trusted);
+  return ret;
+}
+
+int hop_start(SocksLink *sl)
+{
+  struct hops *hops;
+
+  if (!sl->hop && !sl->hop_accept)
+    return 0;
+
+  hops = calloc(sizeof (*hops), 1);
+  if (!hops)
+    return -1;
+  INIT_LIST_HEAD(&hops->peers);
+  sl->hops = hops;
+
+  if (sl->hop_accept && hop_trusted_load(sl, hops))
+    return -1;
+  return 0;
+}
+
+void hop_stop(SocksLink *sl)
+{
+  struct hops *hops = sl->hops;
+  struct hop_peer *peer, *tmp;
+
+  if (!hops)
+    return ;
+
+  list_for_each_entry_safe(peer, tmp, &hops->peers, next, struct hop_peer) {
+    list_del(&peer->next);
+    free(peer);
+  }
+  if (hops->trusted)
+    prefix_table_free(hops->trusted);
+
+  free(hops);
+  sl->hops = NULL;
+}
+
+static struct hop_peer *hop_peer_find(struct hops *hops,
+				      const struct sockaddr_storage *addr,
+				      socklen_t addrlen)
+{
+  struct hop_peer *peer;
+
+  list_for_each_entry(peer, &hops->peers, next, struct hop_peer) {
+    if (peer->addrlen == addrlen && !memcmp(&peer->addr, addr, addrlen))
+      return peer;
+  }
+  return NULL;
+}
+
+/* The hop method this next-hop selected, or AUTH_METHOD_INVALID */
+uint8_t hop_known_method(SocksLink *sl, const struct sockaddr_storage *addr,
+			 socklen_t addrlen)
+{
+  struct hop_peer *peer;
+
+  if (!sl->hops)
+    return AUTH_METHOD_INVALID;
+
+  peer = hop_peer_find(sl->hops, addr, addrlen);
+  return peer ? peer->method : AUTH_METHOD_INVALID;
+}
+
+/* Remember the hop method of this next-hop, AUTH_METHOD_INVALID forgets */
+void hop_set_known(SocksLink *sl, const struct sockaddr_storage *addr,
+		   socklen_t addrlen, uint8_t method)
+{
+  struct hop_peer *peer;
+
+  if (!sl->hops)
+    return ;
+
+  peer = hop_peer_find(sl->hops, addr, addrlen);
+  if (peer && method == AUTH_METHOD_INVALID) {
+    list_del(&peer->next);
+    free(peer);
+  } else if (!peer && method != AUTH_METHOD_INVALID) {
+    peer = calloc(sizeof (*peer), 1);
+    if (!peer)
+      return ;
+    memcpy(&peer->addr, addr, addrlen);
+    peer->addrlen = addrlen;
+    list_add(&peer->next, &sl->hops->peers);
+  }
+  if (peer && method != AUTH_METHOD_INVALID)
+    peer->method = method;
+}
+
+/* Send the handshake message, credentials are those of server_method */
+void hop_send(Client *cl)
+{
+  uint8_t message[2 + SOCKS5_ADDR_MAX];
+  size_t len;
+
+  message[0] = HOP_VERSION;
+  message[1] = 0;
+  if (cl->server_method == AUTH_METHOD_USERNAME)
+    message[1] |= HOP_FLAG_USERNAME;
+
+  len = 2 + socks5_addr_write(message + 2, &cl->client.addr);
+  bufferevent_write(cl->server.bufev, message, len);
+
+  if (cl->server_method == AUTH_METHOD_USERNAME) {
+    bufferevent_write(cl->server.bufev, &cl->auth.username.ulen, 1);
+    bufferevent_write(cl->server.bufev, cl->auth.username.uname,
+		      cl->auth.username.ulen);
+    bufferevent_write(cl->server.bufev, &cl->auth.username.plen, 1);
+    bufferevent_write(cl->server.bufev, cl->auth.username.passwd,
+		      cl->auth.username.plen);
+  }
+}
+
+/* Whether the client may use the method */
+bool hop_is_trusted(Client *cl)
+{
+  struct hops *hops = cl->parent->hops;
+
+  return hops && hops->trusted &&
+    prefix_table_lookup(hops->trusted, &cl->client.addr) >= 0;
+}
+
+/*
+ * Parse the handshake message of a trusted client: cl->client_method
+ * and cl->auth are set, and the client address becomes the original
+ * one. Returns the message length, 0 if it isn't complete yet, or -1
+ * if it's invalid.
+ */
+int hop_parse(Client *cl, const uint8_t *buffer, size_t len)
+{
+  struct socks5_request origin;
+  size_t off;
+  uint8_t ulen, plen;
+  int ret;
+  char buf[ADDR_NTOP_BUFSIZ];
+
+  if (len < 2)
+    return 0;
+  if (buffer[0] != HOP_VERSION)
+    return -1;
+
+  ret = socks5_addr_parse(buffer + 2, len - 2, &origin);
+  if (ret <= 0)
+    return ret;
+  off = 2 + ret;
+
+  /* nothing is set before the whole message is there */
+  if (buffer[1] & HOP_FLAG_USERNAME) {
+    if (len < off + 1)
+      return 0;
+    ulen = buffer[off];
+    if (len < off + 1 + ulen + 1)
+      return 0;
+    plen = buffer[off + 1 + ulen];
+    if (len < off + 1 + ulen + 1 + plen)
+      return 0;
+
+    cl->client_method = AUTH_METHOD_USERNAME;
+    cl->auth.username.ulen = ulen;
+    cl->auth.username.plen = plen;
+    memcpy(cl->auth.username.uname, buffer + off + 1, ulen);
+    memcpy(cl->auth.username.passwd, buffer + off + 1 + ulen + 1, plen);
+    off += 1 + ulen + 1 + plen;
+  } else
+    cl->client_method = AUTH_METHOD_NONE;
+
+  /* policies apply to the original client, datagrams come from the hop */
+  if (origin.addrlen) {
+    memcpy(&cl->hop_addr, &cl->client.addr, cl->client.addrlen);
+    cl->hop_addrlen = cl->client.addrlen;
+    memcpy(&cl->client.addr, &origin.addr, origin.addrlen);
+    cl->client.addrlen = origin.addrlen;
+
+    prcl_infos(cl, "client relayed by %s",
+	       addr_ntop(&cl->hop_addr, buf, sizeof (buf)));
+  }
+
+  return off;
+}
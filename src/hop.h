@@ -0,0 +1,23 @@
+#ifndef HOP_H
+# define HOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int hop_start(SocksLink *sl);
+void hop_stop(SocksLink *sl);
+
+uint8_t hop_known_method(SocksLink *sl, const struct sockaddr_storage *addr,
+			 socklen_t addrlen);
+void hop_set_known(SocksLink *sl, const struct sockaddr_storage *addr,
+		   socklen_t addrlen, uint8_t method);
+void hop_send(Client *cl);
+
+bool hop_is_trusted(Client *cl);
+int hop_parse(Client *cl, const uint8_t *buffer, size_t len);
+
+#endif /* !HOP_H */
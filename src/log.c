@@ -41,9 +41,13 @@ static void pr_syslog(int level, const char *prefix, const char *fmt, va_list ap
 static void prcl_common(Client *client, int level, const char *fmt, va_list ap)
 {
   char buf[256] = {0, };
-  size_t bytes = sizeof (buf);
+  size_t len = 0;
   char *prefix = NULL;
 
+  /* virtual listeners are named first */
+  if (client->parent->name)
+    len = snprintf(buf, sizeof (buf), "%.64s: ", client->parent->name);
+
   switch (client->client.addr.ss_family) {
   case AF_INET:
     {
@@ -52,7 +56,8 @@ static void prcl_common(Client *client, int level, const char *fmt, va_list ap)
 
       sin = ((struct sockaddr_in *)&client->client.addr);
       if (inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof (addr)))
-	snprintf(buf, bytes, "%s:%d: ", addr, ntohs(sin->sin_port));
+	snprintf(buf + len, sizeof (buf) - len, "%s:%d: ", addr,
+		 ntohs(sin->sin_port));
     }
     break ;
 #ifdef HAVE_IPV6
@@ -63,7 +68,8 @@ static void prcl_common(Client *client, int level, const char *fmt, va_list ap)
 
       sin6 = ((struct sockaddr_in6 *)&client->client.addr);
       if (inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof (addr)))
-	snprintf(buf, bytes, "[%s]:%d: ", addr, ntohs(sin6->sin6_port));
+	snprintf(buf + len, sizeof (buf) - len, "[%s]:%d: ", addr,
+		 ntohs(sin6->sin6_port));
     }
     break ;
 #endif
@@ -84,10 +90,18 @@ static void prcl_common(Client *client, int level, const char *fmt, va_list ap)
 
 static void pr_common(SocksLink *sl, int level, const char *fmt, va_list ap)
 {
+  char buf[256];
+  char *prefix = NULL;
+
+  if (sl && sl->name) {
+    snprintf(buf, sizeof (buf), "%.64s: ", sl->name);
+    prefix = buf;
+  }
+
   if (sl && sl->syslog)
-    pr_syslog(level, NULL, fmt, ap);
+    pr_syslog(level, prefix, fmt, ap);
   else
-    pr_stderr(NULL, fmt, ap);
+    pr_stderr(prefix, fmt, ap);
 }
 
 #define PR_FUNC(__name, __level, __syslog_level)	\
@@ -0,0 +1,653 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "mux.h"
+#include "list.h"
+#include "utils.h"
+#include "profile.h"
+#include "admit.h"
+#include "log.h"
+
+/*
+ * Multiplexed tunnels between sockslinkd instances
+ *
+ * With --mux, connections to a next-hop are carried over a few
+ * persistent TCP connections (tunnels) instead of one connection each.
+ * The next-hop must run with --mux-accept, and hands every channel of
+ * a tunnel to its usual SOCKS5 code, as if it were a new client.
+ *
+ * A tunnel starts with a preamble in both directions, then carries
+ * frames:
+ *
+ *   type (1) | reserved (1) | length (2) | channel (4) | payload
+ *
+ * OPEN opens a channel (sent by the connecting side only), DATA
+ * carries its bytes, WINDOW gives back credit for bytes written out,
+ * CLOSE closes it. Each channel may have MUX_WINDOW bytes in flight in
+ * each direction, so a slow stream never holds the tunnel, and a peer
+ * sending more loses the tunnel. A tunnel carries up to
+ * MUX_CHANNELS_MAX channels, fewer while the accepting side is
+ * overloaded.
+ *
+ * Locally a channel is one end of a socketpair, the other end being
+ * given to server_connect() (connecting side) or client_new()
+ * (accepting side), which don't know the difference.
+ */
+
+#define MUX_VERSION		1
+#define MUX_PREAMBLE_LEN	8
+#define MUX_HEADER_LEN		8
+#define MUX_FRAME_MAX		16384
+#define MUX_CHANNELS_HASH	256
+
+enum {
+  MUX_FRAME_OPEN = 1,
+  MUX_FRAME_DATA,
+  MUX_FRAME_WINDOW,
+  MUX_FRAME_CLOSE,
+};
+
+static const uint8_t mux_preamble[MUX_PREAMBLE_LEN] = {
+  MUX_MAGIC, 'S', 'L', 'M', 'U', 'X', MUX_VERSION, 0
+};
+
+/* A next-hop reached through tunnels */
+struct mux_peer {
+  struct list_head next;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct list_head tunnels;
+  int tunnels_count;
+  time_t plain_until; /* didn't answer as a tunnel, use plain connections */
+};
+
+struct mux_tunnel {
+  struct list_head next;
+  SocksLink *sl;
+  struct mux_peer *peer; /* NULL on the accepting side */
+  int fd;
+  struct bufferevent *bufev;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  bool ready; /* preamble received */
+  uint32_t next_id;
+  int channels_count;
+  struct list_head channels[MUX_CHANNELS_HASH];
+};
+
+struct mux_channel {
+  struct list_head next;
+  struct mux_tunnel *tunnel;
+  uint32_t id;
+  int fd;
+  struct bufferevent *bufev;
+  uint32_t send_window; /* bytes we may still send */
+  uint32_t recv_unacked; /* bytes received and not credited back yet */
+  bool eof; /* local end closed, CLOSE sent once the input is flushed */
+  bool closing; /* remote end closed, freed once the output is flushed */
+};
+
+struct mux {
+  struct list_head peers;
+  struct list_head accepted;
+};
+
+static void mux_frame_write(struct mux_tunnel *tunnel, uint8_t type,
+			    uint32_t id, const void *data, uint16_t len)
+{
+  uint8_t header[MUX_HEADER_LEN] = {
+    type, 0, len >> 8, len & 0xff, id >> 24, id >> 16, id >> 8, id
+  };
+
+  bufferevent_write(tunnel->bufev, header, sizeof (header));
+  if (len)
+    bufferevent_write(tunnel->bufev, (void *)data, len);
+}
+
+static struct mux_channel *mux_channel_find(struct mux_tunnel *tunnel,
+					    uint32_t id)
+{
+  struct mux_channel *ch;
+
+  list_for_each_entry(ch, &tunnel->channels[id % MUX_CHANNELS_HASH], next,
+		      struct mux_channel) {
+    if (ch->id == id)
+      return ch;
+  }
+  return NULL;
+}
+
+static void mux_channel_free(struct mux_channel *ch)
+{
+  list_del(&ch->next);
+  ch->tunnel->channels_count--;
+
+  bufferevent_disable(ch->bufev, EV_READ | EV_WRITE);
+  bufferevent_free(ch->bufev);
+  close(ch->fd);
+  admit_fds(ch->tunnel->sl, -1);
+  free(ch);
+}
+
+/* Send what the credit allows, then CLOSE if the local end is gone */
+static void on_channel_read(struct bufferevent *bev, void *ctx)
+{
+  struct mux_channel *ch = ctx;
+  struct evbuffer *input = EVBUFFER_INPUT(bev);
+  size_t len;
+
+  while ((len = EVBUFFER_LENGTH(input)) && ch->send_window) {
+    if (len > ch->send_window)
+      len = ch->send_window;
+    if (len > MUX_FRAME_MAX)
+      len = MUX_FRAME_MAX;
+
+    mux_frame_write(ch->tunnel, MUX_FRAME_DATA, ch->id, EVBUFFER_DATA(input),
+		    len);
+    evbuffer_drain(input, len);
+    ch->send_window -= len;
+  }
+
+  if (EVBUFFER_LENGTH(input)) {
+    /* out of credit, wait for a WINDOW frame */
+    bufferevent_disable(bev, EV_READ);
+    return ;
+  }
+
+  if (ch->eof) {
+    mux_frame_write(ch->tunnel, MUX_FRAME_CLOSE, ch->id, NULL, 0);
+    mux_channel_free(ch);
+  }
+}
+
+/* Bytes left our buffer, the remote end may send as much again */
+static void on_channel_write(struct bufferevent *bev, void *ctx)
+{
+  struct mux_channel *ch = ctx;
+  size_t buffered = EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev));
+  uint32_t credit;
+
+  if (ch->closing) {
+    if (!buffered)
+      mux_channel_free(ch);
+    return ;
+  }
+
+  if (ch->recv_unacked <= buffered)
+    return ;
+
+  credit = htonl(ch->recv_unacked - buffered);
+  ch->recv_unacked = buffered;
+  mux_frame_write(ch->tunnel, MUX_FRAME_WINDOW, ch->id, &credit,
+		  sizeof (credit));
+}
+
+static void on_channel_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct mux_channel *ch = ctx;
+
+  if (ch->closing) {
+    mux_channel_free(ch);
+    return ;
+  }
+
+  ch->eof = true;
+  bufferevent_disable(bev, EV_WRITE);
+
+  /* flush what is left, if credit allows */
+  on_channel_read(bev, ch);
+}
+
+/* Returns the end of the socketpair given to the rest of sockslink */
+static struct mux_channel *mux_channel_new(struct mux_tunnel *tunnel,
+					   uint32_t id, int *fd)
+{
+  struct mux_channel *ch;
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    pr_err(tunnel->sl, "socketpair failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  ch = calloc(sizeof (*ch), 1);
+  if (!ch)
+    goto error;
+
+  ch->bufev = bufferevent_new(fds[0], on_channel_read, on_channel_write,
+			      on_channel_event, ch);
+  if (!ch->bufev)
+    goto error;
+
+  sock_set_nonblock(fds[0]);
+  sock_set_nonblock(fds[1]);
+
+  ch->tunnel = tunnel;
+  ch->id = id;
+  ch->fd = fds[0];
+  admit_fds(tunnel->sl, 1);
+  ch->send_window = MUX_WINDOW;
+  list_add(&ch->next, &tunnel->channels[id % MUX_CHANNELS_HASH]);
+  tunnel->channels_count++;
+
+  bufferevent_base_set(tunnel->sl->base, ch->bufev);
+  bufferevent_setwatermark(ch->bufev, EV_READ, 0, MUX_WINDOW);
+  bufferevent_setwatermark(ch->bufev, EV_WRITE, MUX_WINDOW / 2, 0);
+  bufferevent_enable(ch->bufev, EV_READ | EV_WRITE);
+
+  *fd = fds[1];
+  return ch;
+
+ error:
+  free(ch);
+  close(fds[0]);
+  close(fds[1]);
+  return NULL;
+}
+
+static void mux_tunnel_free(struct mux_tunnel *tunnel)
+{
+  struct mux_channel *ch, *tmp;
+
+  /* the local ends see their connection closed */
+  for (int i = 0; i < MUX_CHANNELS_HASH; ++i) {
+    list_for_each_entry_safe(ch, tmp, &tunnel->channels[i], next,
+			     struct mux_channel)
+      mux_channel_free(ch);
+  }
+
+  if (tunnel->peer) {
+    /* a next-hop which never answered isn't one of ours */
+    if (!tunnel->ready)
+      tunnel->peer->plain_until = time(NULL) + MUX_RETRY_TIMEOUT;
+    tunnel->peer->tunnels_count--;
+  }
+  list_del(&tunnel->next);
+
+  if (tunnel->bufev) {
+    bufferevent_disable(tunnel->bufev, EV_READ | EV_WRITE);
+    bufferevent_free(tunnel->bufev);
+  }
+  close(tunnel->fd);
+  admit_fds(tunnel->sl, -1);
+  free(tunnel);
+}
+
+static void mux_tunnel_open(struct mux_tunnel *tunnel, uint32_t id)
+{
+  SocksLink *sl = tunnel->sl;
+  struct mux_channel *ch;
+  int fd;
+
+  if (tunnel->peer || mux_channel_find(tunnel, id)) {
+    mux_frame_write(tunnel, MUX_FRAME_CLOSE, id, NULL, 0);
+    return ;
+  }
+
+  /* closed right away, like a refused connection */
+  if (tunnel->channels_count >= MUX_CHANNELS_MAX || admit_overloaded(sl)) {
+    pr_debug(sl, "refusing tunnel channel %u (%d open)", id,
+	     tunnel->channels_count);
+    mux_frame_write(tunnel, MUX_FRAME_CLOSE, id, NULL, 0);
+    return ;
+  }
+
+  ch = mux_channel_new(tunnel, id, &fd);
+  if (!ch) {
+    mux_frame_write(tunnel, MUX_FRAME_CLOSE, id, NULL, 0);
+    return ;
+  }
+
+  /* rules and routes see the address of the tunnel */
+  if (!client_new(sl, fd, &tunnel->addr, tunnel->addrlen,
+		  profile_find(sl, NULL)))
+    close(fd);
+}
+
+/* Returns -1 if the tunnel was closed */
+static int mux_tunnel_frame(struct mux_tunnel *tunnel, uint8_t type,
+			    uint32_t id, const uint8_t *data, uint16_t len)
+{
+  struct mux_channel *ch;
+  uint32_t credit;
+
+  if (type == MUX_FRAME_OPEN) {
+    mux_tunnel_open(tunnel, id);
+    return 0;
+  }
+
+  ch = mux_channel_find(tunnel, id);
+  if (!ch)
+    return 0;
+
+  switch (type) {
+  case MUX_FRAME_DATA:
+    if (ch->closing)
+      break ;
+    if (ch->recv_unacked + len > MUX_WINDOW) {
+      pr_warn(tunnel->sl, "tunnel channel %u exceeded its window, "
+	      "closing the tunnel", id);
+      mux_tunnel_free(tunnel);
+      return -1;
+    }
+    ch->recv_unacked += len;
+    bufferevent_write(ch->bufev, (void *)data, len);
+    break ;
+
+  case MUX_FRAME_WINDOW:
+    if (len != sizeof (credit))
+      break ;
+    memcpy(&credit, data, sizeof (credit));
+    ch->send_window += ntohl(credit);
+    if (!ch->eof)
+      bufferevent_enable(ch->bufev, EV_READ);
+    on_channel_read(ch->bufev, ch);
+    break ;
+
+  case MUX_FRAME_CLOSE:
+    if (ch->eof || !EVBUFFER_LENGTH(EVBUFFER_OUTPUT(ch->bufev))) {
+      mux_channel_free(ch);
+      break ;
+    }
+    ch->closing = true;
+    bufferevent_disable(ch->bufev, EV_READ);
+    break ;
+  }
+  return 0;
+}
+
+static void on_tunnel_read(struct bufferevent *bev, void *ctx)
+{
+  struct mux_tunnel *tunnel = ctx;
+  struct evbuffer *input = EVBUFFER_INPUT(bev);
+
+  if (!tunnel->ready) {
+    if (EVBUFFER_LENGTH(input) < MUX_PREAMBLE_LEN)
+      return ;
+    if (memcmp(EVBUFFER_DATA(input), mux_preamble, MUX_PREAMBLE_LEN)) {
+      pr_warn(tunnel->sl, "next-hop doesn't accept tunnels");
+      mux_tunnel_free(tunnel);
+      return ;
+    }
+    evbuffer_drain(input, MUX_PREAMBLE_LEN);
+    tunnel->ready = true;
+    pr_debug(tunnel->sl, "tunnel ready");
+  }
+
+  while (EVBUFFER_LENGTH(input) >= MUX_HEADER_LEN) {
+    uint8_t *frame = EVBUFFER_DATA(input);
+    uint16_t len = (frame[2] << 8) | frame[3];
+    uint32_t id = ((uint32_t)frame[4] << 24) | (frame[5] << 16) |
+      (frame[6] << 8) | frame[7];
+
+    if (len > MUX_FRAME_MAX) {
+      pr_warn(tunnel->sl, "invalid tunnel frame, closing the tunnel");
+      mux_tunnel_free(tunnel);
+      return ;
+    }
+    if (EVBUFFER_LENGTH(input) < MUX_HEADER_LEN + len)
+      return ;
+
+    if (mux_tunnel_frame(tunnel, frame[0], id, frame + MUX_HEADER_LEN, len))
+      return ;
+    evbuffer_drain(input, MUX_HEADER_LEN + len);
+  }
+}
+
+static void on_tunnel_write(struct bufferevent *bev, void *ctx)
+{
+}
+
+static void on_tunnel_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct mux_tunnel *tunnel = ctx;
+
+  pr_debug(tunnel->sl, "tunnel closed (%#x), dropping %d channels", why,
+	   tunnel->channels_count);
+  mux_tunnel_free(tunnel);
+}
+
+static void on_tunnel_connect(struct bufferevent *bev, void *ctx)
+{
+  struct mux_tunnel *tunnel = ctx;
+  int status = 0;
+  socklen_t len = sizeof (status);
+
+  if (getsockopt(tunnel->fd, SOL_SOCKET, SO_ERROR, &status, &len) ||
+      status) {
+    pr_debug(tunnel->sl, "tunnel connection error: %s", strerror(status));
+    mux_tunnel_free(tunnel);
+    return ;
+  }
+
+  bufferevent_setcb(bev, on_tunnel_read, on_tunnel_write, on_tunnel_event,
+		    tunnel);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+  bufferevent_write(bev, (void *)mux_preamble, MUX_PREAMBLE_LEN);
+}
+
+/* Adopts bufev when given, a new one is created otherwise */
+static struct mux_tunnel *mux_tunnel_new(SocksLink *sl, int fd,
+					 struct bufferevent *bufev)
+{
+  struct mux_tunnel *tunnel = calloc(sizeof (*tunnel), 1);
+  int on = 1;
+
+  if (!tunnel)
+    return NULL;
+
+  if (!bufev) {
+    bufev = bufferevent_new(fd, NULL, NULL, on_tunnel_event, tunnel);
+    if (!bufev) {
+      free(tunnel);
+      return NULL;
+    }
+    bufferevent_base_set(sl->base, bufev);
+  }
+  tunnel->bufev = bufev;
+
+  tunnel->sl = sl;
+  tunnel->fd = fd;
+  admit_fds(sl, 1);
+  tunnel->next_id = 1;
+  for (int i = 0; i < MUX_CHANNELS_HASH; ++i)
+    INIT_LIST_HEAD(&tunnel->channels[i]);
+
+  /* tunnels stay up while idle, notice when the other end is gone */
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on));
+  sock_set_tcpnodelay(fd, 1);
+  return tunnel;
+}
+
+static void mux_tunnel_connect(SocksLink *sl, struct mux_peer *peer)
+{
+  struct mux_tunnel *tunnel;
+  int fd;
+
+  fd = socket(peer->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (fd < 0) {
+    pr_err(sl, "can't create tunnel socket: %s", strerror(errno));
+    return ;
+  }
+
+  if (sock_set_nonblock(fd) < 0 ||
+      (connect(fd, (const struct sockaddr *)&peer->addr, peer->addrlen) &&
+       errno != EINPROGRESS)) {
+    pr_debug(sl, "can't connect tunnel: %s", strerror(errno));
+    close(fd);
+    return ;
+  }
+
+  tunnel = mux_tunnel_new(sl, fd, NULL);
+  if (!tunnel) {
+    close(fd);
+    return ;
+  }
+  tunnel->peer = peer;
+  memcpy(&tunnel->addr, &peer->addr, peer->addrlen);
+  tunnel->addrlen = peer->addrlen;
+  list_add_tail(&tunnel->next, &peer->tunnels);
+  peer->tunnels_count++;
+
+  bufferevent_setcb(tunnel->bufev, NULL, on_tunnel_connect, on_tunnel_event,
+		    tunnel);
+  bufferevent_settimeout(tunnel->bufev, 0, SOCKS5_AUTH_TIMEOUT);
+  bufferevent_enable(tunnel->bufev, EV_WRITE);
+}
+
+static struct mux *mux_get(SocksLink *sl)
+{
+  if (!sl->mux) {
+    sl->mux = calloc(sizeof (*sl->mux), 1);
+    if (!sl->mux)
+      return NULL;
+    INIT_LIST_HEAD(&sl->mux->peers);
+    INIT_LIST_HEAD(&sl->mux->accepted);
+  }
+  return sl->mux;
+}
+
+static struct mux_peer *mux_peer_get(struct mux *mux,
+				     const struct sockaddr_storage *addr,
+				     socklen_t addrlen)
+{
+  struct mux_peer *peer;
+
+  list_for_each_entry(peer, &mux->peers, next, struct mux_peer) {
+    if (peer->addrlen == addrlen && !memcmp(&peer->addr, addr, addrlen))
+      return peer;
+  }
+
+  peer = calloc(sizeof (*peer), 1);
+  if (!peer)
+    return NULL;
+  memcpy(&peer->addr, addr, addrlen);
+  peer->addrlen = addrlen;
+  INIT_LIST_HEAD(&peer->tunnels);
+  list_add(&peer->next, &mux->peers);
+  return peer;
+}
+
+/*
+ * Open a channel to this next-hop, the returned fd is used as the
+ * connection to the next-hop. Returns -1 when no tunnel is ready, the
+ * client then gets a connection of its own.
+ */
+int mux_connect(Client *cl, const struct sockaddr_storage *addr,
+		socklen_t addrlen)
+{
+  SocksLink *sl = cl->parent;
+  struct mux *mux = mux_get(sl);
+  struct mux_peer *peer;
+  struct mux_tunnel *tunnel, *best = NULL;
+  struct mux_channel *ch;
+  int fd;
+
+  if (!mux)
+    return -1;
+
+  peer = mux_peer_get(mux, addr, addrlen);
+  if (!peer || peer->plain_until > time(NULL))
+    return -1;
+
+  /* keep the tunnels warm for the next clients */
+  if (peer->tunnels_count < sl->mux_tunnels)
+    mux_tunnel_connect(sl, peer);
+
+  list_for_each_entry(tunnel, &peer->tunnels, next, struct mux_tunnel) {
+    if (tunnel->ready && tunnel->channels_count < MUX_CHANNELS_MAX &&
+	(!best || tunnel->channels_count < best->channels_count))
+      best = tunnel;
+  }
+  if (!best)
+    return -1;
+
+  ch = mux_channel_new(best, best->next_id++, &fd);
+  if (!ch)
+    return -1;
+
+  mux_frame_write(best, MUX_FRAME_OPEN, ch->id, NULL, 0);
+  prcl_debug(cl, "using tunnel channel %u", ch->id);
+  return fd;
+}
+
+/* The client is another sockslinkd, its connection becomes a tunnel */
+void mux_accept(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  struct evbuffer *input = EVBUFFER_INPUT(cl->client.bufev);
+  struct mux *mux = mux_get(sl);
+  struct mux_tunnel *tunnel;
+
+  if (EVBUFFER_LENGTH(input) < MUX_PREAMBLE_LEN)
+    return ;
+
+  if (!mux || memcmp(EVBUFFER_DATA(input), mux_preamble, MUX_PREAMBLE_LEN)) {
+    client_invalid_version(cl);
+    return ;
+  }
+
+  tunnel = mux_tunnel_new(sl, cl->client.fd, cl->client.bufev);
+  if (!tunnel) {
+    client_drop(cl, true);
+    return ;
+  }
+  memcpy(&tunnel->addr, &cl->client.addr, cl->client.addrlen);
+  tunnel->addrlen = cl->client.addrlen;
+  tunnel->ready = true;
+  list_add(&tunnel->next, &mux->accepted);
+
+  prcl_infos(cl, "client is a tunnel");
+
+  /*
+   * The tunnel takes over the connection and its bufferevent, with what was
+   * already read: libevent 2 doesn't let anything but the socket fill the
+   * input buffer of a bufferevent, it can't be moved to a new one.
+   */
+  evbuffer_drain(input, MUX_PREAMBLE_LEN);
+  cl->client.bufev = NULL;
+  cl->client.fd = -1;
+  client_drop(cl, false);
+
+  bufferevent_setwatermark(tunnel->bufev, EV_READ, 0, 0);
+  bufferevent_setcb(tunnel->bufev, on_tunnel_read, on_tunnel_write,
+		    on_tunnel_event, tunnel);
+  bufferevent_enable(tunnel->bufev, EV_READ | EV_WRITE);
+  bufferevent_write(tunnel->bufev, (void *)mux_preamble, MUX_PREAMBLE_LEN);
+
+  if (EVBUFFER_LENGTH(EVBUFFER_INPUT(tunnel->bufev)))
+    on_tunnel_read(tunnel->bufev, tunnel);
+}
+
+void mux_stop(SocksLink *sl)
+{
+  struct mux *mux = sl->mux;
+  struct mux_peer *peer, *ptmp;
+  struct mux_tunnel *tunnel, *tmp;
+
+  if (!mux)
+    return ;
+
+  list_for_each_entry_safe(peer, ptmp, &mux->peers, next, struct mux_peer) {
+    list_for_each_entry_safe(tunnel, tmp, &peer->tunnels, next,
+			     struct mux_tunnel)
+      mux_tunnel_free(tunnel);
+    list_del(&peer->next);
+    free(peer);
+  }
+
+  list_for_each_entry_safe(tunnel, tmp, &mux->accepted, next,
+			   struct mux_tunnel)
+    mux_tunnel_free(tunnel);
+
+  free(mux);
+  sl->mux = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef MUX_H
+# define MUX_H
+
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+/* First byte sent on a tunnel, never a SOCKS version */
+#define MUX_MAGIC	0xf0
+
+int mux_connect(Client *cl, const struct sockaddr_storage *addr,
+		socklen_t addrlen);
+void mux_accept(Client *cl);
+void mux_stop(SocksLink *sl);
+
+#endif /* !MUX_H */
@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "config.h"
+
+#ifdef HAVE_PAM
+# include <pthread.h>
+# include <security/pam_appl.h>
+#endif
+
+#include "sockslink.h"
+#include "client.h"
+#include "pamauth.h"
+#include "utils.h"
+#include "log.h"
+
+#ifdef HAVE_PAM
+
+/*
+ * PAM conversations block, so they run in a pool of worker threads.
+ * Workers only see jobs, never clients: finished jobs are queued back
+ * and the event loop is woken up through a pipe to complete them.
+ */
+
+struct pam_job {
+  struct list_head next;
+  Client *client;		/* event loop only, NULL if the client left */
+  bool running;			/* taken by a worker */
+  char user[256];
+  char passwd[256];
+  int status;
+  char error[128];
+};
+
+struct pam_pool {
+  SocksLink *sl;
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct list_head pending;
+  struct list_head done;
+  int npending;
+  bool stopping;
+  int wake_error;		/* errno of a failed wake up, the workers
+				   don't log */
+  int pipe[2];
+  struct event event;
+};
+
+static int pam_conv(int num_msg, const struct pam_message **msg,
+		    struct pam_response **resp, void *appdata)
+{
+  struct pam_job *job = appdata;
+  struct pam_response *r;
+
+  r = calloc(num_msg, sizeof (*r));
+  if (!r)
+    return PAM_BUF_ERR;
+
+  for (int i = 0; i < num_msg; ++i) {
+    switch (msg[i]->msg_style) {
+    case PAM_PROMPT_ECHO_OFF:
+    case PAM_PROMPT_ECHO_ON:
+      r[i].resp = strdup(job->passwd);
+      if (!r[i].resp)
+	goto error;
+      break ;
+    case PAM_ERROR_MSG:
+    case PAM_TEXT_INFO:
+      break ;
+    default:
+      goto error;
+    }
+  }
+
+  *resp = r;
+  return PAM_SUCCESS;
+ error:
+  for (int i = 0; i < num_msg; ++i)
+    free(r[i].resp);
+  free(r);
+  return PAM_CONV_ERR;
+}
+
+static void pam_run(struct pam_pool *pool, struct pam_job *job)
+{
+  struct pam_conv conv = { pam_conv, job };
+  pam_handle_t *pamh = NULL;
+  int ret;
+
+  ret = pam_start(pool->sl->pam_service, job->user, &conv, &pamh);
+  if (ret == PAM_SUCCESS)
+    ret = pam_authenticate(pamh, PAM_SILENT | PAM_DISALLOW_NULL_AUTHTOK);
+  if (ret == PAM_SUCCESS)
+    ret = pam_acct_mgmt(pamh, PAM_SILENT);
+
+  job->status = ret;
+  if (ret != PAM_SUCCESS)
+    strlcpy(job->error, pam_strerror(pamh, ret), sizeof (job->error));
+  if (pamh)
+    pam_end(pamh, ret);
+
+  memset(job->passwd, 0, sizeof (job->passwd));
+}
+
+static void *pam_worker(void *arg)
+{
+  struct pam_pool *pool = arg;
+  struct pam_job *job;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->stopping && list_empty(&pool->pending))
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->stopping)
+      break ;
+
+    job = list_first_entry(&pool->pending, struct pam_job, next);
+    list_del(&job->next);
+    pool->npending--;
+    job->running = true;
+    pthread_mutex_unlock(&pool->lock);
+
+    pam_run(pool, job);
+
+    pthread_mutex_lock(&pool->lock);
+    list_add_tail(&job->next, &pool->done);
+    if (write(pool->pipe[1], "", 1) < 0 && errno != EAGAIN)
+      pool->wake_error = errno;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void pam_complete(struct pam_job *job)
+{
+  Client *cl = job->client;
+
+  cl->pam_job = NULL;
+
+  if (job->status != PAM_SUCCESS) {
+    client_auth_reject(cl, job->error);
+    return ;
+  }
+
+  prcl_debug(cl, "authenticated by PAM");
+
+  /* Like an helper answering "OK ! none", unless routed */
+  cl->server_method = AUTH_METHOD_NONE;
+  client_auth_route(cl);
+}
+
+static void on_pam_done(int fd, short ev, void *arg)
+{
+  struct pam_pool *pool = arg;
+  struct pam_job *job, *tmp;
+  LIST_HEAD(done);
+  char buf[64];
+  int err;
+
+  while (read(fd, buf, sizeof (buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&pool->lock);
+  list_splice_init(&pool->done, &done);
+  err = pool->wake_error;
+  pool->wake_error = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (err)
+    pr_err(pool->sl, "can't wake up the event loop: %s", strerror(err));
+
+  list_for_each_entry_safe(job, tmp, &done, next, struct pam_job) {
+    list_del(&job->next);
+    if (job->client)
+      pam_complete(job);
+    free(job);
+  }
+}
+
+static void pam_pool_free(struct pam_pool *pool)
+{
+  struct pam_job *job, *tmp;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nthreads; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  list_for_each_entry_safe(job, tmp, &pool->pending, next, struct pam_job)
+    free(job);
+  list_for_each_entry_safe(job, tmp, &pool->done, next, struct pam_job)
+    free(job);
+
+  if (event_initialized(&pool->event))
+    event_del(&pool->event);
+  close(pool->pipe[0]);
+  close(pool->pipe[1]);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+int pamauth_load(SocksLink *sl)
+{
+  struct pam_pool *pool;
+  int ret;
+
+  if (!sl->pam_service)
+    return 0;
+
+  pool = calloc(sizeof (*pool), 1);
+  if (!pool)
+    goto error;
+
+  pool->sl = sl;
+  INIT_LIST_HEAD(&pool->pending);
+  INIT_LIST_HEAD(&pool->done);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  if (pipe(pool->pipe) == -1) {
+    free(pool);
+    goto error;
+  }
+  sock_set_nonblock(pool->pipe[0]);
+  sock_set_nonblock(pool->pipe[1]);
+  fcntl(pool->pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pool->pipe[1], F_SETFD, FD_CLOEXEC);
+
+  event_set(&pool->event, pool->pipe[0], EV_READ | EV_PERSIST,
+	    on_pam_done, pool);
+  event_base_set(sl->base, &pool->event);
+  event_add(&pool->event, NULL);
+
+  pool->threads = calloc(sizeof (*pool->threads), sl->pam_workers);
+  if (!pool->threads) {
+    pam_pool_free(pool);
+    goto error;
+  }
+
+  for (; pool->nthreads < sl->pam_workers; pool->nthreads++) {
+    ret = pthread_create(&pool->threads[pool->nthreads], NULL,
+			 pam_worker, pool);
+    if (ret) {
+      errno = ret;
+      pam_pool_free(pool);
+      goto error;
+    }
+  }
+
+  sl->pam = pool;
+  pr_infos(sl, "PAM service '%s' with %d workers", sl->pam_service,
+	   sl->pam_workers);
+  return 0;
+ error:
+  pr_err(sl, "can't start PAM workers: %s", strerror(errno));
+  return -1;
+}
+
+void pamauth_unload(SocksLink *sl)
+{
+  if (!sl->pam)
+    return ;
+
+  pam_pool_free(sl->pam);
+  sl->pam = NULL;
+}
+
+/* Returns -1 if PAM isn't used for this client */
+int pamauth_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  struct pam_pool *pool = sl->pam;
+  struct pam_job *job;
+  bool full;
+
+  if (!pool || cl->client_method != AUTH_METHOD_USERNAME)
+    return -1;
+
+  job = calloc(sizeof (*job), 1);
+  if (!job) {
+    prcl_err(cl, "can't allocate PAM request");
+    client_disconnect(cl);
+    return 0;
+  }
+
+  job->client = cl;
+  memcpy(job->user, cl->auth.username.uname, cl->auth.username.ulen);
+  memcpy(job->passwd, cl->auth.username.passwd, cl->auth.username.plen);
+
+  /* workers dequeue jobs under the lock */
+  pthread_mutex_lock(&pool->lock);
+  full = sl->auth_queue_max && pool->npending >= sl->auth_queue_max;
+  if (!full) {
+    list_add_tail(&job->next, &pool->pending);
+    pool->npending++;
+    pthread_cond_signal(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (full) {
+    memset(job->passwd, 0, sizeof (job->passwd));
+    free(job);
+    prcl_warn(cl, "too many clients waiting for PAM");
+    client_disconnect(cl);
+    return 0;
+  }
+
+  cl->pam_job = job;
+  return 0;
+}
+
+void pamauth_cancel(Client *cl)
+{
+  struct pam_pool *pool = cl->parent->pam;
+  struct pam_job *job = cl->pam_job;
+
+  if (!job)
+    return ;
+
+  cl->pam_job = NULL;
+  job->client = NULL;
+
+  /* not started yet, no need to keep it */
+  pthread_mutex_lock(&pool->lock);
+  if (!job->running) {
+    list_del(&job->next);
+    pool->npending--;
+    free(job);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+#else
+
+int pamauth_load(SocksLink *sl)
+{
+  if (!sl->pam_service)
+    return 0;
+
+  pr_err(sl, "PAM is not supported on this system");
+  return -1;
+}
+
+void pamauth_unload(SocksLink *sl)
+{
+}
+
+int pamauth_call(Client *cl)
+{
+  return -1;
+}
+
+void pamauth_cancel(Client *cl)
+{
+}
+
+#endif
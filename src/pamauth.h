@@ -0,0 +1,13 @@
+#ifndef PAMAUTH_H
+# define PAMAUTH_H
+
+#include "sockslink.h"
+#include "client.h"
+
+int pamauth_load(SocksLink *sl);
+void pamauth_unload(SocksLink *sl);
+
+int pamauth_call(Client *client);
+void pamauth_cancel(Client *client);
+
+#endif /* !PAMAUTH_H */
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_DLOPEN
+# include <dlfcn.h>
+#endif
+
+#include "sockslink.h"
+#include "sockslink-plugin.h"
+#include "client.h"
+#include "plugin.h"
+#include "log.h"
+
+struct sockslink_auth_request {
+  Client *client; /* NULL if the client went away */
+};
+
+int plugin_load(SocksLink *sl)
+{
+#ifdef HAVE_DLOPEN
+  const struct sockslink_plugin *plugin;
+  struct sockslink_plugin_host host;
+
+  if (!sl->plugin_path)
+    return 0;
+
+  sl->plugin_handle = dlopen(sl->plugin_path, RTLD_NOW | RTLD_LOCAL);
+  if (!sl->plugin_handle) {
+    pr_err(sl, "can't load plugin: %s", dlerror());
+    return -1;
+  }
+
+  plugin = dlsym(sl->plugin_handle, SOCKSLINK_PLUGIN_SYMBOL);
+  if (!plugin) {
+    pr_err(sl, "%s: no '%s' symbol", sl->plugin_path, SOCKSLINK_PLUGIN_SYMBOL);
+    goto error;
+  }
+
+  if (plugin->abi != SOCKSLINK_PLUGIN_ABI || !plugin->authenticate) {
+    pr_err(sl, "%s: unsupported plugin (abi: %u, expected: %u)",
+	   sl->plugin_path, plugin->abi, SOCKSLINK_PLUGIN_ABI);
+    goto error;
+  }
+
+  host.abi = SOCKSLINK_PLUGIN_ABI;
+  host.base = sl->base;
+  host.verbose = sl->verbose;
+
+  sl->plugin_priv = NULL;
+  if (plugin->init && plugin->init(&host, sl->plugin_arg, &sl->plugin_priv)) {
+    pr_err(sl, "plugin %s failed to initialize", plugin->name);
+    goto error;
+  }
+
+  sl->plugin = plugin;
+  pr_infos(sl, "plugin %s loaded (%s)", plugin->name, sl->plugin_path);
+  return 0;
+ error:
+  dlclose(sl->plugin_handle);
+  sl->plugin_handle = NULL;
+  return -1;
+#else
+  if (!sl->plugin_path)
+    return 0;
+
+  pr_err(sl, "plugins are not supported on this system");
+  return -1;
+#endif
+}
+
+void plugin_unload(SocksLink *sl)
+{
+#ifdef HAVE_DLOPEN
+  if (sl->plugin && sl->plugin->fini)
+    sl->plugin->fini(sl->plugin_priv);
+
+  if (sl->plugin_handle)
+    dlclose(sl->plugin_handle);
+
+  sl->plugin = NULL;
+  sl->plugin_handle = NULL;
+#endif
+}
+
+static void plugin_route(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  const struct sockslink_plugin *plugin = sl->plugin;
+  struct sockslink_route route;
+  struct sockaddr_storage nexthop_addr;
+  socklen_t nexthop_addrlen = 0;
+
+  memset(&route, 0, sizeof (route));
+
+  if (!plugin->route ||
+      plugin->route(sl->plugin_priv,
+		    (struct sockaddr *)&cl->client.addr, cl->client.addrlen,
+		    cl->auth.username.uname, cl->auth.username.ulen, &route)) {
+    /* Forward client credentials to the routed or default next-hop */
+    cl->server_method = cl->client_method;
+    client_auth_route(cl);
+    return ;
+  } else {
+    if (route.nexthop && route.nexthop_len <= sizeof (nexthop_addr)) {
+      memcpy(&nexthop_addr, route.nexthop, route.nexthop_len);
+      nexthop_addrlen = route.nexthop_len;
+    }
+
+    if (route.method == SOCKSLINK_METHOD_NONE) {
+      cl->server_method = AUTH_METHOD_NONE;
+    } else if (route.method == SOCKSLINK_METHOD_USERNAME) {
+      cl->server_method = AUTH_METHOD_USERNAME;
+      cl->auth.username.ulen = route.ulen;
+      cl->auth.username.plen = route.plen;
+      if (route.ulen)
+	memcpy(cl->auth.username.uname, route.username, route.ulen);
+      if (route.plen)
+	memcpy(cl->auth.username.passwd, route.password, route.plen);
+    } else {
+      cl->server_method = AUTH_METHOD_INVALID;
+    }
+  }
+
+  if (!route.nexthop && sl->nexthop_addrlen) {
+    memcpy(&nexthop_addr, &sl->nexthop_addr, sl->nexthop_addrlen);
+    nexthop_addrlen = sl->nexthop_addrlen;
+  }
+
+  client_auth_accept(cl, &nexthop_addr, nexthop_addrlen);
+}
+
+static void on_plugin_auth(sockslink_auth_request *req, int status,
+			   const char *error)
+{
+  Client *cl = req->client;
+
+  free(req);
+
+  if (!cl)
+    return ;
+
+  cl->plugin_req = NULL;
+
+  switch (status) {
+  case SOCKSLINK_AUTH_ALLOW:
+    prcl_debug(cl, "authenticated by plugin");
+    plugin_route(cl);
+    break ;
+  case SOCKSLINK_AUTH_DENY:
+    client_auth_reject(cl, error ? error : "denied by plugin");
+    break ;
+  default:
+    prcl_debug(cl, "plugin declined, falling back");
+    client_auth_fallback(cl);
+    break ;
+  }
+}
+
+/* Returns -1 if no plugin is loaded */
+int plugin_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  sockslink_auth_request *req;
+
+  if (!sl->plugin)
+    return -1;
+
+  req = calloc(sizeof (*req), 1);
+  if (!req) {
+    client_disconnect(cl);
+    return 0;
+  }
+
+  req->client = cl;
+  cl->plugin_req = req;
+
+  sl->plugin->authenticate(sl->plugin_priv, req,
+			   (struct sockaddr *)&cl->client.addr,
+			   cl->client.addrlen, cl->client_method,
+			   cl->auth.username.uname, cl->auth.username.ulen,
+			   cl->auth.username.passwd, cl->auth.username.plen,
+			   on_plugin_auth);
+  return 0;
+}
+
+/* The client is going away, ignore the pending completion */
+void plugin_cancel(Client *cl)
+{
+  if (cl->plugin_req)
+    cl->plugin_req->client = NULL;
+  cl->plugin_req = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef PLUGIN_H
+# define PLUGIN_H
+
+#include "sockslink.h"
+#include "client.h"
+
+int plugin_load(SocksLink *sl);
+void plugin_unload(SocksLink *sl);
+
+int plugin_call(Client *client);
+void plugin_cancel(Client *client);
+
+#endif /* !PLUGIN_H */
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "prefix.h"
+
+/*
+ * Prefixes are first inserted in a plain binary trie, then flattened
+ * in an array skipping single child nodes without value: a lookup
+ * only visits the nodes where prefixes actually branch.
+ */
+
+struct prefix_node {
+  uint8_t key[PREFIX_KEY_SIZE];
+  uint8_t bits;			/* prefix length of this node */
+  int value;			/* -1 if no prefix ends here */
+  int child[2];			/* -1 if none */
+};
+
+struct prefix_tree {
+  struct prefix_node *nodes;
+  int nnodes;
+  int maxbits;
+};
+
+/* Uncompressed trie, only used until prefix_table_compile() */
+struct build_node {
+  struct build_node *child[2];
+  int value;
+};
+
+struct prefix_table {
+  struct prefix_tree tree[2];	/* IPv4, IPv6 */
+  struct build_node *roots[2];
+};
+
+static inline int key_bit(const uint8_t *key, int bit)
+{
+  return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static inline void key_set_bit(uint8_t *key, int bit, int value)
+{
+  if (value)
+    key[bit / 8] |= 1 << (7 - bit % 8);
+  else
+    key[bit / 8] &= ~(1 << (7 - bit % 8));
+}
+
+static inline bool key_match(const uint8_t *key, const uint8_t *prefix,
+			     int bits)
+{
+  int bytes = bits / 8;
+
+  if (memcmp(key, prefix, bytes))
+    return false;
+  if (bits % 8) {
+    uint8_t mask = 0xff << (8 - bits % 8);
+
+    return !((key[bytes] ^ prefix[bytes]) & mask);
+  }
+  return true;
+}
+
+int prefix_parse(const char *str, struct prefix *prefix)
+{
+  char buf[INET6_ADDRSTRLEN + 5];
+  char *slash;
+  int maxbits;
+
+  if (strlen(str) >= sizeof (buf))
+    return -1;
+  strcpy(buf, str);
+
+  memset(prefix, 0, sizeof (*prefix));
+
+  slash = strchr(buf, '/');
+  if (slash)
+    *slash++ = '\0';
+
+  if (inet_pton(AF_INET, buf, prefix->key) == 1) {
+    prefix->family = AF_INET;
+    maxbits = 32;
+  }
+#ifdef HAVE_IPV6
+  else if (inet_pton(AF_INET6, buf, prefix->key) == 1) {
+    prefix->family = AF_INET6;
+    maxbits = 128;
+  }
+#endif
+  else
+    return -1;
+
+  prefix->bits = maxbits;
+  if (slash) {
+    char *end;
+    long bits = strtol(slash, &end, 10);
+
+    if (!*slash || *end || bits < 0 || bits > maxbits)
+      return -1;
+    prefix->bits = bits;
+  }
+
+  return 0;
+}
+
+bool prefix_contains(const struct prefix *prefix, const struct prefix *sub)
+{
+  return prefix->family == sub->family && prefix->bits <= sub->bits &&
+    key_match(sub->key, prefix->key, prefix->bits);
+}
+
+static void build_free(struct build_node *node)
+{
+  if (!node)
+    return ;
+  build_free(node->child[0]);
+  build_free(node->child[1]);
+  free(node);
+}
+
+static struct build_node *build_node_new(void)
+{
+  struct build_node *node = calloc(sizeof (*node), 1);
+
+  if (node)
+    node->value = -1;
+  return node;
+}
+
+struct prefix_table *prefix_table_new(void)
+{
+  struct prefix_table *table = calloc(sizeof (*table), 1);
+
+  if (!table)
+    return NULL;
+
+  table->tree[0].maxbits = 32;
+  table->tree[1].maxbits = 128;
+  table->roots[0] = build_node_new();
+  table->roots[1] = build_node_new();
+  if (!table->roots[0] || !table->roots[1]) {
+    prefix_table_free(table);
+    return NULL;
+  }
+  return table;
+}
+
+void prefix_table_free(struct prefix_table *table)
+{
+  if (!table)
+    return ;
+
+  for (int i = 0; i < 2; ++i) {
+    build_free(table->roots[i]);
+    free(table->tree[i].nodes);
+  }
+  free(table);
+}
+
+/* The first value added for a given prefix is kept */
+int prefix_table_add(struct prefix_table *table, const struct prefix *prefix,
+		     int value)
+{
+  struct build_node *node = table->roots[prefix->family == AF_INET ? 0 : 1];
+
+  for (int i = 0; i < prefix->bits; ++i) {
+    int b = key_bit(prefix->key, i);
+
+    if (!node->child[b] && !(node->child[b] = build_node_new()))
+      return -1;
+    node = node->child[b];
+  }
+
+  if (node->value == -1)
+    node->value = value;
+  return 0;
+}
+
+static int tree_compress(struct prefix_tree *tree, struct build_node *node,
+			 int bits, uint8_t *key)
+{
+  struct prefix_node *nodes;
+  uint8_t sub[PREFIX_KEY_SIZE];
+  int idx;
+
+  while (node->value == -1 && !node->child[0] != !node->child[1]) {
+    int b = node->child[1] ? 1 : 0;
+
+    key_set_bit(key, bits++, b);
+    node = node->child[b];
+  }
+
+  nodes = realloc(tree->nodes, (tree->nnodes + 1) * sizeof (*nodes));
+  if (!nodes)
+    return -1;
+  tree->nodes = nodes;
+
+  idx = tree->nnodes++;
+  memcpy(nodes[idx].key, key, PREFIX_KEY_SIZE);
+  nodes[idx].bits = bits;
+  nodes[idx].value = node->value;
+  nodes[idx].child[0] = nodes[idx].child[1] = -1;
+
+  for (int b = 0; b < 2; ++b) {
+    int child;
+
+    if (!node->child[b])
+      continue ;
+
+    memcpy(sub, key, sizeof (sub));
+    key_set_bit(sub, bits, b);
+    child = tree_compress(tree, node->child[b], bits + 1, sub);
+    if (child < 0)
+      return child;
+    tree->nodes[idx].child[b] = child;
+  }
+
+  return idx;
+}
+
+int prefix_table_compile(struct prefix_table *table)
+{
+  for (int i = 0; i < 2; ++i) {
+    uint8_t key[PREFIX_KEY_SIZE];
+
+    memset(key, 0, sizeof (key));
+    if (tree_compress(&table->tree[i], table->roots[i], 0, key) < 0)
+      return -1;
+    build_free(table->roots[i]);
+    table->roots[i] = NULL;
+  }
+  return 0;
+}
+
+static int tree_lookup(const struct prefix_tree *tree, const uint8_t *key)
+{
+  int best = -1;
+  int n = tree->nnodes ? 0 : -1;
+
+  while (n != -1) {
+    const struct prefix_node *node = &tree->nodes[n];
+
+    if (!key_match(key, node->key, node->bits))
+      break ;
+    if (node->value != -1)
+      best = node->value;
+    if (node->bits >= tree->maxbits)
+      break ;
+    n = node->child[key_bit(key, node->bits)];
+  }
+
+  return best;
+}
+
+/* Returns the value of the longest matching prefix, or -1 */
+int prefix_table_lookup(const struct prefix_table *table,
+			const struct sockaddr_storage *addr)
+{
+  uint8_t buf[PREFIX_KEY_SIZE];
+
+  switch (addr->ss_family) {
+  case AF_INET:
+    memset(buf, 0, sizeof (buf));
+    memcpy(buf, &((struct sockaddr_in *)addr)->sin_addr, 4);
+    return tree_lookup(&table->tree[0], buf);
+#ifdef HAVE_IPV6
+  case AF_INET6: {
+    const struct in6_addr *in6 = &((struct sockaddr_in6 *)addr)->sin6_addr;
+
+    if (IN6_IS_ADDR_V4MAPPED(in6)) {
+      memset(buf, 0, sizeof (buf));
+      memcpy(buf, in6->s6_addr + 12, 4);
+      return tree_lookup(&table->tree[0], buf);
+    }
+    return tree_lookup(&table->tree[1], in6->s6_addr);
+  }
+#endif
+  default:
+    return -1;
+  }
+}
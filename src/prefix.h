@@ -0,0 +1,37 @@
+#ifndef PREFIX_H
+# define PREFIX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * IPv4 and IPv6 prefix tables, with longest prefix match lookups
+ *
+ * Prefixes are added with an integer value, then the table is
+ * compiled once into path compressed binary tries (one per address
+ * family) before any lookup.
+ */
+
+#define PREFIX_KEY_SIZE		16
+
+struct prefix {
+  uint8_t key[PREFIX_KEY_SIZE];
+  int bits;
+  int family;
+};
+
+struct prefix_table;
+
+int prefix_parse(const char *str, struct prefix *prefix);
+bool prefix_contains(const struct prefix *prefix, const struct prefix *sub);
+
+struct prefix_table *prefix_table_new(void);
+void prefix_table_free(struct prefix_table *table);
+int prefix_table_add(struct prefix_table *table, const struct prefix *prefix,
+		     int value);
+int prefix_table_compile(struct prefix_table *table);
+int prefix_table_lookup(const struct prefix_table *table,
+			const struct sockaddr_storage *addr);
+
+#endif /* !PREFIX_H */
@@ -0,0 +1,230 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "profile.h"
+#include "list.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Tuning profiles
+ *
+ * A profile is defined by --profile=<name>:<key>=<value>,... and given
+ * to listen addresses by --listen=<address>@<name>. Its clients and the
+ * servers they connect to use its timeouts and buffers, and both
+ * sockets get its options. Keys not given keep the built-in values,
+ * which a profile named "default" replaces for the other addresses.
+ */
+
+static const struct profile profile_builtin = {
+  .name = "default",
+  .auth_timeout = SOCKS5_AUTH_TIMEOUT,
+  .io_timeout = SOCKS_IO_TIMEOUT,
+  .bufsize = SOCKS_STREAM_BUFSIZ,
+  .nodelay = -1,
+};
+
+static int profile_parse_int(const char *val, int min, int *out)
+{
+  char *end;
+  long v;
+
+  errno = 0;
+  v = strtol(val, &end, 0);
+  if (errno || end == val || *end || v < min || v > 0x7fffffff)
+    return -1;
+  *out = v;
+  return 0;
+}
+
+/* keepalive=<idle>:<interval>:<count> */
+static int profile_parse_keepalive(const char *val, struct profile *profile)
+{
+  char buf[64];
+  char *intvl, *cnt;
+
+  if (strlcpy(buf, val, sizeof (buf)) >= sizeof (buf))
+    return -1;
+  intvl = strchr(buf, ':');
+  cnt = intvl ? strchr(intvl + 1, ':') : NULL;
+  if (!cnt)
+    return -1;
+  *intvl++ = '\0';
+  *cnt++ = '\0';
+
+  return profile_parse_int(buf, 1, &profile->keepidle) ||
+    profile_parse_int(intvl, 1, &profile->keepintvl) ||
+    profile_parse_int(cnt, 1, &profile->keepcnt) ? -1 : 0;
+}
+
+static int profile_parse_key(struct profile *profile, const char *key,
+			     const char *val)
+{
+  int v;
+
+  if (!strcmp(key, "buffer") && !strcmp(val, "auto")) {
+#ifndef HAVE_LINUX_TCP_H
+    return -1;
+#endif
+    profile->adaptive = true;
+  } else if (!strcmp(key, "buffer")) {
+    if (profile_parse_int(val, 1, &v))
+      return -1;
+    profile->bufsize = v;
+    profile->adaptive = false;
+  } else if (!strcmp(key, "auth-timeout"))
+    return profile_parse_int(val, 1, &profile->auth_timeout);
+  else if (!strcmp(key, "io-timeout"))
+    return profile_parse_int(val, 1, &profile->io_timeout);
+  else if (!strcmp(key, "sndbuf"))
+    return profile_parse_int(val, 0, &profile->sndbuf);
+  else if (!strcmp(key, "rcvbuf"))
+    return profile_parse_int(val, 0, &profile->rcvbuf);
+  else if (!strcmp(key, "nodelay")) {
+    if (profile_parse_int(val, 0, &v) || v > 1)
+      return -1;
+    profile->nodelay = v;
+  } else if (!strcmp(key, "notsent-lowat"))
+    return profile_parse_int(val, 0, &profile->notsent_lowat);
+  else if (!strcmp(key, "keepalive"))
+    return profile_parse_keepalive(val, profile);
+  else if (!strcmp(key, "cc")) {
+    if (strlcpy(profile->cc, val, sizeof (profile->cc)) >=
+	sizeof (profile->cc))
+      return -1;
+  } else
+    return -1;
+  return 0;
+}
+
+/* --profile=<name>:<key>=<value>,... */
+int profile_parse(SocksLink *sl, const char *arg)
+{
+  struct profile *profile;
+  const struct profile *found;
+  char *list, *tok, *save, *val;
+  const char *colon = strchr(arg, ':');
+  int ret = 0;
+
+  if (!colon || colon == arg) {
+    pr_err(sl, "invalid argument for --profile '%s'", arg);
+    return -1;
+  }
+
+  list = strndup(arg, colon - arg);
+  if (!list)
+    return -1;
+  found = profile_find(sl, list);
+  if (found && found != &profile_builtin) {
+    pr_err(sl, "profile '%s' already set", list);
+    free(list);
+    return -1;
+  }
+
+  profile = malloc(sizeof (*profile));
+  if (!profile) {
+    free(list);
+    return -1;
+  }
+  *profile = profile_builtin;
+  profile->name = list;
+  list_add_tail(&profile->next, &sl->profiles);
+
+  list = strdup(colon + 1);
+  if (!list)
+    return -1;
+
+  for (tok = strtok_r(list, ",", &save); tok && !ret;
+       tok = strtok_r(NULL, ",", &save)) {
+    val = strchr(tok, '=');
+    if (val)
+      *val++ = '\0';
+    if (!val || profile_parse_key(profile, tok, val)) {
+      pr_err(sl, "invalid setting in profile '%s': '%s'", profile->name, tok);
+      ret = -1;
+    }
+  }
+
+  free(list);
+  return ret;
+}
+
+void profile_free_all(SocksLink *sl)
+{
+  struct profile *profile, *tmp;
+
+  list_for_each_entry_safe(profile, tmp, &sl->profiles, next, struct profile) {
+    list_del(&profile->next);
+    free((char *)profile->name);
+    free(profile);
+  }
+}
+
+/* The profile of this name, the default one without, NULL if unknown */
+const struct profile *profile_find(SocksLink *sl, const char *name)
+{
+  struct profile *profile;
+
+  if (!name)
+    name = profile_builtin.name;
+
+  list_for_each_entry(profile, &sl->profiles, next, struct profile) {
+    if (!strcmp(profile->name, name))
+      return profile;
+  }
+  return strcmp(name, profile_builtin.name) ? NULL : &profile_builtin;
+}
+
+/*
+ * Set the socket options of the profile, before connect() for servers.
+ * Returns -1 with errno if one of them failed, the others are set.
+ */
+int profile_apply(const struct profile *profile, int fd)
+{
+  int on = 1;
+  int ret = 0;
+
+  if (profile->sndbuf &&
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile->sndbuf,
+		 sizeof (profile->sndbuf)))
+    ret = -1;
+
+  if (profile->rcvbuf &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &profile->rcvbuf,
+		 sizeof (profile->rcvbuf)))
+    ret = -1;
+
+  if (profile->nodelay >= 0 && sock_set_tcpnodelay(fd, profile->nodelay))
+    ret = -1;
+
+#ifdef TCP_NOTSENT_LOWAT
+  if (profile->notsent_lowat &&
+      setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile->notsent_lowat,
+		 sizeof (profile->notsent_lowat)))
+    ret = -1;
+#endif
+
+  if (profile->keepidle &&
+      (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on)) ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &profile->keepidle,
+		  sizeof (profile->keepidle)) ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &profile->keepintvl,
+		  sizeof (profile->keepintvl)) ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &profile->keepcnt,
+		  sizeof (profile->keepcnt))))
+    ret = -1;
+
+  if (profile->cc[0] &&
+      setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile->cc,
+		 strlen(profile->cc)))
+    ret = -1;
+
+  return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef PROFILE_H
+# define PROFILE_H
+
+#include <stddef.h>
+
+#include "sockslink.h"
+#include "list.h"
+
+#define PROFILE_CC_MAX 16
+
+/* Tuning of the connections of a listen address, and of their servers */
+struct profile {
+  struct list_head next;
+  const char *name;
+  int auth_timeout; /* seconds to authenticate and connect */
+  int io_timeout; /* seconds without traffic once streaming */
+  size_t bufsize; /* bytes queued for the other side */
+  bool adaptive; /* bufsize follows the bandwidth-delay product */
+  int sndbuf; /* SO_SNDBUF, 0 for the system default */
+  int rcvbuf; /* SO_RCVBUF, 0 for the system default */
+  int nodelay; /* TCP_NODELAY, -1 to leave it alone */
+  int notsent_lowat; /* TCP_NOTSENT_LOWAT, 0 for the system default */
+  int keepidle; /* TCP keepalive, 0 to leave it off */
+  int keepintvl;
+  int keepcnt;
+  char cc[PROFILE_CC_MAX]; /* TCP_CONGESTION, empty for the default */
+};
+
+int profile_parse(SocksLink *sl, const char *arg);
+void profile_free_all(SocksLink *sl);
+
+const struct profile *profile_find(SocksLink *sl, const char *name);
+int profile_apply(const struct profile *profile, int fd);
+
+#endif /* !PROFILE_H */
@@ -0,0 +1,200 @@
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "request.h"
+
+static socklen_t request_set_addr(struct socks5_request *req, int family,
+				  const void *addr)
+{
+  memset(&req->addr, 0, sizeof (req->addr));
+
+  if (family == AF_INET) {
+    struct sockaddr_in *in = (struct sockaddr_in *)&req->addr;
+
+    in->sin_family = AF_INET;
+    in->sin_port = htons(req->port);
+    memcpy(&in->sin_addr, addr, 4);
+    return sizeof (*in);
+  }
+#ifdef HAVE_IPV6
+  if (family == AF_INET6) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&req->addr;
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(req->port);
+    memcpy(&in6->sin6_addr, addr, 16);
+    return sizeof (*in6);
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Parse ATYP, the address and the port, as written by
+ * socks5_addr_write(). Returns their length, 0 if they aren't complete
+ * yet, or -1 if they are invalid
+ */
+int socks5_addr_parse(const uint8_t *buffer, size_t len,
+		      struct socks5_request *req)
+{
+  uint8_t addr[16];
+  size_t need;
+
+  if (len < 2)
+    return 0;
+
+  req->atyp = buffer[0];
+  req->name[0] = '\0';
+
+  switch (req->atyp) {
+  case SOCKS5_ATYP_IPV4:
+    need = 1 + 4 + 2;
+    break ;
+  case SOCKS5_ATYP_IPV6:
+    need = 1 + 16 + 2;
+    break ;
+  case SOCKS5_ATYP_DOMAIN:
+    need = 1 + 1 + buffer[1] + 2;
+    break ;
+  default:
+    return -1;
+  }
+
+  if (len < need)
+    return 0;
+
+  req->port = (buffer[need - 2] << 8) | buffer[need - 1];
+
+  switch (req->atyp) {
+  case SOCKS5_ATYP_IPV4:
+    req->addrlen = request_set_addr(req, AF_INET, buffer + 1);
+    break ;
+  case SOCKS5_ATYP_IPV6:
+    req->addrlen = request_set_addr(req, AF_INET6, buffer + 1);
+    break ;
+  case SOCKS5_ATYP_DOMAIN:
+    memcpy(req->name, buffer + 2, buffer[1]);
+    req->name[buffer[1]] = '\0';
+
+    /* some clients send literal addresses as domains */
+    if (inet_pton(AF_INET, req->name, addr) == 1)
+      req->addrlen = request_set_addr(req, AF_INET, addr);
+#ifdef HAVE_IPV6
+    else if (inet_pton(AF_INET6, req->name, addr) == 1)
+      req->addrlen = request_set_addr(req, AF_INET6, addr);
+#endif
+    else
+      req->addrlen = 0;
+    break ;
+  }
+
+  return need;
+}
+
+/* Parse the address found at buffer[3], after a 3 bytes header */
+static int request_parse_addr(const uint8_t *buffer, size_t len,
+			      struct socks5_request *req)
+{
+  int ret = socks5_addr_parse(buffer + 3, len - 3, req);
+
+  return ret > 0 ? 3 + ret : ret;
+}
+
+/*
+ * Returns the request length, 0 if it isn't complete yet, or -1 if
+ * it's invalid
+ */
+int socks5_request_parse(const uint8_t *buffer, size_t len,
+			 struct socks5_request *req)
+{
+  if (len < 5)
+    return 0;
+
+  if (buffer[0] != SOCKS5_VER || buffer[2] != 0x00)
+    return -1;
+
+  req->cmd = buffer[1];
+  return request_parse_addr(buffer, len, req);
+}
+
+/*
+ * Parse the header of a UDP datagram, req->cmd is set to the fragment
+ * number. Returns the header length, or -1 if it's invalid
+ */
+int socks5_udp_parse(const uint8_t *buffer, size_t len,
+		     struct socks5_request *req)
+{
+  int ret;
+
+  if (len < 5 || buffer[0] != 0x00 || buffer[1] != 0x00)
+    return -1;
+
+  req->cmd = buffer[2];
+  ret = request_parse_addr(buffer, len, req);
+  return ret ? ret : -1;
+}
+
+/*
+ * Write ATYP, the address and the port as found in replies and UDP
+ * headers, buffer must hold SOCKS5_ADDR_MAX bytes. IPv4-mapped
+ * addresses are written as IPv4. Returns the length written.
+ */
+size_t socks5_addr_write(uint8_t *buffer, const struct sockaddr_storage *addr)
+{
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+    buffer[0] = SOCKS5_ATYP_IPV4;
+    memcpy(buffer + 1, &in->sin_addr, 4);
+    memcpy(buffer + 5, &in->sin_port, 2);
+    return 1 + 4 + 2;
+  }
+#ifdef HAVE_IPV6
+  if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+      buffer[0] = SOCKS5_ATYP_IPV4;
+      memcpy(buffer + 1, in6->sin6_addr.s6_addr + 12, 4);
+      memcpy(buffer + 5, &in6->sin6_port, 2);
+      return 1 + 4 + 2;
+    }
+
+    buffer[0] = SOCKS5_ATYP_IPV6;
+    memcpy(buffer + 1, &in6->sin6_addr, 16);
+    memcpy(buffer + 17, &in6->sin6_port, 2);
+    return 1 + 16 + 2;
+  }
+#endif
+
+  /* unknown, 0.0.0.0:0 */
+  memset(buffer, 0, 1 + 4 + 2);
+  buffer[0] = SOCKS5_ATYP_IPV4;
+  return 1 + 4 + 2;
+}
+
+uint8_t socks5_reply_errno(int err)
+{
+  switch (err) {
+  case ECONNREFUSED:
+    return SOCKS5_REP_REFUSED;
+  case ENETUNREACH:
+  case ENETDOWN:
+    return SOCKS5_REP_NET_UNREACHABLE;
+  case EHOSTUNREACH:
+  case EHOSTDOWN:
+  case ETIMEDOUT:
+    return SOCKS5_REP_HOST_UNREACHABLE;
+  case EACCES:
+  case EPERM:
+    return SOCKS5_REP_NOT_ALLOWED;
+  case EAFNOSUPPORT:
+    return SOCKS5_REP_ATYP_UNSUPPORTED;
+  default:
+    return SOCKS5_REP_FAILURE;
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef REQUEST_H
+# define REQUEST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* SOCKS5 requests (RFC1928) */
+#define SOCKS5_CMD_CONNECT	0x01
+#define SOCKS5_CMD_BIND		0x02
+#define SOCKS5_CMD_UDP		0x03
+
+#define SOCKS5_ATYP_IPV4	0x01
+#define SOCKS5_ATYP_DOMAIN	0x03
+#define SOCKS5_ATYP_IPV6	0x04
+
+/* VER CMD RSV ATYP, up to 255 bytes of domain, and PORT */
+#define SOCKS5_REQUEST_MAX	(4 + 1 + 255 + 2)
+
+/* ATYP, an IPv6 address and PORT */
+#define SOCKS5_ADDR_MAX		(1 + 16 + 2)
+
+/* Replies */
+#define SOCKS5_REP_SUCCEEDED		0x00
+#define SOCKS5_REP_FAILURE		0x01
+#define SOCKS5_REP_NOT_ALLOWED		0x02
+#define SOCKS5_REP_NET_UNREACHABLE	0x03
+#define SOCKS5_REP_HOST_UNREACHABLE	0x04
+#define SOCKS5_REP_REFUSED		0x05
+#define SOCKS5_REP_TTL_EXPIRED		0x06
+#define SOCKS5_REP_CMD_UNSUPPORTED	0x07
+#define SOCKS5_REP_ATYP_UNSUPPORTED	0x08
+
+struct socks5_request {
+  uint8_t cmd;
+  uint8_t atyp;
+  char name[256];		/* SOCKS5_ATYP_DOMAIN only */
+  struct sockaddr_storage addr;	/* port included */
+  socklen_t addrlen;		/* 0 if name isn't a literal address */
+  uint16_t port;
+};
+
+int socks5_request_parse(const uint8_t *buffer, size_t len,
+			 struct socks5_request *req);
+int socks5_udp_parse(const uint8_t *buffer, size_t len,
+		     struct socks5_request *req);
+int socks5_addr_parse(const uint8_t *buffer, size_t len,
+		      struct socks5_request *req);
+size_t socks5_addr_write(uint8_t *buffer, const struct sockaddr_storage *addr);
+uint8_t socks5_reply_errno(int err);
+
+#endif /* !REQUEST_H */
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "routes.h"
+#include "prefix.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Source address routing table
+ *
+ * # source         next-hop     [method [username [password]]]
+ * 10.0.0.0/8       10.0.0.1:1080
+ * 192.168.0.0/16   !            none
+ * 2001:db8::/32    [::1]:1081   username user%40foo secret
+ *
+ * Like the helpers answers, '!' is the default next-hop, credentials are
+ * urlencoded, and without a method the client's credentials are
+ * forwarded.
+ *
+ * The first line matching a prefix wins, and the longest prefix
+ * matching the client address is used.
+ */
+
+struct routes {
+  struct prefix_table *table;
+  struct route *routes;
+  int nroutes;
+};
+
+static int parse_route(SocksLink *sl, struct route *route, int argc,
+		       char *argv[])
+{
+  char buf[256];
+  int ret;
+
+  memset(route, 0, sizeof (*route));
+  route->method = AUTH_METHOD_INVALID;
+
+  if (strcmp(argv[0], "!")) {
+    ret = parse_nexthop_numeric(argv[0], &route->nexthop_addr,
+				&route->nexthop_addrlen);
+    if (ret) {
+      pr_err(sl, "invalid next-hop address '%s': %s", argv[0],
+	     gai_strerror(ret));
+      return -1;
+    }
+  }
+
+  if (argc < 2)
+    return 0;
+
+  if (!strcmp(argv[1], "none") && argc == 2) {
+    route->method = AUTH_METHOD_NONE;
+    return 0;
+  }
+
+  if (strcmp(argv[1], "username") || argc > 4)
+    return -1;
+
+  route->method = AUTH_METHOD_USERNAME;
+
+  if (argc >= 3) {
+    ret = urldecode(argv[2], strlen(argv[2]), buf, 255);
+    if (ret < 0 || !(route->uname = malloc(ret ? ret : 1)))
+      return -1;
+    memcpy(route->uname, buf, ret);
+    route->ulen = ret;
+  }
+
+  if (argc >= 4) {
+    ret = urldecode(argv[3], strlen(argv[3]), buf, 255);
+    if (ret < 0 || !(route->passwd = malloc(ret ? ret : 1)))
+      return -1;
+    memcpy(route->passwd, buf, ret);
+    route->plen = ret;
+  }
+
+  return 0;
+}
+
+struct routes *routes_open(SocksLink *sl, const char *path)
+{
+  struct routes *routes;
+  FILE *fp;
+  char line[1024];
+  int lineno = 0;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    pr_err(sl, "can't open routes file '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+
+  routes = calloc(sizeof (*routes), 1);
+  if (!routes || !(routes->table = prefix_table_new()))
+    goto error;
+
+  while (fgets(line, sizeof (line), fp)) {
+    struct prefix prefix;
+    char *argv[6];
+    char *p = line;
+    int argc;
+    struct route *tmp;
+
+    lineno++;
+
+    if (!strchr(line, '\n') && !feof(fp))
+      goto error_line;
+
+    for (argc = 0; ; ) {
+      for (; *p && isspace((unsigned char)*p); p++)
+	*p = '\0';
+      if (!*p || *p == '#')
+	break ;
+      if (argc == ARRAY_SIZE(argv))
+	goto error_line;
+      argv[argc++] = p;
+      for (; *p && !isspace((unsigned char)*p); p++)
+	;
+    }
+    *p = '\0';
+
+    if (!argc)
+      continue ;
+
+    if (argc < 2 || prefix_parse(argv[0], &prefix))
+      goto error_line;
+
+    tmp = realloc(routes->routes, (routes->nroutes + 1) * sizeof (*tmp));
+    if (!tmp)
+      goto error;
+    routes->routes = tmp;
+
+    if (parse_route(sl, &routes->routes[routes->nroutes], argc - 1, argv + 1)) {
+      routes->nroutes++; /* so it's freed */
+      goto error_line;
+    }
+
+    if (prefix_table_add(routes->table, &prefix, routes->nroutes))
+      goto error;
+    routes->nroutes++;
+  }
+
+  if (prefix_table_compile(routes->table))
+    goto error;
+
+  fclose(fp);
+  return routes;
+
+ error_line:
+  pr_err(sl, "%s:%d: invalid route", path, lineno);
+  errno = EINVAL;
+ error:
+  if (errno != EINVAL)
+    pr_err(sl, "can't load routes file '%s': %s", path, strerror(errno));
+  routes_close(routes);
+  fclose(fp);
+  return NULL;
+}
+
+void routes_close(struct routes *routes)
+{
+  if (!routes)
+    return ;
+
+  for (int i = 0; i < routes->nroutes; ++i) {
+    free(routes->routes[i].uname);
+    free(routes->routes[i].passwd);
+  }
+  free(routes->routes);
+  prefix_table_free(routes->table);
+  free(routes);
+}
+
+int routes_count(const struct routes *routes)
+{
+  return routes->nroutes;
+}
+
+const struct route *routes_lookup(const struct routes *routes,
+				  const struct sockaddr_storage *addr)
+{
+  int route = prefix_table_lookup(routes->table, addr);
+
+  return route == -1 ? NULL : &routes->routes[route];
+}
+
+int routes_load(SocksLink *sl)
+{
+  if (!sl->routes_file)
+    return 0;
+
+  sl->routes = routes_open(sl, sl->routes_file);
+  if (!sl->routes)
+    return -1;
+
+  pr_infos(sl, "%d routes loaded from %s", routes_count(sl->routes),
+	   sl->routes_file);
+  return 0;
+}
+
+/* Swap tables only once the new one is loaded */
+void routes_reload(SocksLink *sl)
+{
+  struct routes *routes;
+
+  if (!sl->routes_file)
+    return ;
+
+  routes = routes_open(sl, sl->routes_file);
+  if (!routes) {
+    pr_err(sl, "keeping the old routes");
+    return ;
+  }
+
+  routes_close(sl->routes);
+  sl->routes = routes;
+
+  pr_infos(sl, "%d routes reloaded from %s", routes_count(routes),
+	   sl->routes_file);
+}
+
+void routes_unload(SocksLink *sl)
+{
+  routes_close(sl->routes);
+  sl->routes = NULL;
+}
+
+/* Returns -1 if no route matches the client source address */
+int routes_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  const struct route *route;
+  const struct sockaddr_storage *nexthop_addr = &sl->nexthop_addr;
+  socklen_t nexthop_addrlen = sl->nexthop_addrlen;
+
+  if (!sl->routes)
+    return -1;
+
+  route = routes_lookup(sl->routes, &cl->client.addr);
+  if (!route)
+    return -1;
+
+  prcl_debug(cl, "routed by source address");
+
+  if (route->nexthop_addrlen) {
+    nexthop_addr = &route->nexthop_addr;
+    nexthop_addrlen = route->nexthop_addrlen;
+  }
+
+  if (route->method == AUTH_METHOD_INVALID) {
+    cl->server_method = cl->client_method;
+  } else {
+    cl->server_method = route->method;
+    if (route->method == AUTH_METHOD_USERNAME) {
+      cl->auth.username.ulen = route->ulen;
+      cl->auth.username.plen = route->plen;
+      memcpy(cl->auth.username.uname, route->uname, route->ulen);
+      memcpy(cl->auth.username.passwd, route->passwd, route->plen);
+    }
+  }
+
+  client_auth_accept(cl, nexthop_addr, nexthop_addrlen);
+  return 0;
+}
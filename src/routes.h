@@ -0,0 +1,33 @@
+#ifndef ROUTES_H
+# define ROUTES_H
+
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+struct route {
+  struct sockaddr_storage nexthop_addr;
+  socklen_t nexthop_addrlen;	/* 0 for the default next-hop */
+  uint8_t method;		/* AUTH_METHOD_INVALID: forward client's */
+  uint8_t ulen;
+  uint8_t plen;
+  uint8_t *uname;
+  uint8_t *passwd;
+};
+
+struct routes;
+
+struct routes *routes_open(SocksLink *sl, const char *path);
+void routes_close(struct routes *routes);
+const struct route *routes_lookup(const struct routes *routes,
+				  const struct sockaddr_storage *addr);
+int routes_count(const struct routes *routes);
+
+int routes_load(SocksLink *sl);
+void routes_reload(SocksLink *sl);
+void routes_unload(SocksLink *sl);
+
+int routes_call(Client *client);
+
+#endif /* !ROUTES_H */
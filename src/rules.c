@@ -0,0 +1,751 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "rules.h"
+#include "prefix.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Authentication and routing rules
+ *
+ * # action  conditions
+ * deny      from 192.168.66.0/24
+ * allow     from 10.0.0.0/8 user *@corp via 10.0.0.1:1080
+ * pass      user admin*
+ * allow     method none days mon-fri hours 08:00-19:00
+ *
+ * Conditions are "from <prefix>", "user <name|*|prefix*|*suffix>",
+ * "method none|username", "days <sun,mon-fri,...>" and "hours
+ * HH:MM-HH:MM" (local time, may wrap around midnight). A rule with a
+ * "user" condition only matches clients using the username method.
+ *
+ * The first matching rule wins: "allow" sends the client to its "via"
+ * next-hop ('!' or nothing for the default one) with its own
+ * credentials, "deny" rejects it, and "pass" hands it to the other
+ * authentication backends, like clients matching no rule.
+ *
+ * Each condition is compiled into a lookup returning the bitmap of the
+ * rules it accepts: a prefix table for sources, tries for names and
+ * their prefixes and suffixes, and a bitmap refreshed every minute for
+ * time windows. Matching a client is one lookup per condition and an
+ * AND of the bitmaps, whatever the number of rules.
+ */
+
+enum {
+  RULE_ALLOW,
+  RULE_DENY,
+  RULE_PASS,
+};
+
+struct rule {
+  int action;
+  int lineno;
+  struct sockaddr_storage nexthop_addr;
+  socklen_t nexthop_addrlen;	/* 0 for the default next-hop */
+
+  /* only used while compiling */
+  bool has_from;
+  struct prefix from;
+  char *user;
+  int method;			/* -1 for any */
+  bool timed;
+  uint8_t days;			/* bit n for tm_wday n */
+  int start, end;		/* minutes, end excluded */
+};
+
+/* Tries of names, one node per character */
+struct name_node {
+  int child;
+  int sibling;
+  int prefix_set;		/* patterns ending here or above */
+  int exact_set;		/* names ending here */
+  uint8_t c;
+};
+
+struct name_trie {
+  struct name_node *nodes;
+  int nnodes;
+};
+
+struct rules {
+  struct rule *rules;
+  int nrules;
+
+  /* rule bitmaps, set 0 is empty */
+  uint64_t *sets;
+  int nsets;
+  int nwords;
+
+  struct prefix_table *sources;
+  int any_source;
+  int any_user;
+  struct name_trie prefixes;
+  struct name_trie suffixes;
+  int methods[2];		/* none, username */
+
+  /* timed rules are only matched on the current minute */
+  int untimed;
+  int now;
+  time_t now_minute;
+};
+
+static const char *days_names[] = {
+  "sun", "mon", "tue", "wed", "thu", "fri", "sat"
+};
+
+static uint64_t *rules_set(const struct rules *rules, int set)
+{
+  return rules->sets + (size_t)set * rules->nwords;
+}
+
+static int rules_new_set(struct rules *rules)
+{
+  uint64_t *sets;
+
+  sets = realloc(rules->sets, (size_t)(rules->nsets + 1) * rules->nwords *
+		 sizeof (*sets));
+  if (!sets)
+    return -1;
+  rules->sets = sets;
+  memset(rules_set(rules, rules->nsets), 0,
+	 rules->nwords * sizeof (*sets));
+  return rules->nsets++;
+}
+
+static inline void set_add(uint64_t *set, int rule)
+{
+  set[rule / 64] |= 1ULL << (rule % 64);
+}
+
+static int name_trie_init(struct name_trie *trie)
+{
+  trie->nodes = calloc(sizeof (*trie->nodes), 1);
+  if (!trie->nodes)
+    return -1;
+  trie->nnodes = 1;
+  trie->nodes[0].child = trie->nodes[0].sibling = -1;
+  return 0;
+}
+
+static int name_trie_child(const struct name_trie *trie, int node, uint8_t c)
+{
+  for (int n = trie->nodes[node].child; n != -1; n = trie->nodes[n].sibling)
+    if (trie->nodes[n].c == c)
+      return n;
+  return -1;
+}
+
+/* Returns the node of name, created if needed */
+static int name_trie_insert(struct name_trie *trie, const char *name,
+			    size_t len, bool reverse)
+{
+  int node = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    uint8_t c = name[reverse ? len - i - 1 : i];
+    int child = name_trie_child(trie, node, c);
+
+    if (child == -1) {
+      struct name_node *nodes;
+
+      nodes = realloc(trie->nodes, (trie->nnodes + 1) * sizeof (*nodes));
+      if (!nodes)
+	return -1;
+      trie->nodes = nodes;
+
+      child = trie->nnodes++;
+      nodes[child].c = c;
+      nodes[child].child = -1;
+      nodes[child].prefix_set = nodes[child].exact_set = 0;
+      nodes[child].sibling = nodes[node].child;
+      nodes[node].child = child;
+    }
+    node = child;
+  }
+  return node;
+}
+
+/* Make every node accept the patterns of its ancestors */
+static void name_trie_inherit(struct rules *rules, struct name_trie *trie,
+			      int node, int parent_set)
+{
+  struct name_node *n = &trie->nodes[node];
+
+  if (!n->prefix_set) {
+    n->prefix_set = parent_set;
+  } else if (parent_set) {
+    uint64_t *dst = rules_set(rules, n->prefix_set);
+    uint64_t *src = rules_set(rules, parent_set);
+
+    for (int w = 0; w < rules->nwords; ++w)
+      dst[w] |= src[w];
+  }
+
+  for (int c = n->child; c != -1; c = trie->nodes[c].sibling)
+    name_trie_inherit(rules, trie, c, trie->nodes[node].prefix_set);
+}
+
+static int name_trie_mark(struct rules *rules, struct name_trie *trie,
+			  const char *name, size_t len, bool reverse,
+			  bool exact, int rule)
+{
+  int node, *set;
+
+  node = name_trie_insert(trie, name, len, reverse);
+  if (node == -1)
+    return -1;
+
+  set = exact ? &trie->nodes[node].exact_set : &trie->nodes[node].prefix_set;
+  if (!*set && (*set = rules_new_set(rules)) == -1) {
+    *set = 0;
+    return -1;
+  }
+
+  set_add(rules_set(rules, *set), rule);
+  return 0;
+}
+
+static int parse_days(const char *str, uint8_t *days)
+{
+  char buf[64];
+  char *tok, *save;
+
+  if (strlen(str) >= sizeof (buf))
+    return -1;
+  strcpy(buf, str);
+
+  *days = 0;
+  for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    char *dash = strchr(tok, '-');
+    int first = -1, last = -1;
+
+    if (dash)
+      *dash++ = '\0';
+
+    for (int i = 0; i < ARRAY_SIZE(days_names); ++i) {
+      if (!strcasecmp(tok, days_names[i]))
+	first = i;
+      if (dash && !strcasecmp(dash, days_names[i]))
+	last = i;
+    }
+    if (first == -1 || (dash && last == -1))
+      return -1;
+    if (!dash)
+      last = first;
+
+    /* ranges may wrap around the week, "fri-mon" */
+    for (int i = first; ; i = (i + 1) % 7) {
+      *days |= 1 << i;
+      if (i == last)
+	break ;
+    }
+  }
+  return *days ? 0 : -1;
+}
+
+static int parse_minute(const char *str, const char **end)
+{
+  unsigned int h, m;
+  int n;
+
+  if (sscanf(str, "%2u:%2u%n", &h, &m, &n) != 2 || h > 24 || m > 59 ||
+      (h == 24 && m))
+    return -1;
+  *end = str + n;
+  return h * 60 + m;
+}
+
+static int parse_hours(const char *str, int *start, int *end)
+{
+  const char *p;
+
+  *start = parse_minute(str, &p);
+  if (*start == -1 || *p != '-')
+    return -1;
+  *end = parse_minute(p + 1, &p);
+  if (*end == -1 || *p || *start == *end)
+    return -1;
+  return 0;
+}
+
+static int parse_rule(SocksLink *sl, struct rule *rule, int argc,
+		      char *argv[])
+{
+  int ret;
+
+  memset(rule, 0, sizeof (*rule));
+  rule->method = -1;
+  rule->days = 0x7f;
+  rule->start = 0;
+  rule->end = 24 * 60;
+
+  if (!strcmp(argv[0], "allow"))
+    rule->action = RULE_ALLOW;
+  else if (!strcmp(argv[0], "deny"))
+    rule->action = RULE_DENY;
+  else if (!strcmp(argv[0], "pass"))
+    rule->action = RULE_PASS;
+  else
+    return -1;
+
+  for (int i = 1; i < argc; i += 2) {
+    const char *key, *value;
+
+    if (i + 1 >= argc)
+      return -1;
+    key = argv[i];
+    value = argv[i + 1];
+
+    if (!strcmp(key, "from") && !rule->has_from) {
+      if (prefix_parse(value, &rule->from))
+	return -1;
+      rule->has_from = true;
+    } else if (!strcmp(key, "user") && !rule->user) {
+      size_t len = strlen(value);
+
+      if (len > 255 || (len > 1 && strchr(value + 1, '*') &&
+			strchr(value + 1, '*') != value + len - 1) ||
+	  (value[0] == '*' && len > 1 && value[len - 1] == '*'))
+	return -1;
+      rule->user = strdup(value);
+      if (!rule->user)
+	return -1;
+    } else if (!strcmp(key, "method") && rule->method == -1) {
+      if (!strcmp(value, "none"))
+	rule->method = AUTH_METHOD_NONE;
+      else if (!strcmp(value, "username"))
+	rule->method = AUTH_METHOD_USERNAME;
+      else
+	return -1;
+    } else if (!strcmp(key, "days")) {
+      if (parse_days(value, &rule->days))
+	return -1;
+      rule->timed = true;
+    } else if (!strcmp(key, "hours")) {
+      if (parse_hours(value, &rule->start, &rule->end))
+	return -1;
+      rule->timed = true;
+    } else if (!strcmp(key, "via") && rule->action == RULE_ALLOW &&
+	       !rule->nexthop_addrlen) {
+      if (!strcmp(value, "!"))
+	continue ;
+      ret = parse_nexthop_numeric(value, &rule->nexthop_addr,
+				  &rule->nexthop_addrlen);
+      if (ret) {
+	pr_err(sl, "invalid next-hop address '%s': %s", value,
+	       gai_strerror(ret));
+	return -1;
+      }
+    } else
+      return -1;
+  }
+
+  return 0;
+}
+
+static int rules_compile_sources(struct rules *rules)
+{
+  struct prefix *prefixes = NULL;
+  int nprefixes = 0;
+  int ret = -1;
+
+  rules->any_source = rules_new_set(rules);
+  rules->sources = prefix_table_new();
+  if (rules->any_source == -1 || !rules->sources)
+    return -1;
+
+  for (int r = 0; r < rules->nrules; ++r) {
+    if (!rules->rules[r].has_from)
+      set_add(rules_set(rules, rules->any_source), r);
+  }
+
+  /* one set per distinct prefix, with all the rules containing it */
+  for (int r = 0; r < rules->nrules; ++r) {
+    const struct prefix *from = &rules->rules[r].from;
+    struct prefix *tmp;
+    uint64_t *set;
+    int s, i;
+
+    if (!rules->rules[r].has_from)
+      continue ;
+
+    for (i = 0; i < nprefixes; ++i)
+      if (prefixes[i].family == from->family &&
+	  prefixes[i].bits == from->bits && prefix_contains(&prefixes[i], from))
+	break ;
+    if (i < nprefixes)
+      continue ;
+
+    tmp = realloc(prefixes, (nprefixes + 1) * sizeof (*tmp));
+    if (!tmp)
+      goto out;
+    prefixes = tmp;
+    prefixes[nprefixes++] = *from;
+
+    s = rules_new_set(rules);
+    if (s == -1 || prefix_table_add(rules->sources, from, s))
+      goto out;
+
+    set = rules_set(rules, s);
+    memcpy(set, rules_set(rules, rules->any_source),
+	   rules->nwords * sizeof (*set));
+    for (int o = 0; o < rules->nrules; ++o) {
+      if (rules->rules[o].has_from &&
+	  prefix_contains(&rules->rules[o].from, from))
+	set_add(set, o);
+    }
+  }
+
+  ret = prefix_table_compile(rules->sources);
+ out:
+  free(prefixes);
+  return ret;
+}
+
+static int rules_compile_users(struct rules *rules)
+{
+  rules->any_user = rules_new_set(rules);
+  if (rules->any_user == -1 || name_trie_init(&rules->prefixes) ||
+      name_trie_init(&rules->suffixes))
+    return -1;
+
+  for (int r = 0; r < rules->nrules; ++r) {
+    const char *user = rules->rules[r].user;
+    size_t len;
+    int ret;
+
+    if (!user) {
+      set_add(rules_set(rules, rules->any_user), r);
+      continue ;
+    }
+
+    len = strlen(user);
+    if (len && user[len - 1] == '*')
+      ret = name_trie_mark(rules, &rules->prefixes, user, len - 1, false,
+			   false, r);
+    else if (user[0] == '*')
+      ret = name_trie_mark(rules, &rules->suffixes, user + 1, len - 1, true,
+			   false, r);
+    else
+      ret = name_trie_mark(rules, &rules->prefixes, user, len, false, true,
+			   r);
+    if (ret)
+      return -1;
+  }
+
+  name_trie_inherit(rules, &rules->prefixes, 0, 0);
+  name_trie_inherit(rules, &rules->suffixes, 0, 0);
+  return 0;
+}
+
+static int rules_compile(struct rules *rules)
+{
+  rules->nwords = (rules->nrules + 63) / 64;
+  if (!rules->nwords)
+    rules->nwords = 1;
+
+  /* set 0 is the empty set */
+  if (rules_new_set(rules) != 0)
+    return -1;
+
+  if (rules_compile_sources(rules) || rules_compile_users(rules))
+    return -1;
+
+  rules->methods[0] = rules_new_set(rules);
+  rules->methods[1] = rules_new_set(rules);
+  rules->untimed = rules_new_set(rules);
+  rules->now = rules_new_set(rules);
+  if (rules->methods[0] == -1 || rules->methods[1] == -1 ||
+      rules->untimed == -1 || rules->now == -1)
+    return -1;
+
+  for (int r = 0; r < rules->nrules; ++r) {
+    const struct rule *rule = &rules->rules[r];
+
+    if (rule->method != AUTH_METHOD_USERNAME)
+      set_add(rules_set(rules, rules->methods[0]), r);
+    if (rule->method != AUTH_METHOD_NONE)
+      set_add(rules_set(rules, rules->methods[1]), r);
+    if (!rule->timed)
+      set_add(rules_set(rules, rules->untimed), r);
+  }
+
+  /* conditions aren't needed anymore */
+  for (int r = 0; r < rules->nrules; ++r) {
+    free(rules->rules[r].user);
+    rules->rules[r].user = NULL;
+  }
+  rules->now_minute = -1;
+  return 0;
+}
+
+struct rules *rules_open(SocksLink *sl, const char *path)
+{
+  struct rules *rules;
+  FILE *fp;
+  char line[1024];
+  int lineno = 0;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    pr_err(sl, "can't open rules file '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+
+  rules = calloc(sizeof (*rules), 1);
+  if (!rules)
+    goto error;
+
+  while (fgets(line, sizeof (line), fp)) {
+    char *argv[16];
+    char *p = line;
+    int argc;
+    struct rule *tmp;
+
+    lineno++;
+
+    if (!strchr(line, '\n') && !feof(fp)) {
+      pr_err(sl, "%s:%d: rule too long", path, lineno);
+      errno = EINVAL;
+      goto error;
+    }
+
+    for (argc = 0; ; ) {
+      for (; *p && isspace((unsigned char)*p); p++)
+	*p = '\0';
+      if (!*p || *p == '#')
+	break ;
+      if (argc == ARRAY_SIZE(argv)) {
+	pr_err(sl, "%s:%d: too many words in rule", path, lineno);
+	errno = EINVAL;
+	goto error;
+      }
+      argv[argc++] = p;
+      for (; *p && !isspace((unsigned char)*p); p++)
+	;
+    }
+    *p = '\0';
+
+    if (!argc)
+      continue ;
+
+    tmp = realloc(rules->rules, (rules->nrules + 1) * sizeof (*tmp));
+    if (!tmp)
+      goto error;
+    rules->rules = tmp;
+
+    tmp = &rules->rules[rules->nrules++];
+    if (parse_rule(sl, tmp, argc, argv)) {
+      pr_err(sl, "%s:%d: invalid rule", path, lineno);
+      errno = EINVAL;
+      goto error;
+    }
+    tmp->lineno = lineno;
+  }
+
+  if (rules_compile(rules))
+    goto error;
+
+  fclose(fp);
+  return rules;
+
+ error:
+  if (errno != EINVAL)
+    pr_err(sl, "can't load rules file '%s': %s", path, strerror(errno));
+  rules_close(rules);
+  fclose(fp);
+  return NULL;
+}
+
+void rules_close(struct rules *rules)
+{
+  if (!rules)
+    return ;
+
+  for (int r = 0; r < rules->nrules; ++r)
+    free(rules->rules[r].user);
+  free(rules->rules);
+  free(rules->sets);
+  prefix_table_free(rules->sources);
+  free(rules->prefixes.nodes);
+  free(rules->suffixes.nodes);
+  free(rules);
+}
+
+int rules_count(const struct rules *rules)
+{
+  return rules->nrules;
+}
+
+static int rules_match_name(const struct rules *rules,
+			    const struct name_trie *trie,
+			    const uint8_t *name, size_t len, bool reverse,
+			    int *exact)
+{
+  int node = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    int child = name_trie_child(trie, node, name[reverse ? len - i - 1 : i]);
+
+    if (child == -1)
+      return trie->nodes[node].prefix_set;
+    node = child;
+  }
+
+  if (exact)
+    *exact = trie->nodes[node].exact_set;
+  return trie->nodes[node].prefix_set;
+}
+
+/* Refresh the timed rules active this minute */
+static const uint64_t *rules_now(struct rules *rules)
+{
+  uint64_t *now = rules_set(rules, rules->now);
+  time_t t = time(NULL);
+  struct tm tm;
+  int minute;
+
+  if (t / 60 == rules->now_minute)
+    return now;
+  rules->now_minute = t / 60;
+
+  localtime_r(&t, &tm);
+  minute = tm.tm_hour * 60 + tm.tm_min;
+
+  memcpy(now, rules_set(rules, rules->untimed),
+	 rules->nwords * sizeof (*now));
+  for (int r = 0; r < rules->nrules; ++r) {
+    const struct rule *rule = &rules->rules[r];
+    bool in;
+
+    if (!rule->timed || !(rule->days & (1 << tm.tm_wday)))
+      continue ;
+
+    if (rule->start < rule->end)
+      in = minute >= rule->start && minute < rule->end;
+    else
+      in = minute >= rule->start || minute < rule->end;
+    if (in)
+      set_add(now, r);
+  }
+  return now;
+}
+
+/* Returns the first rule matching the client, or NULL */
+static const struct rule *rules_match(struct rules *rules, Client *cl)
+{
+  const uint64_t *now = rules_now(rules);
+  const uint64_t *source, *method, *any, *prefix, *suffix, *exact;
+  int source_set, exact_set = 0;
+
+  source_set = prefix_table_lookup(rules->sources, &cl->client.addr);
+  if (source_set == -1)
+    source_set = rules->any_source;
+  source = rules_set(rules, source_set);
+
+  any = rules_set(rules, rules->any_user);
+  if (cl->client_method == AUTH_METHOD_USERNAME) {
+    method = rules_set(rules, rules->methods[1]);
+    prefix = rules_set(rules, rules_match_name(rules, &rules->prefixes,
+					       cl->auth.username.uname,
+					       cl->auth.username.ulen,
+					       false, &exact_set));
+    suffix = rules_set(rules, rules_match_name(rules, &rules->suffixes,
+					       cl->auth.username.uname,
+					       cl->auth.username.ulen,
+					       true, NULL));
+  } else {
+    method = rules_set(rules, rules->methods[0]);
+    prefix = suffix = rules_set(rules, 0);
+  }
+  exact = rules_set(rules, exact_set);
+
+  for (int w = 0; w < rules->nwords; ++w) {
+    uint64_t match = source[w] & method[w] & now[w] &
+      (any[w] | prefix[w] | suffix[w] | exact[w]);
+
+    if (match)
+      return &rules->rules[w * 64 + __builtin_ctzll(match)];
+  }
+  return NULL;
+}
+
+int rules_load(SocksLink *sl)
+{
+  if (!sl->rules_file)
+    return 0;
+
+  sl->rules = rules_open(sl, sl->rules_file);
+  if (!sl->rules)
+    return -1;
+
+  pr_infos(sl, "%d rules loaded from %s", rules_count(sl->rules),
+	   sl->rules_file);
+  return 0;
+}
+
+/* Swap tables only once the new one is compiled */
+void rules_reload(SocksLink *sl)
+{
+  struct rules *rules;
+
+  if (!sl->rules_file)
+    return ;
+
+  rules = rules_open(sl, sl->rules_file);
+  if (!rules) {
+    pr_err(sl, "keeping the old rules");
+    return ;
+  }
+
+  rules_close(sl->rules);
+  sl->rules = rules;
+
+  pr_infos(sl, "%d rules reloaded from %s", rules_count(rules),
+	   sl->rules_file);
+}
+
+void rules_unload(SocksLink *sl)
+{
+  rules_close(sl->rules);
+  sl->rules = NULL;
+}
+
+/* Returns -1 if no rule decided for this client */
+int rules_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  const struct rule *rule;
+
+  if (!sl->rules)
+    return -1;
+
+  rule = rules_match(sl->rules, cl);
+  if (!rule || rule->action == RULE_PASS)
+    return -1;
+
+  prcl_debug(cl, "matched rule at line %d", rule->lineno);
+
+  if (rule->action == RULE_DENY) {
+    client_auth_reject(cl, "denied by rule");
+    return 0;
+  }
+
+  /* Forward client credentials */
+  cl->server_method = cl->client_method;
+  if (rule->nexthop_addrlen)
+    client_auth_accept(cl, &rule->nexthop_addr, rule->nexthop_addrlen);
+  else
+    client_auth_accept(cl, &sl->nexthop_addr, sl->nexthop_addrlen);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef RULES_H
+# define RULES_H
+
+#include "sockslink.h"
+#include "client.h"
+
+struct rules;
+
+struct rules *rules_open(SocksLink *sl, const char *path);
+void rules_close(struct rules *rules);
+int rules_count(const struct rules *rules);
+
+int rules_load(SocksLink *sl);
+void rules_reload(SocksLink *sl);
+void rules_unload(SocksLink *sl);
+
+int rules_call(Client *client);
+
+#endif /* !RULES_H */
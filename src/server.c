@@ -1,15 +1,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <errno.h>
+#include <evdns.h>
 
 #include "config.h"
 #include "sockslink.h"
 #include "client.h"
 #include "server.h"
+#include "request.h"
+#include "udp.h"
+#include "mux.h"
+#include "stripe.h"
+#include "hop.h"
+#include "zlink.h"
+#include "tls.h"
+#include "sockmap.h"
+#include "source.h"
+#include "profile.h"
+#include "wheel.h"
 #include "log.h"
 #include "utils.h"
 
+struct server_resolve {
+  Client *client; /* NULL if the client went away */
+#ifdef HAVE_EVDNS_GETADDRINFO
+  struct evdns_getaddrinfo_request *request;
+#else
+  bool ipv6;
+#endif
+};
+
 
 static void on_server_event(struct bufferevent *bev, short why, void *ctx)
 {
@@ -19,10 +41,8 @@ static void on_server_event(struct bufferevent *bev, short why, void *ctx)
     /* Client disconnected, remove the read event and the
      * free the client structure. */
     prcl_debug(cl, "remote server disconnected");
+    cl->server_eof = true;
     client_disconnect(cl);
-  } else if (why & EVBUFFER_TIMEOUT) {
-    prcl_debug(cl, "remote server timeout, disconnecting");
-    client_drop(cl);
   } else {
     prcl_debug(cl, "remote server socket error (%#x), disconnecting", why);
     client_disconnect(cl);
@@ -33,8 +53,88 @@ static void on_server_write(struct bufferevent *bev, void *ctx)
 {
   Client *cl = ctx;
 
-  if (cl->close)
-    client_drop(cl);
+  if (cl->authenticated)
+    cl->active = wheel_now(cl->parent);
+
+  if (cl->close && !EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)))
+    client_drop(cl, false);
+  else if (cl->client_paused) {
+    /* the server caught up, read the client again */
+    cl->client_paused = false;
+    bufferevent_enable(cl->client.bufev, EV_READ);
+  } else if (cl->sockmap_wait)
+    sockmap_offload(cl);
+}
+
+/* The next-hop answered our UDP ASSOCIATE with the address of its relay */
+static void on_server_udp_reply(struct bufferevent *bev, void *ctx)
+{
+  Client *cl = ctx;
+  struct socks5_request reply;
+  int ret;
+
+  ret = socks5_request_parse(EVBUFFER_DATA(EVBUFFER_INPUT(bev)),
+			     EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)), &reply);
+  if (!ret)
+    return ;
+
+  if (ret < 0 || reply.cmd != SOCKS5_REP_SUCCEEDED || !reply.addrlen) {
+    prcl_debug(cl, "UDP association refused by the next-hop");
+    cl->request_rep = ret < 0 ? SOCKS5_REP_FAILURE : reply.cmd;
+    client_disconnect(cl);
+    return ;
+  }
+
+  evbuffer_drain(EVBUFFER_INPUT(bev), ret);
+
+  if (udp_associate(cl, &reply.addr, reply.addrlen)) {
+    client_disconnect(cl);
+    return ;
+  }
+
+  server_start_stream(cl);
+  client_start_stream(cl);
+}
+
+/*
+ * Ask the next-hop for its own association. Datagrams will come from
+ * our socket, not from the client, so the client address isn't given.
+ */
+static void server_udp_associate(Client *cl)
+{
+  struct bufferevent *bev = cl->server.bufev;
+  struct evbuffer *input = EVBUFFER_INPUT(cl->client.bufev);
+  uint8_t message[] = {SOCKS5_VER, SOCKS5_CMD_UDP, 0x00, SOCKS5_ATYP_IPV4,
+		       0, 0, 0, 0, 0, 0};
+  struct socks5_request req;
+  int ret;
+
+  ret = socks5_request_parse(EVBUFFER_DATA(input), EVBUFFER_LENGTH(input),
+			     &req);
+  if (ret > 0)
+    evbuffer_drain(input, ret);
+
+  bufferevent_setcb(bev, on_server_udp_reply, on_server_write,
+		    on_server_event, cl);
+  bufferevent_setwatermark(bev, EV_READ, 0, SOCKS5_REQUEST_MAX);
+  bufferevent_write(bev, message, sizeof (message));
+
+  /* there is still data available in the buffer, call next callback */
+  if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
+    on_server_udp_reply(bev, cl);
+}
+
+/* Authenticated with the next-hop, which now gets the client request */
+static void server_negociated(Client *cl)
+{
+  if (cl->parent->udp && cl->request &&
+      cl->request->cmd == SOCKS5_CMD_UDP) {
+    server_udp_associate(cl);
+    return ;
+  }
+
+  server_start_stream(cl);
+  client_start_stream(cl);
 }
 
 static void on_server_auth_username(struct bufferevent *bev, void *ctx)
@@ -55,7 +155,9 @@ static void on_server_auth_username(struct bufferevent *bev, void *ctx)
   prcl_trace(cl, "username authentication result: %#x %#x", ver, result);
 
   if (ver != 0x01 || result != 0x00) {
-    if (cl->client_method == AUTH_METHOD_USERNAME)
+    if (cl->auth_replied)
+      client_request_fail(cl);
+    else if (cl->client_method == AUTH_METHOD_USERNAME)
       client_auth_username_fail(cl);
     client_disconnect(cl);
     return ;
@@ -63,14 +165,13 @@ static void on_server_auth_username(struct bufferevent *bev, void *ctx)
 
   evbuffer_drain(EVBUFFER_INPUT(bev), 2);
 
-  if (cl->client_method == AUTH_METHOD_USERNAME)
+  if (cl->client_method == AUTH_METHOD_USERNAME && !cl->auth_replied)
     client_auth_username_successful(cl);
 
-  server_start_stream(cl);
-  client_start_stream(cl);
+  server_negociated(cl);
 }
 
-static void server_auth_username(Client *cl)
+static void server_auth_username_send(Client *cl)
 {
   struct bufferevent *bev = cl->server.bufev;
   uint8_t ver = 0x01;
@@ -79,14 +180,68 @@ static void server_auth_username(Client *cl)
 
   prcl_trace(cl, "sending username authentication data");
 
-  bufferevent_setcb(bev, on_server_auth_username, on_server_write,
-		    on_server_event, cl);
-
   bufferevent_write(bev, &ver, 1);
   bufferevent_write(bev, &ulen, 1);
   bufferevent_write(bev, cl->auth.username.uname, ulen);
   bufferevent_write(bev, &plen, 1);
   bufferevent_write(bev, cl->auth.username.passwd, plen);
+}
+
+static void server_auth_username(Client *cl)
+{
+  struct bufferevent *bev = cl->server.bufev;
+
+  bufferevent_setcb(bev, on_server_auth_username, on_server_write,
+		    on_server_event, cl);
+
+  /* already sent with the negociation request through tunnels */
+  if (!cl->server_mux || cl->parent->hop)
+    server_auth_username_send(cl);
+
+  /* there is still data available in the buffer, call next callback */
+  if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
+    on_server_auth_username(bev, cl);
+}
+
+/*
+ * Send the hop handshake, the next-hop is a sockslinkd which reads the
+ * request right after it: send the request too if we already have it.
+ * With compression, the rest goes through a new server bufferevent,
+ * and the raw_in bytes still expected from the method reply aren't
+ * compressed.
+ */
+static int server_hop_send(Client *cl, uint8_t method, size_t raw_in)
+{
+  struct evbuffer *input = EVBUFFER_INPUT(cl->client.bufev);
+
+  hop_send(cl);
+
+  if (method == AUTH_METHOD_HOP_ZLIB &&
+      zlink_wrap(cl, &cl->server, raw_in)) {
+    client_disconnect(cl);
+    return -1;
+  }
+
+  if (cl->auth_replied && cl->request &&
+      cl->request->cmd != SOCKS5_CMD_UDP && EVBUFFER_LENGTH(input)) {
+    bufferevent_write(cl->server.bufev, EVBUFFER_DATA(input),
+		      EVBUFFER_LENGTH(input));
+    evbuffer_drain(input, EVBUFFER_LENGTH(input));
+  }
+  return 0;
+}
+
+/* The reply to the hop handshake is the one of RFC1929 */
+static void server_auth_hop(Client *cl, uint8_t method)
+{
+  struct bufferevent *bev;
+
+  if (!cl->server_hop && server_hop_send(cl, method, 0))
+    return ;
+
+  bev = cl->server.bufev;
+  bufferevent_setcb(bev, on_server_auth_username, on_server_write,
+		    on_server_event, cl);
 
   /* there is still data available in the buffer, call next callback */
   if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
@@ -113,6 +268,25 @@ static void on_server_negociate(struct bufferevent *bev, void *ctx)
    * and parameters, so we can't really tell "bad authentification method".
    * let client_disconnect() send a fake authentication specific failure
    */
+  if (ver == SOCKS5_VER && cl->parent->hop &&
+      (method == AUTH_METHOD_HOP ||
+       (method == AUTH_METHOD_HOP_ZLIB && cl->parent->compress)) &&
+      (!cl->server_hop || method == cl->server_hop)) {
+    evbuffer_drain(EVBUFFER_INPUT(bev), 2);
+    hop_set_known(cl->parent, &cl->server.addr, cl->server.addrlen, method);
+    server_auth_hop(cl, method);
+    return ;
+  }
+
+  if (cl->server_hop) {
+    /* the handshake we sent along was taken for something else */
+    prcl_debug(cl, "next-hop doesn't select the hop handshake anymore");
+    hop_set_known(cl->parent, &cl->server.addr, cl->server.addrlen,
+		  AUTH_METHOD_INVALID);
+    client_disconnect(cl);
+    return ;
+  }
+
   if (ver != SOCKS5_VER || method != cl->server_method) {
     client_disconnect(cl);
     return ;
@@ -125,60 +299,139 @@ static void on_server_negociate(struct bufferevent *bev, void *ctx)
   } else {
     /* If the client used a username, and is still waiting for
      * a reply... */
-    if (cl->client_method == AUTH_METHOD_USERNAME)
+    if (cl->client_method == AUTH_METHOD_USERNAME && !cl->auth_replied)
       client_auth_username_successful(cl);
 
-    server_start_stream(cl);
-    client_start_stream(cl);
+    server_negociated(cl);
   }
 }
 
 static void server_negociate(Client *cl)
 {
+  SocksLink *sl = cl->parent;
   struct bufferevent *bev = cl->server.bufev;
-  uint8_t message[] = {SOCKS5_VER, 1, cl->server_method};
+  uint8_t message[5] = {SOCKS5_VER, 1, cl->server_method};
+  uint8_t known;
+  size_t len = 3;
 
   prcl_debug(cl, "sending negociation request to remote server (method: %#x)",
 	     cl->server_method);
 
+  /*
+   * Offer the hop handshakes along with our method, or alone with the
+   * handshake itself the one a next-hop selected before
+   */
+  cl->server_hop = 0;
+  if (sl->hop && (cl->server_method == AUTH_METHOD_NONE ||
+		  cl->server_method == AUTH_METHOD_USERNAME)) {
+    known = hop_known_method(sl, &cl->server.addr, cl->server.addrlen);
+    if (known != AUTH_METHOD_INVALID) {
+      cl->server_hop = known;
+      message[2] = known;
+    } else {
+      len = 2;
+      if (sl->compress)
+	message[len++] = AUTH_METHOD_HOP_ZLIB;
+      message[len++] = AUTH_METHOD_HOP;
+      message[len++] = cl->server_method;
+      message[1] = len - 2;
+    }
+  }
+
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  bufferevent_write(bev, message, len);
+
+  /*
+   * The other end of a tunnel is a sockslinkd, which reads the
+   * credentials right after the method: save a round trip. The method
+   * reply is still to come uncompressed.
+   */
+  if (cl->server_hop) {
+    if (server_hop_send(cl, cl->server_hop, 2))
+      return ;
+  } else if (cl->server_mux && !sl->hop &&
+	     cl->server_method == AUTH_METHOD_USERNAME)
+    server_auth_username_send(cl);
+
+  bev = cl->server.bufev;
   bufferevent_disable(bev, EV_READ | EV_WRITE);
-  bufferevent_settimeout(bev, SOCKS5_AUTH_TIMEOUT, SOCKS5_AUTH_TIMEOUT);
   bufferevent_setcb(bev, on_server_negociate, on_server_write, on_server_event, cl);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
 
-  bufferevent_write(bev, message, sizeof (message));
-
   /* there is still data available in the buffer, call next callback */
   if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)))
     on_server_negociate(bev, cl);
 }
 
+/* Tell the client where we are connected from */
+static void server_reply_direct(Client *cl)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof (addr);
+  uint8_t message[3 + SOCKS5_ADDR_MAX] = {SOCKS5_VER, SOCKS5_REP_SUCCEEDED, 0x00};
+
+  if (getsockname(cl->server.fd, (struct sockaddr *)&addr, &len))
+    addr.ss_family = AF_UNSPEC;
+
+  len = 3 + socks5_addr_write(message + 3, &addr);
+  bufferevent_write(cl->client.bufev, message, len);
+}
+
+static void server_connected(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+
+  if (cl->direct) {
+    server_reply_direct(cl);
+    server_start_stream(cl);
+    client_start_stream(cl);
+  } else if (sl->pipe) {
+    /* If server is in pipe mode, relay data now */
+    server_start_stream(cl);
+    client_start_stream(cl);
+  } else {
+    /* Else, try to authenticate with the remote server */
+    server_negociate(cl);
+  }
+}
+
+static void server_tls_done(Client *cl, bool ok)
+{
+  if (ok)
+    server_connected(cl);
+  else
+    client_drop(cl, true);
+}
+
 static void on_server_connect(struct bufferevent *bev, void *ctx)
 {
   Client *cl = ctx;
   SocksLink *sl = cl->parent;
   int ret;
   int status = 0;
-  socklen_t len = 0;
+  socklen_t len = sizeof (status);
 
   /* Check for connect() error */
   ret = getsockopt(cl->server.fd, SOL_SOCKET, SO_ERROR, &status, &len);
-  if (ret) {
-    prcl_debug(cl, "connection error: %s", strerror(status));
-    client_drop(cl);
+  if (ret || status) {
+    prcl_debug(cl, "connection error: %s", strerror(ret ? errno : status));
+    if (cl->direct) {
+      cl->request_rep = socks5_reply_errno(ret ? errno : status);
+      client_disconnect(cl);
+    } else
+      client_drop(cl, true);
     return ;
   }
 
   prcl_debug(cl, "remote server connected");
 
-  if (sl->pipe) {
-    /* If server is in pipe mode, relay data now */
-    server_start_stream(cl);
-    client_start_stream(cl);
-  } else {
-    /* Else, try to authenticate with the remote server */
-    server_negociate(cl);
+  if (sl->tls_nexthop && !cl->direct) {
+    if (tls_connect(cl, server_tls_done))
+      client_drop(cl, true);
+    return ;
   }
+
+  server_connected(cl);
 }
 
 static void on_server_read_stream(struct bufferevent *bev, void *ctx)
@@ -188,9 +441,16 @@ static void on_server_read_stream(struct bufferevent *bev, void *ctx)
   char *buffer = EVBUFFER_DATA(EVBUFFER_INPUT(bev));
 
   prcl_trace(cl, "received %d bytes from server", bytes);
+  cl->active = wheel_now(cl->parent);
 
   bufferevent_write(cl->client.bufev, buffer, bytes);
   evbuffer_drain(EVBUFFER_INPUT(bev), bytes);
+
+  /* don't queue more than client_bufsiz for a slower client */
+  if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(cl->client.bufev)) >= cl->client_bufsiz) {
+    cl->server_paused = true;
+    bufferevent_disable(bev, EV_READ);
+  }
 }
 
 void server_start_stream(Client *cl)
@@ -198,8 +458,8 @@ void server_start_stream(Client *cl)
   struct bufferevent *bev = cl->server.bufev;
 
   bufferevent_disable(bev, EV_READ | EV_WRITE);
-  bufferevent_settimeout(bev, SOCKS_IO_TIMEOUT, SOCKS_IO_TIMEOUT);
-  bufferevent_setwatermark(bev, EV_READ, 0, SOCKS_STREAM_BUFSIZ);
+  bufferevent_setwatermark(bev, EV_READ, 0, cl->client_bufsiz);
+  bufferevent_setwatermark(bev, EV_WRITE, cl->server_bufsiz / 2, 0);
   bufferevent_setcb(bev, on_server_read_stream, on_server_write, on_server_event, cl);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
 
@@ -208,22 +468,19 @@ void server_start_stream(Client *cl)
     on_server_read_stream(bev, cl);
 }
 
-void server_connect(Client *cl, const struct sockaddr_storage *addr,
-		    socklen_t addrlen)
+static int server_socket(Client *cl, const struct sockaddr_storage *addr,
+			 socklen_t addrlen)
 {
-  SocksLink *sl = cl->parent;
-  struct bufferevent *bev;
   int fd;
   int ret;
+  int attempt = 0;
 
-  memcpy(&cl->server.addr, addr, addrlen);
-  cl->server.addrlen = addrlen;
-
+retry:
   ret = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
 
   if (ret == -1) {
     prcl_err(cl, "can't create remote server socket: %s", strerror(errno));
-    goto error;
+    return -1;
   }
 
   fd = ret;
@@ -232,32 +489,285 @@ void server_connect(Client *cl, const struct sockaddr_storage *addr,
 
   if (ret < 0) {
     prcl_err(cl, "failed to set remote server socket to non-blocking");
-    goto error;
+    close(fd);
+    return -1;
   }
 
-  ret = connect(fd, (const struct sockaddr *)addr, addrlen);
+  /* failures were reported for the listener */
+  profile_apply(cl->profile, fd);
+
+  ret = source_bind(cl, fd, addr->ss_family, attempt);
+
+  if (!ret)
+    ret = connect(fd, (const struct sockaddr *)addr, addrlen);
+
+  /* no port left from this source address, try the next one */
+  if (ret == -1 && errno == EADDRNOTAVAIL && cl->source) {
+    source_exhausted(cl);
+    close(fd);
+    attempt++;
+    goto retry;
+  }
 
   if (ret == -1 && errno != EINPROGRESS) {
     prcl_err(cl, "can't connect to remote server: %s", strerror(errno));
-    goto error;
+    cl->request_rep = socks5_reply_errno(errno);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void server_connect(Client *cl, const struct sockaddr_storage *addr,
+		    socklen_t addrlen)
+{
+  SocksLink *sl = cl->parent;
+  struct bufferevent *bev;
+  int fd = -1;
+
+  memcpy(&cl->server.addr, addr, addrlen);
+  cl->server.addrlen = addrlen;
+
+  if (sl->mux_tunnels && !cl->direct) {
+    fd = mux_connect(cl, addr, addrlen);
+    cl->server_mux = fd >= 0;
+  } else if (sl->stripe_links && !cl->direct)
+    fd = stripe_connect(cl, addr, addrlen);
+
+  if (fd < 0)
+    fd = server_socket(cl, addr, addrlen);
+
+  if (fd < 0) {
+    /* the client is waiting for the result of its request */
+    if (cl->direct)
+      client_disconnect(cl);
+    else
+      client_drop(cl, true);
+    return ;
   }
 
   bev = bufferevent_new(fd, NULL, NULL, NULL, NULL);
   if (!bev) {
     prcl_err(cl, "can't create bufferevent");
-    goto error;
+    close(fd);
+    client_drop(cl, true);
+    return ;
   }
 
   cl->server.fd = fd;
   cl->server.bufev = bev;
 
   bufferevent_base_set(sl->base, bev);
+  /* the client timer bounds the connection too */
   bufferevent_setcb(bev, NULL, on_server_connect, on_server_event, cl);
-  bufferevent_settimeout(bev, 0, SOCKS5_AUTH_TIMEOUT);
   bufferevent_enable(bev, EV_WRITE);
+}
+
+/* Connect once the destination name is resolved, addrlen is 0 on error */
+static void server_resolved(struct server_resolve *res,
+			    struct sockaddr_storage *addr, socklen_t addrlen,
+			    const char *error)
+{
+  Client *cl = res->client;
+
+  free(res);
+  if (!cl)
+    return ;
+  cl->resolve = NULL;
+
+  if (!addrlen) {
+    prcl_debug(cl, "can't resolve %s: %s", cl->request->name, error);
+    cl->request_rep = SOCKS5_REP_HOST_UNREACHABLE;
+    client_disconnect(cl);
+    return ;
+  }
+
+  server_connect(cl, addr, addrlen);
+}
+
+#ifdef HAVE_EVDNS_GETADDRINFO
+static void on_server_resolve(int result, struct evutil_addrinfo *ai,
+			      void *arg)
+{
+  struct server_resolve *res = arg;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = 0;
+
+  if (result == 0 && ai && ai->ai_addrlen <= sizeof (addr)) {
+    memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+    addrlen = ai->ai_addrlen;
+  }
+  if (ai)
+    evutil_freeaddrinfo(ai);
+
+  server_resolved(res, &addr, addrlen, evutil_gai_strerror(result));
+}
+
+static int server_resolve(SocksLink *sl, struct server_resolve *res,
+			  const struct socks5_request *req)
+{
+  struct evdns_getaddrinfo_request *request;
+  struct evutil_addrinfo hints;
+  char port[6];
+
+  /* virtual listeners use the resolver of the main one */
+  if (sl->master)
+    sl = sl->master;
+
+  if (!sl->dns) {
+    sl->dns = evdns_base_new(sl->base, 1);
+    if (!sl->dns)
+      return -1;
+  }
+
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = EVUTIL_AI_ADDRCONFIG | EVUTIL_AI_NUMERICSERV;
+  snprintf(port, sizeof (port), "%u", req->port);
+
+  /* NULL when the callback already ran and released res, errors included */
+  request = evdns_getaddrinfo(sl->dns, req->name, port, &hints,
+			      on_server_resolve, res);
+  if (request)
+    res->request = request;
+  return 0;
+}
+
+void server_shutdown(SocksLink *sl)
+{
+  if (!sl->dns)
+    return ;
+  evdns_base_free(sl->dns, 0);
+  sl->dns = NULL;
+}
+#else
+static void on_server_resolve(int result, char type, int count, int ttl,
+			      void *addresses, void *arg)
+{
+  struct server_resolve *res = arg;
+  Client *cl = res->client;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = 0;
+
+  memset(&addr, 0, sizeof (addr));
+
+  if (cl && result == DNS_ERR_NONE && count > 0 && type == DNS_IPv4_A) {
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+
+    in->sin_family = AF_INET;
+    in->sin_port = htons(cl->request->port);
+    memcpy(&in->sin_addr, addresses, 4);
+    addrlen = sizeof (*in);
+  }
+#ifdef HAVE_IPV6
+  else if (cl && result == DNS_ERR_NONE && count > 0 &&
+	   type == DNS_IPv6_AAAA) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(cl->request->port);
+    memcpy(&in6->sin6_addr, addresses, 16);
+    addrlen = sizeof (*in6);
+  } else if (cl && !res->ipv6) {
+    /* no IPv4 address, try IPv6 */
+    res->ipv6 = true;
+    if (!evdns_resolve_ipv6(cl->request->name, 0, on_server_resolve, res))
+      return ;
+  }
+#endif
+
+  server_resolved(res, &addr, addrlen, evdns_err_to_string(result));
+}
+
+static int server_resolve(SocksLink *sl, struct server_resolve *res,
+			  const struct socks5_request *req)
+{
+  if (sl->master)
+    sl = sl->master;
+
+  if (!sl->dns) {
+    if (evdns_init())
+      return -1;
+    sl->dns = true;
+  }
+
+  return evdns_resolve_ipv4(req->name, 0, on_server_resolve, res);
+}
+
+void server_shutdown(SocksLink *sl)
+{
+  if (!sl->dns)
+    return ;
+  /* pending requests complete with an error, releasing their state */
+  evdns_shutdown(1);
+  sl->dns = false;
+}
+#endif
+
+/* Handle the client request ourself, instead of relaying it */
+void server_connect_direct(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  struct socks5_request *req = cl->request;
+  struct server_resolve *res;
+
+  cl->direct = true;
+
+  if (req->cmd == SOCKS5_CMD_UDP && sl->udp) {
+    if (udp_associate(cl, NULL, 0))
+      client_disconnect(cl);
+    else
+      client_start_stream(cl);
+    return ;
+  }
+
+  if (req->cmd != SOCKS5_CMD_CONNECT) {
+    prcl_debug(cl, "unsupported command %#x", req->cmd);
+    cl->request_rep = SOCKS5_REP_CMD_UNSUPPORTED;
+    client_disconnect(cl);
+    return ;
+  }
+
+  if (req->addrlen) {
+    server_connect(cl, &req->addr, req->addrlen);
+    return ;
+  }
+
+  prcl_debug(cl, "resolving %s", req->name);
+
+  res = calloc(sizeof (*res), 1);
+  if (!res) {
+    prcl_err(cl, "can't allocate resolver request");
+    client_disconnect(cl);
+    return ;
+  }
+  res->client = cl;
+  cl->resolve = res;
+
+  if (server_resolve(sl, res, req)) {
+    prcl_err(cl, "can't start resolving %s", req->name);
+    cl->resolve = NULL;
+    free(res);
+    cl->request_rep = SOCKS5_REP_HOST_UNREACHABLE;
+    client_disconnect(cl);
+  }
+}
+
+void server_cancel(Client *cl)
+{
+  struct server_resolve *res = cl->resolve;
+
+  if (!res)
+    return ;
 
-  return ;
- error:
-  client_drop(cl);
-  return ;
+  cl->resolve = NULL;
+  res->client = NULL;
+#ifdef HAVE_EVDNS_GETADDRINFO
+  /* the callback runs with an error and releases res */
+  if (res->request)
+    evdns_getaddrinfo_cancel(res->request);
+#endif
 }
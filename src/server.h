@@ -6,6 +6,10 @@
 void server_connect(Client *cl, const struct sockaddr_storage *addr,
 		    socklen_t addrlen);
 
+void server_connect_direct(Client *cl);
+void server_cancel(Client *cl);
+void server_shutdown(SocksLink *sl);
+
 void server_start_stream(Client *cl);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef SHA256_H
+# define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+
+struct sha256 {
+  uint32_t state[8];
+  uint64_t count;
+  uint8_t buf[64];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* !SHA256_H */
@@ -0,0 +1,584 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_BPF_H
+# include <sys/syscall.h>
+# include <netinet/in.h>
+# include <linux/bpf.h>
+# include <linux/sockios.h>
+# include <linux/tcp.h>
+#endif
+
+#include "sockslink.h"
+#include "client.h"
+#include "sockmap.h"
+#include "profile.h"
+#include "log.h"
+
+#ifdef HAVE_LINUX_BPF_H
+
+/*
+ * Kernel relay of established streams
+ *
+ * Once both sides of a client are streaming and our buffers are
+ * flushed, the two TCP sockets go in a BPF sockhash, each one under
+ * the cookie of the other. The sk_skb verdict program looks the cookie
+ * of the receiving socket up and redirects the data to the socket found
+ * there: the payload doesn't come to userspace anymore.
+ *
+ * The program runs on the sockets of another sockhash, under their own
+ * cookie: they only go there once both are in the first one, and leave
+ * it first, so it never looks up a peer which isn't there yet or
+ * anymore, which would drop the data.
+ *
+ * Data which arrived on a socket right before it got in the map is only
+ * seen by the program when more arrives, unless the socket is poked:
+ * setting SO_RCVLOWAT runs it.
+ *
+ * We only watch the sockets for their end: like in userspace, the
+ * client going away drops the connection, the server going away drops
+ * it once the kernel wrote to the client all that was received from
+ * the server, told by their TCP_INFO byte counters. The idle timeout
+ * comes from TCP_INFO too.
+ */
+
+#define BPF_INSN(c, d, s, o, i)						\
+  ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s),	\
+		     .off = (o), .imm = (i)})
+
+struct sockmap {
+  int map_fd; /* each socket under the cookie of its peer */
+  int run_fd; /* those the program runs on, under their own cookie */
+  int verdict_fd;
+  int parser_fd; /* only for kernels without BPF_SK_SKB_VERDICT */
+};
+
+struct sockmap_conn {
+  Client *cl;
+  struct event ev_client;
+  struct event ev_server;
+  struct event timer;
+  uint64_t client_cookie;
+  uint64_t server_cookie;
+  /* bytes received from the server but not written to the client, by us */
+  int64_t server_offset;
+  bool flushing; /* the server is gone, waiting for the client to get it all */
+  long flush_left; /* SOCKMAP_FLUSH_INTERVAL ticks left to flush */
+};
+
+static long bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+static int sockmap_prog_load(SocksLink *sl, struct bpf_insn *insns,
+			     size_t count)
+{
+  union bpf_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = (uintptr_t)insns;
+  attr.insn_cnt = count;
+  attr.license = (uintptr_t)"GPL";
+
+  fd = bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0)
+    pr_err(sl, "can't load the kernel relay program: %s", strerror(errno));
+  return fd;
+}
+
+static int sockmap_prog_attach(struct sockmap *sm, int prog_fd,
+			       enum bpf_attach_type type)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.target_fd = sm->run_fd;
+  attr.attach_bpf_fd = prog_fd;
+  attr.attach_type = type;
+  return bpf(BPF_PROG_ATTACH, &attr);
+}
+
+/* Redirect to the socket stored under our own cookie */
+static int sockmap_verdict_load(SocksLink *sl, struct sockmap *sm)
+{
+  struct bpf_insn insns[] = {
+    BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+    BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+    BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+    BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+    BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+	     sm->map_fd),
+    BPF_INSN(0, 0, 0, 0, 0),
+    BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+    BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8),
+    BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+    BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+    BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  sm->verdict_fd = sockmap_prog_load(sl, insns, ARRAY_SIZE(insns));
+  return sm->verdict_fd < 0 ? -1 : 0;
+}
+
+/* Older kernels want a stream parser: each skb is a message */
+static int sockmap_parser_load(SocksLink *sl, struct sockmap *sm)
+{
+  struct bpf_insn insns[] = {
+    BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1,
+	     offsetof(struct __sk_buff, len), 0),
+    BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  sm->parser_fd = sockmap_prog_load(sl, insns, ARRAY_SIZE(insns));
+  return sm->parser_fd < 0 ? -1 : 0;
+}
+
+static int sockmap_create(SocksLink *sl)
+{
+  union bpf_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+  attr.key_size = sizeof (uint64_t);
+  attr.value_size = sizeof (uint32_t);
+  attr.max_entries = SOCKMAP_MAX_SOCKETS;
+
+  fd = bpf(BPF_MAP_CREATE, &attr);
+  if (fd < 0)
+    pr_err(sl, "can't create the kernel relay map: %s", strerror(errno));
+  return fd;
+}
+
+static int sockmap_load(SocksLink *sl, struct sockmap *sm)
+{
+  sm->map_fd = sockmap_create(sl);
+  if (sm->map_fd < 0)
+    return -1;
+  sm->run_fd = sockmap_create(sl);
+  if (sm->run_fd < 0)
+    return -1;
+
+  if (sockmap_verdict_load(sl, sm))
+    return -1;
+
+  if (!sockmap_prog_attach(sm, sm->verdict_fd, BPF_SK_SKB_VERDICT))
+    return 0;
+
+  if (sockmap_parser_load(sl, sm) ||
+      sockmap_prog_attach(sm, sm->parser_fd, BPF_SK_SKB_STREAM_PARSER) ||
+      sockmap_prog_attach(sm, sm->verdict_fd, BPF_SK_SKB_STREAM_VERDICT)) {
+    pr_err(sl, "can't attach the kernel relay program: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int sockmap_update(int map_fd, uint64_t key, int fd)
+{
+  union bpf_attr attr;
+  uint32_t value = fd;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&value;
+  attr.flags = BPF_NOEXIST;
+  return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void sockmap_delete(int map_fd, uint64_t key)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* A plain TCP socket, without kTLS or any other upper layer */
+static bool sock_is_tcp(int fd)
+{
+  int protocol;
+  char ulp[16] = "";
+  socklen_t len = sizeof (protocol);
+
+  if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) ||
+      protocol != IPPROTO_TCP)
+    return false;
+
+  len = sizeof (ulp);
+  return getsockopt(fd, IPPROTO_TCP, TCP_ULP, ulp, &len) || !ulp[0];
+}
+
+static int sock_get_cookie(int fd, uint64_t *cookie)
+{
+  socklen_t len = sizeof (*cookie);
+
+  return getsockopt(fd, SOL_SOCKET, SO_COOKIE, cookie, &len);
+}
+
+/* Bytes received so far, and bytes written so far */
+static int sock_get_counters(int fd, uint64_t *received, uint64_t *written)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof (info);
+  int outq;
+
+  memset(&info, 0, sizeof (info));
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) ||
+      ioctl(fd, SIOCOUTQ, &outq))
+    return -1;
+
+  *received = info.tcpi_bytes_received;
+  *written = info.tcpi_bytes_acked + outq;
+  return 0;
+}
+
+/* Milliseconds since this socket received data */
+static uint32_t sock_get_idle(int fd)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof (info);
+
+  memset(&info, 0, sizeof (info));
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+    return 0;
+  return info.tcpi_last_data_recv;
+}
+
+/* Have the program read what's already queued */
+static void sock_poke(int fd)
+{
+  int lowat = 1;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof (lowat));
+}
+
+static void sockmap_timer_add(struct sockmap_conn *conn, long msec)
+{
+  struct timeval tv = {msec / 1000, (msec % 1000) * 1000};
+
+  event_add(&conn->timer, &tv);
+}
+
+/* Whether the client was written all that the server sent */
+static bool sockmap_flushed(struct sockmap_conn *conn)
+{
+  Client *cl = conn->cl;
+  uint64_t received, written, unused;
+
+  if (sock_get_counters(cl->server.fd, &received, &unused) ||
+      sock_get_counters(cl->client.fd, &unused, &written))
+    return true;
+
+  return (int64_t)(received - written) <= conn->server_offset;
+}
+
+static void on_sockmap_timer(int fd, short ev, void *arg)
+{
+  struct sockmap_conn *conn = arg;
+  Client *cl = conn->cl;
+  uint32_t idle;
+
+  if (conn->flushing) {
+    if (sockmap_flushed(conn) || !--conn->flush_left) {
+      prcl_debug(cl, "remote server disconnected");
+      client_drop(cl, false);
+    } else
+      sockmap_timer_add(conn, SOCKMAP_FLUSH_INTERVAL);
+    return ;
+  }
+
+  idle = sock_get_idle(cl->client.fd);
+  if (idle > sock_get_idle(cl->server.fd))
+    idle = sock_get_idle(cl->server.fd);
+
+  if (idle >= (long)cl->profile->io_timeout * 1000) {
+    prcl_debug(cl, "kernel relay timeout, disconnecting");
+    client_drop(cl, true);
+    return ;
+  }
+  sockmap_timer_add(conn, (long)cl->profile->io_timeout * 1000 - idle);
+}
+
+/*
+ * A socket became readable: it's closed, failed, or got data before
+ * the program saw it. Peeking at it would duplicate that data, ask TCP.
+ * Returns -1 on error, 0 on EOF.
+ */
+static int sockmap_check(Client *cl, int fd)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof (info);
+  int err = 0;
+
+  memset(&info, 0, sizeof (info));
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+    err = errno;
+  len = sizeof (err);
+  if (!err && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    err = errno;
+
+  if (err) {
+    prcl_debug(cl, "kernel relay socket error: %s", strerror(err));
+    return -1;
+  }
+  if (info.tcpi_state != BPF_TCP_ESTABLISHED)
+    return 0;
+
+  sock_poke(fd);
+  return 1;
+}
+
+static void on_sockmap_client(int fd, short ev, void *arg)
+{
+  struct sockmap_conn *conn = arg;
+  Client *cl = conn->cl;
+  int ret;
+
+  ret = sockmap_check(cl, fd);
+  if (ret > 0)
+    return ;
+
+  if (!ret)
+    pr_debug(cl->parent, "client disconnected");
+  client_drop(cl, ret < 0);
+}
+
+static void on_sockmap_server(int fd, short ev, void *arg)
+{
+  struct sockmap_conn *conn = arg;
+  Client *cl = conn->cl;
+  int ret;
+
+  ret = sockmap_check(cl, fd);
+  if (ret > 0)
+    return ;
+  if (ret < 0) {
+    client_drop(cl, true);
+    return ;
+  }
+
+  /* the rest is in the kernel, on its way to the client */
+  cl->server_eof = true;
+  event_del(&conn->ev_server);
+  event_del(&conn->timer);
+  conn->flushing = true;
+  conn->flush_left = (long)cl->profile->io_timeout * 1000 /
+    SOCKMAP_FLUSH_INTERVAL;
+  on_sockmap_timer(-1, 0, conn);
+}
+
+/*
+ * Bytes waiting in the receive queue of a socket: the program would get
+ * a packet we partly read whole again, the queue must be empty when the
+ * socket goes in the map
+ */
+static int sock_get_inq(int fd)
+{
+  int inq;
+
+  if (ioctl(fd, SIOCINQ, &inq))
+    return -1;
+  return inq;
+}
+
+/* Whether userspace still has data of this client, or will have */
+static bool sockmap_busy(Client *cl)
+{
+  return sock_get_inq(cl->client.fd) || sock_get_inq(cl->server.fd) ||
+    EVBUFFER_LENGTH(EVBUFFER_INPUT(cl->client.bufev)) ||
+    EVBUFFER_LENGTH(EVBUFFER_OUTPUT(cl->client.bufev)) ||
+    EVBUFFER_LENGTH(EVBUFFER_INPUT(cl->server.bufev)) ||
+    EVBUFFER_LENGTH(EVBUFFER_OUTPUT(cl->server.bufev));
+}
+
+static int sockmap_insert(Client *cl, struct sockmap_conn *conn)
+{
+  struct sockmap *sm = cl->parent->sockmap;
+  uint64_t received, written, unused;
+
+  if (sock_get_cookie(cl->client.fd, &conn->client_cookie) ||
+      sock_get_cookie(cl->server.fd, &conn->server_cookie) ||
+      sock_get_counters(cl->server.fd, &received, &unused) ||
+      sock_get_counters(cl->client.fd, &unused, &written))
+    return -1;
+  conn->server_offset = received - written;
+
+  if (sockmap_update(sm->map_fd, conn->server_cookie, cl->client.fd))
+    return -1;
+  if (sockmap_update(sm->map_fd, conn->client_cookie, cl->server.fd))
+    goto error;
+
+  /* both peers are there, the program may run */
+  if (sockmap_update(sm->run_fd, conn->client_cookie, cl->client.fd))
+    goto error;
+  if (sockmap_update(sm->run_fd, conn->server_cookie, cl->server.fd)) {
+    sockmap_delete(sm->run_fd, conn->client_cookie);
+    goto error;
+  }
+  return 0;
+
+ error:
+  sockmap_delete(sm->map_fd, conn->server_cookie);
+  sockmap_delete(sm->map_fd, conn->client_cookie);
+  return -1;
+}
+
+/*
+ * Both sides are streaming: hand them over to the kernel once our
+ * buffers are flushed, called again by the write callbacks until then
+ */
+void sockmap_offload(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  struct sockmap_conn *conn;
+
+  if (!sl->sockmap || cl->sockmap || cl->udp || cl->close ||
+      !cl->server.bufev)
+    return ;
+
+  if (!cl->sockmap_wait) {
+    if (!sock_is_tcp(cl->client.fd) || !sock_is_tcp(cl->server.fd))
+      return ;
+    cl->sockmap_wait = true;
+  }
+
+  if (sockmap_busy(cl))
+    return ;
+
+  conn = calloc(sizeof (*conn), 1);
+  if (!conn)
+    return ;
+
+  /* the sockets are the kernel's from now on, before more comes in */
+  bufferevent_disable(cl->client.bufev, EV_READ | EV_WRITE);
+  bufferevent_disable(cl->server.bufev, EV_READ | EV_WRITE);
+
+  if (sockmap_insert(cl, conn)) {
+    prcl_debug(cl, "can't relay in the kernel: %s", strerror(errno));
+    free(conn);
+    cl->sockmap_wait = false;
+    bufferevent_enable(cl->client.bufev, EV_READ | EV_WRITE);
+    bufferevent_enable(cl->server.bufev, EV_READ | EV_WRITE);
+    return ;
+  }
+
+  conn->cl = cl;
+  cl->sockmap = conn;
+  cl->sockmap_wait = false;
+
+  event_set(&conn->ev_client, cl->client.fd, EV_READ | EV_PERSIST,
+	    on_sockmap_client, conn);
+  event_base_set(sl->base, &conn->ev_client);
+  event_add(&conn->ev_client, NULL);
+  event_set(&conn->ev_server, cl->server.fd, EV_READ | EV_PERSIST,
+	    on_sockmap_server, conn);
+  event_base_set(sl->base, &conn->ev_server);
+  event_add(&conn->ev_server, NULL);
+  evtimer_set(&conn->timer, on_sockmap_timer, conn);
+  event_base_set(sl->base, &conn->timer);
+  sockmap_timer_add(conn, (long)cl->profile->io_timeout * 1000);
+
+  prcl_debug(cl, "stream relayed by the kernel");
+
+  sock_poke(cl->client.fd);
+  sock_poke(cl->server.fd);
+}
+
+void sockmap_release(Client *cl)
+{
+  struct sockmap *sm = cl->parent->sockmap;
+  struct sockmap_conn *conn = cl->sockmap;
+
+  if (!conn)
+    return ;
+
+  cl->sockmap = NULL;
+
+  /* the program stops before the peers go */
+  sockmap_delete(sm->run_fd, conn->client_cookie);
+  sockmap_delete(sm->run_fd, conn->server_cookie);
+  sockmap_delete(sm->map_fd, conn->server_cookie);
+  sockmap_delete(sm->map_fd, conn->client_cookie);
+  event_del(&conn->ev_client);
+  event_del(&conn->ev_server);
+  event_del(&conn->timer);
+  free(conn);
+}
+
+int sockmap_start(SocksLink *sl)
+{
+  struct sockmap *sm;
+
+  if (!sl->kernel_relay)
+    return 0;
+
+  sm = calloc(sizeof (*sm), 1);
+  if (!sm)
+    return -1;
+  sm->map_fd = -1;
+  sm->run_fd = -1;
+  sm->verdict_fd = -1;
+  sm->parser_fd = -1;
+  sl->sockmap = sm;
+
+  return sockmap_load(sl, sm);
+}
+
+void sockmap_stop(SocksLink *sl)
+{
+  struct sockmap *sm = sl->sockmap;
+
+  if (!sm)
+    return ;
+
+  if (sm->map_fd >= 0)
+    close(sm->map_fd);
+  if (sm->run_fd >= 0)
+    close(sm->run_fd);
+  if (sm->verdict_fd >= 0)
+    close(sm->verdict_fd);
+  if (sm->parser_fd >= 0)
+    close(sm->parser_fd);
+
+  free(sm);
+  sl->sockmap = NULL;
+}
+
+#else
+
+int sockmap_start(SocksLink *sl)
+{
+  if (!sl->kernel_relay)
+    return 0;
+
+  pr_err(sl, "the kernel relay is not supported on this system");
+  return -1;
+}
+
+void sockmap_stop(SocksLink *sl)
+{
+}
+
+void sockmap_offload(Client *cl)
+{
+}
+
+void sockmap_release(Client *cl)
+{
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SOCKMAP_H
+# define SOCKMAP_H
+
+#include "sockslink.h"
+#include "client.h"
+
+int sockmap_start(SocksLink *sl);
+void sockmap_stop(SocksLink *sl);
+
+void sockmap_offload(Client *cl);
+void sockmap_release(Client *cl);
+
+#endif /* !SOCKMAP_H */
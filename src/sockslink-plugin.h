@@ -0,0 +1,95 @@
+#ifndef SOCKSLINK_PLUGIN_H
+# define SOCKSLINK_PLUGIN_H
+
+/*
+ * In-process authentication and routing plugins
+ *
+ * A plugin is a shared object exporting a `struct sockslink_plugin`
+ * named `sockslink_plugin`. It is loaded with --plugin and takes the
+ * place of the external helper: clients it declines are still given
+ * to the helper (or the default next-hop).
+ *
+ * Everything is called from the event loop thread, and completions
+ * must be called from it too. A plugin running its own threads has to
+ * post the result back to `host->base` (an event_base) first.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+
+#define SOCKSLINK_PLUGIN_ABI		1
+#define SOCKSLINK_PLUGIN_SYMBOL		"sockslink_plugin"
+
+/* Authentication decisions */
+#define SOCKSLINK_AUTH_ALLOW		0
+#define SOCKSLINK_AUTH_DENY		1
+#define SOCKSLINK_AUTH_DECLINE		2 /* let the helper decide */
+
+/* SOCKS5 methods (RFC1928) */
+#define SOCKSLINK_METHOD_NONE		0x00
+#define SOCKSLINK_METHOD_USERNAME	0x02
+
+struct sockslink_plugin_host {
+  unsigned int abi;
+  void *base;		/* struct event_base * of the event loop */
+  int verbose;
+};
+
+/* Opaque, one per authentication request */
+typedef struct sockslink_auth_request sockslink_auth_request;
+
+/*
+ * Must be called exactly once per request, error is only used with
+ * SOCKSLINK_AUTH_DENY and may be NULL
+ */
+typedef void (*sockslink_auth_completion)(sockslink_auth_request *req,
+					  int status, const char *error);
+
+/*
+ * Where an allowed client goes, leave nexthop NULL to use the default
+ * next-hop. Credentials are copied, and are only used with
+ * SOCKSLINK_METHOD_USERNAME.
+ */
+struct sockslink_route {
+  const struct sockaddr *nexthop;
+  socklen_t nexthop_len;
+  uint8_t method;
+  const uint8_t *username;
+  uint8_t ulen;
+  const uint8_t *password;
+  uint8_t plen;
+};
+
+struct sockslink_plugin {
+  unsigned int abi;		/* SOCKSLINK_PLUGIN_ABI */
+  const char *name;
+
+  /* optional, arg is --plugin-arg (or NULL), returns 0 on success */
+  int (*init)(const struct sockslink_plugin_host *host, const char *arg,
+	      void **priv);
+  /* optional */
+  void (*fini)(void *priv);
+
+  /*
+   * method is the one negociated with the client, user and pass are
+   * only valid until this function returns
+   */
+  void (*authenticate)(void *priv, sockslink_auth_request *req,
+		       const struct sockaddr *source, socklen_t sourcelen,
+		       uint8_t method,
+		       const uint8_t *user, size_t ulen,
+		       const uint8_t *pass, size_t plen,
+		       sockslink_auth_completion completion);
+
+  /*
+   * optional, called synchronously for allowed clients. Return 0 after
+   * filling route, or -1 to forward the client credentials to the
+   * default next-hop.
+   */
+  int (*route)(void *priv, const struct sockaddr *source, socklen_t sourcelen,
+	       const uint8_t *user, size_t ulen,
+	       struct sockslink_route *route);
+};
+
+#endif /* !SOCKSLINK_PLUGIN_H */
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "userdb.h"
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: %s <users> <database>\n", program_invocation_short_name);
+  fprintf(stderr, "Compile a users file for sockslinkd --users-file\n"
+	  "\n"
+	  "Each line of <users> is 'username:password[:next-hop]', lines\n"
+	  "starting with '#' are ignored. <database> is atomically replaced,\n"
+	  "send SIGHUP to sockslinkd to reload it.\n"
+	  );
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *fp;
+  int lineno = 0;
+  int ret;
+
+  if (argc != 3 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+    usage();
+    return argc == 3 ? 0 : 1;
+  }
+
+  fp = fopen(argv[1], "r");
+  if (!fp) {
+    fprintf(stderr, "%s: can't open '%s': %s\n", program_invocation_short_name,
+	    argv[1], strerror(errno));
+    return 1;
+  }
+
+  ret = userdb_compile(fp, argv[2], &lineno);
+
+  if (ret && errno == EINVAL)
+    fprintf(stderr, "%s: %s:%d: invalid line\n", program_invocation_short_name,
+	    argv[1], lineno);
+  else if (ret && errno == EEXIST)
+    fprintf(stderr, "%s: %s:%d: duplicate user\n", program_invocation_short_name,
+	    argv[1], lineno);
+  else if (ret)
+    fprintf(stderr, "%s: can't write '%s': %s\n", program_invocation_short_name,
+	    argv[2], strerror(errno));
+
+  fclose(fp);
+  return ret ? 1 : 0;
+}
@@ -19,7 +19,27 @@
 
 #include "sockslink.h"
 #include "client.h"
+#include "server.h"
 #include "helper.h"
+#include "plugin.h"
+#include "users.h"
+#include "routes.h"
+#include "aliases.h"
+#include "rules.h"
+#include "pamauth.h"
+#include "destinations.h"
+#include "udp.h"
+#include "mux.h"
+#include "stripe.h"
+#include "hop.h"
+#include "zlink.h"
+#include "tls.h"
+#include "sockmap.h"
+#include "autobuf.h"
+#include "source.h"
+#include "profile.h"
+#include "wheel.h"
+#include "admit.h"
 #include "log.h"
 #include "config.h"
 #include "utils.h"
@@ -41,27 +61,6 @@ static void sig_sigaction(int sig, siginfo_t *infos, void *ctx)
       sl->exiting = true;
     }
     break ;
-  case SIGCHLD:
-    {
-      int status;
-      Helper *helper, *tmp;
-
-      if (infos->si_pid != waitpid(infos->si_pid, &status, WNOHANG))
-	break ;
-
-      list_for_each_entry(sl, &servers, next, SocksLink) {
-	list_for_each_entry_safe(helper, tmp, &sl->helpers, next, Helper)
-	  if (helper->pid == infos->si_pid)
-	    helper->dying = true;
-      }
-    }
-    break ;
-  case SIGHUP:
-    list_for_each_entry(sl, &servers, next, SocksLink) {
-      sl->helpers_reload = true;
-      helpers_refill_pool(sl);
-    }
-    break ;
   case SIGUSR1: /* Show current connections */
     {
       int i = 0;
@@ -71,6 +70,8 @@ static void sig_sigaction(int sig, siginfo_t *infos, void *ctx)
       list_for_each_entry(sl, &servers, next, SocksLink) {
 	fprintf(stdout, "sockslinkd #%d\n", i++);
 	fprintf(stdout, "==============\n");
+	if (sl->name)
+	  fprintf(stdout, "listener:   %s\n", sl->name);
 	fprintf(stdout, "listen on:\n");
 	for (int j = 0; j < SOCKSLINK_LISTEN_FD_MAX && sl->fd[j] != -1; ++j)
 	  fprintf(stdout, "%s:%s - #%d", sl->addresses[j],
@@ -110,6 +111,7 @@ static void sig_sigaction(int sig, siginfo_t *infos, void *ctx)
 		  client->close, client->authenticated,
 		  client->client_method, client->server_method);
 	}
+	source_dump(sl, stdout);
 	fprintf(stdout, "helpers:\n");
 	fprintf(stdout, "--------\n");
 	list_for_each_entry(helper, &sl->helpers, next, Helper) {
@@ -140,17 +142,11 @@ static int setup_sigactions(void)
   memset(&sa, 0, sizeof (sa));
   sigemptyset(&sa.sa_mask);
   sigaddset(&sa.sa_mask, SIGPIPE);
-  sigaddset(&sa.sa_mask, SIGCHLD);
   sigaddset(&sa.sa_mask, SIGINT);
-  sigaddset(&sa.sa_mask, SIGHUP);
   sigaddset(&sa.sa_mask, SIGUSR1);
 
-  sa.sa_flags = SA_NOCLDSTOP|SA_SIGINFO;
+  sa.sa_flags = SA_SIGINFO;
   sa.sa_sigaction = sig_sigaction;
-  ret = sigaction(SIGCHLD, &sa, NULL);
-  if (ret)
-    goto error;
-
   ret = sigaction(SIGPIPE, &sa, NULL);
   if (ret)
     goto error;
@@ -159,10 +155,6 @@ static int setup_sigactions(void)
   if (ret)
     goto error;
 
-  ret = sigaction(SIGHUP, &sa, NULL);
-  if (ret)
-    goto error;
-
   ret = sigaction(SIGUSR1, &sa, NULL);
   if (ret)
     goto error;
@@ -173,10 +165,8 @@ static int setup_sigactions(void)
   return ret;
 }
 
-int sockslink_init(SocksLink *sl)
+static void sockslink_defaults(SocksLink *sl)
 {
-  int ret = 0;
-
   memset(sl, 0, sizeof (*sl));
   memset(sl->fd, -1, sizeof (sl->fd));
   memset(sl->methods, AUTH_METHOD_INVALID, sizeof (sl->methods));
@@ -184,8 +174,27 @@ int sockslink_init(SocksLink *sl)
   INIT_LIST_HEAD(&sl->clients);
   INIT_LIST_HEAD(&sl->next);
   INIT_LIST_HEAD(&sl->helpers);
+  INIT_LIST_HEAD(&sl->helpers_zombies);
+  INIT_LIST_HEAD(&sl->auth_queue);
+  INIT_LIST_HEAD(&sl->profiles);
+  INIT_LIST_HEAD(&sl->listeners);
+  INIT_LIST_HEAD(&sl->listener);
+  INIT_LIST_HEAD(&sl->handshakes);
+  sl->auth_queue_max = -1;
+}
+
+int sockslink_init(SocksLink *sl)
+{
+  int ret = 0;
 
-  sl->base = event_base_new();
+  sockslink_defaults(sl);
+
+  /*
+   * bufferevent_new() binds new bufferevents to the current base
+   * before bufferevent_base_set() is called, and only event_init()
+   * sets it on libevent 2
+   */
+  sl->base = event_init();
   if (!sl->base) {
     pr_err(sl, "can't initialize libevent");
     ret = -1;
@@ -205,72 +214,197 @@ error:
   return ret;
 }
 
+/*
+ * A virtual listener, with its own addresses, methods, next-hop, helpers
+ * and tuning, served by the loop of sl. Process-wide settings are those
+ * of sl.
+ */
+SocksLink *sockslink_new_listener(SocksLink *sl, const char *name)
+{
+  SocksLink *vl;
+
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    if (!strcmp(vl->name, name)) {
+      pr_err(sl, "listener '%s' already defined", name);
+      return NULL;
+    }
+
+  vl = malloc(sizeof (*vl));
+  if (!vl)
+    return NULL;
+
+  sockslink_defaults(vl);
+  vl->name = strdup(name);
+  if (!vl->name) {
+    free(vl);
+    return NULL;
+  }
+  vl->master = sl;
+  vl->base = sl->base;
+  vl->verbose = sl->verbose;
+  vl->fg = sl->fg;
+  vl->pidfd = -1;
+
+  list_add_tail(&vl->listener, &sl->listeners);
+  list_add_tail(&vl->next, &servers);
+  return vl;
+}
+
 void sockslink_clear(SocksLink *sl)
 {
+  SocksLink *vl, *tmp;
+
+  list_for_each_entry_safe(vl, tmp, &sl->listeners, listener, SocksLink) {
+    sockslink_clear(vl);
+    free(vl);
+  }
+
   free((char *)sl->username);
   free((char *)sl->groupname);
   free((char *)sl->conf);
   free((char *)sl->port);
   free((char *)sl->helper_command);
-
-  for (int i = 0; i < ARRAY_SIZE(sl->addresses); ++i)
+  free((char *)sl->helper_socket);
+  free((char *)sl->plugin_path);
+  free((char *)sl->plugin_arg);
+  free((char *)sl->users_file);
+  free((char *)sl->routes_file);
+  free((char *)sl->aliases_file);
+  free((char *)sl->rules_file);
+  free((char *)sl->pam_service);
+  free((char *)sl->destinations_file);
+  free((char *)sl->hop_accept);
+  free((char *)sl->tls_port);
+  free((char *)sl->tls_cert);
+  free((char *)sl->tls_key);
+  free((char *)sl->tls_ca);
+  free((char *)sl->tls_name);
+  free((char *)sl->source);
+
+  for (int i = 0; i < ARRAY_SIZE(sl->addresses); ++i) {
     free((char *)sl->addresses[i]);
+    free((char *)sl->address_profiles[i]);
+  }
+  profile_free_all(sl);
 
   pr_debug(sl, "clearing sockslink");
-  event_base_free(sl->base);
+  if (!sl->master)
+    event_base_free(sl->base);
+  list_del_init(&sl->listener);
   list_del_init(&sl->next);
+  free((char *)sl->name);
+}
+
+/*
+ * SIGCHLD is delivered through libevent, so we can safely walk
+ * the helper lists from here
+ */
+static void on_sigchld(int sig, short ev, void *arg)
+{
+  SocksLink *sl = arg;
+
+  helpers_reap(sl);
+}
+
+static void sockslink_reload(SocksLink *sl)
+{
+  sl->helpers_reload = true;
+  helpers_refill_pool(sl);
+  users_reload(sl);
+  routes_reload(sl);
+  aliases_reload(sl);
+  rules_reload(sl);
+  destinations_reload(sl);
+}
+
+/* Reload helpers and tables, of the virtual listeners too */
+static void on_sighup(int sig, short ev, void *arg)
+{
+  SocksLink *sl = arg;
+  SocksLink *vl;
+
+  sockslink_reload(sl);
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    sockslink_reload(vl);
+}
+
+/* The profile of the listener of this fd */
+static const struct profile *sockslink_fd_profile(SocksLink *sl, int afd)
+{
+  for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX && sl->fd[i] != -1; ++i)
+    if (sl->fd[i] == afd)
+      return sl->fd_profile[i];
+  return profile_find(sl, NULL);
 }
 
 static void on_accept(int afd, short ev, void *arg)
 {
   SocksLink *sl = arg;
+  const struct profile *profile = sockslink_fd_profile(sl, afd);
   Client *client;
   int fd;
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
 
+  if (admit_overloaded(sl)) {
+    admit_reject(sl, afd, false);
+    return;
+  }
+
   fd = accept(afd, (struct sockaddr *)&addr, &addrlen);
   if (fd == -1) {
-    pr_warn(sl, "accept failed: %s", strerror(errno));
+    admit_accept_failed(sl, afd, false, errno);
     return;
   }
 
   if (sock_set_nonblock(fd) < 0)
     pr_warn(sl, "failed to set client socket non-blocking: %s", strerror(errno));
 
-  //if (sock_set_tcpnodelay(fd, 1) < 0)
-  //  pr_warn(sl, "failed to set client socket tcp nodelay: %s", strerror(errno));
+  /* failures were reported for the listener */
+  profile_apply(profile, fd);
 
-  client = client_new(sl, fd, &addr, addrlen);
-  if (!client) {
+  /* the client may already be gone when this returns */
+  client = client_new(sl, fd, &addr, addrlen, profile);
+  if (!client)
     close(fd);
-    return ;
-  }
-
-  prcl_infos(client, "client connected #%d", client->client.fd);
 }
 
-int sockslink_start(SocksLink *sl)
+/* Clients of a TLS listener become clients once the handshake is done */
+static void on_accept_tls(int afd, short ev, void *arg)
 {
-  int ret;
-  int n = 0;
+  SocksLink *sl = arg;
+  const struct profile *profile = sockslink_fd_profile(sl, afd);
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
 
-  pr_debug(sl, "starting sockslink");
+  if (admit_overloaded(sl)) {
+    admit_reject(sl, afd, true);
+    return;
+  }
 
-  if (getuid() == 0) {
-    sl->fds_max = set_maxfds(sl->fds_max);
+  fd = accept(afd, (struct sockaddr *)&addr, &addrlen);
+  if (fd == -1) {
+    admit_accept_failed(sl, afd, true, errno);
+    return;
+  }
 
-    if (sl->fds_max < 0)
-      pr_err(sl, "error while getting/setting maximum number of open"
-	     "file descriptors: %s", strerror(errno));
-    else
-      pr_debug(sl, "can open up to %d fds", sl->fds_max);
+  if (sock_set_nonblock(fd) < 0)
+    pr_warn(sl, "failed to set client socket non-blocking: %s", strerror(errno));
 
-    if (sl->cores)
-      enable_cores(sl->cores);
-  }
+  profile_apply(profile, fd);
+
+  if (tls_accept(sl, fd, &addr, addrlen, profile))
+    close(fd);
+}
+
+/* Listen on each address at this port, returns the number of fds */
+static int sockslink_listen(SocksLink *sl, const char *port, bool tls, int n)
+{
+  int ret;
 
   for (int i = 0; sl->addresses[i]; ++i) {
+    const struct profile *profile = profile_find(sl, sl->address_profiles[i]);
     struct addrinfo hints;
     struct addrinfo *result, *rp;
 
@@ -281,12 +415,12 @@ int sockslink_start(SocksLink *sl)
     hints.ai_protocol = IPPROTO_TCP;
 
     pr_debug(sl, "trying to listen on iface: %s port: %s",
-	     sl->addresses[i], sl->port);
-    ret = getaddrinfo(sl->addresses[i], sl->port, &hints, &result);
+	     sl->addresses[i], port);
+    ret = getaddrinfo(sl->addresses[i], port, &hints, &result);
 
     if (ret != 0) {
       pr_err(sl, "getaddrinfo(\"%s\", \"%s\"): %s", sl->addresses[i],
-	     sl->port, gai_strerror(ret));
+	     port, gai_strerror(ret));
       continue ;
     }
 
@@ -301,7 +435,8 @@ int sockslink_start(SocksLink *sl)
 
 	  sin = ((struct sockaddr_in *)rp->ai_addr);
 	  inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof (buf));
-	  pr_infos(sl, "listenning on %s:%d", buf, ntohs(sin->sin_port));
+	  pr_infos(sl, "listenning on %s:%d%s", buf, ntohs(sin->sin_port),
+		   tls ? " (TLS)" : "");
 	}
 	break ;
 #ifdef HAVE_IPV6
@@ -312,7 +447,8 @@ int sockslink_start(SocksLink *sl)
 
 	  sin6 = ((struct sockaddr_in6 *)rp->ai_addr);
 	  inet_ntop(rp->ai_family, &sin6->sin6_addr, buf, sizeof (buf));
-	  pr_infos(sl, "listenning on [%s]:%d", buf, ntohs(sin6->sin6_port));
+	  pr_infos(sl, "listenning on [%s]:%d%s", buf, ntohs(sin6->sin6_port),
+		   tls ? " (TLS)" : "");
 	}
 	break ;
 #endif
@@ -359,6 +495,11 @@ int sockslink_start(SocksLink *sl)
 	goto error_continue;
       }
 
+      /* accepted sockets get the options again, this reports failures */
+      if (profile_apply(profile, fd))
+	pr_warn(sl, "can't set all the options of profile '%s': %s",
+		profile->name, strerror(errno));
+
       ret = listen(fd, 5);
 
       if (ret < 0) {
@@ -366,6 +507,8 @@ int sockslink_start(SocksLink *sl)
 	goto error_continue;
       }
 
+      sl->fd_tls[n] = tls;
+      sl->fd_profile[n] = profile;
       sl->fd[n++] = fd;
       continue ;
     error_continue:
@@ -375,10 +518,108 @@ int sockslink_start(SocksLink *sl)
     freeaddrinfo(result);
   }
 
+  return n;
+}
+
+/* Listen on the main and TLS ports of sl */
+static int sockslink_listen_all(SocksLink *sl)
+{
+  int n = 0;
+
+  n = sockslink_listen(sl, sl->port, false, n);
+  if (sl->tls_port)
+    n = sockslink_listen(sl, sl->tls_port, true, n);
+
   if (n == 0) {
     pr_err(sl, "can't listen on any specified interface, exiting");
     return -1;
   }
+  return 0;
+}
+
+/* Files, plugins and links of sl, once daemonized */
+static int sockslink_load(SocksLink *sl)
+{
+  /* after daemonize(), plugins may start threads */
+  if (plugin_load(sl))
+    return -1;
+
+  if (pamauth_load(sl))
+    return -1;
+
+  if (users_load(sl))
+    return -1;
+
+  if (routes_load(sl))
+    return -1;
+
+  if (aliases_load(sl))
+    return -1;
+
+  if (rules_load(sl))
+    return -1;
+
+  if (destinations_load(sl))
+    return -1;
+
+  if (udp_start(sl))
+    return -1;
+
+  if (hop_start(sl))
+    return -1;
+
+  if (zlink_start(sl))
+    return -1;
+
+  if (tls_start(sl))
+    return -1;
+
+  if (sockmap_start(sl))
+    return -1;
+
+  if (source_start(sl))
+    return -1;
+
+  return 0;
+}
+
+static void sockslink_accept(SocksLink *sl)
+{
+  for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX && sl->fd[i] != -1; ++i) {
+    event_set(&sl->ev_accept[i], sl->fd[i], EV_READ|EV_PERSIST,
+	      sl->fd_tls[i] ? on_accept_tls : on_accept, sl);
+    event_base_set(sl->base, &sl->ev_accept[i]);
+    event_add(&sl->ev_accept[i], NULL);
+  }
+
+  helpers_start_pool(sl);
+}
+
+int sockslink_start(SocksLink *sl)
+{
+  SocksLink *vl;
+  int ret;
+
+  pr_debug(sl, "starting sockslink");
+
+  if (getuid() == 0) {
+    sl->fds_max = set_maxfds(sl->fds_max);
+
+    if (sl->fds_max < 0)
+      pr_err(sl, "error while getting/setting maximum number of open"
+	     "file descriptors: %s", strerror(errno));
+    else
+      pr_debug(sl, "can open up to %d fds", sl->fds_max);
+
+    if (sl->cores)
+      enable_cores(sl->cores);
+  }
+
+  if (sockslink_listen_all(sl))
+    return -1;
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    if (sockslink_listen_all(vl))
+      return -1;
 
   if (sl->pid) {
     ret = open(sl->pid, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -419,6 +660,15 @@ int sockslink_start(SocksLink *sl)
     }
   }
 
+  if (wheel_start(sl))
+    return -1;
+
+  if (sockslink_load(sl))
+    return -1;
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    if (sockslink_load(vl))
+      return -1;
+
   ret = drop_privileges(sl->username, sl->groupname);
   if (ret) {
     pr_err(sl, "failed to drop privileges (%s:%s): %s",
@@ -436,25 +686,33 @@ int sockslink_start(SocksLink *sl)
     sl->pidfd = -1;
   }
 
-  for (int i = 0; i < n; ++i) {
-    if (sl->fd[i] == -1)
-      continue ;
-    n++;
-    event_set(&sl->ev_accept[i], sl->fd[i], EV_READ|EV_PERSIST, on_accept, sl);
-    event_base_set(sl->base, &sl->ev_accept[i]);
-    event_add(&sl->ev_accept[i], NULL);
-  }
+  signal_set(&sl->sigchld_event, SIGCHLD, on_sigchld, sl);
+  event_base_set(sl->base, &sl->sigchld_event);
+  signal_add(&sl->sigchld_event, NULL);
 
-  helpers_start_pool(sl);
+  signal_set(&sl->sighup_event, SIGHUP, on_sighup, sl);
+  event_base_set(sl->base, &sl->sighup_event);
+  signal_add(&sl->sighup_event, NULL);
 
+  /* before the helpers, which report their fds */
+  if (admit_start(sl))
+    return -1;
+
+  sockslink_accept(sl);
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    sockslink_accept(vl);
   return 0;
 }
 
 int sockslink_stop(SocksLink *sl)
 {
   int ret = 0;
+  SocksLink *vl;
   Client *client, *ctmp;
 
+  list_for_each_entry(vl, &sl->listeners, listener, SocksLink)
+    sockslink_stop(vl);
+
   pr_infos(sl, "stopping sockslink");
 
   list_for_each_entry_safe(client, ctmp, &sl->clients, next, Client)
@@ -463,12 +721,38 @@ int sockslink_stop(SocksLink *sl)
   for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX; ++i) {
     if (sl->fd[i] == -1)
       continue ;
-    event_del(&sl->ev_accept[i]);
+    if (event_initialized(&sl->ev_accept[i]))
+      event_del(&sl->ev_accept[i]);
     close(sl->fd[i]);
     sl->fd[i] = -1;
   }
 
   helpers_stop_pool(sl);
+  plugin_unload(sl);
+  pamauth_unload(sl);
+  users_unload(sl);
+  routes_unload(sl);
+  aliases_unload(sl);
+  rules_unload(sl);
+  destinations_unload(sl);
+  udp_stop(sl);
+  mux_stop(sl);
+  stripe_stop(sl);
+  hop_stop(sl);
+  zlink_stop(sl);
+  tls_stop(sl);
+  sockmap_stop(sl);
+  autobuf_stop(sl);
+  source_stop(sl);
+
+  server_shutdown(sl);
+  wheel_stop(sl);
+  admit_stop(sl);
+
+  if (signal_initialized(&sl->sigchld_event))
+    signal_del(&sl->sigchld_event);
+  if (signal_initialized(&sl->sighup_event))
+    signal_del(&sl->sighup_event);
   return ret;
 }
 
@@ -9,12 +9,15 @@
 #include "event-compat.h"
 
 #include "list.h"
+#include "wheel.h"
 
 #define SOCKS5_VER		0x05
 
 #define AUTH_METHOD_NONE	0x00
 #define AUTH_METHOD_GSSAPI	0x01
 #define AUTH_METHOD_USERNAME	0x02
+#define AUTH_METHOD_HOP		0x88	/* private, between sockslinkd */
+#define AUTH_METHOD_HOP_ZLIB	0x89	/* same, on a compressed link */
 #define AUTH_METHOD_INVALID	0xFF
 
 #ifndef ARRAY_SIZE
@@ -31,12 +34,17 @@ struct helper {
   pid_t pid;
   bool running; /* helper is up and running */
   bool dying;   /* helper is dying */
+  bool socket;  /* connection to an auth service, not a process */
+  int conn;     /* index of that connection, for logs */
   int stdin;
   int stdout;
   int stderr;
   struct bufferevent *bufev_in;
   struct bufferevent *bufev_out;
   struct bufferevent *bufev_err;
+  struct event kill_event;
+  struct wheel_timer timeout; /* of the requests it was given */
+  unsigned long active; /* tick of its last reply */
   struct list_head next;
 };
 
@@ -61,6 +69,8 @@ struct sockslink {
   /* Network config */
   const char *port;
   const char *addresses[SOCKSLINK_LISTEN_FD_MAX];
+  const char *address_profiles[SOCKSLINK_LISTEN_FD_MAX]; /* after '@' */
+  struct list_head profiles;
   struct sockaddr_storage nexthop_addr;
   socklen_t nexthop_addrlen;
   const char *nexthop_port;
@@ -70,20 +80,131 @@ struct sockslink {
 
   /* network and libevent */
   struct event_base *base;
+  struct wheel *wheel; /* timeouts, of the main SocksLink only */
   int fd[SOCKSLINK_LISTEN_FD_MAX];
+  bool fd_tls[SOCKSLINK_LISTEN_FD_MAX]; /* listening on tls_port */
+  const struct profile *fd_profile[SOCKSLINK_LISTEN_FD_MAX];
   struct event ev_accept[SOCKSLINK_LISTEN_FD_MAX];
+  bool accept_paused; /* ev_accept removed while overloaded */
+
+  /* Admission control */
+  bool overload_reject;
+  struct admit *admit; /* of the main SocksLink only */
+  struct list_head handshakes; /* clients not streaming, oldest first */
+  int handshakes_len;
 
   /* Clients */
   struct list_head clients;
   int fds_max;
+  struct autobufs *autobufs; /* adaptive clients, of the main SocksLink only */
 
   /* Helpers */
   const char *helper_command;
+  const char *helper_socket;
+  int helper_conns; /* connections made to the auth service */
   int helpers_max;
+  int helpers_backoff;
   int helpers_running;
   bool helpers_reload;
   struct list_head helpers;
+  struct list_head helpers_zombies; /* killed, waiting for SIGCHLD */
   struct event helper_refill_event;
+  struct list_head auth_queue; /* clients waiting for a running helper */
+  int auth_queue_len;
+  int auth_queue_max;
+  int auth_pending; /* requests sent to helpers, not answered yet */
+  bool auth_over; /* queue or helpers full, not back under ADMIT_AUTH_LOW */
+  unsigned int auth_id;
+  struct event auth_queue_event;
+  struct event sigchld_event;
+  struct event sighup_event;
+
+  /* In-process plugin */
+  const char *plugin_path;
+  const char *plugin_arg;
+  void *plugin_handle;
+  const struct sockslink_plugin *plugin;
+  void *plugin_priv;
+
+  /* Users file */
+  const char *users_file;
+  struct users *users;
+
+  /* Source address routes */
+  const char *routes_file;
+  struct routes *routes;
+
+  /* user@alias next-hops */
+  const char *aliases_file;
+  struct aliases *aliases;
+
+  /* Authentication and routing rules */
+  const char *rules_file;
+  struct rules *rules;
+
+  /* PAM authentication */
+  const char *pam_service;
+  int pam_workers;
+  struct pam_pool *pam;
+
+  /* Destination routes */
+  const char *destinations_file;
+  struct destinations *destinations;
+
+  /* Tunnels between sockslinkd instances */
+  int mux_tunnels;
+  bool mux_accept;
+  struct mux *mux;
+
+  /* Striped connections between sockslinkd instances */
+  int stripe_links;
+  bool stripe_accept;
+  struct stripes *stripes;
+
+  /* One-shot handshake between sockslinkd instances */
+  bool hop;
+  const char *hop_accept;
+  struct hops *hops;
+
+  /* Compressed links between sockslinkd instances */
+  bool compress;
+  struct zlinks *zlinks;
+
+  /* TLS listeners and next-hop connections */
+  const char *tls_port;
+  const char *tls_cert;
+  const char *tls_key;
+  bool tls_nexthop;
+  const char *tls_ca;
+  const char *tls_name;
+  struct tls *tls;
+
+  /* Streams relayed in the kernel */
+  bool kernel_relay;
+  struct sockmap *sockmap;
+
+  /* Outbound source addresses */
+  const char *source;
+  bool source_hash;
+  bool reset_aborted;
+  struct sources *sources;
+
+  /* UDP ASSOCIATE */
+  bool udp;
+  struct udp_relay *udp_relay;
+
+  /* Resolver for direct connections */
+#ifdef HAVE_EVDNS_GETADDRINFO
+  struct evdns_base *dns;
+#else
+  bool dns;
+#endif
+
+  /* Virtual listeners, [name] sections of the configuration file */
+  const char *name; /* NULL for the main one */
+  struct sockslink *master; /* main one, whose loop and resolver they share */
+  struct list_head listeners; /* of the main one */
+  struct list_head listener;
 
   /* To chain SocksLinks */
   struct list_head next;
@@ -92,6 +213,7 @@ struct sockslink {
 typedef struct sockslink SocksLink;
 
 int sockslink_init(SocksLink *sl);
+SocksLink *sockslink_new_listener(SocksLink *sl, const char *name);
 int sockslink_loop(SocksLink *sl);
 int sockslink_start(SocksLink *sl);
 int sockslink_stop(SocksLink *sl);
@@ -0,0 +1,239 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "source.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Outbound source addresses
+ *
+ * With --source, connections to next-hops and destinations are bound to
+ * one of the given local addresses (of the family of the remote one),
+ * picked round-robin or, with --source-hash, by hashing the client
+ * address so a client keeps its source. Every address has its own
+ * ephemeral ports for each remote ip:port: a pool of N addresses gives
+ * N times more connections before running out of ports.
+ *
+ * Sockets are bound with IP_BIND_ADDRESS_NO_PORT, so that the port is
+ * only chosen by connect(), knowing the remote ip:port: bind() alone
+ * would need a port unique to the local address. When connect() has no
+ * port left, the next address of the pool is tried.
+ */
+
+struct source_addr {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  unsigned int active; /* ports used by current connections */
+  unsigned long connects;
+  unsigned long exhausted; /* connect() found no port left */
+};
+
+struct sources {
+  struct source_addr *addrs;
+  int count;
+  unsigned int next; /* round-robin cursor */
+};
+
+/* A numeric IPv4 or IPv6 address, with port 0 */
+static int source_parse(const char *str, struct source_addr *src)
+{
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(str, "0", &hints, &result))
+    return -1;
+
+  memcpy(&src->addr, result->ai_addr, result->ai_addrlen);
+  src->addrlen = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+int source_start(SocksLink *sl)
+{
+  struct sources *sources;
+  struct source_addr *src;
+  char *list, *tok, *save;
+  const char *p;
+  int count = 1;
+
+  if (!sl->source)
+    return 0;
+
+  for (p = sl->source; *p; ++p)
+    count += *p == ',';
+
+  sources = calloc(sizeof (*sources), 1);
+  if (!sources)
+    return -1;
+  sl->sources = sources;
+
+  sources->addrs = calloc(sizeof (*sources->addrs), count);
+  list = strdup(sl->source);
+  if (!sources->addrs || !list) {
+    free(list);
+    return -1;
+  }
+
+  for (tok = strtok_r(list, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    src = &sources->addrs[sources->count];
+    if (source_parse(tok, src)) {
+      pr_err(sl, "invalid address in --source: '%s'", tok);
+      free(list);
+      return -1;
+    }
+    sources->count++;
+  }
+
+  free(list);
+  return 0;
+}
+
+void source_stop(SocksLink *sl)
+{
+  struct sources *sources = sl->sources;
+
+  if (!sources)
+    return ;
+
+  free(sources->addrs);
+  free(sources);
+  sl->sources = NULL;
+}
+
+static unsigned int source_hash(const struct sockaddr_storage *addr)
+{
+  const uint8_t *bytes;
+  size_t len;
+
+  if (addr->ss_family == AF_INET6) {
+    bytes = (const uint8_t *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+    len = sizeof (struct in6_addr);
+  } else {
+    bytes = (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+    len = sizeof (struct in_addr);
+  }
+
+  return hash_fnv1a(HASH_FNV1A_INIT, bytes, len);
+}
+
+/* The n-th address of this family after start, NULL if there is none */
+static struct source_addr *source_pick(struct sources *sources, int family,
+				       unsigned int start, int n)
+{
+  struct source_addr *src;
+  int i, matches = 0;
+
+  for (i = 0; i < sources->count; ++i)
+    matches += sources->addrs[i].addr.ss_family == family;
+  if (n >= matches)
+    return NULL;
+
+  n = (start + n) % matches;
+  for (i = 0; i < sources->count; ++i) {
+    src = &sources->addrs[i];
+    if (src->addr.ss_family == family && !n--)
+      return src;
+  }
+  return NULL;
+}
+
+/*
+ * Bind a socket about to connect to the family to the next address of
+ * the pool, attempt counting the addresses which had no port left. The
+ * socket is left alone without addresses of this family, and -1 is
+ * returned with EADDRNOTAVAIL once they were all tried.
+ */
+int source_bind(Client *cl, int fd, int family, int attempt)
+{
+  SocksLink *sl = cl->parent;
+  struct sources *sources = sl->sources;
+  struct source_addr *src;
+  char buf[ADDR_NTOP_BUFSIZ];
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  int on = 1;
+#endif
+
+  if (!sources || !source_pick(sources, family, 0, 0))
+    return 0;
+
+  source_release(cl);
+  if (!attempt)
+    cl->source_start = sl->source_hash ? source_hash(&cl->client.addr) :
+      sources->next++;
+
+  src = source_pick(sources, family, cl->source_start, attempt);
+  if (!src) {
+    errno = EADDRNOTAVAIL;
+    return -1;
+  }
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof (on));
+#endif
+
+  if (bind(fd, (const struct sockaddr *)&src->addr, src->addrlen)) {
+    prcl_err(cl, "can't bind to source address %s: %s",
+	     addr_ntop(&src->addr, buf, sizeof (buf)), strerror(errno));
+    return -1;
+  }
+
+  src->connects++;
+  src->active++;
+  cl->source = src;
+  return 0;
+}
+
+/* connect() found no port left from the address the socket is bound to */
+void source_exhausted(Client *cl)
+{
+  if (cl->source)
+    cl->source->exhausted++;
+  source_release(cl);
+}
+
+void source_release(Client *cl)
+{
+  if (!cl->source)
+    return ;
+
+  cl->source->active--;
+  cl->source = NULL;
+}
+
+/* Ports used from each address, for SIGUSR1 */
+void source_dump(SocksLink *sl, FILE *out)
+{
+  struct sources *sources = sl->sources;
+  struct source_addr *src;
+  char buf[ADDR_NTOP_BUFSIZ];
+  int i;
+
+  if (!sources)
+    return ;
+
+  fprintf(out, "sources:\n");
+  fprintf(out, "--------\n");
+  for (i = 0; i < sources->count; ++i) {
+    src = &sources->addrs[i];
+    fprintf(out, "%s: %u ports in use (connects: %lu, exhausted: %lu)\n",
+	    addr_ntop(&src->addr, buf, sizeof (buf)), src->active,
+	    src->connects, src->exhausted);
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef SOURCE_H
+# define SOURCE_H
+
+#include <stdio.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int source_start(SocksLink *sl);
+void source_stop(SocksLink *sl);
+
+int source_bind(Client *cl, int fd, int family, int attempt);
+void source_exhausted(Client *cl);
+void source_release(Client *cl);
+
+void source_dump(SocksLink *sl, FILE *out);
+
+#endif /* !SOURCE_H */
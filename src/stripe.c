@@ -0,0 +1,694 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "stripe.h"
+#include "list.h"
+#include "utils.h"
+#include "profile.h"
+#include "admit.h"
+#include "log.h"
+
+/*
+ * Striped connections between sockslinkd instances
+ *
+ * With --stripe, each connection to a next-hop is carried over several
+ * parallel TCP connections (links), so that a single bulk transfer is
+ * not limited by the window and loss recovery of one TCP connection.
+ * The next-hop must run with --stripe-accept, it gathers the links of
+ * a connection and hands the reassembled stream to its usual SOCKS5
+ * code, as if it were a new client.
+ *
+ * Every link starts with a preamble, echoed back by the accepting side:
+ *
+ *   magic (1) | "SLST" (4) | version (1) | index (1) | count (1) | id (8)
+ *
+ * then carries chunks, in both directions:
+ *
+ *   sequence (4) | length (2) | flags (1) | reserved (1) | payload
+ *
+ * Chunks are numbered per direction and each one is sent on the link
+ * with the least bytes queued, so faster links carry more of them. A
+ * link carries its chunks in order, the next chunk to deliver is thus
+ * always at the head of one of them: out of order chunks just wait in
+ * the input of their link, which stops reading past STRIPE_LINK_BUFSIZ.
+ *
+ * Locally the stream is one end of a socketpair, the other end being
+ * given to server_connect() (connecting side) or client_new()
+ * (accepting side), which don't know the difference.
+ */
+
+#define STRIPE_VERSION		1
+#define STRIPE_PREAMBLE_LEN	16
+#define STRIPE_ID_LEN		8
+#define STRIPE_HEADER_LEN	8
+
+/* Chunk flags */
+#define STRIPE_FIN		0x01
+
+/* A next-hop reached through striped connections */
+struct stripe_peer {
+  struct list_head next;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  time_t plain_until; /* didn't answer as a link, use plain connections */
+};
+
+struct stripe_link {
+  struct stripe *stripe;
+  int index;
+  int fd;
+  struct bufferevent *bufev;
+  bool ready; /* preamble received */
+};
+
+struct stripe {
+  struct list_head next;
+  SocksLink *sl;
+  struct stripe_peer *peer; /* NULL on the accepting side */
+  uint8_t id[STRIPE_ID_LEN];
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int count;
+  int links_ready;
+  struct stripe_link *links;
+  int fd;
+  struct bufferevent *bufev;
+  uint32_t send_seq;
+  uint32_t recv_seq;
+  bool ready; /* all links up, the stream flows */
+  bool eof; /* local end closed, freed once the links are flushed */
+  bool closing; /* remote end closed, freed once the output is flushed */
+};
+
+struct stripes {
+  struct list_head peers;
+  struct list_head pending; /* accepting side, waiting for links */
+  struct list_head active;
+};
+
+static void stripe_preamble(const struct stripe *st, int index,
+			    uint8_t *preamble)
+{
+  preamble[0] = STRIPE_MAGIC;
+  memcpy(preamble + 1, "SLST", 4);
+  preamble[5] = STRIPE_VERSION;
+  preamble[6] = index;
+  preamble[7] = st->count;
+  memcpy(preamble + 8, st->id, STRIPE_ID_LEN);
+}
+
+static void stripe_free(struct stripe *st)
+{
+  int fds = 0;
+
+  for (int i = 0; i < st->count; ++i) {
+    struct stripe_link *link = &st->links[i];
+
+    if (link->bufev) {
+      bufferevent_disable(link->bufev, EV_READ | EV_WRITE);
+      bufferevent_free(link->bufev);
+    }
+    if (link->fd >= 0) {
+      close(link->fd);
+      fds++;
+    }
+  }
+
+  if (st->bufev) {
+    bufferevent_disable(st->bufev, EV_READ | EV_WRITE);
+    bufferevent_free(st->bufev);
+  }
+  if (st->fd >= 0) {
+    close(st->fd);
+    fds++;
+  }
+  admit_fds(st->sl, -fds);
+
+  list_del(&st->next);
+  free(st->links);
+  free(st);
+}
+
+static void stripe_chunk_write(struct stripe_link *link, uint32_t seq,
+			       uint8_t flags, const void *data, uint16_t len)
+{
+  uint8_t header[STRIPE_HEADER_LEN] = {
+    seq >> 24, seq >> 16, seq >> 8, seq, len >> 8, len & 0xff, flags, 0
+  };
+
+  bufferevent_write(link->bufev, header, sizeof (header));
+  if (len)
+    bufferevent_write(link->bufev, (void *)data, len);
+}
+
+/* The link with the least bytes waiting to be sent */
+static struct stripe_link *stripe_link_pick(struct stripe *st)
+{
+  struct stripe_link *best = &st->links[0];
+  size_t best_len = EVBUFFER_LENGTH(EVBUFFER_OUTPUT(best->bufev));
+
+  for (int i = 1; i < st->count; ++i) {
+    size_t len = EVBUFFER_LENGTH(EVBUFFER_OUTPUT(st->links[i].bufev));
+
+    if (len < best_len) {
+      best = &st->links[i];
+      best_len = len;
+    }
+  }
+  return best;
+}
+
+static bool stripe_flushed(struct stripe *st)
+{
+  for (int i = 0; i < st->count; ++i) {
+    if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(st->links[i].bufev)))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Cut what the local end wrote into chunks, until every link has
+ * STRIPE_LINK_BUFSIZ bytes queued. Once the local end is closed, send
+ * everything and a FIN chunk. Returns -1 if the stripe was freed.
+ */
+static int stripe_send(struct stripe *st)
+{
+  struct evbuffer *input = EVBUFFER_INPUT(st->bufev);
+  struct stripe_link *link;
+  size_t len;
+
+  while ((len = EVBUFFER_LENGTH(input))) {
+    link = stripe_link_pick(st);
+    if (!st->eof &&
+	EVBUFFER_LENGTH(EVBUFFER_OUTPUT(link->bufev)) >= STRIPE_LINK_BUFSIZ) {
+      /* links are full, wait for one of them to drain */
+      bufferevent_disable(st->bufev, EV_READ);
+      return 0;
+    }
+
+    if (len > STRIPE_CHUNK_SIZE)
+      len = STRIPE_CHUNK_SIZE;
+    stripe_chunk_write(link, st->send_seq++, 0, EVBUFFER_DATA(input), len);
+    evbuffer_drain(input, len);
+  }
+
+  if (!st->eof)
+    return 0;
+
+  stripe_chunk_write(stripe_link_pick(st), st->send_seq++, STRIPE_FIN,
+		     NULL, 0);
+
+  /* now wait for every link to be flushed */
+  for (int i = 0; i < st->count; ++i) {
+    bufferevent_disable(st->links[i].bufev, EV_READ);
+    bufferevent_setwatermark(st->links[i].bufev, EV_WRITE, 0, 0);
+  }
+  if (stripe_flushed(st)) {
+    stripe_free(st);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write the chunks to the local end in sequence order, as long as it
+ * keeps up. Returns -1 if the stripe was freed.
+ */
+static int stripe_deliver(struct stripe *st)
+{
+  struct evbuffer *output = EVBUFFER_OUTPUT(st->bufev);
+  bool progress = true;
+
+  while (progress && !st->closing &&
+	 EVBUFFER_LENGTH(output) < STRIPE_LINK_BUFSIZ) {
+    progress = false;
+
+    for (int i = 0; i < st->count; ++i) {
+      struct evbuffer *input = EVBUFFER_INPUT(st->links[i].bufev);
+      uint8_t *chunk = EVBUFFER_DATA(input);
+      uint32_t seq;
+      uint16_t len;
+
+      if (EVBUFFER_LENGTH(input) < STRIPE_HEADER_LEN)
+	continue ;
+
+      seq = ((uint32_t)chunk[0] << 24) | (chunk[1] << 16) |
+	(chunk[2] << 8) | chunk[3];
+      len = (chunk[4] << 8) | chunk[5];
+
+      if (len > STRIPE_CHUNK_SIZE) {
+	pr_warn(st->sl, "invalid stripe chunk, closing the connection");
+	stripe_free(st);
+	return -1;
+      }
+      if (seq != st->recv_seq ||
+	  EVBUFFER_LENGTH(input) < STRIPE_HEADER_LEN + len)
+	continue ;
+
+      if (chunk[6] & STRIPE_FIN)
+	st->closing = true;
+      else
+	bufferevent_write(st->bufev, chunk + STRIPE_HEADER_LEN, len);
+      evbuffer_drain(input, STRIPE_HEADER_LEN + len);
+      st->recv_seq++;
+      progress = true;
+    }
+  }
+
+  if (!st->closing)
+    return 0;
+
+  for (int i = 0; i < st->count; ++i)
+    bufferevent_disable(st->links[i].bufev, EV_READ);
+  bufferevent_disable(st->bufev, EV_READ);
+  bufferevent_setwatermark(st->bufev, EV_WRITE, 0, 0);
+
+  if (!EVBUFFER_LENGTH(output)) {
+    stripe_free(st);
+    return -1;
+  }
+  return 0;
+}
+
+static void on_local_read(struct bufferevent *bev, void *ctx)
+{
+  stripe_send(ctx);
+}
+
+static void on_local_write(struct bufferevent *bev, void *ctx)
+{
+  struct stripe *st = ctx;
+
+  if (st->closing) {
+    if (!EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)))
+      stripe_free(st);
+    return ;
+  }
+
+  /* the local end caught up, deliver what waits in the links */
+  stripe_deliver(st);
+}
+
+static void on_local_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct stripe *st = ctx;
+
+  if (st->closing || st->eof) {
+    stripe_free(st);
+    return ;
+  }
+
+  st->eof = true;
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  stripe_send(st);
+}
+
+/* Returns the end of the socketpair given to the rest of sockslink */
+static int stripe_local_new(struct stripe *st)
+{
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    pr_err(st->sl, "socketpair failed: %s", strerror(errno));
+    return -1;
+  }
+
+  st->bufev = bufferevent_new(fds[0], on_local_read, on_local_write,
+			      on_local_event, st);
+  if (!st->bufev) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  sock_set_nonblock(fds[0]);
+  sock_set_nonblock(fds[1]);
+  st->fd = fds[0];
+  admit_fds(st->sl, 1);
+
+  bufferevent_base_set(st->sl->base, st->bufev);
+  bufferevent_setwatermark(st->bufev, EV_READ, 0, STRIPE_LINK_BUFSIZ);
+  bufferevent_setwatermark(st->bufev, EV_WRITE, STRIPE_LINK_BUFSIZ / 2, 0);
+
+  return fds[1];
+}
+
+/* Every link is up, let the stream flow */
+static int stripe_ready(struct stripe *st)
+{
+  st->ready = true;
+  for (int i = 0; i < st->count; ++i)
+    bufferevent_settimeout(st->links[i].bufev, 0, 0);
+  bufferevent_enable(st->bufev, EV_READ | EV_WRITE);
+
+  if (stripe_deliver(st))
+    return -1;
+  return stripe_send(st);
+}
+
+static void on_link_read(struct bufferevent *bev, void *ctx)
+{
+  struct stripe_link *link = ctx;
+  struct stripe *st = link->stripe;
+  struct evbuffer *input = EVBUFFER_INPUT(bev);
+  uint8_t preamble[STRIPE_PREAMBLE_LEN];
+
+  if (!link->ready) {
+    /* connecting side, the next-hop echoes the preamble */
+    if (EVBUFFER_LENGTH(input) < STRIPE_PREAMBLE_LEN)
+      return ;
+    stripe_preamble(st, link->index, preamble);
+    if (memcmp(EVBUFFER_DATA(input), preamble, STRIPE_PREAMBLE_LEN)) {
+      pr_warn(st->sl, "next-hop doesn't accept striped connections");
+      st->peer->plain_until = time(NULL) + STRIPE_RETRY_TIMEOUT;
+      stripe_free(st);
+      return ;
+    }
+    evbuffer_drain(input, STRIPE_PREAMBLE_LEN);
+    link->ready = true;
+    if (++st->links_ready == st->count) {
+      pr_debug(st->sl, "striped connection ready, %d links", st->count);
+      stripe_ready(st);
+    }
+    return ;
+  }
+
+  if (st->ready)
+    stripe_deliver(st);
+}
+
+static void on_link_write(struct bufferevent *bev, void *ctx)
+{
+  struct stripe_link *link = ctx;
+  struct stripe *st = link->stripe;
+
+  if (st->eof) {
+    if (stripe_flushed(st))
+      stripe_free(st);
+    return ;
+  }
+
+  /* room on the links again */
+  if (st->ready && !st->closing) {
+    bufferevent_enable(st->bufev, EV_READ);
+    stripe_send(st);
+  }
+}
+
+static void on_link_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct stripe_link *link = ctx;
+  struct stripe *st = link->stripe;
+
+  if (st->closing) {
+    /* everything was received, keep flushing the local end */
+    bufferevent_disable(bev, EV_READ | EV_WRITE);
+    return ;
+  }
+
+  /* a next-hop closing before answering isn't one of ours */
+  if (st->peer && !link->ready && (why & EVBUFFER_EOF))
+    st->peer->plain_until = time(NULL) + STRIPE_RETRY_TIMEOUT;
+
+  pr_debug(st->sl, "stripe link %d closed (%#x)", link->index, why);
+  stripe_free(st);
+}
+
+static struct stripe *stripe_new(SocksLink *sl, int count)
+{
+  struct stripe *st = calloc(sizeof (*st), 1);
+
+  if (!st)
+    return NULL;
+
+  st->links = calloc(sizeof (*st->links), count);
+  if (!st->links) {
+    free(st);
+    return NULL;
+  }
+
+  st->sl = sl;
+  st->fd = -1;
+  st->count = count;
+  for (int i = 0; i < count; ++i) {
+    st->links[i].stripe = st;
+    st->links[i].index = i;
+    st->links[i].fd = -1;
+  }
+  return st;
+}
+
+/* Adopts bufev when given, a new one is created otherwise */
+static int stripe_link_set(struct stripe *st, int index, int fd,
+			   struct bufferevent *bufev)
+{
+  struct stripe_link *link = &st->links[index];
+
+  if (bufev)
+    bufferevent_setcb(bufev, on_link_read, on_link_write, on_link_event, link);
+  else {
+    bufev = bufferevent_new(fd, on_link_read, on_link_write, on_link_event,
+			    link);
+    if (!bufev)
+      return -1;
+    bufferevent_base_set(st->sl->base, bufev);
+  }
+  link->bufev = bufev;
+  link->fd = fd;
+  admit_fds(st->sl, 1);
+
+  bufferevent_setwatermark(link->bufev, EV_READ, 0, STRIPE_LINK_BUFSIZ);
+  bufferevent_setwatermark(link->bufev, EV_WRITE, STRIPE_LINK_BUFSIZ / 2, 0);
+  bufferevent_settimeout(link->bufev, SOCKS5_AUTH_TIMEOUT, 0);
+  sock_set_tcpnodelay(fd, 1);
+  return 0;
+}
+
+static struct stripes *stripes_get(SocksLink *sl)
+{
+  if (!sl->stripes) {
+    sl->stripes = calloc(sizeof (*sl->stripes), 1);
+    if (!sl->stripes)
+      return NULL;
+    INIT_LIST_HEAD(&sl->stripes->peers);
+    INIT_LIST_HEAD(&sl->stripes->pending);
+    INIT_LIST_HEAD(&sl->stripes->active);
+  }
+  return sl->stripes;
+}
+
+static struct stripe_peer *stripe_peer_get(struct stripes *stripes,
+					   const struct sockaddr_storage *addr,
+					   socklen_t addrlen)
+{
+  struct stripe_peer *peer;
+
+  list_for_each_entry(peer, &stripes->peers, next, struct stripe_peer) {
+    if (peer->addrlen == addrlen && !memcmp(&peer->addr, addr, addrlen))
+      return peer;
+  }
+
+  peer = calloc(sizeof (*peer), 1);
+  if (!peer)
+    return NULL;
+  memcpy(&peer->addr, addr, addrlen);
+  peer->addrlen = addrlen;
+  list_add(&peer->next, &stripes->peers);
+  return peer;
+}
+
+/*
+ * Open the links of a striped connection to this next-hop, the
+ * returned fd is used as the connection to the next-hop. Returns -1
+ * when the next-hop doesn't accept striped connections, the client
+ * then gets a plain connection.
+ */
+int stripe_connect(Client *cl, const struct sockaddr_storage *addr,
+		   socklen_t addrlen)
+{
+  SocksLink *sl = cl->parent;
+  struct stripes *stripes = stripes_get(sl);
+  struct stripe_peer *peer;
+  struct stripe *st;
+  uint8_t preamble[STRIPE_PREAMBLE_LEN];
+  int fd;
+
+  if (!stripes)
+    return -1;
+
+  peer = stripe_peer_get(stripes, addr, addrlen);
+  if (!peer || peer->plain_until > time(NULL))
+    return -1;
+
+  st = stripe_new(sl, sl->stripe_links);
+  if (!st)
+    return -1;
+  st->peer = peer;
+  list_add(&st->next, &stripes->active);
+
+  if (getrandom(st->id, sizeof (st->id), 0) != sizeof (st->id)) {
+    prcl_err(cl, "can't get a stripe id: %s", strerror(errno));
+    goto error;
+  }
+
+  for (int i = 0; i < st->count; ++i) {
+    fd = socket(addr->ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+      prcl_err(cl, "can't create stripe socket: %s", strerror(errno));
+      goto error;
+    }
+
+    if (sock_set_nonblock(fd) < 0 ||
+	(connect(fd, (const struct sockaddr *)addr, addrlen) &&
+	 errno != EINPROGRESS) ||
+	stripe_link_set(st, i, fd, NULL)) {
+      prcl_debug(cl, "can't connect stripe link: %s", strerror(errno));
+      close(fd);
+      goto error;
+    }
+
+    stripe_preamble(st, i, preamble);
+    bufferevent_write(st->links[i].bufev, preamble, sizeof (preamble));
+    bufferevent_enable(st->links[i].bufev, EV_READ | EV_WRITE);
+  }
+
+  /* the local end is read once every link is acknowledged */
+  fd = stripe_local_new(st);
+  if (fd < 0)
+    goto error;
+
+  prcl_debug(cl, "striping over %d links", st->count);
+  return fd;
+
+ error:
+  stripe_free(st);
+  return -1;
+}
+
+static struct stripe *stripe_pending_find(struct stripes *stripes,
+					  const uint8_t *preamble)
+{
+  struct stripe *st;
+
+  list_for_each_entry(st, &stripes->pending, next, struct stripe) {
+    if (st->count == preamble[7] &&
+	!memcmp(st->id, preamble + 8, STRIPE_ID_LEN))
+      return st;
+  }
+  return NULL;
+}
+
+/* The client is a link of a striped connection from another sockslinkd */
+void stripe_accept(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  struct evbuffer *input = EVBUFFER_INPUT(cl->client.bufev);
+  struct stripes *stripes = stripes_get(sl);
+  struct stripe *st;
+  struct stripe_link *link;
+  uint8_t preamble[STRIPE_PREAMBLE_LEN];
+  int index, count, fd;
+
+  if (EVBUFFER_LENGTH(input) < STRIPE_PREAMBLE_LEN)
+    return ;
+
+  memcpy(preamble, EVBUFFER_DATA(input), STRIPE_PREAMBLE_LEN);
+  index = preamble[6];
+  count = preamble[7];
+
+  if (!stripes || memcmp(preamble + 1, "SLST", 4) ||
+      preamble[5] != STRIPE_VERSION || !count || count > STRIPE_LINKS_MAX ||
+      index >= count) {
+    client_invalid_version(cl);
+    return ;
+  }
+
+  st = stripe_pending_find(stripes, preamble);
+  if (!st) {
+    st = stripe_new(sl, count);
+    if (!st) {
+      client_drop(cl, true);
+      return ;
+    }
+    memcpy(st->id, preamble + 8, STRIPE_ID_LEN);
+    memcpy(&st->addr, &cl->client.addr, cl->client.addrlen);
+    st->addrlen = cl->client.addrlen;
+    list_add(&st->next, &stripes->pending);
+  }
+
+  link = &st->links[index];
+  if (link->bufev ||
+      stripe_link_set(st, index, cl->client.fd, cl->client.bufev)) {
+    if (!st->links_ready)
+      stripe_free(st);
+    client_invalid_version(cl);
+    return ;
+  }
+
+  prcl_infos(cl, "client is stripe link %d/%d", index + 1, count);
+
+  /*
+   * The link takes over the connection and its bufferevent, with what was
+   * already read: only the socket may fill a bufferevent's input buffer.
+   */
+  evbuffer_drain(input, STRIPE_PREAMBLE_LEN);
+  cl->client.bufev = NULL;
+  cl->client.fd = -1;
+  client_drop(cl, false);
+
+  link->ready = true;
+  bufferevent_write(link->bufev, preamble, sizeof (preamble));
+  bufferevent_enable(link->bufev, EV_READ | EV_WRITE);
+
+  if (++st->links_ready < st->count)
+    return ;
+
+  list_del(&st->next);
+  list_add(&st->next, &stripes->active);
+
+  fd = stripe_local_new(st);
+  if (fd < 0) {
+    stripe_free(st);
+    return ;
+  }
+
+  /* rules and routes see the address of the first link */
+  if (!client_new(sl, fd, &st->addr, st->addrlen, profile_find(sl, NULL)))
+    close(fd);
+
+  stripe_ready(st);
+}
+
+void stripe_stop(SocksLink *sl)
+{
+  struct stripes *stripes = sl->stripes;
+  struct stripe_peer *peer, *ptmp;
+  struct stripe *st, *tmp;
+
+  if (!stripes)
+    return ;
+
+  list_for_each_entry_safe(st, tmp, &stripes->pending, next, struct stripe)
+    stripe_free(st);
+  list_for_each_entry_safe(st, tmp, &stripes->active, next, struct stripe)
+    stripe_free(st);
+
+  list_for_each_entry_safe(peer, ptmp, &stripes->peers, next,
+			   struct stripe_peer) {
+    list_del(&peer->next);
+    free(peer);
+  }
+
+  free(stripes);
+  sl->stripes = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef STRIPE_H
+# define STRIPE_H
+
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+/* First byte sent on a link, never a SOCKS version */
+#define STRIPE_MAGIC		0xf1
+
+/* Maximum number of links of a striped connection */
+#define STRIPE_LINKS_MAX	16
+
+int stripe_connect(Client *cl, const struct sockaddr_storage *addr,
+		   socklen_t addrlen);
+void stripe_accept(Client *cl);
+void stripe_stop(SocksLink *sl);
+
+#endif /* !STRIPE_H */
@@ -0,0 +1,682 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef HAVE_OPENSSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+# include <openssl/x509v3.h>
+#endif
+
+#include "sockslink.h"
+#include "client.h"
+#include "tls.h"
+#include "list.h"
+#include "utils.h"
+#include "profile.h"
+#include "admit.h"
+#include "wheel.h"
+#include "log.h"
+
+#ifdef HAVE_OPENSSL
+
+/*
+ * TLS on listeners and next-hop connections
+ *
+ * The handshake runs on the socket itself, before the connection goes
+ * on: a --tls-port client only becomes a Client once it's done, a
+ * next-hop connection only starts the SOCKS5 negociation then.
+ *
+ * With kernel TLS, the keys are then handed over to the socket, which
+ * is used as a plain one from there: the record layer costs no copy in
+ * userspace. Otherwise, or if some records were already read past the
+ * handshake, the connection is put behind a socketpair and records are
+ * relayed here, like tunnels.
+ *
+ * Kernel TLS can't read the TLS 1.3 session tickets, our listeners
+ * don't send any: the next-hops are expected to be sockslinkd too.
+ */
+
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+# define TLS_KTLS
+#endif
+
+#define TLS_RECORD_SIZE		16384
+
+struct tls_conn {
+  struct list_head next;
+  SocksLink *sl;
+  SSL *ssl;
+  int raw_fd; /* the TCP connection */
+  struct event ev_read;
+  struct event ev_write;
+  bool handshake;
+  struct wheel_timer timer; /* of the handshake, armed once */
+  /* connecting side, its fd until the handshake is done */
+  Client *cl;
+  void (*done)(Client *cl, bool ok);
+  /* accepting side */
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  const struct profile *profile; /* of the client too on the connecting side */
+  /* records relayed in userspace */
+  int fd;
+  struct bufferevent *bufev; /* our end of the socketpair */
+  bool eof; /* local end closed, freed once close_notify is sent */
+  bool closing; /* link closed, freed once the local end is flushed */
+  int fds; /* besides those of the client, for admission control */
+};
+
+struct tls {
+  SSL_CTX *server; /* NULL without --tls-port */
+  SSL_CTX *client; /* NULL without --tls-next-hop */
+  struct list_head conns;
+};
+
+static const char *tls_strerror(void)
+{
+  unsigned long err = ERR_get_error();
+  const char *reason;
+
+  ERR_clear_error();
+  if (!err)
+    return errno ? strerror(errno) : "connection closed";
+
+  reason = ERR_reason_error_string(err);
+  return reason ? reason : "unknown error";
+}
+
+static void tls_conn_free(struct tls_conn *tc)
+{
+  /* an accepted client leaving before its handshake is done */
+  if (tc->handshake && !tc->cl)
+    admit_tls_done(tc->sl);
+
+  event_del(&tc->ev_read);
+  event_del(&tc->ev_write);
+  wheel_del(&tc->timer);
+  SSL_free(tc->ssl);
+
+  if (tc->bufev) {
+    bufferevent_disable(tc->bufev, EV_READ | EV_WRITE);
+    bufferevent_free(tc->bufev);
+    close(tc->fd);
+  }
+
+  /* until the handshake is done, the client owns its server socket */
+  if (tc->cl)
+    tc->cl->tls = NULL;
+  else if (tc->raw_fd >= 0)
+    close(tc->raw_fd);
+
+  admit_fds(tc->sl, -tc->fds);
+  list_del(&tc->next);
+  free(tc);
+}
+
+/*
+ * Whether the link closed (1), failed (-1) or waits for the socket,
+ * want_read and want_write telling for what
+ */
+static int tls_link_error(struct tls_conn *tc, int ret,
+			  bool *want_read, bool *want_write)
+{
+  switch (SSL_get_error(tc->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    *want_read = true;
+    return 0;
+  case SSL_ERROR_WANT_WRITE:
+    *want_write = true;
+    return 0;
+  case SSL_ERROR_ZERO_RETURN:
+    return 1;
+  default:
+    pr_debug(tc->sl, "TLS link failed: %s", tls_strerror());
+    return -1;
+  }
+}
+
+/* Relay records both ways, as long as each end keeps up */
+static void tls_link_run(struct tls_conn *tc)
+{
+  struct evbuffer *input = EVBUFFER_INPUT(tc->bufev);
+  struct evbuffer *output = EVBUFFER_OUTPUT(tc->bufev);
+  uint8_t buffer[TLS_RECORD_SIZE];
+  bool want_read = false, want_write = false;
+  size_t len;
+  int ret;
+
+  while (!tc->eof && !tc->closing &&
+	 EVBUFFER_LENGTH(output) < TLS_LINK_BUFSIZ) {
+    ret = SSL_read(tc->ssl, buffer, sizeof (buffer));
+    if (ret > 0) {
+      bufferevent_write(tc->bufev, buffer, ret);
+      continue ;
+    }
+
+    ret = tls_link_error(tc, ret, &want_read, &want_write);
+    if (ret < 0) {
+      tls_conn_free(tc);
+      return ;
+    }
+    if (ret > 0) {
+      /* deliver what was received, then close the local end */
+      tc->closing = true;
+      bufferevent_disable(tc->bufev, EV_READ);
+      bufferevent_setwatermark(tc->bufev, EV_WRITE, 0, 0);
+    }
+    break ;
+  }
+
+  if (tc->closing) {
+    if (!EVBUFFER_LENGTH(output))
+      tls_conn_free(tc);
+    return ;
+  }
+
+  while ((len = EVBUFFER_LENGTH(input))) {
+    if (len > TLS_RECORD_SIZE)
+      len = TLS_RECORD_SIZE;
+    ret = SSL_write(tc->ssl, EVBUFFER_DATA(input), len);
+    if (ret > 0) {
+      evbuffer_drain(input, ret);
+      continue ;
+    }
+
+    if (tls_link_error(tc, ret, &want_read, &want_write)) {
+      tls_conn_free(tc);
+      return ;
+    }
+    break ;
+  }
+
+  if (tc->eof && !EVBUFFER_LENGTH(input)) {
+    ret = SSL_shutdown(tc->ssl);
+    if (ret >= 0 || tls_link_error(tc, ret, &want_read, &want_write)) {
+      tls_conn_free(tc);
+      return ;
+    }
+  }
+
+  event_del(&tc->ev_read);
+  event_del(&tc->ev_write);
+  if (want_read)
+    event_add(&tc->ev_read, NULL);
+  if (want_write)
+    event_add(&tc->ev_write, NULL);
+}
+
+static void on_tls_read(struct bufferevent *bev, void *ctx)
+{
+  tls_link_run(ctx);
+}
+
+static void on_tls_write(struct bufferevent *bev, void *ctx)
+{
+  tls_link_run(ctx);
+}
+
+static void on_tls_local_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct tls_conn *tc = ctx;
+
+  if (tc->eof || tc->closing) {
+    tls_conn_free(tc);
+    return ;
+  }
+
+  tc->eof = true;
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  tls_link_run(tc);
+}
+
+/*
+ * The handshake is done: returns the fd the connection goes on with,
+ * the socket itself with kernel TLS (tc is then freed), or the other
+ * end of the socketpair of a link. Returns -1 on error.
+ */
+static int tls_ready(struct tls_conn *tc)
+{
+  int fds[2];
+  int fd;
+
+#ifdef TLS_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(tc->ssl)) &&
+      BIO_get_ktls_recv(SSL_get_rbio(tc->ssl)) &&
+      !SSL_has_pending(tc->ssl)) {
+    pr_debug(tc->sl, "TLS handshake done, records offloaded to the kernel");
+    fd = tc->raw_fd;
+    tc->raw_fd = -1;
+    if (tc->cl)
+      tc->cl->tls = NULL;
+    tc->cl = NULL;
+    tls_conn_free(tc);
+    return fd;
+  }
+#endif
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    pr_err(tc->sl, "socketpair failed: %s", strerror(errno));
+    return -1;
+  }
+
+  tc->bufev = bufferevent_new(fds[0], on_tls_read, on_tls_write,
+			      on_tls_local_event, tc);
+  if (!tc->bufev) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  sock_set_nonblock(fds[0]);
+  sock_set_nonblock(fds[1]);
+  tc->fd = fds[0];
+
+  /* the socket and our end of the socketpair, the client has the other */
+  admit_fds(tc->sl, 2 - tc->fds);
+  tc->fds = 2;
+
+  bufferevent_base_set(tc->sl->base, tc->bufev);
+  bufferevent_setwatermark(tc->bufev, EV_READ, 0, TLS_LINK_BUFSIZ);
+  bufferevent_setwatermark(tc->bufev, EV_WRITE, TLS_LINK_BUFSIZ / 2, 0);
+  bufferevent_enable(tc->bufev, EV_READ | EV_WRITE);
+
+  /* the link owns the socket from now on */
+  if (tc->cl)
+    tc->cl->tls = NULL;
+  tc->cl = NULL;
+
+  pr_debug(tc->sl, "TLS handshake done, records relayed in userspace");
+
+  /* records may already be there, tc may be freed */
+  tls_link_run(tc);
+  return fds[1];
+}
+
+static void tls_accepted(struct tls_conn *tc)
+{
+  SocksLink *sl = tc->sl;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = tc->addrlen;
+  const struct profile *profile = tc->profile;
+  int fd;
+
+  memcpy(&addr, &tc->addr, addrlen);
+
+  fd = tls_ready(tc);
+  if (fd < 0) {
+    tls_conn_free(tc);
+    return ;
+  }
+
+  /* the link is run once the client reads, it may be gone by then */
+  if (!client_new(sl, fd, &addr, addrlen, profile))
+    close(fd);
+}
+
+static void tls_connected(struct tls_conn *tc)
+{
+  Client *cl = tc->cl;
+  void (*done)(Client *cl, bool ok) = tc->done;
+  struct bufferevent *bev;
+  int fd;
+
+  fd = tls_ready(tc);
+  if (fd < 0) {
+    tls_conn_free(tc);
+    done(cl, false);
+    return ;
+  }
+
+  /* the server goes on through the socketpair */
+  if (fd != cl->server.fd) {
+    bufferevent_free(cl->server.bufev);
+    cl->server.bufev = NULL;
+    cl->server.fd = fd;
+
+    bev = bufferevent_new(fd, NULL, NULL, NULL, NULL);
+    if (!bev) {
+      done(cl, false);
+      return ;
+    }
+    bufferevent_base_set(cl->parent->base, bev);
+    cl->server.bufev = bev;
+  }
+
+  done(cl, true);
+}
+
+static void tls_handshake_failed(struct tls_conn *tc, const char *error)
+{
+  Client *cl = tc->cl;
+  void (*done)(Client *cl, bool ok) = tc->done;
+
+  if (cl)
+    prcl_debug(cl, "TLS handshake with the next-hop failed: %s", error);
+  else
+    pr_debug(tc->sl, "TLS handshake failed: %s", error);
+
+  tls_conn_free(tc);
+  if (cl)
+    done(cl, false);
+}
+
+static void tls_handshake(struct tls_conn *tc)
+{
+  int ret;
+
+  ret = SSL_do_handshake(tc->ssl);
+  if (ret == 1) {
+    tc->handshake = false;
+    event_del(&tc->ev_read);
+    event_del(&tc->ev_write);
+    wheel_del(&tc->timer);
+    if (tc->cl)
+      tls_connected(tc);
+    else {
+      admit_tls_done(tc->sl);
+      tls_accepted(tc);
+    }
+    return ;
+  }
+
+  event_del(&tc->ev_read);
+  event_del(&tc->ev_write);
+  switch (SSL_get_error(tc->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    event_add(&tc->ev_read, NULL);
+    break ;
+  case SSL_ERROR_WANT_WRITE:
+    event_add(&tc->ev_write, NULL);
+    break ;
+  default:
+    tls_handshake_failed(tc, tls_strerror());
+  }
+}
+
+static void on_tls_event(int fd, short ev, void *arg)
+{
+  struct tls_conn *tc = arg;
+
+  if (!tc->handshake)
+    tls_link_run(tc);
+  else
+    tls_handshake(tc);
+}
+
+static void on_tls_timeout(struct wheel_timer *timer)
+{
+  struct tls_conn *tc = container_of(timer, struct tls_conn, timer);
+
+  tls_handshake_failed(tc, "timeout");
+}
+
+static struct tls_conn *tls_conn_new(SocksLink *sl, SSL_CTX *ctx, int fd)
+{
+  struct tls_conn *tc;
+
+  tc = calloc(sizeof (*tc), 1);
+  if (!tc)
+    return NULL;
+
+  tc->ssl = SSL_new(ctx);
+  if (!tc->ssl || !SSL_set_fd(tc->ssl, fd)) {
+    pr_err(sl, "can't create TLS connection: %s", tls_strerror());
+    SSL_free(tc->ssl);
+    free(tc);
+    return NULL;
+  }
+
+  tc->sl = sl;
+  tc->raw_fd = fd;
+  tc->fd = -1;
+  tc->handshake = true;
+  wheel_timer_init(&tc->timer, on_tls_timeout);
+  event_set(&tc->ev_read, fd, EV_READ, on_tls_event, tc);
+  event_base_set(sl->base, &tc->ev_read);
+  event_set(&tc->ev_write, fd, EV_WRITE, on_tls_event, tc);
+  event_base_set(sl->base, &tc->ev_write);
+  list_add(&tc->next, &sl->tls->conns);
+  return tc;
+}
+
+/* Handshake with a client of a --tls-port listener, which owns fd */
+int tls_accept(SocksLink *sl, int fd, const struct sockaddr_storage *addr,
+	       socklen_t addrlen, const struct profile *profile)
+{
+  struct tls_conn *tc;
+
+  if (!sl->tls || !sl->tls->server)
+    return -1;
+
+  tc = tls_conn_new(sl, sl->tls->server, fd);
+  if (!tc)
+    return -1;
+
+  memcpy(&tc->addr, addr, addrlen);
+  tc->addrlen = addrlen;
+  tc->profile = profile;
+  SSL_set_accept_state(tc->ssl);
+
+  /* not a client yet, its socket is ours */
+  tc->fds = 1;
+  admit_fds(sl, 1);
+
+  /* however it trickles in, the handshake has this long from the accept */
+  wheel_add(sl, &tc->timer, admit_tls_start(sl, profile));
+
+  tls_handshake(tc);
+  return 0;
+}
+
+/* Certificates must be for --tls-name, or the address of the next-hop */
+static int tls_verify_name(Client *cl, SSL *ssl)
+{
+  X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+  const struct sockaddr_storage *addr = &cl->server.addr;
+
+  if (cl->parent->tls_name) {
+    SSL_set_tlsext_host_name(ssl, cl->parent->tls_name);
+    return X509_VERIFY_PARAM_set1_host(param, cl->parent->tls_name, 0);
+  }
+
+  if (addr->ss_family == AF_INET)
+    return X509_VERIFY_PARAM_set1_ip(param, (const unsigned char *)
+				     &((const struct sockaddr_in *)addr)->sin_addr, 4);
+#ifdef HAVE_IPV6
+  if (addr->ss_family == AF_INET6)
+    return X509_VERIFY_PARAM_set1_ip(param, (const unsigned char *)
+				     &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+#endif
+  return 0;
+}
+
+/*
+ * Handshake with the next-hop on the connected server socket, then
+ * call done: cl->server.fd and cl->server.bufev may have changed.
+ */
+int tls_connect(Client *cl, void (*done)(Client *cl, bool ok))
+{
+  SocksLink *sl = cl->parent;
+  struct tls_conn *tc;
+
+  if (!sl->tls || !sl->tls->client)
+    return -1;
+
+  tc = tls_conn_new(sl, sl->tls->client, cl->server.fd);
+  if (!tc)
+    return -1;
+
+  tc->cl = cl;
+  tc->done = done;
+  tc->profile = cl->profile;
+  cl->tls = tc;
+
+  if (!tls_verify_name(cl, tc->ssl)) {
+    prcl_err(cl, "can't set the name to verify");
+    tls_conn_free(tc);
+    return -1;
+  }
+  SSL_set_connect_state(tc->ssl);
+
+  /* the handshake has the socket for itself, and auth_timeout from now */
+  bufferevent_disable(cl->server.bufev, EV_READ | EV_WRITE);
+  wheel_add(sl, &tc->timer, tc->profile->auth_timeout);
+
+  tls_handshake(tc);
+  return 0;
+}
+
+/* The client is dropped during the handshake */
+void tls_cancel(Client *cl)
+{
+  if (cl->tls)
+    tls_conn_free(cl->tls);
+}
+
+static SSL_CTX *tls_ctx_new(SocksLink *sl, const SSL_METHOD *method)
+{
+  SSL_CTX *ctx;
+
+  ctx = SSL_CTX_new(method);
+  if (!ctx) {
+    pr_err(sl, "can't create TLS context: %s", tls_strerror());
+    return NULL;
+  }
+
+  SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#ifdef TLS_KTLS
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  /* sockets with kernel TLS close without close_notify */
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		   SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  return ctx;
+}
+
+static int tls_server_load(SocksLink *sl, struct tls *tls)
+{
+  tls->server = tls_ctx_new(sl, TLS_server_method());
+  if (!tls->server)
+    return -1;
+
+  SSL_CTX_set_options(tls->server, SSL_OP_NO_TICKET);
+  SSL_CTX_set_num_tickets(tls->server, 0);
+
+  if (SSL_CTX_use_certificate_chain_file(tls->server, sl->tls_cert) != 1) {
+    pr_err(sl, "can't load certificate '%s': %s", sl->tls_cert,
+	   tls_strerror());
+    return -1;
+  }
+  if (SSL_CTX_use_PrivateKey_file(tls->server, sl->tls_key,
+				  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(tls->server) != 1) {
+    pr_err(sl, "can't load private key '%s': %s", sl->tls_key,
+	   tls_strerror());
+    return -1;
+  }
+  return 0;
+}
+
+static int tls_client_load(SocksLink *sl, struct tls *tls)
+{
+  int ret;
+
+  tls->client = tls_ctx_new(sl, TLS_client_method());
+  if (!tls->client)
+    return -1;
+
+  SSL_CTX_set_verify(tls->client, SSL_VERIFY_PEER, NULL);
+  if (sl->tls_ca)
+    ret = SSL_CTX_load_verify_locations(tls->client, sl->tls_ca, NULL);
+  else
+    ret = SSL_CTX_set_default_verify_paths(tls->client);
+
+  if (ret != 1) {
+    pr_err(sl, "can't load CA certificates%s%s: %s",
+	   sl->tls_ca ? " from " : "", sl->tls_ca ? sl->tls_ca : "",
+	   tls_strerror());
+    return -1;
+  }
+  return 0;
+}
+
+int tls_start(SocksLink *sl)
+{
+  struct tls *tls;
+
+  if (!sl->tls_port && !sl->tls_nexthop)
+    return 0;
+
+  tls = calloc(sizeof (*tls), 1);
+  if (!tls)
+    return -1;
+  INIT_LIST_HEAD(&tls->conns);
+  sl->tls = tls;
+
+  if (sl->tls_port && tls_server_load(sl, tls))
+    return -1;
+  if (sl->tls_nexthop && tls_client_load(sl, tls))
+    return -1;
+  return 0;
+}
+
+void tls_stop(SocksLink *sl)
+{
+  struct tls *tls = sl->tls;
+  struct tls_conn *tc, *tmp;
+
+  if (!tls)
+    return ;
+
+  list_for_each_entry_safe(tc, tmp, &tls->conns, next, struct tls_conn)
+    tls_conn_free(tc);
+
+  SSL_CTX_free(tls->server);
+  SSL_CTX_free(tls->client);
+  free(tls);
+  sl->tls = NULL;
+}
+
+#else
+
+int tls_start(SocksLink *sl)
+{
+  if (!sl->tls_port && !sl->tls_nexthop)
+    return 0;
+
+  pr_err(sl, "TLS is not supported on this system");
+  return -1;
+}
+
+void tls_stop(SocksLink *sl)
+{
+}
+
+int tls_accept(SocksLink *sl, int fd, const struct sockaddr_storage *addr,
+	       socklen_t addrlen, const struct profile *profile)
+{
+  return -1;
+}
+
+int tls_connect(Client *cl, void (*done)(Client *cl, bool ok))
+{
+  return -1;
+}
+
+void tls_cancel(Client *cl)
+{
+}
+
+#endif
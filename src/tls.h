@@ -0,0 +1,18 @@
+#ifndef TLS_H
+# define TLS_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int tls_start(SocksLink *sl);
+void tls_stop(SocksLink *sl);
+
+int tls_accept(SocksLink *sl, int fd, const struct sockaddr_storage *addr,
+	       socklen_t addrlen, const struct profile *profile);
+int tls_connect(Client *cl, void (*done)(Client *cl, bool ok));
+void tls_cancel(Client *cl);
+
+#endif /* !TLS_H */
@@ -0,0 +1,694 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "request.h"
+#include "udp.h"
+#include "list.h"
+#include "utils.h"
+#include "admit.h"
+#include "wheel.h"
+#include "log.h"
+
+/*
+ * UDP ASSOCIATE relay
+ *
+ * Each TCP listener gets a UDP socket bound to the same address and
+ * port, shared by all the associations: datagrams from clients are
+ * read in batches and matched to their association by source address.
+ * Every association has its own outgoing socket, either connected to
+ * the UDP relay of the next-hop (datagrams are forwarded untouched), or
+ * talking to the destinations directly when the next-hop is "direct"
+ * (the SOCKS5 header is stripped, and rebuilt on the way back).
+ *
+ * Clients may only send from the address of their TCP connection, and
+ * from the port given in their request, or the port of their first
+ * datagram if they didn't give any. Fragmented datagrams are dropped.
+ */
+
+/* Buckets of the flows hash table, must be a power of 2 */
+#define UDP_FLOWS_HASH		4096
+
+/* Room left before received datagrams to prepend a SOCKS5 header */
+#define UDP_HEADER_ROOM		(3 + SOCKS5_ADDR_MAX)
+
+#define UDP_BUFSIZ		(UDP_HEADER_ROOM + 65535)
+
+#ifndef HAVE_RECVMMSG
+# define mmsghdr sockslink_mmsghdr
+# define recvmmsg sockslink_recvmmsg
+
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+		    int flags, struct timespec *timeout)
+{
+  unsigned int i;
+  ssize_t ret = 0;
+
+  (void) timeout;
+
+  for (i = 0; i < vlen; ++i) {
+    ret = recvmsg(fd, &msgs[i].msg_hdr, flags);
+    if (ret < 0)
+      break ;
+    msgs[i].msg_len = ret;
+  }
+  return i ? (int)i : (int)ret;
+}
+#endif
+
+#ifndef HAVE_SENDMMSG
+# define sendmmsg sockslink_sendmmsg
+
+static int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+		    int flags)
+{
+  unsigned int i;
+  ssize_t ret = 0;
+
+  for (i = 0; i < vlen; ++i) {
+    ret = sendmsg(fd, &msgs[i].msg_hdr, flags);
+    if (ret < 0)
+      break ;
+    msgs[i].msg_len = ret;
+  }
+  return i ? (int)i : (int)ret;
+}
+#endif
+
+struct udp_relay;
+
+struct udp_listener {
+  struct udp_relay *relay;
+  int fd;
+  struct sockaddr_storage addr;
+  struct event ev;
+};
+
+struct udp_flow {
+  struct udp_flow *hnext; /* hash chain, by client address */
+  struct list_head next; /* pending flows, client port still unknown */
+  bool hashed;
+  Client *client;
+  struct udp_relay *relay;
+  struct udp_listener *listener;
+  struct sockaddr_storage client_addr;
+  socklen_t client_addrlen;
+  bool relayed; /* fd is connected to the UDP relay of the next-hop */
+  int family;
+  int fd;
+  struct event ev;
+};
+
+struct udp_batch {
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  struct sockaddr_storage names[UDP_BATCH];
+  int count;
+  int fd;
+};
+
+struct udp_relay {
+  SocksLink *sl;
+  int listeners_count;
+  struct udp_listener listeners[SOCKSLINK_LISTEN_FD_MAX];
+  struct udp_flow *flows[UDP_FLOWS_HASH];
+  struct list_head pending;
+  struct udp_batch in;
+  struct udp_batch out;
+  uint8_t buffers[UDP_BATCH][UDP_BUFSIZ];
+};
+
+static const uint8_t *udp_addr_ip(const struct sockaddr_storage *addr,
+				  size_t *len)
+{
+  if (addr->ss_family == AF_INET) {
+    *len = 4;
+    return (const uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+  }
+#ifdef HAVE_IPV6
+  if (addr->ss_family == AF_INET6) {
+    *len = 16;
+    return ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+  }
+#endif
+  *len = 0;
+  return NULL;
+}
+
+static uint16_t *udp_addr_port(const struct sockaddr_storage *addr)
+{
+  if (addr->ss_family == AF_INET)
+    return &((struct sockaddr_in *)addr)->sin_port;
+#ifdef HAVE_IPV6
+  if (addr->ss_family == AF_INET6)
+    return &((struct sockaddr_in6 *)addr)->sin6_port;
+#endif
+  return NULL;
+}
+
+static bool udp_addr_equal(const struct sockaddr_storage *a,
+			   const struct sockaddr_storage *b, bool port)
+{
+  const uint8_t *ipa, *ipb;
+  size_t len;
+
+  if (a->ss_family != b->ss_family)
+    return false;
+
+  ipa = udp_addr_ip(a, &len);
+  ipb = udp_addr_ip(b, &len);
+
+  return ipa && !memcmp(ipa, ipb, len) &&
+    (!port || *udp_addr_port(a) == *udp_addr_port(b));
+}
+
+static bool udp_addr_is_any(const struct sockaddr_storage *addr)
+{
+  const uint8_t *ip;
+  size_t len;
+
+  ip = udp_addr_ip(addr, &len);
+  for (size_t i = 0; i < len; ++i)
+    if (ip[i])
+      return false;
+  return true;
+}
+
+static unsigned int udp_hash(const struct sockaddr_storage *addr)
+{
+  const uint8_t *ip;
+  uint16_t *port = udp_addr_port(addr);
+  size_t len;
+  uint32_t h;
+
+  ip = udp_addr_ip(addr, &len);
+  h = hash_fnv1a(HASH_FNV1A_INIT, ip, len);
+  if (port)
+    h = hash_fnv1a(h, port, sizeof (*port));
+  return h & (UDP_FLOWS_HASH - 1);
+}
+
+static void udp_flow_hash(struct udp_relay *relay, struct udp_flow *flow)
+{
+  unsigned int h = udp_hash(&flow->client_addr);
+
+  /* a newer association from the same address takes over */
+  flow->hnext = relay->flows[h];
+  relay->flows[h] = flow;
+  flow->hashed = true;
+}
+
+static void udp_flow_unhash(struct udp_relay *relay, struct udp_flow *flow)
+{
+  struct udp_flow **pflow = &relay->flows[udp_hash(&flow->client_addr)];
+
+  for (; *pflow; pflow = &(*pflow)->hnext) {
+    if (*pflow == flow) {
+      *pflow = flow->hnext;
+      break ;
+    }
+  }
+  flow->hashed = false;
+}
+
+static struct udp_flow *udp_flow_lookup(struct udp_relay *relay,
+					const struct sockaddr_storage *addr)
+{
+  struct udp_flow *flow;
+  uint16_t port;
+
+  for (flow = relay->flows[udp_hash(addr)]; flow; flow = flow->hnext) {
+    if (udp_addr_equal(&flow->client_addr, addr, true))
+      return flow;
+  }
+
+  /* first datagram of a client that didn't tell its port */
+  list_for_each_entry(flow, &relay->pending, next, struct udp_flow) {
+    if (!udp_addr_equal(&flow->client_addr, addr, false))
+      continue ;
+
+    port = *udp_addr_port(addr);
+    *udp_addr_port(&flow->client_addr) = port;
+
+    list_del_init(&flow->next);
+    udp_flow_hash(relay, flow);
+    prcl_debug(flow->client, "UDP association bound to port %d",
+	       ntohs(port));
+    return flow;
+  }
+
+  return NULL;
+}
+
+/* Read up to UDP_BATCH datagrams, offset bytes into the buffers */
+static int udp_batch_recv(struct udp_relay *relay, int fd, size_t offset)
+{
+  struct udp_batch *in = &relay->in;
+
+  for (int i = 0; i < UDP_BATCH; ++i) {
+    struct msghdr *hdr = &in->msgs[i].msg_hdr;
+
+    in->iov[i].iov_base = relay->buffers[i] + offset;
+    in->iov[i].iov_len = UDP_BUFSIZ - offset;
+    memset(hdr, 0, sizeof (*hdr));
+    hdr->msg_name = &in->names[i];
+    hdr->msg_namelen = sizeof (in->names[i]);
+    hdr->msg_iov = &in->iov[i];
+    hdr->msg_iovlen = 1;
+  }
+
+  return recvmmsg(fd, in->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+}
+
+static void udp_batch_flush(struct udp_batch *out)
+{
+  int sent = 0;
+  int ret;
+
+  while (sent < out->count) {
+    ret = sendmmsg(out->fd, out->msgs + sent, out->count - sent,
+		   MSG_DONTWAIT);
+    if (ret < 0) {
+      /* like any congested link, drop what doesn't fit */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break ;
+      /* skip the datagram in error, and go on */
+      ret = 1;
+    }
+    sent += ret;
+  }
+  out->count = 0;
+}
+
+static void udp_batch_add(struct udp_batch *out, int fd,
+			  uint8_t *data, size_t len,
+			  const struct sockaddr_storage *name,
+			  socklen_t namelen)
+{
+  struct msghdr *hdr;
+
+  if (out->count && (out->fd != fd || out->count == UDP_BATCH))
+    udp_batch_flush(out);
+
+  out->fd = fd;
+  hdr = &out->msgs[out->count].msg_hdr;
+  memset(hdr, 0, sizeof (*hdr));
+  out->iov[out->count].iov_base = data;
+  out->iov[out->count].iov_len = len;
+  hdr->msg_iov = &out->iov[out->count];
+  hdr->msg_iovlen = 1;
+  if (name) {
+    memcpy(&out->names[out->count], name, namelen);
+    hdr->msg_name = &out->names[out->count];
+    hdr->msg_namelen = namelen;
+  }
+  out->count++;
+}
+
+/* Fit the destination to the family of the flow socket */
+static socklen_t udp_flow_dest(const struct udp_flow *flow,
+			       struct sockaddr_storage *addr, socklen_t len)
+{
+  if (addr->ss_family == flow->family)
+    return len;
+#ifdef HAVE_IPV6
+  if (addr->ss_family == AF_INET && flow->family == AF_INET6) {
+    struct sockaddr_in in = *(struct sockaddr_in *)addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+    memset(in6, 0, sizeof (*in6));
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = in.sin_port;
+    in6->sin6_addr.s6_addr[10] = 0xff;
+    in6->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(in6->sin6_addr.s6_addr + 12, &in.sin_addr, 4);
+    return sizeof (*in6);
+  }
+#endif
+  return 0;
+}
+
+/* Datagrams from clients */
+static void on_udp_listener_read(int fd, short ev, void *arg)
+{
+  struct udp_listener *listener = arg;
+  struct udp_relay *relay = listener->relay;
+  struct udp_batch *in = &relay->in;
+  struct socks5_request req;
+  struct udp_flow *flow;
+  int count;
+  int ret;
+
+  count = udp_batch_recv(relay, fd, 0);
+
+  for (int i = 0; i < count; ++i) {
+    uint8_t *data = relay->buffers[i];
+    size_t len = in->msgs[i].msg_len;
+
+    if (in->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+      continue ;
+
+    flow = udp_flow_lookup(relay, &in->names[i]);
+    if (!flow || flow->listener != listener)
+      continue ;
+
+    /* the controlling connection stays idle while datagrams flow */
+    flow->client->active = wheel_now(flow->client->parent);
+
+    if (flow->relayed) {
+      udp_batch_add(&relay->out, flow->fd, data, len, NULL, 0);
+      continue ;
+    }
+
+    /* no fragments, and destinations must be addresses */
+    ret = socks5_udp_parse(data, len, &req);
+    if (ret < 0 || req.cmd != 0 || !req.addrlen)
+      continue ;
+
+    req.addrlen = udp_flow_dest(flow, &req.addr, req.addrlen);
+    if (!req.addrlen)
+      continue ;
+
+    udp_batch_add(&relay->out, flow->fd, data + ret, len - ret,
+		  &req.addr, req.addrlen);
+  }
+
+  if (relay->out.count)
+    udp_batch_flush(&relay->out);
+}
+
+/* Datagrams from the next-hop relay or from destinations */
+static void on_udp_flow_read(int fd, short ev, void *arg)
+{
+  struct udp_flow *flow = arg;
+  struct udp_relay *relay = flow->relay;
+  struct udp_batch *in = &relay->in;
+  size_t room = flow->relayed ? 0 : UDP_HEADER_ROOM;
+  int count;
+
+  count = udp_batch_recv(relay, fd, room);
+
+  /* nowhere to send them until the client port is known */
+  if (!flow->hashed || count <= 0)
+    return ;
+  flow->client->active = wheel_now(flow->client->parent);
+
+  for (int i = 0; i < count; ++i) {
+    uint8_t *data = relay->buffers[i] + room;
+    size_t len = in->msgs[i].msg_len;
+
+    if (in->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+      continue ;
+
+    if (!flow->relayed) {
+      uint8_t header[UDP_HEADER_ROOM] = {0x00, 0x00, 0x00};
+      size_t hlen = 3 + socks5_addr_write(header + 3, &in->names[i]);
+
+      data -= hlen;
+      len += hlen;
+      memcpy(data, header, hlen);
+    }
+
+    udp_batch_add(&relay->out, flow->listener->fd, data, len,
+		  &flow->client_addr, flow->client_addrlen);
+  }
+
+  if (relay->out.count)
+    udp_batch_flush(&relay->out);
+}
+
+static struct udp_listener *udp_listener_find(struct udp_relay *relay,
+					      const struct sockaddr_storage *addr)
+{
+  for (int i = 0; i < relay->listeners_count; ++i) {
+    struct udp_listener *listener = &relay->listeners[i];
+
+    if (listener->addr.ss_family != addr->ss_family)
+      continue ;
+    if (udp_addr_is_any(&listener->addr) ||
+	udp_addr_equal(&listener->addr, addr, false))
+      return listener;
+  }
+  return NULL;
+}
+
+/*
+ * Create the association of the client, and reply to its request. relay
+ * is the UDP relay of the next-hop, or NULL to talk to destinations
+ * ourself. On error, cl->request_rep is set and -1 is returned.
+ */
+int udp_associate(Client *cl, const struct sockaddr_storage *relay_addr,
+		  socklen_t relay_addrlen)
+{
+  SocksLink *sl = cl->parent;
+  struct udp_relay *relay = sl->udp_relay;
+  struct udp_flow *flow;
+  struct sockaddr_storage local;
+  struct sockaddr_storage nexthop;
+  socklen_t len = sizeof (local);
+  uint8_t message[3 + SOCKS5_ADDR_MAX] = {SOCKS5_VER, SOCKS5_REP_SUCCEEDED, 0x00};
+  uint16_t *port;
+
+  cl->request_rep = SOCKS5_REP_FAILURE;
+
+  if (getsockname(cl->client.fd, (struct sockaddr *)&local, &len)) {
+    prcl_err(cl, "getsockname failed: %s", strerror(errno));
+    return -1;
+  }
+
+  flow = calloc(sizeof (*flow), 1);
+  if (!flow) {
+    prcl_err(cl, "can't allocate UDP association");
+    return -1;
+  }
+  INIT_LIST_HEAD(&flow->next);
+  flow->fd = -1;
+  flow->client = cl;
+  flow->relay = relay;
+
+  flow->listener = udp_listener_find(relay, &local);
+  if (!flow->listener) {
+    prcl_err(cl, "no UDP socket for this listener");
+    goto error;
+  }
+
+  /* datagrams are only accepted from the client host, or its hop */
+  if (cl->hop_addrlen) {
+    memcpy(&flow->client_addr, &cl->hop_addr, cl->hop_addrlen);
+    flow->client_addrlen = cl->hop_addrlen;
+  } else {
+    memcpy(&flow->client_addr, &cl->client.addr, cl->client.addrlen);
+    flow->client_addrlen = cl->client.addrlen;
+  }
+  port = udp_addr_port(&flow->client_addr);
+  if (!port)
+    goto error;
+  *port = htons(cl->request->port);
+
+  if (relay_addr) {
+    /* "any" means the address we connected to */
+    if (udp_addr_is_any(relay_addr) &&
+	relay_addr->ss_family == cl->server.addr.ss_family) {
+      memcpy(&nexthop, &cl->server.addr, cl->server.addrlen);
+      relay_addrlen = cl->server.addrlen;
+      *udp_addr_port(&nexthop) = *udp_addr_port(relay_addr);
+      relay_addr = &nexthop;
+    }
+    flow->family = relay_addr->ss_family;
+    flow->relayed = true;
+  } else {
+#ifdef HAVE_IPV6
+    flow->family = AF_INET6;
+#else
+    flow->family = AF_INET;
+#endif
+  }
+
+  flow->fd = socket(flow->family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+#ifdef HAVE_IPV6
+  if (flow->fd < 0 && !relay_addr) {
+    flow->family = AF_INET;
+    flow->fd = socket(flow->family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  }
+#endif
+  if (flow->fd < 0) {
+    prcl_err(cl, "can't create UDP socket: %s", strerror(errno));
+    goto error;
+  }
+
+  /* reach IPv4 destinations too */
+  if (flow->family == AF_INET6 && !relay_addr)
+    sock_set_v6only(flow->fd, 0);
+
+  if (sock_set_nonblock(flow->fd) < 0) {
+    prcl_err(cl, "failed to set UDP socket non-blocking");
+    goto error;
+  }
+
+  if (relay_addr &&
+      connect(flow->fd, (const struct sockaddr *)relay_addr, relay_addrlen)) {
+    prcl_err(cl, "can't connect to the next-hop UDP relay: %s",
+	     strerror(errno));
+    cl->request_rep = socks5_reply_errno(errno);
+    goto error;
+  }
+
+  /* the client has no server socket unless the next-hop relays it */
+  if (flow->relayed)
+    admit_fds(sl, 1);
+
+  event_set(&flow->ev, flow->fd, EV_READ | EV_PERSIST, on_udp_flow_read, flow);
+  event_base_set(sl->base, &flow->ev);
+  event_add(&flow->ev, NULL);
+
+  if (*udp_addr_port(&flow->client_addr))
+    udp_flow_hash(relay, flow);
+  else
+    list_add_tail(&flow->next, &relay->pending);
+  cl->udp = flow;
+
+  /* the client sends its datagrams where it reached us */
+  *udp_addr_port(&local) = *udp_addr_port(&flow->listener->addr);
+
+  len = 3 + socks5_addr_write(message + 3, &local);
+  bufferevent_write(cl->client.bufev, message, len);
+
+  prcl_debug(cl, "UDP association %s", flow->relayed ?
+	     "relayed to the next-hop" : "started");
+  return 0;
+
+ error:
+  if (flow->fd >= 0)
+    close(flow->fd);
+  free(flow);
+  return -1;
+}
+
+void udp_release(Client *cl)
+{
+  struct udp_flow *flow = cl->udp;
+
+  if (!flow)
+    return ;
+
+  cl->udp = NULL;
+
+  if (flow->hashed)
+    udp_flow_unhash(flow->relay, flow);
+  else
+    list_del(&flow->next);
+
+  event_del(&flow->ev);
+  close(flow->fd);
+  if (flow->relayed)
+    admit_fds(cl->parent, -1);
+  free(flow);
+}
+
+int udp_start(SocksLink *sl)
+{
+  struct udp_relay *relay;
+  int size = UDP_SOCKET_BUFSIZ;
+
+  if (!sl->udp)
+    return 0;
+
+  relay = calloc(sizeof (*relay), 1);
+  if (!relay) {
+    pr_err(sl, "can't allocate UDP relay");
+    return -1;
+  }
+  relay->sl = sl;
+  INIT_LIST_HEAD(&relay->pending);
+  sl->udp_relay = relay;
+
+  for (int i = 0; i < SOCKSLINK_LISTEN_FD_MAX && sl->fd[i] != -1; ++i) {
+    struct udp_listener *listener = &relay->listeners[relay->listeners_count];
+    socklen_t len = sizeof (listener->addr);
+    char buf[ADDR_NTOP_BUFSIZ];
+    int fd;
+
+    /* datagrams aren't encrypted, keep them off the TLS ports */
+    if (sl->fd_tls[i])
+      continue ;
+
+    if (getsockname(sl->fd[i], (struct sockaddr *)&listener->addr, &len)) {
+      pr_err(sl, "getsockname failed: %s", strerror(errno));
+      return -1;
+    }
+
+    fd = socket(listener->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      pr_err(sl, "can't create UDP socket: %s", strerror(errno));
+      return -1;
+    }
+    listener->fd = fd;
+    listener->relay = relay;
+    relay->listeners_count++;
+
+    if (listener->addr.ss_family == AF_INET6)
+      sock_set_v6only(fd, 1);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size)) ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size)))
+      pr_warn(sl, "can't set UDP socket buffers: %s", strerror(errno));
+
+    if (sock_set_nonblock(fd) < 0) {
+      pr_err(sl, "failed to set UDP socket non-blocking");
+      return -1;
+    }
+
+    if (bind(fd, (const struct sockaddr *)&listener->addr, len)) {
+      pr_err(sl, "UDP bind failed: %s", strerror(errno));
+      return -1;
+    }
+
+    pr_infos(sl, "relaying UDP on %s port %d",
+	     addr_ntop(&listener->addr, buf, sizeof (buf)),
+	     ntohs(*udp_addr_port(&listener->addr)));
+
+    event_set(&listener->ev, fd, EV_READ | EV_PERSIST,
+	      on_udp_listener_read, listener);
+    event_base_set(sl->base, &listener->ev);
+    event_add(&listener->ev, NULL);
+  }
+
+  return 0;
+}
+
+void udp_stop(SocksLink *sl)
+{
+  struct udp_relay *relay = sl->udp_relay;
+  struct udp_flow *flow, *tmp;
+
+  if (!relay)
+    return ;
+
+  for (int i = 0; i < UDP_FLOWS_HASH; ++i) {
+    while (relay->flows[i])
+      udp_release(relay->flows[i]->client);
+  }
+  list_for_each_entry_safe(flow, tmp, &relay->pending, next, struct udp_flow)
+    udp_release(flow->client);
+
+  for (int i = 0; i < relay->listeners_count; ++i) {
+    if (event_initialized(&relay->listeners[i].ev))
+      event_del(&relay->listeners[i].ev);
+    close(relay->listeners[i].fd);
+  }
+
+  free(relay);
+  sl->udp_relay = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef UDP_H
+# define UDP_H
+
+#include <sys/socket.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int udp_start(SocksLink *sl);
+void udp_stop(SocksLink *sl);
+
+int udp_associate(Client *cl, const struct sockaddr_storage *relay,
+		  socklen_t relaylen);
+void udp_release(Client *cl);
+
+#endif /* !UDP_H */
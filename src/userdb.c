@@ -0,0 +1,342 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "config.h"
+#include "userdb.h"
+#include "utils.h"
+
+struct userdb {
+  const uint8_t *map;
+  size_t size;
+  const struct userdb_header *header;
+  const struct userdb_entry *entries;
+};
+
+static void userdb_digest(const uint8_t *salt, const uint8_t *passwd,
+			  size_t len, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+  struct sha256 ctx;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, salt, USERDB_SALT_SIZE);
+  sha256_update(&ctx, passwd, len);
+  sha256_final(&ctx, digest);
+}
+
+static bool userdb_valid(const struct userdb *db)
+{
+  const struct userdb_header *hdr = db->header;
+  uint32_t used = 0;
+  size_t table;
+
+  if (db->size < sizeof (*hdr) ||
+      memcmp(hdr->magic, USERDB_MAGIC, sizeof (hdr->magic)) ||
+      hdr->version != USERDB_VERSION || hdr->size != db->size)
+    return false;
+
+  /* nbuckets must be a non-zero power of two */
+  if (!hdr->nbuckets || (hdr->nbuckets & (hdr->nbuckets - 1)) ||
+      hdr->nentries >= hdr->nbuckets)
+    return false;
+
+  table = sizeof (*hdr) + (size_t)hdr->nbuckets * sizeof (struct userdb_entry);
+  if (table > db->size)
+    return false;
+
+  /* Check every string once, so lookups don't have to */
+  for (uint32_t i = 0; i < hdr->nbuckets; ++i) {
+    const struct userdb_entry *e = &db->entries[i];
+
+    if (!e->name_len)
+      continue ;
+    used++;
+    if (e->name_off < table || e->name_len > db->size ||
+	e->name_off > db->size - e->name_len)
+      return false;
+    if (e->nexthop_len &&
+	(e->nexthop_off < table || e->nexthop_len > db->size ||
+	 e->nexthop_off > db->size - e->nexthop_len))
+      return false;
+  }
+
+  /* lookups stop at an empty bucket, there must be one */
+  return used == hdr->nentries;
+}
+
+struct userdb *userdb_open(const char *path)
+{
+  struct userdb *db;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  db = calloc(sizeof (*db), 1);
+  if (!db) {
+    munmap(map, st.st_size ? st.st_size : 1);
+    return NULL;
+  }
+
+  db->map = map;
+  db->size = st.st_size;
+  db->header = map;
+  db->entries = (const struct userdb_entry *)(db->map + sizeof (*db->header));
+
+  if (!userdb_valid(db)) {
+    userdb_close(db);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return db;
+}
+
+void userdb_close(struct userdb *db)
+{
+  if (!db)
+    return ;
+
+  munmap((void *)db->map, db->size ? db->size : 1);
+  free(db);
+}
+
+uint32_t userdb_nentries(const struct userdb *db)
+{
+  return db->header->nentries;
+}
+
+uint32_t userdb_nbuckets(const struct userdb *db)
+{
+  return db->header->nbuckets;
+}
+
+/* The entry in this bucket, NULL if it's empty */
+const struct userdb_entry *userdb_bucket(const struct userdb *db, uint32_t i)
+{
+  return db->entries[i].name_len ? &db->entries[i] : NULL;
+}
+
+/* The bucket of an entry, to keep data about it next to the table */
+uint32_t userdb_index(const struct userdb *db,
+		      const struct userdb_entry *entry)
+{
+  return entry - db->entries;
+}
+
+const struct userdb_entry *userdb_lookup(const struct userdb *db,
+					 const uint8_t *name, size_t len)
+{
+  uint32_t mask = db->header->nbuckets - 1;
+  uint32_t hash = hash_fnv1a(HASH_FNV1A_INIT, name, len);
+
+  /* there is always an empty bucket, this ends */
+  for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+    const struct userdb_entry *e = &db->entries[i];
+
+    if (!e->name_len)
+      return NULL;
+    if (e->hash == hash && e->name_len == len &&
+	!memcmp(db->map + e->name_off, name, len))
+      return e;
+  }
+}
+
+bool userdb_check_password(const struct userdb_entry *entry,
+			   const uint8_t *passwd, size_t len)
+{
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  uint8_t diff = 0;
+
+  userdb_digest(entry->salt, passwd, len, digest);
+
+  /* constant time */
+  for (int i = 0; i < SHA256_DIGEST_SIZE; ++i)
+    diff |= digest[i] ^ entry->digest[i];
+
+  return !diff;
+}
+
+const char *userdb_nexthop(const struct userdb *db,
+			   const struct userdb_entry *entry,
+			   char *dst, size_t size)
+{
+  if (!entry->nexthop_len || entry->nexthop_len >= size)
+    return NULL;
+
+  memcpy(dst, db->map + entry->nexthop_off, entry->nexthop_len);
+  dst[entry->nexthop_len] = '\0';
+  return dst;
+}
+
+/*
+ * Compile "username:password[:next-hop]" lines, '#' starts a comment.
+ * The output is written to a temporary file then renamed, so a running
+ * sockslinkd never maps a partial file. On syntax errors, errno is
+ * EINVAL and lineno the faulty line, EEXIST if its user was already
+ * given.
+ */
+int userdb_compile(FILE *in, const char *output, int *lineno)
+{
+  struct userdb_header hdr;
+  struct userdb_entry *entries = NULL;
+  char *strings = NULL;
+  size_t strings_len = 0, strings_size = 0;
+  uint32_t nentries = 0, nbuckets = 16;
+  char line[1024];
+  char *tmp = NULL;
+  size_t table;
+  int fd = -1;
+  int ret = -1;
+
+  /* First pass: count users to size the table (load factor <= 0.5) */
+  while (fgets(line, sizeof (line), in))
+    if (*line != '#' && *line != '\n')
+      nentries++;
+  while (nbuckets < nentries * 2)
+    nbuckets *= 2;
+  rewind(in);
+
+  entries = calloc(nbuckets, sizeof (*entries));
+  if (!entries)
+    goto exit;
+
+  table = sizeof (hdr) + nbuckets * sizeof (*entries);
+  nentries = 0;
+  *lineno = 0;
+
+  while (fgets(line, sizeof (line), in)) {
+    char *name, *passwd, *nexthop, *end;
+    size_t name_len, nexthop_len;
+    uint32_t hash, i;
+    struct userdb_entry *e;
+
+    ++*lineno;
+    if (*line == '#' || *line == '\n')
+      continue ;
+
+    end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+
+    name = line;
+    passwd = strchr(name, ':');
+    if (!passwd) {
+      errno = EINVAL;
+      goto exit;
+    }
+    *passwd++ = '\0';
+    nexthop = strchr(passwd, ':');
+    if (nexthop)
+      *nexthop++ = '\0';
+
+    /* next-hops may contain ':' themselves, passwords can't */
+    name_len = strlen(name);
+    nexthop_len = nexthop ? strlen(nexthop) : 0;
+    if (!name_len || name_len > 255 || strlen(passwd) > 255 ||
+	nexthop_len > 255) {
+      errno = EINVAL;
+      goto exit;
+    }
+
+    hash = hash_fnv1a(HASH_FNV1A_INIT, name, name_len);
+    for (i = hash & (nbuckets - 1); entries[i].name_len;
+	 i = (i + 1) & (nbuckets - 1)) {
+      e = &entries[i];
+      if (e->hash == hash && e->name_len == name_len &&
+	  !memcmp(strings + e->name_off - table, name, name_len)) {
+	errno = EEXIST;
+	goto exit;
+      }
+    }
+    e = &entries[i];
+
+    if (strings_len + name_len + nexthop_len > strings_size) {
+      char *p;
+
+      strings_size = (strings_size + name_len + nexthop_len) * 2;
+      p = realloc(strings, strings_size);
+      if (!p)
+	goto exit;
+      strings = p;
+    }
+
+    e->hash = hash;
+    e->name_len = name_len;
+    e->name_off = table + strings_len;
+    memcpy(strings + strings_len, name, name_len);
+    strings_len += name_len;
+
+    if (nexthop_len) {
+      e->nexthop_len = nexthop_len;
+      e->nexthop_off = table + strings_len;
+      memcpy(strings + strings_len, nexthop, nexthop_len);
+      strings_len += nexthop_len;
+    }
+
+    if (getrandom(e->salt, sizeof (e->salt), 0) != sizeof (e->salt))
+      goto exit;
+    userdb_digest(e->salt, (uint8_t *)passwd, strlen(passwd), e->digest);
+    nentries++;
+  }
+
+  memset(&hdr, 0, sizeof (hdr));
+  memcpy(hdr.magic, USERDB_MAGIC, sizeof (hdr.magic));
+  hdr.version = USERDB_VERSION;
+  hdr.nbuckets = nbuckets;
+  hdr.nentries = nentries;
+  hdr.size = table + strings_len;
+
+  if (asprintf(&tmp, "%s.XXXXXX", output) < 0) {
+    tmp = NULL;
+    goto exit;
+  }
+
+  fd = mkstemp(tmp);
+  if (fd == -1)
+    goto exit;
+
+  if (write(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+      write(fd, entries, nbuckets * sizeof (*entries)) !=
+      nbuckets * sizeof (*entries) ||
+      (strings_len && write(fd, strings, strings_len) != strings_len))
+    goto exit;
+
+  if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP) || fsync(fd))
+    goto exit;
+
+  if (rename(tmp, output))
+    goto exit;
+
+  ret = 0;
+ exit:
+  if (fd != -1)
+    close(fd);
+  if (ret && tmp)
+    unlink(tmp);
+  free(tmp);
+  free(entries);
+  free(strings);
+  return ret;
+}
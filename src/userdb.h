@@ -0,0 +1,63 @@
+#ifndef USERDB_H
+# define USERDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sha256.h"
+
+/*
+ * Compiled users file (sockslink-userdb), mapped read-only by
+ * sockslinkd. All integers are in host byte order.
+ *
+ * header | entries[nbuckets] | strings
+ *
+ * Entries are an open addressing hash table (linear probing) on
+ * the username, empty buckets have a zero name_len.
+ */
+
+#define USERDB_MAGIC		"SLUSERDB"
+#define USERDB_VERSION		1
+#define USERDB_SALT_SIZE	16
+
+struct userdb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nbuckets;	/* power of two */
+  uint32_t nentries;
+  uint32_t size;	/* of the whole file */
+};
+
+struct userdb_entry {
+  uint32_t hash;
+  uint32_t name_off;	/* from the start of the file */
+  uint32_t nexthop_off;
+  uint8_t name_len;
+  uint8_t nexthop_len;	/* 0 for the default next-hop */
+  uint8_t pad[2];
+  uint8_t salt[USERDB_SALT_SIZE];
+  uint8_t digest[SHA256_DIGEST_SIZE]; /* sha256(salt . password) */
+};
+
+struct userdb;
+
+struct userdb *userdb_open(const char *path);
+void userdb_close(struct userdb *db);
+
+const struct userdb_entry *userdb_lookup(const struct userdb *db,
+					 const uint8_t *name, size_t len);
+bool userdb_check_password(const struct userdb_entry *entry,
+			   const uint8_t *passwd, size_t len);
+const char *userdb_nexthop(const struct userdb *db,
+			   const struct userdb_entry *entry,
+			   char *dst, size_t size);
+uint32_t userdb_nentries(const struct userdb *db);
+uint32_t userdb_nbuckets(const struct userdb *db);
+const struct userdb_entry *userdb_bucket(const struct userdb *db, uint32_t i);
+uint32_t userdb_index(const struct userdb *db,
+		      const struct userdb_entry *entry);
+
+int userdb_compile(FILE *in, const char *output, int *lineno);
+
+#endif /* !USERDB_H */
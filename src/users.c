@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "client.h"
+#include "users.h"
+#include "userdb.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * The compiled users file, with the next-hops of its users parsed when
+ * it is loaded. They must be addresses: reloads run in the event loop,
+ * which never waits for a resolver.
+ */
+struct users {
+  struct userdb *db;
+  struct users_nexthop {
+    struct sockaddr_storage addr;
+    socklen_t addrlen; /* 0 for the default next-hop */
+  } *nexthops; /* by bucket of db */
+};
+
+static void users_close(struct users *users)
+{
+  if (!users)
+    return ;
+
+  userdb_close(users->db);
+  free(users->nexthops);
+  free(users);
+}
+
+static struct users *users_open(SocksLink *sl, const char *path)
+{
+  struct users *users;
+  const struct userdb_entry *entry;
+  uint32_t *resolved = NULL; /* first bucket of each next-hop */
+  uint32_t nresolved = 0;
+  char nexthop[256], other[256];
+  uint32_t i, j;
+  int ret;
+
+  users = calloc(sizeof (*users), 1);
+  if (!users)
+    return NULL;
+
+  users->db = userdb_open(path);
+  if (!users->db) {
+    pr_err(sl, "can't load users file '%s': %s", path,
+	   errno == EINVAL ? "invalid format" : strerror(errno));
+    goto error;
+  }
+
+  users->nexthops = calloc(sizeof (*users->nexthops),
+			   userdb_nbuckets(users->db));
+  resolved = calloc(sizeof (*resolved), userdb_nbuckets(users->db));
+  if (!users->nexthops || !resolved) {
+    pr_err(sl, "can't load users file '%s': %s", path, strerror(errno));
+    goto error;
+  }
+
+  for (i = 0; i < userdb_nbuckets(users->db); ++i) {
+    entry = userdb_bucket(users->db, i);
+    if (!entry ||
+	!userdb_nexthop(users->db, entry, nexthop, sizeof (nexthop)))
+      continue ;
+
+    /* users mostly share a few next-hops, parse each once */
+    for (j = 0; j < nresolved; ++j) {
+      userdb_nexthop(users->db, userdb_bucket(users->db, resolved[j]),
+		     other, sizeof (other));
+      if (!strcmp(nexthop, other))
+	break ;
+    }
+    if (j < nresolved) {
+      users->nexthops[i] = users->nexthops[resolved[j]];
+      continue ;
+    }
+
+    ret = parse_nexthop_numeric(nexthop, &users->nexthops[i].addr,
+				&users->nexthops[i].addrlen);
+    if (ret) {
+      pr_err(sl, "%s: invalid next-hop address '%s': %s", path, nexthop,
+	     gai_strerror(ret));
+      goto error;
+    }
+    resolved[nresolved++] = i;
+  }
+
+  free(resolved);
+  return users;
+
+ error:
+  free(resolved);
+  users_close(users);
+  return NULL;
+}
+
+int users_load(SocksLink *sl)
+{
+  if (!sl->users_file)
+    return 0;
+
+  sl->users = users_open(sl, sl->users_file);
+  if (!sl->users)
+    return -1;
+
+  pr_infos(sl, "%u users loaded from %s", userdb_nentries(sl->users->db),
+	   sl->users_file);
+  return 0;
+}
+
+/* Swap tables only once the new one is valid */
+void users_reload(SocksLink *sl)
+{
+  struct users *users;
+
+  if (!sl->users_file)
+    return ;
+
+  users = users_open(sl, sl->users_file);
+  if (!users) {
+    pr_err(sl, "keeping the old users file");
+    return ;
+  }
+
+  users_close(sl->users);
+  sl->users = users;
+
+  pr_infos(sl, "%u users reloaded from %s", userdb_nentries(users->db),
+	   sl->users_file);
+}
+
+void users_unload(SocksLink *sl)
+{
+  users_close(sl->users);
+  sl->users = NULL;
+}
+
+/*
+ * Returns -1 if the users file doesn't know this client, the next
+ * backends may (aliases, routes, PAM, plugin or helper)
+ */
+int users_call(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+  const struct userdb_entry *entry;
+  const struct users_nexthop *nexthop;
+
+  if (!sl->users || cl->client_method != AUTH_METHOD_USERNAME)
+    return -1;
+
+  entry = userdb_lookup(sl->users->db, cl->auth.username.uname,
+			cl->auth.username.ulen);
+  if (!entry)
+    return -1;
+
+  if (!userdb_check_password(entry, cl->auth.username.passwd,
+			     cl->auth.username.plen)) {
+    client_auth_reject(cl, "bad password");
+    return 0;
+  }
+
+  prcl_debug(cl, "authenticated by users file");
+
+  nexthop = &sl->users->nexthops[userdb_index(sl->users->db, entry)];
+
+  /* Forward client credentials */
+  cl->server_method = cl->client_method;
+  if (nexthop->addrlen)
+    client_auth_accept(cl, &nexthop->addr, nexthop->addrlen);
+  else
+    client_auth_accept(cl, &sl->nexthop_addr, sl->nexthop_addrlen);
+  return 0;
+}
+
+/*
+ * Once no backend took the client, nor an helper may: with a users
+ * file, a username it doesn't know isn't forwarded to the default
+ * next-hop. Returns -1 if the client may go there.
+ */
+int users_reject(Client *cl)
+{
+  SocksLink *sl = cl->parent;
+
+  if (!sl->users || sl->helpers_max ||
+      cl->client_method != AUTH_METHOD_USERNAME)
+    return -1;
+
+  client_auth_reject(cl, "no such user");
+  return 0;
+}
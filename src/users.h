@@ -0,0 +1,14 @@
+#ifndef USERS_H
+# define USERS_H
+
+#include "sockslink.h"
+#include "client.h"
+
+int users_load(SocksLink *sl);
+void users_reload(SocksLink *sl);
+void users_unload(SocksLink *sl);
+
+int users_call(Client *client);
+int users_reject(Client *client);
+
+#endif /* !USERS_H */
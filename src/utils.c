@@ -31,6 +31,14 @@ int sock_set_reuseaddr(int s, int on)
   return setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
 }
 
+/* on with 0 seconds: close() resets the connection */
+int sock_set_linger(int s, int on, int secs)
+{
+  struct linger linger = {on, secs};
+
+  return setsockopt(s, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+}
+
 int sock_set_nonblock(int s)
 {
   int flags;
@@ -68,6 +76,21 @@ const char *addr_ntop(const struct sockaddr_storage *addr,
   return ret;
 }
 
+/*
+ * FNV-1a of data, continuing hash: start from HASH_FNV1A_INIT, or the
+ * hash of what comes before
+ */
+uint32_t hash_fnv1a(uint32_t hash, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  while (len--) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 /**
  * strlcat - Append a length-limited, %NUL-terminated string to another
  * @dest: The string to be appended to
@@ -187,9 +210,9 @@ int urlencode(const char *src, size_t srclen, char *dst, size_t dstlen)
   return bytes;
 }
 
-int parse_ip_port(const char *str, const char *fallback_service,
-		  struct sockaddr_storage *addr,
-		  socklen_t *addrlen)
+static int parse_ip_port_flags(const char *str, const char *fallback_service,
+			       int flags, struct sockaddr_storage *addr,
+			       socklen_t *addrlen)
 {
   struct addrinfo hints;
   struct addrinfo *result;
@@ -199,7 +222,7 @@ int parse_ip_port(const char *str, const char *fallback_service,
   int ret;
 
   memset(&hints, 0, sizeof (hints));
-  hints.ai_flags = AI_PASSIVE;     /* For wildcard IP address */
+  hints.ai_flags = flags;
 
   if (*tmp == '[') {
     /* IPV6: [ipv6]:port */
@@ -236,3 +259,45 @@ int parse_ip_port(const char *str, const char *fallback_service,
   freeaddrinfo(result);
   return 0;
 }
+
+int parse_ip_port(const char *str, const char *fallback_service,
+		  struct sockaddr_storage *addr,
+		  socklen_t *addrlen)
+{
+  /* For wildcard IP address */
+  return parse_ip_port_flags(str, fallback_service, AI_PASSIVE, addr, addrlen);
+}
+
+static int parse_nexthop_flags(const char *address, const char *service,
+			       int flags, struct sockaddr_storage *addr,
+			       socklen_t *addrlen)
+{
+  if (!strcmp(address, "direct")) {
+    memset(addr, 0, sizeof (*addr));
+    addr->ss_family = AF_UNSPEC;
+    *addrlen = sizeof (addr->ss_family);
+    return 0;
+  }
+
+  return parse_ip_port_flags(address, service, flags, addr, addrlen);
+}
+
+/* Like parse_ip_port(), but also accepts "direct" */
+int parse_nexthop(const char *address, struct sockaddr_storage *addr,
+		  socklen_t *addrlen)
+{
+  return parse_nexthop_flags(address, "socks", AI_PASSIVE, addr, addrlen);
+}
+
+/*
+ * Like parse_nexthop(), for the files reloaded on SIGHUP: reloads run in
+ * the event loop, so only addresses and port numbers are taken, never
+ * names to look up
+ */
+int parse_nexthop_numeric(const char *address, struct sockaddr_storage *addr,
+			  socklen_t *addrlen)
+{
+  return parse_nexthop_flags(address, "1080",
+			     AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV,
+			     addr, addrlen);
+}
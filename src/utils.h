@@ -1,6 +1,8 @@
 #ifndef UTILS_H
 # define UTILS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include "config.h"
 
@@ -8,11 +10,15 @@ int sock_set_v6only(int s, int on);
 int sock_set_tcpnodelay(int s, int on);
 int sock_set_nonblock(int s);
 int sock_set_reuseaddr(int s, int on);
+int sock_set_linger(int s, int on, int secs);
 
 size_t strlcpy(char *dst, const char *src, size_t size);
 size_t strlcat(char *dst, const char *src, size_t size);
 char *strnchr(const char *s, size_t count, int c);
 
+#define HASH_FNV1A_INIT 2166136261u
+uint32_t hash_fnv1a(uint32_t hash, const void *data, size_t len);
+
 int urldecode(const char *src, size_t srclen, char *dst, size_t dstlen);
 int urlencode(const char *src, size_t srclen, char *dst, size_t dstlen);
 
@@ -28,5 +34,16 @@ const char *addr_ntop(const struct sockaddr_storage *addr,
 int parse_ip_port(const char *address, const char *fallback_service,
 		  struct sockaddr_storage *addr,
 		  socklen_t *addrlen);
+int parse_nexthop(const char *address, struct sockaddr_storage *addr,
+		  socklen_t *addrlen);
+int parse_nexthop_numeric(const char *address, struct sockaddr_storage *addr,
+			  socklen_t *addrlen);
+
+/* "direct" next-hop: connect to the destination ourself */
+static inline bool nexthop_is_direct(const struct sockaddr_storage *addr,
+				     socklen_t addrlen)
+{
+  return addrlen && addr->ss_family == AF_UNSPEC;
+}
 
 #endif /* !UTILS_H */
@@ -0,0 +1,216 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "sockslink.h"
+#include "wheel.h"
+#include "list.h"
+#include "log.h"
+
+/*
+ * Timer wheel
+ *
+ * Handshake, idle and helper timeouts are counted in seconds by one
+ * hierarchical wheel per process, shared by the virtual listeners, and
+ * driven by a single libevent timer ticking every second. Adding or
+ * removing a timer is a list operation, instead of an update of the
+ * libevent heap for each connection.
+ *
+ * Timers expiring within WHEEL_SIZE ticks sit in the slots of the
+ * first level, the next levels hold coarser ranges which cascade down
+ * when the first level wraps. Connections don't move their timer on
+ * I/O, they stamp wheel_now() and their callback sets the timer again
+ * for the rest of their timeout when it fires.
+ */
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_MAX	((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct wheel {
+  struct event tick;
+  struct timespec start; /* of tick 0 */
+  unsigned long jiffies; /* next tick to run */
+  struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* Virtual listeners use the wheel of the main SocksLink */
+static struct wheel *wheel_get(SocksLink *sl)
+{
+  return sl->master ? sl->master->wheel : sl->wheel;
+}
+
+static void wheel_place(struct wheel *w, struct wheel_timer *timer)
+{
+  unsigned long expires = timer->expires;
+  unsigned long delta = expires - w->jiffies;
+  int level;
+
+  /* already due, run it with the next tick */
+  if ((long)delta < 0) {
+    expires = w->jiffies;
+    delta = 0;
+  } else if (delta > WHEEL_MAX) {
+    /* the callback finds it early and sets it again */
+    expires = w->jiffies + WHEEL_MAX;
+    delta = WHEEL_MAX;
+  }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; ++level)
+    if (delta < 1UL << (WHEEL_BITS * (level + 1)))
+      break ;
+
+  list_add_tail(&timer->next,
+		&w->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+}
+
+/* Spread the timers of a slot of this level on the levels below */
+static int wheel_cascade(struct wheel *w, int level)
+{
+  int index = (w->jiffies >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  struct wheel_timer *timer, *tmp;
+  LIST_HEAD(slot);
+
+  list_splice_init(&w->slots[level][index], &slot);
+  list_for_each_entry_safe(timer, tmp, &slot, next, struct wheel_timer)
+    wheel_place(w, timer);
+
+  return index;
+}
+
+static void wheel_run_tick(struct wheel *w)
+{
+  int index = w->jiffies & WHEEL_MASK;
+  struct wheel_timer *timer;
+  LIST_HEAD(slot);
+
+  for (int level = 1; !index && level < WHEEL_LEVELS; ++level)
+    index = wheel_cascade(w, level);
+
+  list_splice_init(&w->slots[0][w->jiffies & WHEEL_MASK], &slot);
+  w->jiffies++;
+
+  /* callbacks may add or remove timers, this one included */
+  while (!list_empty(&slot)) {
+    timer = list_first_entry(&slot, struct wheel_timer, next);
+    list_del_init(&timer->next);
+    timer->cb(timer);
+  }
+}
+
+/* Seconds since the wheel started */
+static unsigned long wheel_elapsed(struct wheel *w)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec - w->start.tv_sec -
+    (now.tv_nsec < w->start.tv_nsec ? 1 : 0);
+}
+
+static void on_wheel_tick(int fd, short ev, void *arg)
+{
+  struct wheel *w = arg;
+  unsigned long elapsed = wheel_elapsed(w);
+  struct timespec now;
+  struct timeval tv;
+  long nsec;
+
+  /* catch up with the ticks the loop was too busy to run */
+  while (w->jiffies <= elapsed)
+    wheel_run_tick(w);
+
+  /* next tick at start + jiffies, without drifting */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  nsec = (w->start.tv_sec + (long)w->jiffies - now.tv_sec) * 1000000000L +
+    w->start.tv_nsec - now.tv_nsec;
+  if (nsec < 0)
+    nsec = 0;
+  tv.tv_sec = nsec / 1000000000L;
+  tv.tv_usec = (nsec % 1000000000L) / 1000;
+  evtimer_add(&w->tick, &tv);
+}
+
+int wheel_start(SocksLink *sl)
+{
+  struct wheel *w;
+
+  w = malloc(sizeof (*w));
+  if (!w) {
+    pr_err(sl, "can't allocate the timer wheel");
+    return -1;
+  }
+
+  for (int level = 0; level < WHEEL_LEVELS; ++level)
+    for (int i = 0; i < WHEEL_SIZE; ++i)
+      INIT_LIST_HEAD(&w->slots[level][i]);
+
+  clock_gettime(CLOCK_MONOTONIC, &w->start);
+  w->jiffies = 1;
+  sl->wheel = w;
+
+  evtimer_set(&w->tick, on_wheel_tick, w);
+  event_base_set(sl->base, &w->tick);
+  on_wheel_tick(-1, 0, w);
+  return 0;
+}
+
+void wheel_stop(SocksLink *sl)
+{
+  struct wheel *w = sl->wheel;
+  struct wheel_timer *timer, *tmp;
+
+  if (!w)
+    return ;
+
+  /* left over timers become idle, their owners may still delete them */
+  for (int level = 0; level < WHEEL_LEVELS; ++level)
+    for (int i = 0; i < WHEEL_SIZE; ++i)
+      list_for_each_entry_safe(timer, tmp, &w->slots[level][i], next,
+			       struct wheel_timer)
+	list_del_init(&timer->next);
+
+  event_del(&w->tick);
+  free(w);
+  sl->wheel = NULL;
+}
+
+/* Current tick, to stamp activity with */
+unsigned long wheel_now(SocksLink *sl)
+{
+  return wheel_get(sl)->jiffies;
+}
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_cb cb)
+{
+  INIT_LIST_HEAD(&timer->next);
+  timer->expires = 0;
+  timer->cb = cb;
+}
+
+/* (Re)arm the timer to fire in at least this number of seconds */
+void wheel_add(SocksLink *sl, struct wheel_timer *timer, unsigned long seconds)
+{
+  struct wheel *w = wheel_get(sl);
+
+  list_del_init(&timer->next);
+  if (!w)
+    return ;
+
+  timer->expires = w->jiffies + seconds;
+  wheel_place(w, timer);
+}
+
+void wheel_del(struct wheel_timer *timer)
+{
+  list_del_init(&timer->next);
+}
+
+bool wheel_pending(const struct wheel_timer *timer)
+{
+  return !list_empty(&timer->next);
+}
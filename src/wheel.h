@@ -0,0 +1,31 @@
+#ifndef WHEEL_H
+# define WHEEL_H
+
+#include <stdbool.h>
+
+#include "list.h"
+
+struct sockslink;
+struct wheel_timer;
+
+typedef void (*wheel_cb)(struct wheel_timer *timer);
+
+/* A timeout in the wheel, in seconds */
+struct wheel_timer {
+  struct list_head next; /* empty when not pending */
+  unsigned long expires; /* tick it fires at */
+  wheel_cb cb;
+};
+
+int wheel_start(struct sockslink *sl);
+void wheel_stop(struct sockslink *sl);
+
+unsigned long wheel_now(struct sockslink *sl);
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_cb cb);
+void wheel_add(struct sockslink *sl, struct wheel_timer *timer,
+	       unsigned long seconds);
+void wheel_del(struct wheel_timer *timer);
+bool wheel_pending(const struct wheel_timer *timer);
+
+#endif /* !WHEEL_H */
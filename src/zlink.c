@@ -0,0 +1,486 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "config.h"
+
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+#include "sockslink.h"
+#include "client.h"
+#include "zlink.h"
+#include "list.h"
+#include "utils.h"
+#include "admit.h"
+#include "log.h"
+
+#ifdef HAVE_ZLIB
+
+/*
+ * Compressed links between sockslinkd instances
+ *
+ * Selected with AUTH_METHOD_HOP_ZLIB, see hop.c: past the handshake
+ * message, and past the method reply the other way, both directions
+ * carry frames:
+ *
+ *   type (1) | length (2) | payload
+ *
+ * DEFLATE frames hold raw deflate data ending with a sync flush, for at
+ * most ZLINK_CHUNK bytes of stream, RAW frames hold bytes which went
+ * around the compressor: each side keeps one deflate stream per
+ * direction, which never sees them.
+ *
+ * Chunks shorter than ZLINK_MIN_LEN are always sent as is, chunks
+ * which don't shrink by ZLINK_MIN_SAVING send the next ZLINK_BYPASS
+ * bytes uncompressed before trying again, and a connection which used
+ * ZLINK_BUDGET microseconds of compression in the current second sends
+ * uncompressed data until the next one.
+ *
+ * Like tunnels, the link is put behind a socketpair, the peer gets the
+ * other end and keeps reading and writing plain SOCKS5.
+ */
+
+#define ZLINK_HEADER_LEN	3
+#define ZLINK_MIN_LEN		64	/* handshakes and keystrokes */
+#define ZLINK_MIN_SAVING	8	/* at least 1/8th smaller */
+
+/* Small windows, links are many and the data is mostly short lived */
+#define ZLINK_WINDOW_BITS	12
+#define ZLINK_MEM_LEVEL		5
+
+enum {
+  ZLINK_RAW = 0,
+  ZLINK_DEFLATE,
+};
+
+struct zlink {
+  struct list_head next;
+  SocksLink *sl;
+  int raw_fd;
+  struct bufferevent *raw; /* the connection to the other sockslinkd */
+  int fd;
+  struct bufferevent *bufev; /* our end of the socketpair */
+  size_t raw_in; /* bytes still to pass as is, before the first frame */
+  z_stream deflate;
+  z_stream inflate;
+  size_t bypass; /* bytes to send uncompressed before trying again */
+  time_t budget_second;
+  long budget_used; /* microseconds of compression in budget_second */
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  bool eof; /* local end closed, freed once the link is flushed */
+  bool closing; /* link closed, freed once the local end is flushed */
+};
+
+struct zlinks {
+  struct list_head links;
+};
+
+static void zlink_free(struct zlink *zl)
+{
+  pr_debug(zl->sl, "compressed link closed, %llu bytes sent as %llu",
+	   zl->bytes_in, zl->bytes_out);
+
+  bufferevent_disable(zl->raw, EV_READ | EV_WRITE);
+  bufferevent_free(zl->raw);
+  close(zl->raw_fd);
+  bufferevent_disable(zl->bufev, EV_READ | EV_WRITE);
+  bufferevent_free(zl->bufev);
+  close(zl->fd);
+
+  deflateEnd(&zl->deflate);
+  inflateEnd(&zl->inflate);
+  admit_fds(zl->sl, -2);
+  list_del(&zl->next);
+  free(zl);
+}
+
+static long zlink_usec(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000 +
+    (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void zlink_frame_write(struct zlink *zl, uint8_t type,
+			      const void *data, size_t len)
+{
+  uint8_t header[ZLINK_HEADER_LEN] = {type, len >> 8, len & 0xff};
+
+  bufferevent_write(zl->raw, header, sizeof (header));
+  bufferevent_write(zl->raw, (void *)data, len);
+  zl->bytes_out += ZLINK_HEADER_LEN + len;
+}
+
+/* Whether this chunk may be compressed, given the bypass and the budget */
+static bool zlink_should_compress(struct zlink *zl, size_t len,
+				  const struct timespec *now)
+{
+  if (len < ZLINK_MIN_LEN)
+    return false;
+
+  if (zl->bypass) {
+    zl->bypass = zl->bypass > len ? zl->bypass - len : 0;
+    return false;
+  }
+
+  if (now->tv_sec != zl->budget_second) {
+    zl->budget_second = now->tv_sec;
+    zl->budget_used = 0;
+  }
+  return zl->budget_used < ZLINK_BUDGET;
+}
+
+static int zlink_compress(struct zlink *zl, uint8_t *data, size_t len)
+{
+  uint8_t out[ZLINK_CHUNK * 2];
+  struct timespec start, end;
+  size_t outlen;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!zlink_should_compress(zl, len, &start)) {
+    zlink_frame_write(zl, ZLINK_RAW, data, len);
+    return 0;
+  }
+
+  zl->deflate.next_in = data;
+  zl->deflate.avail_in = len;
+  zl->deflate.next_out = out;
+  zl->deflate.avail_out = sizeof (out);
+  if (deflate(&zl->deflate, Z_SYNC_FLUSH) != Z_OK ||
+      zl->deflate.avail_in) {
+    pr_err(zl->sl, "deflate failed: %s",
+	   zl->deflate.msg ? zl->deflate.msg : "no room");
+    return -1;
+  }
+  outlen = sizeof (out) - zl->deflate.avail_out;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  zl->budget_used += zlink_usec(&start, &end);
+
+  /* not worth it, leave the compressor alone for a while */
+  if (outlen > len - len / ZLINK_MIN_SAVING)
+    zl->bypass = ZLINK_BYPASS;
+
+  zlink_frame_write(zl, ZLINK_DEFLATE, out, outlen);
+  return 0;
+}
+
+/*
+ * Compress what the local end wrote, as long as the link keeps up.
+ * Returns -1 if the link was freed.
+ */
+static int zlink_send(struct zlink *zl)
+{
+  struct evbuffer *input = EVBUFFER_INPUT(zl->bufev);
+  size_t len;
+
+  while ((len = EVBUFFER_LENGTH(input))) {
+    if (!zl->eof &&
+	EVBUFFER_LENGTH(EVBUFFER_OUTPUT(zl->raw)) >= ZLINK_BUFSIZ) {
+      /* wait for the link to drain */
+      bufferevent_disable(zl->bufev, EV_READ);
+      return 0;
+    }
+
+    if (len > ZLINK_CHUNK)
+      len = ZLINK_CHUNK;
+    if (zlink_compress(zl, EVBUFFER_DATA(input), len)) {
+      zlink_free(zl);
+      return -1;
+    }
+    zl->bytes_in += len;
+    evbuffer_drain(input, len);
+  }
+
+  if (!zl->eof)
+    return 0;
+
+  if (!EVBUFFER_LENGTH(EVBUFFER_OUTPUT(zl->raw))) {
+    zlink_free(zl);
+    return -1;
+  }
+  bufferevent_disable(zl->raw, EV_READ);
+  bufferevent_setwatermark(zl->raw, EV_WRITE, 0, 0);
+  return 0;
+}
+
+static int zlink_inflate(struct zlink *zl, uint8_t *data, size_t len)
+{
+  uint8_t out[ZLINK_CHUNK];
+  int ret;
+
+  zl->inflate.next_in = data;
+  zl->inflate.avail_in = len;
+  zl->inflate.next_out = out;
+  zl->inflate.avail_out = sizeof (out);
+  ret = inflate(&zl->inflate, Z_SYNC_FLUSH);
+
+  /* a frame never holds more than a chunk */
+  if ((ret != Z_OK && ret != Z_BUF_ERROR) || zl->inflate.avail_in) {
+    pr_warn(zl->sl, "invalid compressed frame: %s",
+	    zl->inflate.msg ? zl->inflate.msg : "too large");
+    return -1;
+  }
+
+  bufferevent_write(zl->bufev, out, sizeof (out) - zl->inflate.avail_out);
+  return 0;
+}
+
+/*
+ * Write the frames received to the local end, as long as it keeps up.
+ * Returns -1 if the link was freed.
+ */
+static int zlink_receive(struct zlink *zl)
+{
+  struct evbuffer *input = EVBUFFER_INPUT(zl->raw);
+  struct evbuffer *output = EVBUFFER_OUTPUT(zl->bufev);
+  uint8_t *frame;
+  size_t len;
+
+  if (zl->raw_in && EVBUFFER_LENGTH(input)) {
+    len = EVBUFFER_LENGTH(input);
+    if (len > zl->raw_in)
+      len = zl->raw_in;
+    bufferevent_write(zl->bufev, EVBUFFER_DATA(input), len);
+    evbuffer_drain(input, len);
+    zl->raw_in -= len;
+  }
+
+  while (!zl->raw_in && EVBUFFER_LENGTH(output) < ZLINK_BUFSIZ &&
+	 EVBUFFER_LENGTH(input) >= ZLINK_HEADER_LEN) {
+    frame = EVBUFFER_DATA(input);
+    len = (frame[1] << 8) | frame[2];
+
+    /* from the header, not once a bogus payload is there */
+    if (frame[0] != ZLINK_DEFLATE &&
+	(frame[0] != ZLINK_RAW || len > ZLINK_CHUNK)) {
+      pr_warn(zl->sl, "invalid frame on a compressed link");
+      zlink_free(zl);
+      return -1;
+    }
+    if (EVBUFFER_LENGTH(input) < ZLINK_HEADER_LEN + len)
+      break ;
+
+    if (frame[0] == ZLINK_DEFLATE) {
+      if (zlink_inflate(zl, frame + ZLINK_HEADER_LEN, len)) {
+	zlink_free(zl);
+	return -1;
+      }
+    } else
+      bufferevent_write(zl->bufev, frame + ZLINK_HEADER_LEN, len);
+    evbuffer_drain(input, ZLINK_HEADER_LEN + len);
+  }
+
+  if (zl->closing && !EVBUFFER_LENGTH(output)) {
+    zlink_free(zl);
+    return -1;
+  }
+  return 0;
+}
+
+static void on_zlink_raw_read(struct bufferevent *bev, void *ctx)
+{
+  zlink_receive(ctx);
+}
+
+static void on_zlink_raw_write(struct bufferevent *bev, void *ctx)
+{
+  struct zlink *zl = ctx;
+
+  if (zl->eof) {
+    if (!EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)))
+      zlink_free(zl);
+    return ;
+  }
+
+  /* room on the link again */
+  bufferevent_enable(zl->bufev, EV_READ);
+  zlink_send(zl);
+}
+
+static void on_zlink_raw_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct zlink *zl = ctx;
+
+  if (zl->eof || zl->closing) {
+    zlink_free(zl);
+    return ;
+  }
+
+  /* deliver what was received, then close the local end */
+  zl->closing = true;
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  bufferevent_disable(zl->bufev, EV_READ);
+  bufferevent_setwatermark(zl->bufev, EV_WRITE, 0, 0);
+  zlink_receive(zl);
+}
+
+static void on_zlink_read(struct bufferevent *bev, void *ctx)
+{
+  zlink_send(ctx);
+}
+
+static void on_zlink_write(struct bufferevent *bev, void *ctx)
+{
+  struct zlink *zl = ctx;
+
+  /* the local end caught up */
+  zlink_receive(zl);
+}
+
+static void on_zlink_event(struct bufferevent *bev, short why, void *ctx)
+{
+  struct zlink *zl = ctx;
+
+  if (zl->eof || zl->closing) {
+    zlink_free(zl);
+    return ;
+  }
+
+  zl->eof = true;
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  zlink_send(zl);
+}
+
+int zlink_start(SocksLink *sl)
+{
+  if (!sl->compress)
+    return 0;
+
+  sl->zlinks = calloc(sizeof (*sl->zlinks), 1);
+  if (!sl->zlinks)
+    return -1;
+  INIT_LIST_HEAD(&sl->zlinks->links);
+  return 0;
+}
+
+void zlink_stop(SocksLink *sl)
+{
+  struct zlink *zl, *tmp;
+
+  if (!sl->zlinks)
+    return ;
+
+  list_for_each_entry_safe(zl, tmp, &sl->zlinks->links, next, struct zlink)
+    zlink_free(zl);
+
+  free(sl->zlinks);
+  sl->zlinks = NULL;
+}
+
+/*
+ * Compress the rest of this connection: the peer gets one end of a
+ * socketpair, the link its connection. The first raw_in bytes received
+ * are still passed as is. Returns -1 on error, the peer is unchanged.
+ */
+int zlink_wrap(Client *cl, Peer *peer, size_t raw_in)
+{
+  SocksLink *sl = cl->parent;
+  struct zlink *zl;
+  struct bufferevent *bev;
+  int fds[2];
+
+  if (!sl->zlinks)
+    return -1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    prcl_err(cl, "socketpair failed: %s", strerror(errno));
+    return -1;
+  }
+
+  zl = calloc(sizeof (*zl), 1);
+  if (!zl)
+    goto error;
+
+  if (deflateInit2(&zl->deflate, Z_BEST_SPEED, Z_DEFLATED,
+		   -ZLINK_WINDOW_BITS, ZLINK_MEM_LEVEL,
+		   Z_DEFAULT_STRATEGY) != Z_OK)
+    goto error;
+  if (inflateInit2(&zl->inflate, -ZLINK_WINDOW_BITS) != Z_OK) {
+    deflateEnd(&zl->deflate);
+    goto error;
+  }
+
+  zl->bufev = bufferevent_new(fds[0], on_zlink_read, on_zlink_write,
+			      on_zlink_event, zl);
+  bev = bufferevent_new(fds[1], NULL, NULL, NULL, NULL);
+  if (!zl->bufev || !bev) {
+    if (zl->bufev)
+      bufferevent_free(zl->bufev);
+    if (bev)
+      bufferevent_free(bev);
+    deflateEnd(&zl->deflate);
+    inflateEnd(&zl->inflate);
+    goto error;
+  }
+
+  sock_set_nonblock(fds[0]);
+  sock_set_nonblock(fds[1]);
+
+  zl->sl = sl;
+  zl->fd = fds[0];
+  zl->raw_fd = peer->fd;
+  zl->raw = peer->bufev;
+  zl->raw_in = raw_in;
+  list_add(&zl->next, &sl->zlinks->links);
+  /* the connection and our end, the peer has the other */
+  admit_fds(sl, 2);
+
+  bufferevent_base_set(sl->base, zl->bufev);
+  bufferevent_setwatermark(zl->bufev, EV_READ, 0, ZLINK_BUFSIZ);
+  bufferevent_setwatermark(zl->bufev, EV_WRITE, ZLINK_BUFSIZ / 2, 0);
+  bufferevent_enable(zl->bufev, EV_READ | EV_WRITE);
+
+  /* timeouts are the peer's business */
+  bufferevent_setcb(zl->raw, on_zlink_raw_read, on_zlink_raw_write,
+		    on_zlink_raw_event, zl);
+  bufferevent_settimeout(zl->raw, 0, 0);
+  bufferevent_setwatermark(zl->raw, EV_READ, 0, ZLINK_BUFSIZ);
+  bufferevent_setwatermark(zl->raw, EV_WRITE, ZLINK_BUFSIZ / 2, 0);
+  bufferevent_enable(zl->raw, EV_READ | EV_WRITE);
+
+  bufferevent_base_set(sl->base, bev);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+  peer->fd = fds[1];
+  peer->bufev = bev;
+
+  prcl_debug(cl, "compressing the link");
+
+  /* frames may already be there */
+  zlink_receive(zl);
+  return 0;
+
+ error:
+  free(zl);
+  close(fds[0]);
+  close(fds[1]);
+  return -1;
+}
+
+#else
+
+int zlink_start(SocksLink *sl)
+{
+  if (!sl->compress)
+    return 0;
+
+  pr_err(sl, "compression is not supported on this system");
+  return -1;
+}
+
+void zlink_stop(SocksLink *sl)
+{
+}
+
+int zlink_wrap(Client *cl, Peer *peer, size_t raw_in)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ZLINK_H
+# define ZLINK_H
+
+#include <stddef.h>
+
+#include "sockslink.h"
+#include "client.h"
+
+int zlink_start(SocksLink *sl);
+void zlink_stop(SocksLink *sl);
+
+int zlink_wrap(Client *cl, Peer *peer, size_t raw_in);
+
+#endif /* !ZLINK_H */
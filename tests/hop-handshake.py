@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+#
+# --hop/--hop-accept: a chained sockslinkd hands the original client
+# address and credentials to its next-hop, whose rules apply to them.
+# Messages sent by hand: a bad version or address type, a disabled
+# method and truncated messages are refused without a success reply,
+# untrusted peers never get the method, and nothing of this keeps the
+# next-hop from serving.
+#
+# usage: hop-handshake.py <sockslinkd>
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+AUTH_METHOD_HOP = 0x88
+HOP_FLAG_USERNAME = 0x01
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(sock, handler):
+    def loop():
+        while True:
+            c, _ = sock.accept()
+            threading.Thread(target=handler, args=(c,), daemon=True).start()
+    threading.Thread(target=loop, daemon=True).start()
+
+
+def echo(c):
+    try:
+        while True:
+            data = c.recv(4096)
+            if not data:
+                break
+            c.sendall(data)
+    except OSError:
+        pass
+    c.close()
+
+
+def start(sockslinkd, port, nexthop, *args):
+    proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', nexthop] + list(args))
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    return proc
+
+
+def connect_request(port):
+    return (b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') +
+            struct.pack('>H', port))
+
+
+def hop_message(origin, user=None, version=1, atyp=1):
+    message = bytes([version, HOP_FLAG_USERNAME if user is not None else 0,
+                     atyp]) + socket.inet_aton(origin) + b'\x04\x38'
+    if user is not None:
+        message += bytes([len(user)]) + user.encode() + b'\x02pw'
+    return message
+
+
+def relayed(c, echo_port):
+    """True if a CONNECT on c reaches the echo server"""
+    c.sendall(connect_request(echo_port))
+    if recv_exact(c, 10)[1] != 0:
+        return False
+    c.sendall(b'ping')
+    return recv_exact(c, 4) == b'ping'
+
+
+def through(port, source, user, echo_port):
+    """Returns True if a client reaches the echo server through port"""
+    c = socket.socket()
+    c.settimeout(5)
+    try:
+        c.bind((source, 0))
+        c.connect(('127.0.0.1', port))
+        if user is None:
+            c.sendall(b'\x05\x01\x00')
+            if recv_exact(c, 2) != b'\x05\x00':
+                return False
+        else:
+            c.sendall(b'\x05\x01\x02')
+            if recv_exact(c, 2) != b'\x05\x02':
+                return False
+            u = user.encode()
+            c.sendall(bytes([1, len(u)]) + u + b'\x02pw')
+            if recv_exact(c, 2) != b'\x01\x00':
+                return False
+        return relayed(c, echo_port)
+    except (EOFError, ConnectionResetError, socket.timeout):
+        return False
+    finally:
+        c.close()
+
+
+def hop(port, message, echo_port):
+    """Returns True if a hop handshake sent by hand gets relayed"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=5)
+    try:
+        # the message and the request right behind the method, in one go
+        c.sendall(bytes([5, 1, AUTH_METHOD_HOP]) + message +
+                  connect_request(echo_port))
+        if recv_exact(c, 2) != bytes([5, AUTH_METHOD_HOP]):
+            return False
+        if recv_exact(c, 2) != b'\x01\x00':
+            return False
+        c.sendall(b'ping')
+        reply = recv_exact(c, 10)
+        return reply[1] == 0 and recv_exact(c, 4) == b'ping'
+    except (EOFError, ConnectionResetError, socket.timeout):
+        return False
+    finally:
+        c.close()
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    echo_sock = socket.socket()
+    echo_sock.bind(('127.0.0.1', 0))
+    echo_sock.listen(16)
+    serve(echo_sock, echo)
+    echo_port = echo_sock.getsockname()[1]
+    failed = False
+
+    def check(name, ok):
+        nonlocal failed
+        if not ok:
+            print(name)
+            failed = True
+
+    with tempfile.TemporaryDirectory() as tmp:
+        rules = os.path.join(tmp, 'rules')
+        with open(rules, 'w') as f:
+            f.write('deny from 127.0.0.2/32\n')
+            f.write('deny from 10.0.0.0/8\n')
+            f.write('allow user alice\n')
+            f.write('allow method none\n')
+            f.write('deny\n')
+
+        nexthop_port, port, untrusting_port = (free_port(), free_port(),
+                                               free_port())
+        procs = [start(sockslinkd, nexthop_port, 'direct',
+                       '-m', 'username', '-m', 'none',
+                       '--hop-accept=127.0.0.0/8', '--rules', rules)]
+        procs.append(start(sockslinkd, port, '127.0.0.1:%d' % nexthop_port,
+                           '-m', 'username', '-m', 'none', '--hop'))
+        procs.append(start(sockslinkd, untrusting_port, 'direct',
+                           '-m', 'none', '--hop-accept=10.0.0.0/8'))
+        try:
+            # the second time round, the message follows the method request
+            for when in ('first', 'known'):
+                check('chained %s: no authentication' % when,
+                      through(port, '127.0.0.3', None, echo_port))
+                check('chained %s: alice' % when,
+                      through(port, '127.0.0.3', 'alice', echo_port))
+                check('chained %s: bob relayed' % when,
+                      not through(port, '127.0.0.3', 'bob', echo_port))
+                check('chained %s: denied source relayed' % when,
+                      not through(port, '127.0.0.2', None, echo_port))
+
+            check('raw: no credentials',
+                  hop(nexthop_port, hop_message('127.0.0.9'), echo_port))
+            check('raw: alice',
+                  hop(nexthop_port, hop_message('127.0.0.9', 'alice'),
+                      echo_port))
+            refused = [
+                ('denied source', hop_message('10.1.2.3')),
+                ('bob', hop_message('127.0.0.9', 'bob')),
+                ('empty username', hop_message('127.0.0.9', '')),
+                ('version', hop_message('127.0.0.9', version=2)),
+                ('address type', hop_message('127.0.0.9', atyp=2)),
+            ]
+            for name, message in refused:
+                check('raw: %s relayed' % name,
+                      not hop(nexthop_port, message, echo_port))
+
+            # the method is for trusted peers only
+            c = socket.create_connection(('127.0.0.1', untrusting_port),
+                                         timeout=5)
+            c.sendall(bytes([5, 1, AUTH_METHOD_HOP]))
+            check('raw: untrusted peer', recv_exact(c, 2) == b'\x05\xff')
+            c.close()
+
+            # truncated messages, then the peer leaves
+            message = hop_message('127.0.0.9', 'alice')
+            for cut in (1, 4, 9, 10, 15):
+                c = socket.create_connection(('127.0.0.1', nexthop_port))
+                c.sendall(bytes([5, 1, AUTH_METHOD_HOP]) + message[:cut])
+                time.sleep(0.05)
+                c.close()
+
+            check('chained: after errors',
+                  through(port, '127.0.0.3', 'alice', echo_port))
+            check('sockslinkd exited', all(p.poll() is None for p in procs))
+        except (EOFError, OSError) as e:
+            print('hop failed: %s' % e)
+            failed = True
+        finally:
+            for p in procs:
+                p.terminate()
+                p.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,310 @@
+#!/usr/bin/env python3
+#
+# --mux/--mux-accept: streams larger than the channel window go through
+# tunnels intact. Tunnel frames sent by hand: channels are opened and
+# relayed, frames for unknown channels or of unknown types are ignored,
+# oversized frames and window overruns close the tunnel, bad preambles
+# are refused, and nothing of this keeps the next-hop from serving.
+#
+# usage: mux-tunnel.py <sockslinkd>
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+MUX_PREAMBLE = b'\xf0SLMUX\x01\x00'
+MUX_OPEN, MUX_DATA, MUX_WINDOW, MUX_CLOSE = 1, 2, 3, 4
+MUX_FRAME_MAX = 16384
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(sock, handler):
+    def loop():
+        while True:
+            c, _ = sock.accept()
+            threading.Thread(target=handler, args=(c,), daemon=True).start()
+    threading.Thread(target=loop, daemon=True).start()
+
+
+def echo(c):
+    try:
+        while True:
+            data = c.recv(65536)
+            if not data:
+                break
+            c.sendall(data)
+    except OSError:
+        pass
+    c.close()
+
+
+def listener(rcvbuf=None):
+    s = socket.socket()
+    if rcvbuf:
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+    s.bind(('127.0.0.1', 0))
+    s.listen(64)
+    return s
+
+
+def start(sockslinkd, port, nexthop, *args, log=None):
+    proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', nexthop, '-m', 'none'] + list(args),
+                            stderr=log)
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    return proc
+
+
+def connect_request(port):
+    return (b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') +
+            struct.pack('>H', port))
+
+
+def stream(port, echo_port, size):
+    """Send size bytes through a SOCKS5 proxy to the echo server"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=10)
+    try:
+        c.sendall(b'\x05\x01\x00')
+        if recv_exact(c, 2) != b'\x05\x00':
+            return False
+        c.sendall(connect_request(echo_port))
+        if recv_exact(c, 10)[1] != 0:
+            return False
+        data = os.urandom(size)
+        writer = threading.Thread(target=c.sendall, args=(data,))
+        writer.start()
+        ok = recv_exact(c, size) == data
+        writer.join()
+        return ok
+    except (EOFError, OSError):
+        return False
+    finally:
+        c.close()
+
+
+def frame(ftype, channel, data=b''):
+    return struct.pack('>BBHI', ftype, 0, len(data), channel) + data
+
+
+class Tunnel:
+    """A tunnel opened by hand"""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+        self.sock.sendall(MUX_PREAMBLE)
+        if recv_exact(self.sock, len(MUX_PREAMBLE)) != MUX_PREAMBLE:
+            raise EOFError
+
+    def send(self, *frames):
+        self.sock.sendall(b''.join(frames))
+
+    def recv(self, channel):
+        """Returns the next DATA or CLOSE frame of this channel"""
+        while True:
+            ftype, _, length, ch = struct.unpack('>BBHI',
+                                                 recv_exact(self.sock, 8))
+            data = recv_exact(self.sock, length)
+            if ch == channel and ftype in (MUX_DATA, MUX_CLOSE):
+                return ftype, data
+
+    def recv_data(self, channel, size):
+        data = b''
+        while len(data) < size:
+            ftype, chunk = self.recv(channel)
+            if ftype != MUX_DATA:
+                raise EOFError
+            data += chunk
+        return data
+
+    def open(self, channel, echo_port):
+        """Open a channel to the echo server, returns True on success"""
+        self.send(frame(MUX_OPEN, channel),
+                  frame(MUX_DATA, channel, b'\x05\x01\x00'))
+        if self.recv_data(channel, 2) != b'\x05\x00':
+            return False
+        self.send(frame(MUX_DATA, channel, connect_request(echo_port)))
+        return self.recv_data(channel, 10)[1] == 0
+
+    def closed(self, timeout=5):
+        """True if the next-hop closes the tunnel"""
+        self.sock.settimeout(timeout)
+        try:
+            while self.sock.recv(65536):
+                pass
+            return True
+        except ConnectionResetError:
+            return True
+        except socket.timeout:
+            return False
+
+    def close(self):
+        self.sock.close()
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    echo_sock, sink = listener(), listener(rcvbuf=4096)
+    serve(echo_sock, echo)
+    sunk = []
+    serve(sink, sunk.append)  # never read
+    echo_port = echo_sock.getsockname()[1]
+    sink_port = sink.getsockname()[1]
+    failed = False
+
+    def check(name, ok):
+        nonlocal failed
+        if not ok:
+            print(name)
+            failed = True
+
+    nexthop_port, port = free_port(), free_port()
+    plain_port, fallback_port = free_port(), free_port()
+    log_path = os.path.join(os.environ.get('TMPDIR', '/tmp'),
+                            'mux-tunnel-%d.log' % os.getpid())
+    log = open(log_path, 'w+')
+    procs = [start(sockslinkd, nexthop_port, 'direct', '--mux-accept',
+                   log=log)]
+    procs.append(start(sockslinkd, port, '127.0.0.1:%d' % nexthop_port,
+                       '--mux=2'))
+    procs.append(start(sockslinkd, plain_port, 'direct'))
+    procs.append(start(sockslinkd, fallback_port,
+                       '127.0.0.1:%d' % plain_port, '--mux=1'))
+    try:
+        # the first clients warm the tunnels up
+        check('chained: warm up', stream(port, echo_port, 1000))
+        time.sleep(0.5)
+        results = []
+        threads = [threading.Thread(
+            target=lambda: results.append(stream(port, echo_port, 1 << 20)))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        check('chained: streams of 1MB, got %s' % results,
+              results == [True] * 4)
+        log.seek(0)
+        check('chained: no tunnel', 'client is a tunnel' in log.read())
+
+        # a next-hop without --mux-accept gets plain connections
+        stream(fallback_port, echo_port, 10)
+        time.sleep(0.5)
+        check('fallback: plain connections',
+              stream(fallback_port, echo_port, 100000))
+
+        tunnel = Tunnel(nexthop_port)
+        check('raw: open', tunnel.open(1, echo_port))
+        tunnel.send(frame(MUX_DATA, 1, b'ping'))
+        check('raw: echo', tunnel.recv_data(1, 4) == b'ping')
+
+        # ignored: unknown channels and types, short WINDOW frames
+        tunnel.send(frame(MUX_DATA, 77, b'lost'),
+                    frame(MUX_WINDOW, 78, b'\x00\x00\x10\x00'),
+                    frame(MUX_CLOSE, 79),
+                    frame(9, 1, b'what'),
+                    frame(MUX_WINDOW, 1, b'\x01'))
+        tunnel.send(frame(MUX_DATA, 1, b'pong'))
+        check('raw: echo after ignored frames',
+              tunnel.recv_data(1, 4) == b'pong')
+
+        # a channel already open is refused, and stays open
+        tunnel.send(frame(MUX_OPEN, 1))
+        check('raw: duplicate channel', tunnel.recv(1) == (MUX_CLOSE, b''))
+        tunnel.send(frame(MUX_DATA, 1, b'more'))
+        check('raw: echo after duplicate', tunnel.recv_data(1, 4) == b'more')
+
+        # closing a channel leaves the others
+        check('raw: second channel', tunnel.open(2, echo_port))
+        tunnel.send(frame(MUX_CLOSE, 1), frame(MUX_DATA, 2, b'two'))
+        check('raw: echo after close', tunnel.recv_data(2, 3) == b'two')
+
+        # a frame split across writes
+        data = frame(MUX_DATA, 2, b'split')
+        for i in range(len(data)):
+            tunnel.send(data[i:i + 1])
+            time.sleep(0.01)
+        check('raw: split frame', tunnel.recv_data(2, 5) == b'split')
+        tunnel.close()
+
+        # oversized frames close the tunnel
+        tunnel = Tunnel(nexthop_port)
+        tunnel.send(frame(MUX_OPEN, 1),
+                    struct.pack('>BBHI', MUX_DATA, 0, MUX_FRAME_MAX + 1, 1))
+        check('raw: oversized frame', tunnel.closed())
+        tunnel.close()
+
+        # so does sending past the window of a channel
+        tunnel = Tunnel(nexthop_port)
+        check('raw: open to sink', tunnel.open(1, sink_port))
+        chunk = frame(MUX_DATA, 1, b'x' * MUX_FRAME_MAX)
+        try:
+            tunnel.sock.settimeout(10)
+            for _ in range(2048):
+                tunnel.send(chunk)
+        except OSError:
+            pass
+        check('raw: window overrun', tunnel.closed())
+        tunnel.close()
+
+        # another version, or another protocol, is no SOCKS5 greeting
+        for data in (b'\xf0SLMUX\x09\x00', b'\xf0SLMUY\x01\x00'):
+            c = socket.create_connection(('127.0.0.1', nexthop_port),
+                                         timeout=5)
+            c.sendall(data)
+            check('raw: preamble %r' % data,
+                  recv_exact(c, 2) == b'\x05\xff' and c.recv(1) == b'')
+            c.close()
+
+        # truncated preambles, headers and payloads, then the peer leaves
+        for data in (MUX_PREAMBLE[:5], MUX_PREAMBLE + frame(MUX_OPEN, 1)[:5],
+                     MUX_PREAMBLE + frame(MUX_OPEN, 1) +
+                     frame(MUX_DATA, 1, b'\x05\x01\x00')[:9]):
+            c = socket.create_connection(('127.0.0.1', nexthop_port))
+            c.sendall(data)
+            time.sleep(0.05)
+            c.close()
+
+        check('chained: after errors', stream(port, echo_port, 100000))
+        check('sockslinkd exited', all(p.poll() is None for p in procs))
+    except (EOFError, OSError) as e:
+        print('tunnel failed: %s' % e)
+        failed = True
+    finally:
+        for p in procs:
+            p.terminate()
+            p.wait()
+        log.close()
+        os.unlink(log_path)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+#
+# --rules: the first matching rule wins, with overlapping source
+# prefixes, user patterns and methods. Malformed rules files are
+# refused at startup, and kept out by a reload.
+#
+# usage: rules.py <sockslinkd>
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+class Upstream(threading.Thread):
+    """SOCKS5 server recording the usernames it was given, None without"""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.sock = socket.socket()
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(16)
+        self.port = self.sock.getsockname()[1]
+        self.users = []
+        self.conns = []
+
+    def run(self):
+        while True:
+            c, _ = self.sock.accept()
+            try:
+                _, n = recv_exact(c, 2)
+                methods = recv_exact(c, n)
+                if 2 in methods:
+                    c.sendall(b'\x05\x02')
+                    _, ulen = recv_exact(c, 2)
+                    user = recv_exact(c, ulen).decode()
+                    recv_exact(c, recv_exact(c, 1)[0])
+                    c.sendall(b'\x01\x00')
+                else:
+                    c.sendall(b'\x05\x00')
+                    user = None
+                self.users.append(user)
+                # kept open, the client is told it got through
+                self.conns.append(c)
+            except EOFError:
+                c.close()
+
+
+def login(port, source, user, passwd='pw'):
+    """Returns True if the client got through to a next-hop"""
+    c = socket.socket()
+    c.settimeout(5)
+    try:
+        c.bind((source, 0))
+        c.connect(('127.0.0.1', port))
+        if user is None:
+            # the method is accepted first, a denied client is then closed
+            c.sendall(b'\x05\x01\x00')
+            if recv_exact(c, 2) != b'\x05\x00':
+                return False
+            c.settimeout(0.5)
+            try:
+                return c.recv(1) != b''
+            except socket.timeout:
+                return True
+        c.sendall(b'\x05\x01\x02')
+        if recv_exact(c, 2) != b'\x05\x02':
+            return False
+        u, p = user.encode(), passwd.encode()
+        c.sendall(bytes([1, len(u)]) + u + bytes([len(p)]) + p)
+        return recv_exact(c, 2) == b'\x01\x00'
+    except (EOFError, ConnectionResetError, socket.timeout):
+        return False
+    finally:
+        c.close()
+
+
+def start(sockslinkd, port, default, rules):
+    return subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', '127.0.0.1:%d' % default.port,
+                             '-m', 'username', '-m', 'none',
+                             '--rules', rules])
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    upstreams = {name: Upstream()
+                 for name in ('default', 'corp', 'admin', 'lpm', 'open')}
+    for upstream in upstreams.values():
+        upstream.start()
+    port = lambda name: upstreams[name].port
+    failed = False
+
+    with tempfile.TemporaryDirectory() as tmp:
+        rules = os.path.join(tmp, 'rules')
+        with open(rules, 'w') as f:
+            f.write('# a comment, and an empty line\n\n')
+            f.write('deny  from 127.0.0.2/32\n')
+            f.write('allow from 127.0.0.0/8 user *@corp via 127.0.0.1:%d\n'
+                    % port('corp'))
+            f.write('allow user admin* via 127.0.0.1:%d  # trailing\n'
+                    % port('admin'))
+            f.write('pass  user guest\n')
+            f.write('allow from 127.0.3.0/24 user bob via 127.0.0.1:%d\n'
+                    % port('lpm'))
+            f.write('deny  from 127.0.3.0/24\n')
+            f.write('allow from ::/0 via !\n')
+            f.write('allow from 127.0.0.0/8 method none via 127.0.0.1:%d\n'
+                    % port('open'))
+            f.write('deny\n')
+
+        # source, username (None for no authentication), next-hop or None
+        cases = [
+            ('127.0.0.2', 'alice@corp', None),
+            ('127.0.0.3', 'alice@corp', 'corp'),
+            ('127.0.0.3', 'admin7', 'admin'),
+            ('127.0.0.3', 'xadmin', None),
+            ('127.0.0.3', 'guest', 'default'),
+            ('127.0.3.9', 'bob', 'lpm'),
+            ('127.0.3.9', 'carol', None),
+            ('127.0.3.9', 'bob@corp', 'corp'),
+            ('127.0.0.3', 'carol', None),
+            ('127.0.0.3', None, 'open'),
+            ('127.0.3.9', None, None),
+            ('127.0.0.2', None, None),
+        ]
+
+        sport = free_port()
+        proc = start(sockslinkd, sport, upstreams['default'], rules)
+        try:
+            for _ in range(50):
+                try:
+                    socket.create_connection(('127.0.0.1', sport)).close()
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+
+            def check(when):
+                nonlocal failed
+                for upstream in upstreams.values():
+                    upstream.users.clear()
+                expected = {name: [] for name in upstreams}
+                for source, user, nexthop in cases:
+                    if login(sport, source, user) != (nexthop is not None):
+                        print('%s %s from %s: expected %s' %
+                              (when, user, source, nexthop))
+                        failed = True
+                    if nexthop:
+                        expected[nexthop].append(user)
+                time.sleep(0.2)
+                got = {name: u.users for name, u in upstreams.items()}
+                if got != expected:
+                    print('%s: next-hops got %s' % (when, got))
+                    failed = True
+
+            check('loaded')
+
+            # a broken file doesn't replace the rules in use
+            with open(rules, 'a') as f:
+                f.write('allow from 127.0.0.0/33\n')
+            proc.send_signal(signal.SIGHUP)
+            time.sleep(0.5)
+            check('after a broken reload')
+
+            if proc.poll() is not None:
+                print('sockslinkd exited with %d' % proc.returncode)
+                failed = True
+        finally:
+            proc.terminate()
+            proc.wait()
+
+        broken = [
+            'allow from 10.0.0.0/33',
+            'allow from 300.0.0.0/8',
+            'allow from',
+            'allow from 10.0.0.0/8 from 10.0.0.0/8',
+            'accept from 10.0.0.0/8',
+            'allow user *a*',
+            'allow user a*b',
+            'allow method gssapi',
+            'allow days someday',
+            'allow hours 25:00-26:00',
+            'allow hours 08:00',
+            'deny via 127.0.0.1:1080',
+            'allow via localhost:1080',
+            'allow' + ' days mon' * 8,
+            'allow from 10.0.0.0/8 ' + ' ' * 1024 + 'user bob',
+        ]
+        for line in broken:
+            with open(rules, 'w') as f:
+                f.write(line + '\n')
+            proc = start(sockslinkd, free_port(), upstreams['default'],
+                         rules)
+            try:
+                ret = proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                proc.terminate()
+                proc.wait()
+                ret = 0
+            if not ret:
+                print('%r: accepted' % line[:60])
+                failed = True
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
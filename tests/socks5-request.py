@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+#
+# Client requests read by sockslinkd (--destinations, direct next-hop):
+# complete, split and routed requests are relayed, malformed ones get a
+# failure reply and are closed, without disturbing the next clients.
+#
+# usage: socks5-request.py <sockslinkd>
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(sock, handler):
+    def loop():
+        while True:
+            c, _ = sock.accept()
+            threading.Thread(target=handler, args=(c,), daemon=True).start()
+    threading.Thread(target=loop, daemon=True).start()
+
+
+def echo(c):
+    try:
+        while True:
+            data = c.recv(4096)
+            if not data:
+                break
+            c.sendall(data)
+    except OSError:
+        pass
+    c.close()
+
+
+class Upstream:
+    """SOCKS5 next-hop recording the requests replayed to it"""
+
+    def __init__(self):
+        self.sock = socket.socket()
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(16)
+        self.port = self.sock.getsockname()[1]
+        self.requests = []
+        serve(self.sock, self.handle)
+
+    def handle(self, c):
+        try:
+            _, n = recv_exact(c, 2)
+            recv_exact(c, n)
+            c.sendall(b'\x05\x00')
+            head = recv_exact(c, 5)
+            rest = recv_exact(c, head[4] + 2 if head[3] == 3 else
+                              {1: 4 + 2 - 1, 4: 16 + 2 - 1}[head[3]])
+            self.requests.append(head + rest)
+            c.sendall(b'\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00')
+        except (EOFError, KeyError, OSError):
+            c.close()
+            return
+        echo(c)
+
+
+def connect_request(atyp, addr, port):
+    if atyp == 1:
+        dst = socket.inet_aton(addr)
+    elif atyp == 3:
+        dst = bytes([len(addr)]) + addr.encode()
+    return b'\x05\x01\x00' + bytes([atyp]) + dst + struct.pack('>H', port)
+
+
+def session(port, request, split=False):
+    """Returns the reply code, and whether data is relayed after it"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=5)
+    try:
+        c.sendall(b'\x05\x01\x00')
+        if recv_exact(c, 2) != b'\x05\x00':
+            return None, False
+        if split:
+            for i in range(len(request)):
+                c.sendall(request[i:i + 1])
+                time.sleep(0.01)
+        else:
+            c.sendall(request)
+        reply = recv_exact(c, 10)
+        if reply[1] != 0:
+            # the connection must be closed right after a failure
+            return reply[1], c.recv(1) != b''
+        c.sendall(b'ping')
+        return reply[1], recv_exact(c, 4) == b'ping'
+    except (EOFError, ConnectionResetError, socket.timeout):
+        return None, False
+    finally:
+        c.close()
+
+
+def main():
+    sockslinkd = sys.argv[1]
+
+    echo_sock = socket.socket()
+    echo_sock.bind(('127.0.0.1', 0))
+    echo_sock.listen(16)
+    echo_port = echo_sock.getsockname()[1]
+    serve(echo_sock, echo)
+    upstream = Upstream()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        destinations = os.path.join(tmp, 'destinations')
+        with open(destinations, 'w') as f:
+            f.write('corp.test 127.0.0.1:%d\n' % upstream.port)
+            f.write('127.0.0.2/32 127.0.0.1:%d\n' % upstream.port)
+
+        port = free_port()
+        proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                                 '-l', '127.0.0.1', '-p', str(port),
+                                 '-n', 'direct', '-m', 'none',
+                                 '--destinations', destinations])
+        try:
+            for _ in range(50):
+                try:
+                    socket.create_connection(('127.0.0.1', port)).close()
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+
+            to_echo = connect_request(1, '127.0.0.1', echo_port)
+            routed = connect_request(3, 'www.corp.test', 443)
+            results = [
+                ('ipv4', to_echo, False, (0, True)),
+                ('split', to_echo, True, (0, True)),
+                ('literal domain',
+                 connect_request(3, '127.0.0.1', echo_port), False,
+                 (0, True)),
+                ('routed domain', routed, False, (0, True)),
+                ('routed address', connect_request(1, '127.0.0.2', 80),
+                 False, (0, True)),
+                ('bad version', b'\x04' + to_echo[1:], False, (1, False)),
+                ('bad reserved', to_echo[:2] + b'\x01' + to_echo[3:], False,
+                 (1, False)),
+                ('bad address type', to_echo[:3] + b'\x02' + to_echo[4:],
+                 False, (1, False)),
+                ('bind', to_echo[:1] + b'\x02' + to_echo[2:], False,
+                 (7, False)),
+                ('after all that', to_echo, False, (0, True)),
+            ]
+            failed = False
+            for name, request, split, expected in results:
+                got = session(port, request, split)
+                if got != expected:
+                    print('%s: got %s, expected %s' % (name, got, expected))
+                    failed = True
+
+            # truncated requests, then the client leaves
+            for request in (to_echo[:4], routed[:6], routed[:-1]):
+                c = socket.create_connection(('127.0.0.1', port), timeout=5)
+                c.sendall(b'\x05\x01\x00' + request)
+                time.sleep(0.05)
+                c.close()
+            if session(port, to_echo) != (0, True):
+                print('truncated requests: not serving anymore')
+                failed = True
+
+            replayed = [routed, connect_request(1, '127.0.0.2', 80)]
+            if upstream.requests != replayed:
+                print('next-hop got %s' % upstream.requests)
+                failed = True
+            if proc.poll() is not None:
+                print('sockslinkd exited with %d' % proc.returncode)
+                failed = True
+        finally:
+            proc.terminate()
+            proc.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
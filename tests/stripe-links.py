@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+#
+# --stripe/--stripe-accept: streams go through striped connections
+# intact. Links opened by hand: chunks are reassembled in sequence
+# whatever link carries them, oversized chunks close the connection,
+# bad preambles and duplicate links are refused, and nothing of this
+# keeps the next-hop from serving.
+#
+# usage: stripe-links.py <sockslinkd>
+
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+STRIPE_MAGIC = 0xf1
+STRIPE_FIN = 0x01
+STRIPE_CHUNK_SIZE = 16384
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(sock, handler):
+    def loop():
+        while True:
+            c, _ = sock.accept()
+            threading.Thread(target=handler, args=(c,), daemon=True).start()
+    threading.Thread(target=loop, daemon=True).start()
+
+
+def echo(c):
+    try:
+        while True:
+            data = c.recv(65536)
+            if not data:
+                break
+            c.sendall(data)
+    except OSError:
+        pass
+    c.close()
+
+
+def start(sockslinkd, port, nexthop, *args, log=None):
+    proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', nexthop, '-m', 'none'] + list(args),
+                            stderr=log)
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    return proc
+
+
+def connect_request(port):
+    return (b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') +
+            struct.pack('>H', port))
+
+
+def stream(port, echo_port, size):
+    """Send size bytes through a SOCKS5 proxy to the echo server"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=10)
+    try:
+        c.sendall(b'\x05\x01\x00')
+        if recv_exact(c, 2) != b'\x05\x00':
+            return False
+        c.sendall(connect_request(echo_port))
+        if recv_exact(c, 10)[1] != 0:
+            return False
+        data = os.urandom(size)
+        writer = threading.Thread(target=c.sendall, args=(data,))
+        writer.start()
+        ok = recv_exact(c, size) == data
+        writer.join()
+        return ok
+    except (EOFError, OSError):
+        return False
+    finally:
+        c.close()
+
+
+def preamble(index, count, sid, version=1, magic=b'SLST'):
+    return bytes([STRIPE_MAGIC]) + magic + bytes([version, index, count]) + sid
+
+
+def chunk(seq, data=b'', flags=0, length=None):
+    if length is None:
+        length = len(data)
+    return struct.pack('>IHBB', seq, length, flags, 0) + data
+
+
+class Stripe:
+    """A striped connection opened by hand"""
+
+    def __init__(self, port, count):
+        self.sid = os.urandom(8)
+        self.links = []
+        for index in range(count):
+            link = socket.create_connection(('127.0.0.1', port), timeout=5)
+            link.sendall(preamble(index, count, self.sid))
+            self.links.append(link)
+        for index, link in enumerate(self.links):
+            if recv_exact(link, 16) != preamble(index, count, self.sid):
+                raise EOFError
+        self.open = list(self.links)
+        self.inputs = [b''] * count
+        self.chunks = {}
+        self.recv_seq = 0
+
+    def send(self, index, seq, data=b'', flags=0):
+        self.links[index].sendall(chunk(seq, data, flags))
+
+    def read(self, timeout=5):
+        """Reads what the links have, False once they are all closed"""
+        if not self.open:
+            return False
+        ready, _, _ = select.select(self.open, [], [], timeout)
+        if not ready:
+            raise EOFError
+        for link in ready:
+            index = self.links.index(link)
+            try:
+                data = link.recv(65536)
+            except ConnectionResetError:
+                data = b''
+            if not data:
+                self.open.remove(link)
+                continue
+            self.inputs[index] += data
+            while len(self.inputs[index]) >= 8:
+                seq, length, flags, _ = struct.unpack(
+                    '>IHBB', self.inputs[index][:8])
+                if len(self.inputs[index]) < 8 + length:
+                    break
+                self.chunks[seq] = (flags, self.inputs[index][8:8 + length])
+                self.inputs[index] = self.inputs[index][8 + length:]
+        return True
+
+    def recv(self, size):
+        """Returns size bytes of the stream, or less at its end"""
+        data = b''
+        while len(data) < size:
+            if self.recv_seq not in self.chunks:
+                if not self.read():
+                    raise EOFError
+                continue
+            flags, payload = self.chunks.pop(self.recv_seq)
+            self.recv_seq += 1
+            if flags & STRIPE_FIN:
+                break
+            data += payload
+        return data
+
+    def closed(self, timeout=5):
+        """True if the next-hop closes every link"""
+        deadline = time.time() + timeout
+        try:
+            while time.time() < deadline and self.read(timeout):
+                pass
+        except EOFError:
+            pass
+        return not self.open
+
+    def close(self):
+        for link in self.links:
+            link.close()
+
+
+def refused(port, data):
+    """True if the next-hop answers data as an unknown SOCKS version"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=5)
+    try:
+        c.sendall(data)
+        return recv_exact(c, 2) == b'\x05\xff' and c.recv(1) == b''
+    except (EOFError, ConnectionResetError, socket.timeout):
+        return False
+    finally:
+        c.close()
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    echo_sock = socket.socket()
+    echo_sock.bind(('127.0.0.1', 0))
+    echo_sock.listen(64)
+    serve(echo_sock, echo)
+    echo_port = echo_sock.getsockname()[1]
+    failed = False
+
+    def check(name, ok):
+        nonlocal failed
+        if not ok:
+            print(name)
+            failed = True
+
+    nexthop_port, port = free_port(), free_port()
+    plain_port, fallback_port = free_port(), free_port()
+    log_path = os.path.join(os.environ.get('TMPDIR', '/tmp'),
+                            'stripe-links-%d.log' % os.getpid())
+    log = open(log_path, 'w+')
+    procs = [start(sockslinkd, nexthop_port, 'direct', '--stripe-accept',
+                   log=log)]
+    procs.append(start(sockslinkd, port, '127.0.0.1:%d' % nexthop_port,
+                       '--stripe=4'))
+    procs.append(start(sockslinkd, plain_port, 'direct'))
+    procs.append(start(sockslinkd, fallback_port,
+                       '127.0.0.1:%d' % plain_port, '--stripe=2'))
+    try:
+        results = []
+        threads = [threading.Thread(
+            target=lambda: results.append(stream(port, echo_port, 1 << 20)))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        check('chained: streams of 1MB, got %s' % results,
+              results == [True] * 4)
+        log.seek(0)
+        check('chained: not striped', 'client is stripe link 4/4' in log.read())
+
+        # a next-hop without --stripe-accept gets plain connections
+        stream(fallback_port, echo_port, 10)
+        time.sleep(0.5)
+        check('fallback: plain connections',
+              stream(fallback_port, echo_port, 100000))
+
+        # chunks in sequence whatever their link, split across writes
+        stripe = Stripe(nexthop_port, 3)
+        stripe.send(2, 0, b'\x05\x01\x00')
+        check('raw: method', stripe.recv(2) == b'\x05\x00')
+        request = chunk(1, connect_request(echo_port))
+        for i in range(len(request)):
+            stripe.links[0].sendall(request[i:i + 1])
+            time.sleep(0.01)
+        check('raw: connect', stripe.recv(10)[1] == 0)
+        stripe.send(1, 3, b'world')
+        stripe.send(0, 4, b'!')
+        time.sleep(0.1)
+        stripe.send(2, 2, b'hello ')
+        check('raw: out of order', stripe.recv(12) == b'hello world!')
+
+        # chunks up to the largest
+        big = os.urandom(STRIPE_CHUNK_SIZE)
+        stripe.send(1, 5, big)
+        stripe.send(0, 6, b'')
+        check('raw: largest chunk', stripe.recv(len(big)) == big)
+
+        # an end of stream closes the connection
+        stripe.send(2, 7, flags=STRIPE_FIN)
+        check('raw: end of stream', stripe.closed())
+        stripe.close()
+
+        # oversized chunks close the connection
+        stripe = Stripe(nexthop_port, 2)
+        stripe.links[1].sendall(chunk(0, length=STRIPE_CHUNK_SIZE + 1))
+        check('raw: oversized chunk', stripe.closed())
+        stripe.close()
+
+        sid = os.urandom(8)
+        for name, data in (('version', preamble(0, 2, sid, version=9)),
+                           ('magic', preamble(0, 2, sid, magic=b'SLSX')),
+                           ('no links', preamble(0, 0, sid)),
+                           ('too many links', preamble(0, 17, sid)),
+                           ('index', preamble(2, 2, sid))):
+            check('raw: bad %s accepted' % name, refused(nexthop_port, data))
+
+        # a link can't be given twice
+        first = socket.create_connection(('127.0.0.1', nexthop_port),
+                                         timeout=5)
+        first.sendall(preamble(0, 2, sid))
+        check('raw: first link', recv_exact(first, 16) == preamble(0, 2, sid))
+        check('raw: duplicate link accepted',
+              refused(nexthop_port, preamble(0, 2, sid)))
+        first.close()
+
+        # truncated preambles and chunks, incomplete stripes
+        for data in (preamble(0, 2, sid)[:9], preamble(1, 2, os.urandom(8)),
+                     preamble(0, 1, os.urandom(8)) + chunk(0, b'\x05')[:6],
+                     preamble(0, 1, os.urandom(8)) +
+                     chunk(0, b'\x05\x01\x00')[:9]):
+            c = socket.create_connection(('127.0.0.1', nexthop_port))
+            c.sendall(data)
+            time.sleep(0.05)
+            c.close()
+
+        check('chained: after errors', stream(port, echo_port, 100000))
+        check('sockslinkd exited', all(p.poll() is None for p in procs))
+    except (EOFError, OSError) as e:
+        print('stripe failed: %s' % e)
+        failed = True
+    finally:
+        for p in procs:
+            p.terminate()
+            p.wait()
+        log.close()
+        os.unlink(log_path)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+#
+# --udp: datagrams of an association are relayed to destinations and
+# back with their SOCKS5 header, directly or through the relay of a
+# next-hop sockslinkd. Malformed, fragmented and foreign datagrams are
+# dropped without ending the association, which ends with its TCP
+# connection.
+#
+# usage: udp-associate.py <sockslinkd>
+
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+class Echo(threading.Thread):
+    """UDP echo server, keeping what it got"""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(('127.0.0.1', 0))
+        self.port = self.sock.getsockname()[1]
+        self.received = []
+
+    def run(self):
+        while True:
+            data, addr = self.sock.recvfrom(65536)
+            self.received.append(data)
+            self.sock.sendto(data, addr)
+
+
+def header(port, atyp=1, frag=0, rsv=b'\x00\x00'):
+    if atyp == 3:
+        dst = b'\x09localhost'
+    else:
+        dst = socket.inet_aton('127.0.0.1')
+    return rsv + bytes([frag, atyp]) + dst + struct.pack('>H', port)
+
+
+def start(sockslinkd, port, nexthop):
+    proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', nexthop, '-m', 'none', '--udp'])
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    return proc
+
+
+def associate(port, udp):
+    """Returns the TCP connection and the relay address"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=5)
+    c.sendall(b'\x05\x01\x00')
+    if recv_exact(c, 2) != b'\x05\x00':
+        raise EOFError
+    c.sendall(b'\x05\x03\x00\x01' + socket.inet_aton('127.0.0.1') +
+              struct.pack('>H', udp.getsockname()[1] if udp else 0))
+    reply = recv_exact(c, 10)
+    if reply[:4] != b'\x05\x00\x00\x01':
+        raise EOFError
+    return c, (socket.inet_ntoa(reply[4:8]),
+               struct.unpack('>H', reply[8:10])[0])
+
+
+def exchange(udp, relay, datagram, timeout=1):
+    udp.settimeout(timeout)
+    udp.sendto(datagram, relay)
+    try:
+        return udp.recvfrom(65536)[0]
+    except socket.timeout:
+        return None
+
+
+def udp_socket():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', 0))
+    return s
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    echo = Echo()
+    echo.start()
+    good = header(echo.port)
+    failed = False
+
+    def check(name, ok):
+        nonlocal failed
+        if not ok:
+            print(name)
+            failed = True
+
+    nexthop_port, port = free_port(), free_port()
+    nexthop = start(sockslinkd, nexthop_port, 'direct')
+    proc = start(sockslinkd, port, '127.0.0.1:%d' % nexthop_port)
+    try:
+        udp = udp_socket()
+        c, relay = associate(nexthop_port, udp)
+
+        check('direct: no echo',
+              exchange(udp, relay, good + b'ping') == good + b'ping')
+        big = bytes(range(256)) * 32
+        check('direct: large datagram',
+              exchange(udp, relay, good + big) == good + big)
+
+        for i in range(16):
+            udp.sendto(good + b'%d' % i, relay)
+        got = set()
+        udp.settimeout(1)
+        try:
+            while len(got) < 16:
+                got.add(udp.recvfrom(65536)[0])
+        except socket.timeout:
+            pass
+        check('direct: batch of 16, got %d back' % len(got), len(got) == 16)
+
+        dropped = [
+            ('fragment', header(echo.port, frag=1) + b'frag'),
+            ('reserved', header(echo.port, rsv=b'\x00\x01') + b'rsv'),
+            ('address type', header(echo.port, atyp=2) + b'atyp'),
+            ('domain', header(echo.port, atyp=3) + b'domain'),
+            ('truncated address', good[:7]),
+            ('truncated port', good[:9]),
+            ('header only', good[:3]),
+            ('empty', b''),
+        ]
+        for name, datagram in dropped:
+            received = len(echo.received)
+            check('direct: %s relayed' % name,
+                  exchange(udp, relay, datagram, 0.2) is None and
+                  len(echo.received) == received)
+            check('direct: no echo after %s' % name,
+                  exchange(udp, relay, good + b'ok') == good + b'ok')
+
+        # only the port given in the request may send
+        other = udp_socket()
+        received = len(echo.received)
+        check('direct: foreign port relayed',
+              exchange(other, relay, good + b'foreign', 0.2) is None and
+              len(echo.received) == received)
+
+        # the association ends with its TCP connection
+        c.close()
+        time.sleep(0.2)
+        received = len(echo.received)
+        check('direct: relayed after close',
+              exchange(udp, relay, good + b'late', 0.2) is None and
+              len(echo.received) == received)
+
+        # the port of the first datagram, through a next-hop relay
+        chained = udp_socket()
+        c, relay = associate(port, None)
+        check('chained: no echo',
+              exchange(chained, relay, good + b'hop') == good + b'hop')
+        check('chained: foreign port relayed',
+              exchange(udp, relay, good + b'foreign', 0.2) is None)
+        check('chained: fragment relayed',
+              exchange(chained, relay, header(echo.port, frag=2) + b'x',
+                       0.2) is None)
+        check('chained: no echo after errors',
+              exchange(chained, relay, good + b'hop2') == good + b'hop2')
+        c.close()
+
+        check('sockslinkd exited',
+              proc.poll() is None and nexthop.poll() is None)
+    except (EOFError, OSError) as e:
+        print('association failed: %s' % e)
+        failed = True
+    finally:
+        for p in (proc, nexthop):
+            p.terminate()
+            p.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# --users-file with --aliases: users of the file go to the default
+# next-hop, "user@alias" logins to the alias, unknown users are
+# rejected.
+#
+# usage: users-aliases.py <sockslinkd> <sockslink-userdb>
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+class Upstream(threading.Thread):
+    """SOCKS5 server recording the usernames it was given"""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.sock = socket.socket()
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(16)
+        self.port = self.sock.getsockname()[1]
+        self.users = []
+
+    def run(self):
+        while True:
+            c, _ = self.sock.accept()
+            try:
+                _, n = recv_exact(c, 2)
+                recv_exact(c, n)
+                c.sendall(b'\x05\x02')
+                _, ulen = recv_exact(c, 2)
+                user = recv_exact(c, ulen).decode()
+                recv_exact(c, recv_exact(c, 1)[0])
+                self.users.append(user)
+                c.sendall(b'\x01\x00')
+            except EOFError:
+                pass
+            c.close()
+
+
+def login(port, user, passwd):
+    c = socket.create_connection(('127.0.0.1', port), timeout=5)
+    try:
+        c.sendall(b'\x05\x01\x02')
+        if recv_exact(c, 2) != b'\x05\x02':
+            return False
+        u, p = user.encode(), passwd.encode()
+        c.sendall(bytes([1, len(u)]) + u + bytes([len(p)]) + p)
+        return recv_exact(c, 2) == b'\x01\x00'
+    except (EOFError, ConnectionResetError):
+        return False
+    finally:
+        c.close()
+
+
+def main():
+    sockslinkd, userdb = sys.argv[1], sys.argv[2]
+    default, office = Upstream(), Upstream()
+    default.start()
+    office.start()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        users_txt = os.path.join(tmp, 'users.txt')
+        users_db = os.path.join(tmp, 'users.db')
+        aliases = os.path.join(tmp, 'aliases')
+
+        with open(users_txt, 'w') as f:
+            f.write('alice:secret\n')
+        subprocess.check_call([userdb, users_txt, users_db])
+        with open(aliases, 'w') as f:
+            f.write('office 127.0.0.1:%d\n' % office.port)
+
+        port = free_port()
+        proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                                 '-l', '127.0.0.1', '-p', str(port),
+                                 '-n', '127.0.0.1:%d' % default.port,
+                                 '--users-file', users_db,
+                                 '--aliases', aliases])
+        try:
+            for _ in range(50):
+                try:
+                    socket.create_connection(('127.0.0.1', port)).close()
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+
+            results = [
+                ('alice', 'secret', True),
+                ('alice', 'wrong', False),
+                ('bob@office', 'pw', True),
+                ('nobody', 'x', False),
+            ]
+            failed = False
+            for user, passwd, expected in results:
+                if login(port, user, passwd) != expected:
+                    print('%s: expected %s' % (user, expected))
+                    failed = True
+
+            if default.users != ['alice'] or office.users != ['bob']:
+                print('next-hops got %s and %s' % (default.users, office.users))
+                failed = True
+        finally:
+            proc.terminate()
+            proc.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
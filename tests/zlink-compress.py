@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+#
+# --hop --compress: streams go through compressed links intact, however
+# well they compress. Frames sent by hand: raw and deflate frames are
+# relayed, unknown types, oversized raw frames, corrupt deflate data and
+# frames inflating past a chunk close the link, and nothing of this
+# keeps the next-hop from serving.
+#
+# usage: zlink-compress.py <sockslinkd>
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+import zlib
+
+AUTH_METHOD_HOP_ZLIB = 0x89
+ZLINK_RAW, ZLINK_DEFLATE = 0, 1
+ZLINK_CHUNK = 16384
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def recv_exact(c, n):
+    data = b''
+    while len(data) < n:
+        chunk = c.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def serve(sock, handler):
+    def loop():
+        while True:
+            c, _ = sock.accept()
+            threading.Thread(target=handler, args=(c,), daemon=True).start()
+    threading.Thread(target=loop, daemon=True).start()
+
+
+def echo(c):
+    try:
+        while True:
+            data = c.recv(65536)
+            if not data:
+                break
+            c.sendall(data)
+    except OSError:
+        pass
+    c.close()
+
+
+def start(sockslinkd, port, nexthop, *args):
+    proc = subprocess.Popen([sockslinkd, '-c', '/dev/null', '-D',
+                             '-l', '127.0.0.1', '-p', str(port),
+                             '-n', nexthop, '-m', 'none', '--compress'] +
+                            list(args))
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    return proc
+
+
+def connect_request(port):
+    return (b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') +
+            struct.pack('>H', port))
+
+
+def stream(port, echo_port, data):
+    """Send data through a SOCKS5 proxy to the echo server"""
+    c = socket.create_connection(('127.0.0.1', port), timeout=10)
+    try:
+        c.sendall(b'\x05\x01\x00')
+        if recv_exact(c, 2) != b'\x05\x00':
+            return False
+        c.sendall(connect_request(echo_port))
+        if recv_exact(c, 10)[1] != 0:
+            return False
+        writer = threading.Thread(target=c.sendall, args=(data,))
+        writer.start()
+        ok = recv_exact(c, len(data)) == data
+        writer.join()
+        return ok
+    except (EOFError, OSError):
+        return False
+    finally:
+        c.close()
+
+
+def frame(ftype, data, length=None):
+    if length is None:
+        length = len(data)
+    return struct.pack('>BH', ftype, length) + data
+
+
+def deflate(data):
+    compressor = zlib.compressobj(1, zlib.DEFLATED, -12)
+    return compressor.compress(data) + compressor.flush(zlib.Z_SYNC_FLUSH)
+
+
+class ZLink:
+    """A compressed link opened by hand, through the hop handshake"""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+        self.sock.sendall(bytes([5, 1, AUTH_METHOD_HOP_ZLIB]) +
+                          b'\x01\x00\x01' + socket.inet_aton('127.0.0.9') +
+                          b'\x04\x38')
+        if recv_exact(self.sock, 2) != bytes([5, AUTH_METHOD_HOP_ZLIB]):
+            raise EOFError
+        self.deflate = zlib.compressobj(1, zlib.DEFLATED, -12)
+        self.inflate = zlib.decompressobj(-15)
+        self.data = b''
+        self.compressed = 0
+
+    def send(self, *frames):
+        self.sock.sendall(b''.join(frames))
+
+    def send_deflate(self, data):
+        self.send(frame(ZLINK_DEFLATE, self.deflate.compress(data) +
+                        self.deflate.flush(zlib.Z_SYNC_FLUSH)))
+
+    def recv(self, size):
+        while len(self.data) < size:
+            ftype, length = struct.unpack('>BH', recv_exact(self.sock, 3))
+            payload = recv_exact(self.sock, length)
+            if ftype == ZLINK_DEFLATE:
+                self.data += self.inflate.decompress(payload)
+                self.compressed += 1
+            elif ftype == ZLINK_RAW:
+                self.data += payload
+            else:
+                raise EOFError
+        data, self.data = self.data[:size], self.data[size:]
+        return data
+
+    def closed(self, timeout=5):
+        """True if the next-hop closes the link"""
+        self.sock.settimeout(timeout)
+        try:
+            while self.sock.recv(65536):
+                pass
+            return True
+        except ConnectionResetError:
+            return True
+        except socket.timeout:
+            return False
+
+    def close(self):
+        self.sock.close()
+
+
+def opened(port, echo_port):
+    """A link with a CONNECT to the echo server done"""
+    link = ZLink(port)
+    link.send(frame(ZLINK_RAW, connect_request(echo_port)))
+    if link.recv(2) != b'\x01\x00' or link.recv(10)[1] != 0:
+        raise EOFError
+    return link
+
+
+def main():
+    sockslinkd = sys.argv[1]
+    echo_sock = socket.socket()
+    echo_sock.bind(('127.0.0.1', 0))
+    echo_sock.listen(64)
+    serve(echo_sock, echo)
+    echo_port = echo_sock.getsockname()[1]
+    failed = False
+
+    def check(name, ok):
+        nonlocal failed
+        if not ok:
+            print(name)
+            failed = True
+
+    nexthop_port, port = free_port(), free_port()
+    procs = [start(sockslinkd, nexthop_port, 'direct',
+                   '--hop-accept=127.0.0.0/8')]
+    procs.append(start(sockslinkd, port, '127.0.0.1:%d' % nexthop_port,
+                       '--hop'))
+    try:
+        text = b''.join(b'line %d of a rather compressible stream\n' % i
+                        for i in range(40000))
+        streams = [('text', text), ('random', os.urandom(1 << 20)),
+                   ('mixed', (os.urandom(50000) + text[:100000]) * 8),
+                   ('short', b'x')]
+        results = {}
+        threads = [threading.Thread(
+            target=lambda n=name, d=data: results.update(
+                {n: stream(port, echo_port, d)}))
+                   for name, data in streams]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for name, _ in streams:
+            check('chained: %s stream' % name, results.get(name))
+
+        # raw and deflate frames, split across writes too
+        link = opened(nexthop_port, echo_port)
+        link.send(frame(ZLINK_RAW, b'ping'))
+        check('raw: raw frame', link.recv(4) == b'ping')
+        link.send_deflate(b'pong')
+        check('raw: deflate frame', link.recv(4) == b'pong')
+        data = frame(ZLINK_RAW, b'split')
+        for i in range(len(data)):
+            link.send(data[i:i + 1])
+            time.sleep(0.01)
+        check('raw: split frame', link.recv(5) == b'split')
+        chunk = text[:ZLINK_CHUNK]
+        link.send_deflate(chunk)
+        link.send(frame(ZLINK_RAW, b''))
+        check('raw: largest chunk', link.recv(len(chunk)) == chunk)
+        check('raw: nothing compressed', link.compressed > 0)
+        link.close()
+
+        closing = [
+            ('frame type', frame(7, b'what')),
+            ('oversized raw frame', frame(ZLINK_RAW, b'', ZLINK_CHUNK + 1)),
+            ('corrupt deflate frame', frame(ZLINK_DEFLATE, b'\xff' * 32)),
+            ('deflate past a chunk',
+             frame(ZLINK_DEFLATE, deflate(b'\x00' * (ZLINK_CHUNK + 1)))),
+        ]
+        for name, data in closing:
+            link = opened(nexthop_port, echo_port)
+            link.send(data)
+            check('raw: %s' % name, link.closed())
+            link.close()
+
+        # truncated messages and frames, then the peer leaves
+        for data in (b'\x01\x00\x01\x7f', b'\x01\x00\x01\x7f\x00\x00\x09\x04'
+                     b'\x38\x00\x00', b'\x01\x00\x01\x7f\x00\x00\x09\x04\x38' +
+                     frame(ZLINK_DEFLATE, deflate(b'\x05'))[:-1]):
+            c = socket.create_connection(('127.0.0.1', nexthop_port))
+            c.sendall(bytes([5, 1, AUTH_METHOD_HOP_ZLIB]) + data)
+            time.sleep(0.05)
+            c.close()
+
+        check('chained: after errors', stream(port, echo_port, text[:100000]))
+        check('sockslinkd exited', all(p.poll() is None for p in procs))
+    except (EOFError, OSError, zlib.error) as e:
+        print('compressed link failed: %s' % e)
+        failed = True
+    finally:
+        for p in procs:
+            p.terminate()
+            p.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())